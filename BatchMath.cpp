@@ -0,0 +1,529 @@
+#include "BatchMath.h"
+
+#if defined(BATCH_MATH_SCALAR)
+#elif defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define BATCH_MATH_SSE2
+#else
+#define BATCH_MATH_SCALAR
+#endif
+
+#include <float.h>
+#include <math.h>
+#include <stdio.h>
+#include <algorithm>
+
+#include "Timer.h"
+
+using namespace std;
+using namespace chag;
+
+//*****************************************************************************
+//	SIMD wrappers, the kernels below are written once against these
+//*****************************************************************************
+#if defined(BATCH_MATH_SCALAR)
+static const int SIMD_WIDTH = 1;
+static const char *SIMD_NAME = "scalar";
+typedef float SimdFloat;
+typedef bool SimdMask;
+
+static inline SimdFloat simdSet(float v) { return v; }
+static inline SimdFloat simdLoad(const float *p) { return *p; }
+static inline void simdStore(float *p, SimdFloat v) { *p = v; }
+static inline SimdFloat simdAdd(SimdFloat a, SimdFloat b) { return a + b; }
+static inline SimdFloat simdSub(SimdFloat a, SimdFloat b) { return a - b; }
+static inline SimdFloat simdMul(SimdFloat a, SimdFloat b) { return a * b; }
+static inline SimdFloat simdMin(SimdFloat a, SimdFloat b) { return min(a, b); }
+static inline SimdFloat simdMax(SimdFloat a, SimdFloat b) { return max(a, b); }
+static inline SimdFloat simdAbs(SimdFloat a) { return fabsf(a); }
+static inline SimdMask simdLess(SimdFloat a, SimdFloat b) { return a < b; }
+static inline SimdMask simdOr(SimdMask a, SimdMask b) { return a || b; }
+static inline SimdMask simdNoMask() { return false; }
+// One bit per lane
+static inline int simdMaskBits(SimdMask m) { return m ? 1 : 0; }
+#elif defined(__AVX2__)
+static const int SIMD_WIDTH = 8;
+static const char *SIMD_NAME = "AVX2";
+typedef __m256 SimdFloat;
+typedef __m256 SimdMask;
+
+static inline SimdFloat simdSet(float v) { return _mm256_set1_ps(v); }
+static inline SimdFloat simdLoad(const float *p) { return _mm256_loadu_ps(p); }
+static inline void simdStore(float *p, SimdFloat v) { _mm256_storeu_ps(p, v); }
+static inline SimdFloat simdAdd(SimdFloat a, SimdFloat b) { return _mm256_add_ps(a, b); }
+static inline SimdFloat simdSub(SimdFloat a, SimdFloat b) { return _mm256_sub_ps(a, b); }
+static inline SimdFloat simdMul(SimdFloat a, SimdFloat b) { return _mm256_mul_ps(a, b); }
+static inline SimdFloat simdMin(SimdFloat a, SimdFloat b) { return _mm256_min_ps(a, b); }
+static inline SimdFloat simdMax(SimdFloat a, SimdFloat b) { return _mm256_max_ps(a, b); }
+static inline SimdFloat simdAbs(SimdFloat a) { return _mm256_andnot_ps(_mm256_set1_ps(-0.0f), a); }
+static inline SimdMask simdLess(SimdFloat a, SimdFloat b) { return _mm256_cmp_ps(a, b, _CMP_LT_OQ); }
+static inline SimdMask simdOr(SimdMask a, SimdMask b) { return _mm256_or_ps(a, b); }
+static inline SimdMask simdNoMask() { return _mm256_setzero_ps(); }
+static inline int simdMaskBits(SimdMask m) { return _mm256_movemask_ps(m); }
+#else
+static const int SIMD_WIDTH = 4;
+static const char *SIMD_NAME = "SSE2";
+typedef __m128 SimdFloat;
+typedef __m128 SimdMask;
+
+static inline SimdFloat simdSet(float v) { return _mm_set1_ps(v); }
+static inline SimdFloat simdLoad(const float *p) { return _mm_loadu_ps(p); }
+static inline void simdStore(float *p, SimdFloat v) { _mm_storeu_ps(p, v); }
+static inline SimdFloat simdAdd(SimdFloat a, SimdFloat b) { return _mm_add_ps(a, b); }
+static inline SimdFloat simdSub(SimdFloat a, SimdFloat b) { return _mm_sub_ps(a, b); }
+static inline SimdFloat simdMul(SimdFloat a, SimdFloat b) { return _mm_mul_ps(a, b); }
+static inline SimdFloat simdMin(SimdFloat a, SimdFloat b) { return _mm_min_ps(a, b); }
+static inline SimdFloat simdMax(SimdFloat a, SimdFloat b) { return _mm_max_ps(a, b); }
+static inline SimdFloat simdAbs(SimdFloat a) { return _mm_andnot_ps(_mm_set1_ps(-0.0f), a); }
+static inline SimdMask simdLess(SimdFloat a, SimdFloat b) { return _mm_cmplt_ps(a, b); }
+static inline SimdMask simdOr(SimdMask a, SimdMask b) { return _mm_or_ps(a, b); }
+static inline SimdMask simdNoMask() { return _mm_setzero_ps(); }
+static inline int simdMaskBits(SimdMask m) { return _mm_movemask_ps(m); }
+#endif
+
+static size_t padToSimdWidth(size_t size)
+{
+	return (size + SIMD_WIDTH - 1) / SIMD_WIDTH * SIMD_WIDTH;
+}
+
+// Element r of column c of a float4x4
+static inline float element(const float4x4 &m, int c, int r)
+{
+	return (&m.c1.x)[c * 4 + r];
+}
+
+//*****************************************************************************
+//	Arrays
+//*****************************************************************************
+MatrixArray::MatrixArray()
+	: m_size(0)
+	, m_capacity(0)
+{
+}
+
+void MatrixArray::resize(size_t size)
+{
+	m_size = size;
+	size_t capacity = padToSimdWidth(size);
+	if (capacity != m_capacity)
+	{
+		m_capacity = capacity;
+		m_elements.assign(16 * m_capacity, 0.0f);
+	}
+}
+
+void MatrixArray::set(size_t index, const float4x4 &matrix)
+{
+	const float *source = &matrix.c1.x;
+	for (int i = 0; i < 16; ++i)
+	{
+		m_elements[i * m_capacity + index] = source[i];
+	}
+}
+
+float4x4 MatrixArray::get(size_t index) const
+{
+	float4x4 matrix;
+	float *dest = &matrix.c1.x;
+	for (int i = 0; i < 16; ++i)
+	{
+		dest[i] = m_elements[i * m_capacity + index];
+	}
+	return matrix;
+}
+
+void MatrixArray::store(float4x4 *matrices) const
+{
+	for (int i = 0; i < 16; ++i)
+	{
+		const float *source = elements(i);
+		for (size_t j = 0; j < m_size; ++j)
+		{
+			(&matrices[j].c1.x)[i] = source[j];
+		}
+	}
+}
+
+BoxArray::BoxArray()
+	: m_size(0)
+	, m_capacity(0)
+{
+}
+
+void BoxArray::resize(size_t size)
+{
+	m_size = size;
+	size_t capacity = padToSimdWidth(size);
+	if (capacity != m_capacity)
+	{
+		m_capacity = capacity;
+		m_coordinates.assign(6 * m_capacity, 0.0f);
+	}
+}
+
+void BoxArray::set(size_t index, const AABB &box)
+{
+	for (int i = 0; i < 3; ++i)
+	{
+		m_coordinates[i * m_capacity + index] = (&box.min.x)[i];
+		m_coordinates[(i + 3) * m_capacity + index] = (&box.max.x)[i];
+	}
+}
+
+AABB BoxArray::get(size_t index) const
+{
+	AABB box;
+	for (int i = 0; i < 3; ++i)
+	{
+		(&box.min.x)[i] = m_coordinates[i * m_capacity + index];
+		(&box.max.x)[i] = m_coordinates[(i + 3) * m_capacity + index];
+	}
+	return box;
+}
+
+//*****************************************************************************
+//	Kernels. All 16 inputs of a step are loaded before any output is stored,
+//	so the result may be the input array.
+//*****************************************************************************
+void multiplyMatrices(const float4x4 &left, const MatrixArray &right, MatrixArray &result)
+{
+	// Broadcast once, the stores below might otherwise alias left
+	SimdFloat m[16];
+	for (int e = 0; e < 16; ++e)
+	{
+		m[e] = simdSet((&left.c1.x)[e]);
+	}
+	result.resize(right.size());
+	for (size_t i = 0; i < right.paddedSize(); i += SIMD_WIDTH)
+	{
+		SimdFloat r[16];
+		for (int e = 0; e < 16; ++e)
+		{
+			r[e] = simdLoad(right.elements(e) + i);
+		}
+		for (int c = 0; c < 4; ++c)
+		{
+			for (int row = 0; row < 4; ++row)
+			{
+				SimdFloat sum = simdMul(m[0 * 4 + row], r[c * 4 + 0]);
+				sum = simdAdd(sum, simdMul(m[1 * 4 + row], r[c * 4 + 1]));
+				sum = simdAdd(sum, simdMul(m[2 * 4 + row], r[c * 4 + 2]));
+				sum = simdAdd(sum, simdMul(m[3 * 4 + row], r[c * 4 + 3]));
+				simdStore(result.elements(c * 4 + row) + i, sum);
+			}
+		}
+	}
+}
+
+void multiplyMatrices(const MatrixArray &left, const float4x4 &right, MatrixArray &result)
+{
+	SimdFloat m[16];
+	for (int e = 0; e < 16; ++e)
+	{
+		m[e] = simdSet((&right.c1.x)[e]);
+	}
+	result.resize(left.size());
+	for (size_t i = 0; i < left.paddedSize(); i += SIMD_WIDTH)
+	{
+		SimdFloat l[16];
+		for (int e = 0; e < 16; ++e)
+		{
+			l[e] = simdLoad(left.elements(e) + i);
+		}
+		for (int c = 0; c < 4; ++c)
+		{
+			for (int row = 0; row < 4; ++row)
+			{
+				SimdFloat sum = simdMul(l[0 * 4 + row], m[c * 4 + 0]);
+				sum = simdAdd(sum, simdMul(l[1 * 4 + row], m[c * 4 + 1]));
+				sum = simdAdd(sum, simdMul(l[2 * 4 + row], m[c * 4 + 2]));
+				sum = simdAdd(sum, simdMul(l[3 * 4 + row], m[c * 4 + 3]));
+				simdStore(result.elements(c * 4 + row) + i, sum);
+			}
+		}
+	}
+}
+
+void transformBoxes(const AABB &box, const MatrixArray &matrices, BoxArray &result)
+{
+	// As transformAABB(): the center is transformed and the extents grow by
+	// the absolute upper 3x3 of the matrix
+	float3 center = (box.min + box.max) * 0.5f;
+	float3 extents = (box.max - box.min) * 0.5f;
+	result.resize(matrices.size());
+	for (size_t i = 0; i < matrices.paddedSize(); i += SIMD_WIDTH)
+	{
+		for (int row = 0; row < 3; ++row)
+		{
+			SimdFloat newCenter = simdLoad(matrices.elements(3 * 4 + row) + i);
+			SimdFloat newExtents = simdSet(0.0f);
+			for (int c = 0; c < 3; ++c)
+			{
+				SimdFloat m = simdLoad(matrices.elements(c * 4 + row) + i);
+				newCenter = simdAdd(newCenter, simdMul(m, simdSet((&center.x)[c])));
+				newExtents = simdAdd(newExtents, simdMul(simdAbs(m), simdSet((&extents.x)[c])));
+			}
+			simdStore(result.coordinates(row) + i, simdSub(newCenter, newExtents));
+			simdStore(result.coordinates(row + 3) + i, simdAdd(newCenter, newExtents));
+		}
+	}
+}
+
+AABB boundsOfBoxes(const BoxArray &boxes)
+{
+	AABB bounds = makeEmptyAABB();
+	size_t numFull = boxes.size() / SIMD_WIDTH * SIMD_WIDTH;
+	for (int axis = 0; axis < 3; ++axis)
+	{
+		const float *minima = boxes.coordinates(axis);
+		const float *maxima = boxes.coordinates(axis + 3);
+		SimdFloat low = simdSet(FLT_MAX);
+		SimdFloat high = simdSet(-FLT_MAX);
+		for (size_t i = 0; i < numFull; i += SIMD_WIDTH)
+		{
+			low = simdMin(low, simdLoad(minima + i));
+			high = simdMax(high, simdLoad(maxima + i));
+		}
+		float lanes[2][SIMD_WIDTH];
+		simdStore(lanes[0], low);
+		simdStore(lanes[1], high);
+		float &boundsMin = (&bounds.min.x)[axis];
+		float &boundsMax = (&bounds.max.x)[axis];
+		for (int lane = 0; lane < SIMD_WIDTH; ++lane)
+		{
+			boundsMin = min(boundsMin, lanes[0][lane]);
+			boundsMax = max(boundsMax, lanes[1][lane]);
+		}
+		// The padding is not part of the boxes
+		for (size_t i = numFull; i < boxes.size(); ++i)
+		{
+			boundsMin = min(boundsMin, minima[i]);
+			boundsMax = max(boundsMax, maxima[i]);
+		}
+	}
+	return bounds;
+}
+
+int cullBoxes(const Frustum &frustum, const BoxArray &boxes, unsigned char *visible)
+{
+	int numVisible = 0;
+	for (size_t i = 0; i < boxes.paddedSize(); i += SIMD_WIDTH)
+	{
+		SimdMask outside = simdNoMask();
+		for (int p = 0; p < 6; ++p)
+		{
+			// The corner furthest along the normal is picked per plane, the
+			// same for all boxes
+			const float4 &plane = frustum.planes[p];
+			SimdFloat x = simdLoad(boxes.coordinates(plane.x >= 0.0f ? 3 : 0) + i);
+			SimdFloat y = simdLoad(boxes.coordinates(plane.y >= 0.0f ? 4 : 1) + i);
+			SimdFloat z = simdLoad(boxes.coordinates(plane.z >= 0.0f ? 5 : 2) + i);
+			SimdFloat distance = simdAdd(simdAdd(simdAdd(simdMul(simdSet(plane.x), x),
+				simdMul(simdSet(plane.y), y)), simdMul(simdSet(plane.z), z)), simdSet(plane.w));
+			outside = simdOr(outside, simdLess(distance, simdSet(0.0f)));
+		}
+		int bits = simdMaskBits(outside);
+		for (int lane = 0; lane < SIMD_WIDTH; ++lane)
+		{
+			visible[i + lane] = (bits >> lane) & 1 ? 0 : 1;
+			numVisible += i + lane < boxes.size() ? visible[i + lane] : 0;
+		}
+	}
+	return numVisible;
+}
+
+const char *getBatchMathInstructionSet()
+{
+	return SIMD_NAME;
+}
+
+int getBatchMathWidth()
+{
+	return SIMD_WIDTH;
+}
+
+//*****************************************************************************
+//	Self test
+//*****************************************************************************
+static unsigned int testRandom = 12345;
+
+// The kernels add in the same order as the scalar functions, so they match
+// exactly unless the compiler fuses multiply-adds, which it may do
+// differently in each. chag's operator* may also sum in another order.
+#if defined(__FMA__) || defined(__FP_FAST_FMAF)
+static const float ROUNDING_TOLERANCE = 1e-5f;
+#else
+static const float ROUNDING_TOLERANCE = 0.0f;
+#endif
+static const float PRODUCT_TOLERANCE = max(1e-6f, ROUNDING_TOLERANCE);
+
+static float randomFloat(float low, float high)
+{
+	testRandom = testRandom * 1664525u + 1013904223u;
+	return low + (high - low) * float(testRandom >> 8) / float(1 << 24);
+}
+
+/**
+ * The largest difference of the elements, relative to the largest element.
+ */
+static float relativeDifference(const float *a, const float *b, int count)
+{
+	float difference = 0.0f;
+	float magnitude = 1.0f;
+	for (int i = 0; i < count; ++i)
+	{
+		difference = max(difference, fabsf(a[i] - b[i]));
+		magnitude = max(magnitude, fabsf(a[i]));
+	}
+	return difference / magnitude;
+}
+
+static float relativeDifference(const float4x4 &a, const float4x4 &b)
+{
+	return relativeDifference(&a.c1.x, &b.c1.x, 16);
+}
+
+static bool sameBox(const AABB &a, const AABB &b)
+{
+	return relativeDifference(&a.min.x, &b.min.x, 3) <= ROUNDING_TOLERANCE
+		&& relativeDifference(&a.max.x, &b.max.x, 3) <= ROUNDING_TOLERANCE;
+}
+
+static void printTimes(const char *name, double scalarTime, double batchTime, int count, const char *difference)
+{
+	printf("  %-24s scalar %7.2f ns, batched %7.2f ns per element, %5.2fx, %s\n", name,
+		scalarTime * 1e6 / count, batchTime * 1e6 / count, scalarTime / max(1e-9, batchTime), difference);
+}
+
+bool runBatchMathSelfTest(int count)
+{
+	count = max(1, count);
+	printf("Batch math self test: %d elements, %d-wide %s, %s\n", count, SIMD_WIDTH, SIMD_NAME,
+		ROUNDING_TOLERANCE > 0.0f ? "fused multiply-adds, rounding may differ" : "exact");
+
+	// Rigid model matrices with a little scaling, and a camera
+	vector<float4x4> models(count);
+	MatrixArray modelArray;
+	modelArray.resize(count);
+	for (int i = 0; i < count; ++i)
+	{
+		models[i] = make_translation(make_vector(randomFloat(-200.0f, 200.0f), randomFloat(-10.0f, 10.0f),
+												 randomFloat(-200.0f, 200.0f)))
+			* make_rotation_y<float4x4>(randomFloat(0.0f, 6.28f))
+			* make_rotation_x<float4x4>(randomFloat(-0.3f, 0.3f))
+			* make_scale<float4x4>(randomFloat(0.5f, 2.0f));
+		modelArray.set(i, models[i]);
+	}
+	float4x4 viewProjection = perspectiveMatrix(45.0f, 1.5f, 0.1f, 1000.0f)
+		* lookAt(make_vector(120.0f, 60.0f, 80.0f), make_vector(0.0f, 0.0f, 0.0f), make_vector(0.0f, 1.0f, 0.0f));
+	float4x4 decode = make_translation(make_vector(-1.5f, -0.2f, -3.0f)) * make_scale<float4x4>(4.25f);
+	AABB carBox = { make_vector(-1.0f, 0.0f, -2.0f), make_vector(1.0f, 1.5f, 2.0f) };
+	Frustum frustum = makeFrustum(viewProjection);
+	char text[128];
+	bool ok = true;
+
+	// Products on both sides. The outputs are allocated up front, like the
+	// arrays that are kept from frame to frame in use.
+	vector<float4x4> scalarProducts(count);
+	MatrixArray batchProducts;
+	batchProducts.resize(count);
+	double start = getTimeMs();
+	for (int i = 0; i < count; ++i)
+	{
+		scalarProducts[i] = viewProjection * models[i];
+	}
+	double scalarTime = getTimeMs() - start;
+	start = getTimeMs();
+	multiplyMatrices(viewProjection, modelArray, batchProducts);
+	double batchTime = getTimeMs() - start;
+	float difference = 0.0f;
+	for (int i = 0; i < count; ++i)
+	{
+		difference = max(difference, relativeDifference(scalarProducts[i], batchProducts.get(i)));
+	}
+	snprintf(text, sizeof(text), "max relative difference %g", difference);
+	printTimes("view-projection * model", scalarTime, batchTime, count, text);
+	ok = ok && difference <= PRODUCT_TOLERANCE;
+
+	start = getTimeMs();
+	for (int i = 0; i < count; ++i)
+	{
+		scalarProducts[i] = models[i] * decode;
+	}
+	scalarTime = getTimeMs() - start;
+	start = getTimeMs();
+	multiplyMatrices(modelArray, decode, batchProducts);
+	batchTime = getTimeMs() - start;
+	difference = 0.0f;
+	for (int i = 0; i < count; ++i)
+	{
+		difference = max(difference, relativeDifference(scalarProducts[i], batchProducts.get(i)));
+	}
+	snprintf(text, sizeof(text), "max relative difference %g", difference);
+	printTimes("model * decode", scalarTime, batchTime, count, text);
+	ok = ok && difference <= PRODUCT_TOLERANCE;
+
+	// Box transforms and their bounds
+	vector<AABB> scalarBoxes(count);
+	BoxArray batchBoxes;
+	batchBoxes.resize(count);
+	start = getTimeMs();
+	for (int i = 0; i < count; ++i)
+	{
+		scalarBoxes[i] = transformAABB(carBox, models[i]);
+	}
+	scalarTime = getTimeMs() - start;
+	start = getTimeMs();
+	transformBoxes(carBox, modelArray, batchBoxes);
+	batchTime = getTimeMs() - start;
+	int numMismatches = 0;
+	for (int i = 0; i < count; ++i)
+	{
+		numMismatches += sameBox(scalarBoxes[i], batchBoxes.get(i)) ? 0 : 1;
+	}
+	snprintf(text, sizeof(text), "%d mismatches", numMismatches);
+	printTimes("transformAABB", scalarTime, batchTime, count, text);
+	ok = ok && numMismatches == 0;
+
+	start = getTimeMs();
+	AABB scalarBounds = makeEmptyAABB();
+	for (int i = 0; i < count; ++i)
+	{
+		growAABB(scalarBounds, scalarBoxes[i]);
+	}
+	scalarTime = getTimeMs() - start;
+	start = getTimeMs();
+	AABB batchBounds = boundsOfBoxes(batchBoxes);
+	batchTime = getTimeMs() - start;
+	bool sameBounds = sameBox(scalarBounds, batchBounds);
+	printTimes("bounds", scalarTime, batchTime, count, sameBounds ? "identical" : "DIFFERENT");
+	ok = ok && sameBounds;
+
+	// Frustum tests
+	vector<unsigned char> scalarVisible(count);
+	vector<unsigned char> batchVisible(batchBoxes.paddedSize());
+	start = getTimeMs();
+	int numScalarVisible = 0;
+	for (int i = 0; i < count; ++i)
+	{
+		scalarVisible[i] = intersectsFrustum(frustum, scalarBoxes[i]) ? 1 : 0;
+		numScalarVisible += scalarVisible[i];
+	}
+	scalarTime = getTimeMs() - start;
+	start = getTimeMs();
+	int numBatchVisible = cullBoxes(frustum, batchBoxes, &batchVisible[0]);
+	batchTime = getTimeMs() - start;
+	numMismatches = 0;
+	for (int i = 0; i < count; ++i)
+	{
+		numMismatches += scalarVisible[i] != batchVisible[i] ? 1 : 0;
+	}
+	snprintf(text, sizeof(text), "%d of %d visible, %d mismatches", numBatchVisible, count, numMismatches);
+	printTimes("intersectsFrustum", scalarTime, batchTime, count, text);
+	ok = ok && numMismatches == 0 && numScalarVisible == numBatchVisible;
+
+	printf("Batch math self test %s\n", ok ? "passed" : "FAILED");
+	return ok;
+}
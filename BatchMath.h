@@ -0,0 +1,127 @@
+#ifndef BATCH_MATH_H
+#define BATCH_MATH_H
+
+#include <float4x4.h>
+#include <vector>
+
+#include "Culling.h"
+
+//*****************************************************************************
+//	Batched math kernels
+//
+//	The chag float4x4 functions work on one matrix at a time. For thousands of
+//	instances the same operations are done here on arrays stored as structure
+//	of arrays (one array per matrix element or box coordinate), so that one
+//	SIMD register holds the same element of several matrices: AVX2 (8 wide)
+//	when enabled at compile time, otherwise SSE2 (4 wide), or plain scalar
+//	code on other architectures or with BATCH_MATH_SCALAR defined. Every
+//	kernel does its arithmetic in the same order as the scalar function it
+//	replaces (operator*, transformAABB(), intersectsFrustum()), see
+//	runBatchMathSelfTest().
+//
+//	The arrays are padded to a multiple of the SIMD width with zeros, the
+//	kernels run over the padding too and no element beyond size() is
+//	meaningful.
+//*****************************************************************************
+
+/**
+ * n matrices, elements(c * 4 + r)[i] is row r of column c of matrix i (the
+ * order of the columns c1..c4 of float4x4).
+ */
+class MatrixArray
+{
+public:
+	MatrixArray();
+
+	void resize(size_t size);
+	size_t size() const { return m_size; }
+	size_t paddedSize() const { return m_capacity; }
+
+	void set(size_t index, const chag::float4x4 &matrix);
+	chag::float4x4 get(size_t index) const;
+
+	/**
+	 * Copies the matrices out in float4x4 layout, e.g. for a vertex buffer.
+	 */
+	void store(chag::float4x4 *matrices) const;
+
+	float *elements(int element) { return &m_elements[element * m_capacity]; }
+	const float *elements(int element) const { return &m_elements[element * m_capacity]; }
+
+private:
+	std::vector<float> m_elements;
+	size_t m_size;
+	size_t m_capacity;
+};
+
+/**
+ * n boxes, coordinates(0..2) are the minimum x, y and z and coordinates(3..5)
+ * the maximum.
+ */
+class BoxArray
+{
+public:
+	BoxArray();
+
+	void resize(size_t size);
+	size_t size() const { return m_size; }
+	size_t paddedSize() const { return m_capacity; }
+
+	void set(size_t index, const AABB &box);
+	AABB get(size_t index) const;
+
+	float *coordinates(int coordinate) { return &m_coordinates[coordinate * m_capacity]; }
+	const float *coordinates(int coordinate) const { return &m_coordinates[coordinate * m_capacity]; }
+
+private:
+	std::vector<float> m_coordinates;
+	size_t m_size;
+	size_t m_capacity;
+};
+
+/**
+ * result[i] = left * right[i], e.g. the view-projection times each model
+ * matrix.
+ */
+void multiplyMatrices(const chag::float4x4 &left, const MatrixArray &right, MatrixArray &result);
+
+/**
+ * result[i] = left[i] * right, e.g. each model matrix times a matrix applied
+ * in model space first.
+ */
+void multiplyMatrices(const MatrixArray &left, const chag::float4x4 &right, MatrixArray &result);
+
+/**
+ * result[i] = transformAABB(box, matrices[i]), the box of one mesh placed by
+ * each instance's matrix.
+ */
+void transformBoxes(const AABB &box, const MatrixArray &matrices, BoxArray &result);
+
+/**
+ * The box enclosing all boxes, empty if there are none.
+ */
+AABB boundsOfBoxes(const BoxArray &boxes);
+
+/**
+ * visible[i] = intersectsFrustum(frustum, boxes[i]), returns the number of
+ * visible boxes. visible must have room for paddedSize() entries.
+ */
+int cullBoxes(const Frustum &frustum, const BoxArray &boxes, unsigned char *visible);
+
+/**
+ * "AVX2", "SSE2" or "scalar", and the number of elements per step.
+ */
+const char *getBatchMathInstructionSet();
+int getBatchMathWidth();
+
+/**
+ * The microbenchmark and exactness check (--batch-math-test): runs every
+ * kernel and the scalar functions it replaces on count random matrices and
+ * boxes, prints the time per element of both and the largest difference,
+ * and returns false unless the culling results match exactly and the boxes
+ * and matrix products to within rounding (exactly for the boxes, unless the
+ * compiler fuses multiply-adds, e.g. with FMA enabled).
+ */
+bool runBatchMathSelfTest(int count);
+
+#endif // BATCH_MATH_H
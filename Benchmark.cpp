@@ -0,0 +1,119 @@
+#include "Benchmark.h"
+
+#include <glutil.h>
+
+#include <math.h>
+#include <stdio.h>
+#include <algorithm>
+
+using namespace std;
+
+void getBenchmarkCamera(float time, float &theta, float &phi, float &r)
+{
+	const float period = 20.0f;
+	float t = 2.0f * float(M_PI) * time / period;
+	theta = float(M_PI) / 6.0f + t;
+	phi = float(M_PI) * (0.35f + 0.1f * sinf(t * 0.5f));
+	r = 35.0f + 25.0f * sinf(t * 0.75f);
+}
+
+GpuFrameTimer::GpuFrameTimer()
+	: m_numIssued(0)
+	, m_numCollected(0)
+{
+	glGenQueries(NUM_QUERIES, m_queries);
+}
+
+GpuFrameTimer::~GpuFrameTimer()
+{
+	glDeleteQueries(NUM_QUERIES, m_queries);
+}
+
+void GpuFrameTimer::beginFrame()
+{
+	// Reuse the oldest query, reading its result first. By now it is a few
+	// frames old so the result is normally available without waiting.
+	if (m_numIssued - m_numCollected == NUM_QUERIES)
+	{
+		collect(m_numCollected % NUM_QUERIES);
+	}
+	glBeginQuery(GL_TIME_ELAPSED, m_queries[m_numIssued % NUM_QUERIES]);
+}
+
+void GpuFrameTimer::endFrame()
+{
+	glEndQuery(GL_TIME_ELAPSED);
+	++m_numIssued;
+}
+
+void GpuFrameTimer::collect(int query)
+{
+	GLuint64 elapsed = 0;
+	glGetQueryObjectui64v(m_queries[query], GL_QUERY_RESULT, &elapsed);
+	m_times.push_back(double(elapsed) / 1.0e6);
+	++m_numCollected;
+}
+
+const vector<double> &GpuFrameTimer::finish()
+{
+	while (m_numCollected < m_numIssued)
+	{
+		collect(m_numCollected % NUM_QUERIES);
+	}
+	return m_times;
+}
+
+struct FrameTimeSummary
+{
+	double min;
+	double avg;
+	double p99;
+};
+
+static FrameTimeSummary summarize(vector<double> times)
+{
+	FrameTimeSummary summary = { 0.0, 0.0, 0.0 };
+	if (times.empty())
+	{
+		return summary;
+	}
+	sort(times.begin(), times.end());
+	summary.min = times.front();
+	for (size_t i = 0; i < times.size(); ++i)
+	{
+		summary.avg += times[i];
+	}
+	summary.avg /= double(times.size());
+	size_t p99Index = min(times.size() - 1, size_t(ceil(0.99 * double(times.size()))) - 1);
+	summary.p99 = times[p99Index];
+	return summary;
+}
+
+bool writeBenchmarkResults(const BenchmarkSettings &settings,
+						   const vector<double> &cpuTimes,
+						   const vector<double> &gpuTimes)
+{
+	FrameTimeSummary cpu = summarize(cpuTimes);
+	FrameTimeSummary gpu = summarize(gpuTimes);
+	printf("Benchmark: %d frames at %dx%d\n", int(cpuTimes.size()), settings.width, settings.height);
+	printf("  CPU ms: min %.3f avg %.3f p99 %.3f\n", cpu.min, cpu.avg, cpu.p99);
+	printf("  GPU ms: min %.3f avg %.3f p99 %.3f\n", gpu.min, gpu.avg, gpu.p99);
+
+	FILE *file = fopen(settings.csvFileName.c_str(), "w");
+	if (!file)
+	{
+		printf("Warning: could not write '%s'\n", settings.csvFileName.c_str());
+		return false;
+	}
+	fprintf(file, "frame,cpu_ms,gpu_ms\n");
+	for (size_t i = 0; i < cpuTimes.size(); ++i)
+	{
+		fprintf(file, "%d,%.4f,%.4f\n", int(i), cpuTimes[i], i < gpuTimes.size() ? gpuTimes[i] : 0.0);
+	}
+	fprintf(file, "min,%.4f,%.4f\n", cpu.min, gpu.min);
+	fprintf(file, "avg,%.4f,%.4f\n", cpu.avg, gpu.avg);
+	fprintf(file, "p99,%.4f,%.4f\n", cpu.p99, gpu.p99);
+	fclose(file);
+	printf("  Wrote %s\n", settings.csvFileName.c_str());
+	return true;
+}
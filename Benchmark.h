@@ -0,0 +1,69 @@
+#ifndef BENCHMARK_H
+#define BENCHMARK_H
+
+#include <GL/glew.h>
+#include <string>
+#include <vector>
+
+//*****************************************************************************
+//	Benchmark mode
+//
+//	Renders a fixed number of frames offscreen with a fixed timestep and a
+//	scripted camera path, so that runs are deterministic and comparable
+//	between commits. Per-frame CPU and GPU times are written to a CSV file.
+//*****************************************************************************
+
+struct BenchmarkSettings
+{
+	int numFrames;
+	int width;
+	int height;
+	float timeStep;				// seconds of scene time per frame
+	std::string csvFileName;
+};
+
+/**
+ * The scripted camera: one orbit around the island per 'period' seconds while
+ * slowly moving in and out and up and down, covering close and far views.
+ */
+void getBenchmarkCamera(float time, float &theta, float &phi, float &r);
+
+/**
+ * Measures the GPU time of whole frames with GL_TIME_ELAPSED queries. The
+ * queries are kept in a ring several frames deep so reading a result never
+ * waits for the GPU.
+ */
+class GpuFrameTimer
+{
+public:
+	GpuFrameTimer();
+	~GpuFrameTimer();
+
+	void beginFrame();
+	void endFrame();
+
+	/**
+	 * Reads back all outstanding results (this waits for the GPU) and returns
+	 * the GPU time of every frame in milliseconds.
+	 */
+	const std::vector<double> &finish();
+
+private:
+	void collect(int query);
+
+	static const int NUM_QUERIES = 4;
+	GLuint m_queries[NUM_QUERIES];
+	int m_numIssued;
+	int m_numCollected;
+	std::vector<double> m_times;
+};
+
+/**
+ * Writes frame,cpu_ms,gpu_ms rows followed by min, avg and p99 rows, and
+ * prints the summary.
+ */
+bool writeBenchmarkResults(const BenchmarkSettings &settings,
+						   const std::vector<double> &cpuTimes,
+						   const std::vector<double> &gpuTimes);
+
+#endif // BENCHMARK_H
@@ -0,0 +1,241 @@
+#include "Culling.h"
+
+#include <float.h>
+#include <math.h>
+#include <algorithm>
+
+using namespace std;
+using namespace chag;
+
+AABB makeEmptyAABB()
+{
+	AABB box;
+	box.min = make_vector(FLT_MAX, FLT_MAX, FLT_MAX);
+	box.max = make_vector(-FLT_MAX, -FLT_MAX, -FLT_MAX);
+	return box;
+}
+
+void growAABB(AABB &box, const float3 &point)
+{
+	box.min.x = min(box.min.x, point.x);
+	box.min.y = min(box.min.y, point.y);
+	box.min.z = min(box.min.z, point.z);
+	box.max.x = max(box.max.x, point.x);
+	box.max.y = max(box.max.y, point.y);
+	box.max.z = max(box.max.z, point.z);
+}
+
+void growAABB(AABB &box, const AABB &other)
+{
+	growAABB(box, other.min);
+	growAABB(box, other.max);
+}
+
+Frustum makeFrustum(const float4x4 &m)
+{
+	// Gribb & Hartmann: with clip = M * p, a point is inside when
+	// -w <= x, y, z <= w, i.e. (row4 +- rowN) . p >= 0. The rows of the
+	// column major matrix are gathered from the columns.
+	float4 rows[4];
+	for (int i = 0; i < 4; ++i)
+	{
+		rows[i] = make_vector((&m.c1.x)[i], (&m.c2.x)[i], (&m.c3.x)[i], (&m.c4.x)[i]);
+	}
+	Frustum frustum;
+	for (int i = 0; i < 3; ++i)
+	{
+		frustum.planes[i * 2 + 0] = make_vector(rows[3].x + rows[i].x, rows[3].y + rows[i].y,
+												rows[3].z + rows[i].z, rows[3].w + rows[i].w);
+		frustum.planes[i * 2 + 1] = make_vector(rows[3].x - rows[i].x, rows[3].y - rows[i].y,
+												rows[3].z - rows[i].z, rows[3].w - rows[i].w);
+	}
+	return frustum;
+}
+
+bool intersectsFrustum(const Frustum &frustum, const AABB &box)
+{
+	for (int i = 0; i < 6; ++i)
+	{
+		const float4 &plane = frustum.planes[i];
+		// The corner furthest along the plane normal
+		float3 positive = make_vector(plane.x >= 0.0f ? box.max.x : box.min.x,
+									  plane.y >= 0.0f ? box.max.y : box.min.y,
+									  plane.z >= 0.0f ? box.max.z : box.min.z);
+		if (plane.x * positive.x + plane.y * positive.y + plane.z * positive.z + plane.w < 0.0f)
+		{
+			return false;
+		}
+	}
+	return true;
+}
+
+AABB transformAABB(const AABB &box, const float4x4 &m)
+{
+	// Transform the center, the extents grow by the absolute matrix
+	float3 center = (box.min + box.max) * 0.5f;
+	float3 extents = (box.max - box.min) * 0.5f;
+	float3 newCenter = make_vector(m.c4.x, m.c4.y, m.c4.z);
+	float3 newExtents = make_vector(0.0f, 0.0f, 0.0f);
+	const float4 *columns[3] = { &m.c1, &m.c2, &m.c3 };
+	for (int i = 0; i < 3; ++i)
+	{
+		float c = (&center.x)[i];
+		float e = (&extents.x)[i];
+		newCenter += make_vector(columns[i]->x, columns[i]->y, columns[i]->z) * c;
+		newExtents += make_vector(fabsf(columns[i]->x), fabsf(columns[i]->y), fabsf(columns[i]->z)) * e;
+	}
+	AABB result = { newCenter - newExtents, newCenter + newExtents };
+	return result;
+}
+
+void resetCullingStats(CullingStats &stats)
+{
+	stats.numChunks = 0;
+	stats.numVisibleChunks = 0;
+	stats.numTriangles = 0;
+	stats.numVisibleTriangles = 0;
+	stats.numOccludedChunks = 0;
+}
+
+void addCullingStats(CullingStats &total, const CullingStats &stats)
+{
+	total.numChunks += stats.numChunks;
+	total.numVisibleChunks += stats.numVisibleChunks;
+	total.numTriangles += stats.numTriangles;
+	total.numVisibleTriangles += stats.numVisibleTriangles;
+	total.numOccludedChunks += stats.numOccludedChunks;
+}
+
+static float3 centerOf(const AABB &box)
+{
+	return make_vector((box.min.x + box.max.x) * 0.5f, (box.min.y + box.max.y) * 0.5f,
+					   (box.min.z + box.max.z) * 0.5f);
+}
+
+void BVH::build(const vector<AABB> &boxes, int maxLeafSize)
+{
+	m_nodes.clear();
+	m_indices.resize(boxes.size());
+	for (size_t i = 0; i < boxes.size(); ++i)
+	{
+		m_indices[i] = (unsigned int)i;
+	}
+	if (boxes.empty())
+	{
+		return;
+	}
+	m_nodes.resize(1);
+	buildNode(0, boxes, 0, int(boxes.size()), max(1, maxLeafSize));
+}
+
+void BVH::buildNode(int node, const vector<AABB> &boxes, int first, int count, int maxLeafSize)
+{
+	AABB bounds = makeEmptyAABB();
+	AABB centers = makeEmptyAABB();
+	for (int i = first; i < first + count; ++i)
+	{
+		growAABB(bounds, boxes[m_indices[i]]);
+		growAABB(centers, centerOf(boxes[m_indices[i]]));
+	}
+	m_nodes[node].bounds = bounds;
+	if (count <= maxLeafSize)
+	{
+		m_nodes[node].first = first;
+		m_nodes[node].count = count;
+		return;
+	}
+
+	// Split at the median along the axis over which the centers spread most
+	float3 extent = centers.max - centers.min;
+	int axis = extent.x > extent.y ? (extent.x > extent.z ? 0 : 2) : (extent.y > extent.z ? 1 : 2);
+	int half = count / 2;
+	nth_element(m_indices.begin() + first, m_indices.begin() + first + half, m_indices.begin() + first + count,
+		[&boxes, axis](unsigned int a, unsigned int b)
+		{
+			float3 ca = centerOf(boxes[a]);
+			float3 cb = centerOf(boxes[b]);
+			return (&ca.x)[axis] < (&cb.x)[axis];
+		});
+
+	int children = int(m_nodes.size());
+	m_nodes.resize(m_nodes.size() + 2);
+	m_nodes[node].first = children;
+	m_nodes[node].count = 0;
+	buildNode(children + 0, boxes, first, half, maxLeafSize);
+	buildNode(children + 1, boxes, first + half, count - half, maxLeafSize);
+}
+
+void BVH::addSubtree(int node, vector<unsigned int> &visible) const
+{
+	const Node &n = m_nodes[node];
+	if (n.count > 0)
+	{
+		visible.insert(visible.end(), m_indices.begin() + n.first, m_indices.begin() + n.first + n.count);
+		return;
+	}
+	addSubtree(n.first + 0, visible);
+	addSubtree(n.first + 1, visible);
+}
+
+void BVH::query(const Frustum &frustum, vector<unsigned int> &visible) const
+{
+	if (m_nodes.empty())
+	{
+		return;
+	}
+	// Each entry holds a node and the planes it still has to be tested against
+	const int allPlanes = (1 << 6) - 1;
+	pair<int, int> stack[64];
+	int stackSize = 0;
+	stack[stackSize++] = make_pair(0, allPlanes);
+	while (stackSize > 0)
+	{
+		int node = stack[stackSize - 1].first;
+		int planeMask = stack[stackSize - 1].second;
+		--stackSize;
+		const AABB &box = m_nodes[node].bounds;
+
+		bool outside = false;
+		for (int i = 0; i < 6 && !outside; ++i)
+		{
+			if (!(planeMask & (1 << i)))
+			{
+				continue;
+			}
+			const float4 &plane = frustum.planes[i];
+			// The corners furthest along and against the plane normal
+			float3 positive = make_vector(plane.x >= 0.0f ? box.max.x : box.min.x,
+										  plane.y >= 0.0f ? box.max.y : box.min.y,
+										  plane.z >= 0.0f ? box.max.z : box.min.z);
+			float3 negative = make_vector(plane.x >= 0.0f ? box.min.x : box.max.x,
+										  plane.y >= 0.0f ? box.min.y : box.max.y,
+										  plane.z >= 0.0f ? box.min.z : box.max.z);
+			if (plane.x * positive.x + plane.y * positive.y + plane.z * positive.z + plane.w < 0.0f)
+			{
+				outside = true;
+			}
+			else if (plane.x * negative.x + plane.y * negative.y + plane.z * negative.z + plane.w >= 0.0f)
+			{
+				planeMask &= ~(1 << i);
+			}
+		}
+		if (outside)
+		{
+			continue;
+		}
+		if (planeMask == 0)
+		{
+			addSubtree(node, visible);
+		}
+		else if (m_nodes[node].count > 0)
+		{
+			const Node &leaf = m_nodes[node];
+			visible.insert(visible.end(), m_indices.begin() + leaf.first, m_indices.begin() + leaf.first + leaf.count);
+		}
+		else
+		{
+			stack[stackSize++] = make_pair(m_nodes[node].first + 1, planeMask);
+			stack[stackSize++] = make_pair(m_nodes[node].first + 0, planeMask);
+		}
+	}
+}
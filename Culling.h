@@ -0,0 +1,95 @@
+#ifndef CULLING_H
+#define CULLING_H
+
+#include <float4x4.h>
+#include <vector>
+
+//*****************************************************************************
+//	Frustum culling
+//
+//	Meshes are split into spatially compact chunks when converted (see
+//	Mesh.cpp), each with a bounding box. At load time a bounding volume
+//	hierarchy is built over the chunk boxes of a mesh, and every pass queries
+//	it with the frustum of its own view-projection matrix.
+//*****************************************************************************
+
+struct AABB
+{
+	chag::float3 min;
+	chag::float3 max;
+};
+
+AABB makeEmptyAABB();
+void growAABB(AABB &box, const chag::float3 &point);
+void growAABB(AABB &box, const AABB &other);
+
+/**
+ * The six planes (x, y, z = normal, w = distance) bounding the volume that
+ * a model-view-projection matrix maps to the clip cube, in model space. The
+ * normals point inwards and are not normalized.
+ */
+struct Frustum
+{
+	chag::float4 planes[6];
+};
+
+Frustum makeFrustum(const chag::float4x4 &modelViewProjection);
+
+/**
+ * Conservative test, may accept boxes that are outside near a corner of the
+ * frustum.
+ */
+bool intersectsFrustum(const Frustum &frustum, const AABB &box);
+
+/**
+ * The box enclosing the transformed box.
+ */
+AABB transformAABB(const AABB &box, const chag::float4x4 &matrix);
+
+/**
+ * Draw counts of a pass, before and after culling.
+ */
+struct CullingStats
+{
+	int numChunks;
+	int numVisibleChunks;
+	int numTriangles;
+	int numVisibleTriangles;
+	int numOccludedChunks;		// in the frustum but hidden by occluders
+};
+
+void resetCullingStats(CullingStats &stats);
+void addCullingStats(CullingStats &total, const CullingStats &stats);
+
+class BVH
+{
+public:
+	/**
+	 * Builds the hierarchy over the given boxes, splitting at the median of
+	 * the longest axis until a node holds at most maxLeafSize boxes.
+	 */
+	void build(const std::vector<AABB> &boxes, int maxLeafSize = 1);
+
+	/**
+	 * Appends the indices of the boxes that intersect the frustum. Whole
+	 * subtrees are accepted without testing their boxes once a node is
+	 * inside all planes.
+	 */
+	void query(const Frustum &frustum, std::vector<unsigned int> &visible) const;
+
+private:
+	struct Node
+	{
+		AABB bounds;
+		int first;			// leaf: first entry in m_indices, inner: first child (second is first + 1)
+		int count;			// leaf: number of boxes, inner: 0
+	};
+
+	void buildNode(int node, const std::vector<AABB> &boxes, int first, int count, int maxLeafSize);
+	void addSubtree(int node, std::vector<unsigned int> &visible) const;
+
+	std::vector<Node> m_nodes;
+	std::vector<unsigned int> m_indices;
+};
+
+#endif // CULLING_H
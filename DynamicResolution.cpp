@@ -0,0 +1,77 @@
+#include "DynamicResolution.h"
+
+#include <math.h>
+#include <algorithm>
+
+using namespace std;
+
+DynamicResolution::DynamicResolution(float frameBudgetMs, float minScale, float maxScale)
+	: m_numIssued(0)
+	, m_numCollected(0)
+	, m_frameBudget(frameBudgetMs)
+	, m_minScale(minScale)
+	, m_maxScale(maxScale)
+	, m_scale(maxScale)
+	, m_smoothedTime(0.0f)
+{
+	glGenQueries(NUM_FRAMES * 2, m_queries);
+}
+
+DynamicResolution::~DynamicResolution()
+{
+	glDeleteQueries(NUM_FRAMES * 2, m_queries);
+}
+
+void DynamicResolution::beginFrame()
+{
+	// Collect the frames the GPU has finished, oldest first
+	while (m_numCollected < m_numIssued)
+	{
+		int frame = m_numCollected % NUM_FRAMES;
+		GLint available = 0;
+		glGetQueryObjectiv(m_queries[frame * 2 + 1], GL_QUERY_RESULT_AVAILABLE, &available);
+		if (!available)
+		{
+			break;
+		}
+		GLuint64 begin = 0;
+		GLuint64 end = 0;
+		glGetQueryObjectui64v(m_queries[frame * 2 + 0], GL_QUERY_RESULT, &begin);
+		glGetQueryObjectui64v(m_queries[frame * 2 + 1], GL_QUERY_RESULT, &end);
+		update(float(double(end - begin) / 1.0e6));
+		++m_numCollected;
+	}
+	// If all query pairs are still in flight, this frame is not measured
+	// rather than waiting for the oldest one.
+	if (m_numIssued - m_numCollected < NUM_FRAMES)
+	{
+		glQueryCounter(m_queries[(m_numIssued % NUM_FRAMES) * 2 + 0], GL_TIMESTAMP);
+	}
+}
+
+void DynamicResolution::endFrame()
+{
+	if (m_numIssued - m_numCollected < NUM_FRAMES)
+	{
+		glQueryCounter(m_queries[(m_numIssued % NUM_FRAMES) * 2 + 1], GL_TIMESTAMP);
+		++m_numIssued;
+	}
+}
+
+void DynamicResolution::update(float gpuTime)
+{
+	const float smoothing = 0.8f;
+	m_smoothedTime = m_smoothedTime > 0.0f ? smoothing * m_smoothedTime + (1.0f - smoothing) * gpuTime : gpuTime;
+
+	// Leave the scale alone while the time is between 80% and 100% of the
+	// budget, so it does not oscillate around the budget.
+	if (m_smoothedTime > m_frameBudget || m_smoothedTime < 0.8f * m_frameBudget)
+	{
+		// The cost of the scene and post processing passes is mostly
+		// proportional to the number of pixels, i.e. to the scale squared.
+		// Aim for 90% of the budget, changing at most 5% per frame.
+		float wanted = m_scale * sqrtf(0.9f * m_frameBudget / max(m_smoothedTime, 0.01f));
+		wanted = min(max(wanted, m_scale * 0.95f), m_scale * 1.05f);
+		m_scale = min(max(wanted, m_minScale), m_maxScale);
+	}
+}
@@ -0,0 +1,51 @@
+#ifndef DYNAMIC_RESOLUTION_H
+#define DYNAMIC_RESOLUTION_H
+
+#include <GL/glew.h>
+
+//*****************************************************************************
+//	Dynamic resolution
+//
+//	Measures the GPU time of every frame with GL_TIMESTAMP queries and
+//	adjusts the scale at which the scene is rendered (before being upscaled
+//	by the post processing) to keep that time within a budget. Results are
+//	read a few frames late, and only when available, so this never stalls.
+//*****************************************************************************
+
+class DynamicResolution
+{
+public:
+	DynamicResolution(float frameBudgetMs, float minScale = 0.5f, float maxScale = 1.0f);
+	~DynamicResolution();
+
+	void beginFrame();
+	void endFrame();
+
+	/**
+	 * The scale to render the scene at in this frame, in each dimension.
+	 */
+	float getScale() const { return m_scale; }
+
+	/**
+	 * The smoothed GPU frame time the current scale is based on, in ms.
+	 */
+	float getFrameTime() const { return m_smoothedTime; }
+
+	float getFrameBudget() const { return m_frameBudget; }
+
+private:
+	void update(float gpuTime);
+
+	static const int NUM_FRAMES = 4;
+	GLuint m_queries[NUM_FRAMES * 2];	// begin and end timestamp per frame
+	int m_numIssued;
+	int m_numCollected;
+
+	float m_frameBudget;
+	float m_minScale;
+	float m_maxScale;
+	float m_scale;
+	float m_smoothedTime;
+};
+
+#endif // DYNAMIC_RESOLUTION_H
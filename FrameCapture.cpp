@@ -0,0 +1,428 @@
+#include "FrameCapture.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <algorithm>
+#include <vector>
+
+#include "GpuResources.h"
+#include "Timer.h"
+
+using namespace std;
+
+//*****************************************************************************
+//	Image writers, these run on the worker threads
+//*****************************************************************************
+static const unsigned int *getCrcTable()
+{
+	struct Table
+	{
+		Table()
+		{
+			for (unsigned int n = 0; n < 256; ++n)
+			{
+				unsigned int c = n;
+				for (int k = 0; k < 8; ++k)
+				{
+					c = (c & 1) ? 0xedb88320u ^ (c >> 1) : c >> 1;
+				}
+				entries[n] = c;
+			}
+		}
+		unsigned int entries[256];
+	};
+	// Built by the first caller, C++11 makes this thread safe
+	static const Table table;
+	return table.entries;
+}
+
+// The most a stored deflate block can hold
+static const size_t MAX_BLOCK_SIZE = 65535;
+
+/**
+ * Writes a PNG as it goes. The image data is one IDAT chunk holding a zlib
+ * stream of stored (uncompressed) deflate blocks, whose size is known up
+ * front, so each row is written as soon as it is converted while the CRC and
+ * Adler-32 checksums are kept running.
+ */
+class PngStream
+{
+public:
+	explicit PngStream(FILE *file)
+		: m_file(file)
+		, m_crcTable(getCrcTable())
+		, m_crc(0)
+		, m_adlerA(1)
+		, m_adlerB(0)
+		, m_blockLeft(0)
+		, m_dataLeft(0)
+	{
+	}
+
+	void begin(int width, int height)
+	{
+		static const unsigned char signature[8] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n' };
+		fwrite(signature, 1, sizeof(signature), m_file);
+
+		unsigned char header[13];
+		putBigEndian(header, unsigned(width));
+		putBigEndian(header + 4, unsigned(height));
+		header[8] = 8;		// bits per channel
+		header[9] = 2;		// RGB
+		header[10] = 0;		// deflate
+		header[11] = 0;		// adaptive filtering, every row uses none
+		header[12] = 0;		// not interlaced
+		beginChunk("IHDR", sizeof(header));
+		writeChunkData(header, sizeof(header));
+		endChunk();
+
+		// Each row starts with its filter type
+		m_dataLeft = size_t(height) * (1 + 3 * size_t(width));
+		size_t numBlocks = (m_dataLeft + MAX_BLOCK_SIZE - 1) / MAX_BLOCK_SIZE;
+		beginChunk("IDAT", unsigned(2 + m_dataLeft + 5 * numBlocks + 4));
+		static const unsigned char zlibHeader[2] = { 0x78, 0x01 };
+		writeChunkData(zlibHeader, sizeof(zlibHeader));
+	}
+
+	void writeData(const unsigned char *data, size_t size)
+	{
+		while (size > 0)
+		{
+			if (m_blockLeft == 0)
+			{
+				m_blockLeft = min(m_dataLeft, MAX_BLOCK_SIZE);
+				unsigned char blockHeader[5];
+				blockHeader[0] = m_blockLeft == m_dataLeft ? 1 : 0;	// last block, stored
+				blockHeader[1] = (unsigned char)(m_blockLeft & 0xff);
+				blockHeader[2] = (unsigned char)(m_blockLeft >> 8);
+				blockHeader[3] = (unsigned char)(~m_blockLeft & 0xff);
+				blockHeader[4] = (unsigned char)((~m_blockLeft >> 8) & 0xff);
+				writeChunkData(blockHeader, sizeof(blockHeader));
+			}
+			size_t length = min(size, m_blockLeft);
+			writeChunkData(data, length);
+			updateAdler(data, length);
+			m_blockLeft -= length;
+			m_dataLeft -= length;
+			data += length;
+			size -= length;
+		}
+	}
+
+	void end()
+	{
+		unsigned char adler[4];
+		putBigEndian(adler, (m_adlerB << 16) | m_adlerA);
+		writeChunkData(adler, sizeof(adler));
+		endChunk();
+		beginChunk("IEND", 0);
+		endChunk();
+	}
+
+private:
+	static void putBigEndian(unsigned char *p, unsigned int value)
+	{
+		p[0] = (unsigned char)(value >> 24);
+		p[1] = (unsigned char)(value >> 16);
+		p[2] = (unsigned char)(value >> 8);
+		p[3] = (unsigned char)value;
+	}
+
+	void beginChunk(const char *type, unsigned int length)
+	{
+		unsigned char bytes[4];
+		putBigEndian(bytes, length);
+		fwrite(bytes, 1, 4, m_file);
+		// The CRC covers the type and the data
+		m_crc = 0xffffffffu;
+		writeChunkData(type, 4);
+	}
+
+	void writeChunkData(const void *data, size_t size)
+	{
+		const unsigned char *bytes = (const unsigned char *)data;
+		unsigned int crc = m_crc;
+		for (size_t i = 0; i < size; ++i)
+		{
+			crc = m_crcTable[(crc ^ bytes[i]) & 0xff] ^ (crc >> 8);
+		}
+		m_crc = crc;
+		fwrite(data, 1, size, m_file);
+	}
+
+	void endChunk()
+	{
+		unsigned char bytes[4];
+		putBigEndian(bytes, m_crc ^ 0xffffffffu);
+		fwrite(bytes, 1, 4, m_file);
+	}
+
+	void updateAdler(const unsigned char *data, size_t size)
+	{
+		// The sums stay below 2^32 for 5552 bytes before they are reduced
+		while (size > 0)
+		{
+			size_t length = min<size_t>(size, 5552);
+			for (size_t i = 0; i < length; ++i)
+			{
+				m_adlerA += data[i];
+				m_adlerB += m_adlerA;
+			}
+			m_adlerA %= 65521;
+			m_adlerB %= 65521;
+			data += length;
+			size -= length;
+		}
+	}
+
+	FILE *m_file;
+	const unsigned int *m_crcTable;
+	unsigned int m_crc;
+	unsigned int m_adlerA;
+	unsigned int m_adlerB;
+	size_t m_blockLeft;		// bytes left in the current stored block
+	size_t m_dataLeft;		// bytes left in the zlib stream
+};
+
+/**
+ * Writes the RGBA pixels read back by GL (bottom row first) as RGB, top row
+ * first. Returns the number of bytes written, 0 on failure.
+ */
+static size_t writeImage(const string &fileName, FrameCapture::Format format,
+						 const unsigned char *pixels, int width, int height)
+{
+	FILE *file = fopen(fileName.c_str(), "wb");
+	if (!file)
+	{
+		return 0;
+	}
+	vector<char> fileBuffer(1 << 20);
+	setvbuf(file, &fileBuffer[0], _IOFBF, fileBuffer.size());
+
+	// Converted one row at a time, with room for the PNG filter type
+	vector<unsigned char> row(1 + 3 * size_t(width));
+	row[0] = 0;
+	PngStream png(file);
+	if (format == FrameCapture::FORMAT_PNG)
+	{
+		png.begin(width, height);
+	}
+	for (int y = height - 1; y >= 0; --y)
+	{
+		const unsigned char *source = pixels + size_t(y) * size_t(width) * 4;
+		unsigned char *dest = &row[1];
+		for (int x = 0; x < width; ++x)
+		{
+			dest[0] = source[0];
+			dest[1] = source[1];
+			dest[2] = source[2];
+			dest += 3;
+			source += 4;
+		}
+		if (format == FrameCapture::FORMAT_PNG)
+		{
+			png.writeData(&row[0], row.size());
+		}
+		else
+		{
+			fwrite(&row[1], 1, row.size() - 1, file);
+		}
+	}
+	if (format == FrameCapture::FORMAT_PNG)
+	{
+		png.end();
+	}
+	long size = ftell(file);
+	bool ok = !ferror(file);
+	ok = fclose(file) == 0 && ok;
+	return ok ? size_t(max(size, 0L)) : 0;
+}
+
+//*****************************************************************************
+//	FrameCapture
+//*****************************************************************************
+FrameCapture::FrameCapture(ThreadPool &pool, const string &prefix, Format format)
+	: m_pool(pool)
+	, m_prefix(prefix)
+	, m_format(format)
+	, m_numIssued(0)
+	, m_numHandedOff(0)
+	, m_writeTime(0.0)
+	, m_bytesWritten(0.0)
+	, m_numFailed(0)
+	, m_numGpuWaits(0)
+	, m_numWriterWaits(0)
+	, m_startTime(0.0)
+{
+	for (int i = 0; i < NUM_SLOTS; ++i)
+	{
+		Slot &slot = m_slots[i];
+		slot.buffer = createResource(RESOURCE_BUFFER, RESOURCE_STREAMING, "frame capture");
+		slot.fence = 0;
+		slot.width = 0;
+		slot.height = 0;
+		slot.size = 0;
+		slot.frame = -1;
+		slot.mapped = 0;
+		slot.writing = false;
+	}
+}
+
+FrameCapture::~FrameCapture()
+{
+	// Frames not handed off yet are dropped, see finish()
+	for (int i = 0; i < NUM_SLOTS; ++i)
+	{
+		Slot &slot = m_slots[i];
+		retire(slot);
+		if (slot.fence)
+		{
+			glDeleteSync(slot.fence);
+		}
+		deleteResource(RESOURCE_BUFFER, slot.buffer);
+	}
+}
+
+void FrameCapture::capture(GLuint framebuffer, int width, int height)
+{
+	if (m_numIssued == 0)
+	{
+		m_startTime = getTimeMs();
+	}
+	// This slot's frame went to the writers READBACK_DELAY frames ago
+	Slot &slot = m_slots[m_numIssued % NUM_SLOTS];
+	retire(slot);
+
+	size_t size = size_t(width) * size_t(height) * 4;
+	glBindBuffer(GL_PIXEL_PACK_BUFFER, slot.buffer);
+	if (size != slot.size)
+	{
+		glBufferData(GL_PIXEL_PACK_BUFFER, GLsizeiptr(size), 0, GL_STREAM_READ);
+		setResourceStorage(RESOURCE_BUFFER, slot.buffer, size);
+		slot.size = size;
+	}
+	// Into the buffer object, so this returns without waiting for the frame
+	glBindFramebuffer(GL_READ_FRAMEBUFFER, framebuffer);
+	glReadBuffer(framebuffer == 0 ? GL_BACK : GL_COLOR_ATTACHMENT0);
+	glPixelStorei(GL_PACK_ALIGNMENT, 1);
+	glReadPixels(0, 0, width, height, GL_RGBA, GL_UNSIGNED_BYTE, 0);
+	glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+	glBindFramebuffer(GL_READ_FRAMEBUFFER, 0);
+	if (GLEW_ARB_sync)
+	{
+		slot.fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+	}
+	slot.width = width;
+	slot.height = height;
+	slot.frame = m_numIssued++;
+
+	if (m_numIssued - m_numHandedOff > READBACK_DELAY)
+	{
+		handOff(m_slots[m_numHandedOff % NUM_SLOTS]);
+	}
+}
+
+void FrameCapture::handOff(Slot &slot)
+{
+	++m_numHandedOff;
+	if (slot.fence)
+	{
+		// Only a GPU that is several frames behind makes this wait
+		if (glClientWaitSync(slot.fence, 0, 0) == GL_TIMEOUT_EXPIRED)
+		{
+			++m_numGpuWaits;
+			while (glClientWaitSync(slot.fence, GL_SYNC_FLUSH_COMMANDS_BIT, 1000000000) == GL_TIMEOUT_EXPIRED)
+			{
+			}
+		}
+		glDeleteSync(slot.fence);
+		slot.fence = 0;
+	}
+	glBindBuffer(GL_PIXEL_PACK_BUFFER, slot.buffer);
+	slot.mapped = (const unsigned char *)glMapBufferRange(GL_PIXEL_PACK_BUFFER, 0, GLsizeiptr(slot.size),
+														  GL_MAP_READ_BIT);
+	glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+	if (!slot.mapped)
+	{
+		lock_guard<mutex> lock(m_mutex);
+		++m_numFailed;
+		return;
+	}
+	// The mapping stays valid on the worker, only the unmapping is GL
+	{
+		lock_guard<mutex> lock(m_mutex);
+		slot.writing = true;
+	}
+	Slot *writeSlot = &slot;
+	m_pool.submit([this, writeSlot]() { write(writeSlot); });
+}
+
+void FrameCapture::write(Slot *slot)
+{
+	double start = getTimeMs();
+	char number[16];
+	snprintf(number, sizeof(number), "%05d", slot->frame);
+	string fileName = m_prefix + number + (m_format == FORMAT_PNG ? ".png" : ".raw");
+	size_t size = writeImage(fileName, m_format, slot->mapped, slot->width, slot->height);
+	{
+		lock_guard<mutex> lock(m_mutex);
+		if (size == 0 && m_numFailed++ == 0)
+		{
+			printf("Warning: could not write '%s'\n", fileName.c_str());
+		}
+		m_writeTime += getTimeMs() - start;
+		m_bytesWritten += double(size);
+		slot->writing = false;
+	}
+	m_written.notify_all();
+}
+
+void FrameCapture::retire(Slot &slot)
+{
+	{
+		unique_lock<mutex> lock(m_mutex);
+		if (slot.writing)
+		{
+			++m_numWriterWaits;
+			while (slot.writing)
+			{
+				m_written.wait(lock);
+			}
+		}
+	}
+	if (slot.mapped)
+	{
+		glBindBuffer(GL_PIXEL_PACK_BUFFER, slot.buffer);
+		glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+		glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+		slot.mapped = 0;
+	}
+	slot.frame = -1;
+}
+
+void FrameCapture::finish()
+{
+	while (m_numHandedOff < m_numIssued)
+	{
+		handOff(m_slots[m_numHandedOff % NUM_SLOTS]);
+	}
+	for (int i = 0; i < NUM_SLOTS; ++i)
+	{
+		retire(m_slots[i]);
+	}
+	if (m_numIssued == 0)
+	{
+		return;
+	}
+	double seconds = max(1e-3, (getTimeMs() - m_startTime) / 1000.0);
+	const Slot &last = m_slots[(m_numIssued - 1) % NUM_SLOTS];
+	printf("Captured %d frames of %dx%d to %s*%s in %.2f s: %.1f frames per second, %.1f MB/s\n",
+		m_numIssued, last.width, last.height, m_prefix.c_str(), m_format == FORMAT_PNG ? ".png" : ".raw (rgb24)",
+		seconds, double(m_numIssued) / seconds, m_bytesWritten / (1024.0 * 1024.0) / seconds);
+	printf("  %.2f ms per frame on %d writer thread(s), waited for the GPU %d and for the writers %d times\n",
+		m_writeTime / double(m_numIssued), m_pool.getNumThreads(), m_numGpuWaits, m_numWriterWaits);
+	if (m_numFailed > 0)
+	{
+		printf("Warning: %d of %d frames could not be written\n", m_numFailed, m_numIssued);
+	}
+}
@@ -0,0 +1,93 @@
+#ifndef FRAME_CAPTURE_H
+#define FRAME_CAPTURE_H
+
+#include <GL/glew.h>
+#include <condition_variable>
+#include <mutex>
+#include <string>
+
+#include "ThreadPool.h"
+
+//*****************************************************************************
+//	FrameCapture
+//
+//	Records the final frames to numbered image files without stalling the
+//	pipeline. Each frame is read into one of a ring of pixel buffer objects
+//	by an asynchronous glReadPixels, and only mapped READBACK_DELAY frames
+//	later, when the GPU has normally finished with it. The mapped buffer is
+//	then handed to a worker of a ThreadPool, which converts the rows and
+//	streams them straight into the file, and is unmapped once written so the
+//	buffer can take another frame.
+//
+//	PNG files are written uncompressed (stored deflate blocks), which keeps
+//	the encoding far cheaper than the rendering. Raw files are the bare RGB
+//	bytes, top row first, e.g. for ffmpeg -f rawvideo -pix_fmt rgb24.
+//*****************************************************************************
+
+class FrameCapture
+{
+public:
+	enum Format
+	{
+		FORMAT_PNG,
+		FORMAT_RAW
+	};
+
+	/**
+	 * Frames are written to <prefix><frame number, 5 digits>.png or .raw.
+	 */
+	FrameCapture(ThreadPool &pool, const std::string &prefix, Format format);
+	~FrameCapture();
+
+	/**
+	 * Queues the read back of the color buffer of framebuffer (0 for the
+	 * back buffer), call this after the frame is drawn.
+	 */
+	void capture(GLuint framebuffer, int width, int height);
+
+	/**
+	 * Writes all frames still in flight (this waits for the GPU and the
+	 * workers) and prints the capture throughput.
+	 */
+	void finish();
+
+	int getNumFrames() const { return m_numIssued; }
+
+private:
+	struct Slot
+	{
+		GLuint buffer;
+		GLsync fence;			// 0 without ARB_sync
+		int width;
+		int height;
+		size_t size;			// bytes allocated for the buffer
+		int frame;				// -1 when free
+		const unsigned char *mapped;	// while being written
+		bool writing;
+	};
+
+	void handOff(Slot &slot);
+	void retire(Slot &slot);
+	void write(Slot *slot);
+
+	static const int NUM_SLOTS = 6;
+	static const int READBACK_DELAY = 3;
+	ThreadPool &m_pool;
+	std::string m_prefix;
+	Format m_format;
+	Slot m_slots[NUM_SLOTS];
+	int m_numIssued;
+	int m_numHandedOff;
+	// Set by the workers
+	std::mutex m_mutex;
+	std::condition_variable m_written;
+	double m_writeTime;		// ms, summed over the workers
+	double m_bytesWritten;
+	int m_numFailed;
+	// Counted on the main thread
+	int m_numGpuWaits;		// mapped before the read back had finished
+	int m_numWriterWaits;	// a slot was still being written when needed
+	double m_startTime;
+};
+
+#endif // FRAME_CAPTURE_H
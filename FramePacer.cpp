@@ -0,0 +1,94 @@
+#include "FramePacer.h"
+
+#include <algorithm>
+
+using namespace std;
+
+SimulationClock::SimulationClock(float stepsPerSecond)
+	: m_lastUpdate(-1.0)
+	, m_accumulated(0.0)
+	, m_numSteps(0)
+	, m_paused(false)
+{
+	setRate(stepsPerSecond);
+}
+
+void SimulationClock::setRate(float stepsPerSecond)
+{
+	m_stepLength = 1000.0 / double(max(stepsPerSecond, 1.0f));
+}
+
+int SimulationClock::update(double now)
+{
+	if (m_lastUpdate < 0.0 || m_paused)
+	{
+		m_lastUpdate = now;
+		return 0;
+	}
+	m_accumulated += max(0.0, now - m_lastUpdate);
+	m_lastUpdate = now;
+	int numSteps = int(m_accumulated / m_stepLength);
+	m_accumulated -= double(numSteps) * m_stepLength;
+	if (numSteps > MAX_STEPS)
+	{
+		numSteps = MAX_STEPS;
+		m_accumulated = 0.0;
+	}
+	m_numSteps += numSteps;
+	return numSteps;
+}
+
+void SimulationClock::step(double now)
+{
+	m_lastUpdate = now;
+	m_accumulated = 0.0;
+	if (!m_paused)
+	{
+		++m_numSteps;
+	}
+}
+
+void SimulationClock::setPaused(bool paused, double now)
+{
+	// Account for the time up to now in the old state
+	update(now);
+	m_paused = paused;
+}
+
+double SimulationClock::getTimeUntilNextStep(double now) const
+{
+	if (m_lastUpdate < 0.0)
+	{
+		return 0.0;
+	}
+	return max(0.0, m_stepLength - m_accumulated - (now - m_lastUpdate));
+}
+
+FramePacer::FramePacer(float targetRate)
+	: m_nextFrame(0.0)
+{
+	setTargetRate(targetRate);
+}
+
+void FramePacer::setTargetRate(float framesPerSecond)
+{
+	m_period = framesPerSecond > 0.0f ? 1000.0 / double(framesPerSecond) : 0.0;
+}
+
+double FramePacer::getTimeUntilNextFrame(double now) const
+{
+	return max(0.0, m_nextFrame - now);
+}
+
+void FramePacer::beginFrame(double now)
+{
+	// Frames are scheduled on a fixed grid, so a frame that starts a little
+	// late does not delay all following ones. After a frame that was late by
+	// more than a period the grid restarts, rather than frames being rushed
+	// out to catch up.
+	m_nextFrame = m_nextFrame + m_period;
+	if (m_nextFrame < now)
+	{
+		m_nextFrame = now + m_period;
+	}
+}
@@ -0,0 +1,89 @@
+#ifndef FRAME_PACER_H
+#define FRAME_PACER_H
+
+//*****************************************************************************
+//	Frame pacing
+//
+//	The simulation clock advances the animated state in fixed steps of
+//	simulated time, whatever the frame rate is, so the scene animates the
+//	same at 30 and at 144 frames per second and the time only changes when
+//	a step has been taken. The frame pacer spaces frames evenly at a target
+//	rate, and tells how long to wait for the next one rather than sleeping
+//	itself, so the wait can be left to the event loop.
+//
+//	All times are in ms as returned by getTimeMs().
+//*****************************************************************************
+
+class SimulationClock
+{
+public:
+	explicit SimulationClock(float stepsPerSecond = 60.0f);
+
+	void setRate(float stepsPerSecond);
+
+	/**
+	 * Takes as many steps as fit in the real time passed since the last call,
+	 * returns the number taken. After a long stall (e.g. a breakpoint) at
+	 * most MAX_STEPS are taken and the rest of the time is dropped.
+	 */
+	int update(double now);
+
+	/**
+	 * Takes exactly one step (none while paused) whatever the real time,
+	 * e.g. for frame capture, where every frame must advance the scene by the
+	 * same amount for a recording to be repeatable.
+	 */
+	void step(double now);
+
+	/**
+	 * While paused, real time passes without the clock advancing.
+	 */
+	void setPaused(bool paused, double now);
+	bool isPaused() const { return m_paused; }
+
+	/**
+	 * The simulated time in seconds, a whole number of steps.
+	 */
+	float getTime() const { return float(double(m_numSteps) * m_stepLength / 1000.0); }
+
+	/**
+	 * The real time left until update() takes the next step, in ms.
+	 */
+	double getTimeUntilNextStep(double now) const;
+
+private:
+	static const int MAX_STEPS = 10;
+	double m_stepLength;	// ms
+	double m_lastUpdate;	// ms, negative before the first update
+	double m_accumulated;	// ms not yet taken as a step
+	long long m_numSteps;
+	bool m_paused;
+};
+
+class FramePacer
+{
+public:
+	/**
+	 * A target rate of 0 does not limit the frame rate.
+	 */
+	explicit FramePacer(float targetRate = 0.0f);
+
+	void setTargetRate(float framesPerSecond);
+	float getTargetRate() const { return m_period > 0.0 ? float(1000.0 / m_period) : 0.0f; }
+
+	/**
+	 * The time to wait before the next frame may begin, 0 if it may now.
+	 */
+	double getTimeUntilNextFrame(double now) const;
+
+	/**
+	 * Called as each frame begins, schedules the one after it.
+	 */
+	void beginFrame(double now);
+
+private:
+	double m_period;		// ms, 0 for no limit
+	double m_nextFrame;		// ms
+};
+
+#endif // FRAME_PACER_H
@@ -0,0 +1,223 @@
+#include "GpuResources.h"
+
+#include <stdio.h>
+#include <algorithm>
+#include <map>
+#include <string>
+
+using namespace std;
+
+struct ResourceEntry
+{
+	ResourceCategory category;
+	string name;
+	size_t bytes;
+	GLenum format;
+	int numReferences;
+};
+
+typedef pair<int, GLuint> ResourceKey;	// kind and GL name
+
+typedef map<ResourceKey, ResourceEntry> ResourceMap;
+
+/**
+ * Created on first use and never destroyed, GpuResource globals elsewhere
+ * may still release their objects during static destruction.
+ */
+static ResourceMap &getResources()
+{
+	static ResourceMap *resources = new ResourceMap;
+	return *resources;
+}
+
+static ResourceUsage categoryUsage[NUM_RESOURCE_CATEGORIES];
+static ResourceUsage totalUsage;
+
+static const char *categoryNames[NUM_RESOURCE_CATEGORIES] = {
+	"render targets", "meshes", "textures", "streaming"
+};
+static const char *kindNames[] = {
+	"texture", "buffer", "renderbuffer", "framebuffer", "vertex array"
+};
+
+static double toMB(size_t bytes)
+{
+	return double(bytes) / (1024.0 * 1024.0);
+}
+
+GLuint createResource(ResourceKind kind, ResourceCategory category, const char *name)
+{
+	GLuint id = 0;
+	switch (kind)
+	{
+	case RESOURCE_TEXTURE:
+		glGenTextures(1, &id);
+		break;
+	case RESOURCE_BUFFER:
+		glGenBuffers(1, &id);
+		break;
+	case RESOURCE_RENDERBUFFER:
+		glGenRenderbuffers(1, &id);
+		break;
+	case RESOURCE_FRAMEBUFFER:
+		glGenFramebuffers(1, &id);
+		break;
+	case RESOURCE_VERTEX_ARRAY:
+		glGenVertexArrays(1, &id);
+		break;
+	}
+	ResourceEntry &entry = getResources()[ResourceKey(kind, id)];
+	entry.category = category;
+	entry.name = name;
+	entry.bytes = 0;
+	entry.format = GL_NONE;
+	entry.numReferences = 1;
+	++categoryUsage[category].numObjects;
+	++totalUsage.numObjects;
+	return id;
+}
+
+void setResourceStorage(ResourceKind kind, GLuint id, size_t bytes, GLenum format)
+{
+	ResourceMap &resources = getResources();
+	ResourceMap::iterator it = resources.find(ResourceKey(kind, id));
+	if (it == resources.end())
+	{
+		return;
+	}
+	ResourceEntry &entry = it->second;
+	ResourceUsage &usage = categoryUsage[entry.category];
+	usage.bytes = usage.bytes - entry.bytes + bytes;
+	usage.peakBytes = max(usage.peakBytes, usage.bytes);
+	totalUsage.bytes = totalUsage.bytes - entry.bytes + bytes;
+	totalUsage.peakBytes = max(totalUsage.peakBytes, totalUsage.bytes);
+	entry.bytes = bytes;
+	entry.format = format;
+}
+
+void retainResource(ResourceKind kind, GLuint id)
+{
+	ResourceMap &resources = getResources();
+	ResourceMap::iterator it = resources.find(ResourceKey(kind, id));
+	if (it != resources.end())
+	{
+		++it->second.numReferences;
+	}
+}
+
+void deleteResource(ResourceKind kind, GLuint &id)
+{
+	if (id == 0)
+	{
+		return;
+	}
+	ResourceMap &resources = getResources();
+	ResourceMap::iterator it = resources.find(ResourceKey(kind, id));
+	if (it != resources.end())
+	{
+		ResourceEntry &entry = it->second;
+		if (--entry.numReferences > 0)
+		{
+			id = 0;
+			return;
+		}
+		ResourceUsage &usage = categoryUsage[entry.category];
+		--usage.numObjects;
+		usage.bytes -= entry.bytes;
+		--totalUsage.numObjects;
+		totalUsage.bytes -= entry.bytes;
+		resources.erase(it);
+	}
+	switch (kind)
+	{
+	case RESOURCE_TEXTURE:
+		glDeleteTextures(1, &id);
+		break;
+	case RESOURCE_BUFFER:
+		glDeleteBuffers(1, &id);
+		break;
+	case RESOURCE_RENDERBUFFER:
+		glDeleteRenderbuffers(1, &id);
+		break;
+	case RESOURCE_FRAMEBUFFER:
+		glDeleteFramebuffers(1, &id);
+		break;
+	case RESOURCE_VERTEX_ARRAY:
+		glDeleteVertexArrays(1, &id);
+		break;
+	}
+	id = 0;
+}
+
+size_t getTextureBytes(GLenum internalFormat, int width, int height)
+{
+	size_t bytesPerTexel;
+	switch (internalFormat)
+	{
+	case GL_RGBA16F:
+		bytesPerTexel = 8;
+		break;
+	case GL_RGBA32F:
+		bytesPerTexel = 16;
+		break;
+	default:	// GL_RGBA8, GL_R11F_G11F_B10F, GL_DEPTH_COMPONENT32, 24 bit depth padded, ...
+		bytesPerTexel = 4;
+		break;
+	}
+	return size_t(width) * size_t(height) * bytesPerTexel;
+}
+
+size_t getResourceBytes(ResourceKind kind, GLuint id)
+{
+	const ResourceMap &resources = getResources();
+	ResourceMap::const_iterator it = resources.find(ResourceKey(kind, id));
+	return it != resources.end() ? it->second.bytes : 0;
+}
+
+ResourceUsage getResourceUsage(ResourceCategory category)
+{
+	return categoryUsage[category];
+}
+
+ResourceUsage getTotalResourceUsage()
+{
+	return totalUsage;
+}
+
+void printResourceUsage()
+{
+	printf("GPU memory: %.2f MB in %d objects, peak %.2f MB\n", toMB(totalUsage.bytes), totalUsage.numObjects,
+		toMB(totalUsage.peakBytes));
+	for (int i = 0; i < NUM_RESOURCE_CATEGORIES; ++i)
+	{
+		printf("  %-15s %5d objects %8.2f MB, peak %8.2f MB\n", categoryNames[i], categoryUsage[i].numObjects,
+			toMB(categoryUsage[i].bytes), toMB(categoryUsage[i].peakBytes));
+	}
+}
+
+int reportLeakedResources()
+{
+	const ResourceMap &resources = getResources();
+	if (resources.empty())
+	{
+		printf("GPU resources: all released, peak %.2f MB\n", toMB(totalUsage.peakBytes));
+		return 0;
+	}
+	printf("Warning: %d GPU objects (%.2f MB) were not released:\n", int(resources.size()), toMB(totalUsage.bytes));
+	for (ResourceMap::const_iterator it = resources.begin(); it != resources.end(); ++it)
+	{
+		const ResourceEntry &entry = it->second;
+		printf("  %-12s %5u %-15s %-36s %8.1f KB", kindNames[it->first.first], it->first.second,
+			categoryNames[entry.category], entry.name.c_str(), entry.bytes / 1024.0);
+		if (entry.format != GL_NONE)
+		{
+			printf(", format 0x%04x", entry.format);
+		}
+		if (entry.numReferences > 1)
+		{
+			printf(", %d references", entry.numReferences);
+		}
+		printf("\n");
+	}
+	return int(resources.size());
+}
@@ -0,0 +1,136 @@
+#ifndef GPU_RESOURCES_H
+#define GPU_RESOURCES_H
+
+#include <GL/glew.h>
+#include <stddef.h>
+
+//*****************************************************************************
+//	GPU resource registry
+//
+//	Textures, buffers, renderbuffers, framebuffers and vertex arrays are
+//	created and deleted through here, tagged with what they are for and a
+//	name, and given the size of their storage once it is allocated. The
+//	sizes are estimates from the formats, drivers may pad them. The registry
+//	keeps the live totals per category with their high-water marks, and at
+//	exit lists every object that was never deleted.
+//
+//	All of it runs on the main thread, with the GL context.
+//*****************************************************************************
+
+enum ResourceCategory
+{
+	RESOURCE_RENDER_TARGETS,	// post processing targets, the shadow map
+	RESOURCE_MESHES,			// vertex and index buffers, vertex arrays
+	RESOURCE_TEXTURES,			// loaded images
+	RESOURCE_STREAMING,			// pixel, uniform and instance buffers refilled as needed
+	NUM_RESOURCE_CATEGORIES
+};
+
+enum ResourceKind
+{
+	RESOURCE_TEXTURE,
+	RESOURCE_BUFFER,
+	RESOURCE_RENDERBUFFER,
+	RESOURCE_FRAMEBUFFER,
+	RESOURCE_VERTEX_ARRAY
+};
+
+struct ResourceUsage
+{
+	int numObjects;
+	size_t bytes;
+	size_t peakBytes;
+};
+
+/**
+ * Generates one object of the kind and registers it, with one reference.
+ */
+GLuint createResource(ResourceKind kind, ResourceCategory category, const char *name);
+
+/**
+ * Records the storage of an object after glTexImage2D, glBufferData, etc.
+ * format is the internal format of textures and renderbuffers, GL_NONE for
+ * the others. Objects created directly with GL are ignored.
+ */
+void setResourceStorage(ResourceKind kind, GLuint id, size_t bytes, GLenum format = GL_NONE);
+
+/**
+ * Adds a reference, e.g. for a texture that several materials use. Every
+ * reference is dropped with a deleteResource().
+ */
+void retainResource(ResourceKind kind, GLuint id);
+
+/**
+ * Drops a reference and deletes the object with the last one, id is zeroed.
+ * Does nothing for 0.
+ */
+void deleteResource(ResourceKind kind, GLuint &id);
+
+/**
+ * Bytes of width x height texels of an uncompressed internal format.
+ */
+size_t getTextureBytes(GLenum internalFormat, int width, int height);
+
+/**
+ * The storage recorded for one object, 0 if it is not registered.
+ */
+size_t getResourceBytes(ResourceKind kind, GLuint id);
+
+ResourceUsage getResourceUsage(ResourceCategory category);
+ResourceUsage getTotalResourceUsage();
+
+/**
+ * Prints the live objects and memory of each category, with the peaks.
+ */
+void printResourceUsage();
+
+/**
+ * Prints every object still alive, call it once everything has been
+ * released. Returns the number of leaked objects.
+ */
+int reportLeakedResources();
+
+/**
+ * Owns one registered object and deletes it with itself. Converts to the GL
+ * name, so it can be used wherever that is.
+ */
+class GpuResource
+{
+public:
+	GpuResource() : m_kind(RESOURCE_TEXTURE), m_id(0) {}
+	GpuResource(ResourceKind kind, ResourceCategory category, const char *name)
+		: m_kind(kind)
+		, m_id(createResource(kind, category, name))
+	{
+	}
+	~GpuResource() { reset(); }
+
+	GpuResource(GpuResource &&other) : m_kind(other.m_kind), m_id(other.m_id) { other.m_id = 0; }
+	GpuResource &operator=(GpuResource &&other)
+	{
+		if (this != &other)
+		{
+			reset();
+			m_kind = other.m_kind;
+			m_id = other.m_id;
+			other.m_id = 0;
+		}
+		return *this;
+	}
+
+	/**
+	 * Deletes the object, if any.
+	 */
+	void reset() { deleteResource(m_kind, m_id); }
+
+	operator GLuint() const { return m_id; }
+
+private:
+	GpuResource(const GpuResource &);
+	GpuResource &operator=(const GpuResource &);
+
+	ResourceKind m_kind;
+	GLuint m_id;
+};
+
+#endif // GPU_RESOURCES_H
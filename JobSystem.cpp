@@ -0,0 +1,149 @@
+#include "JobSystem.h"
+
+#include <algorithm>
+
+using namespace std;
+
+// The job system and queue of the worker the current thread is, if any
+static thread_local const JobSystem *currentSystem = 0;
+static thread_local int currentWorker = -1;
+
+JobSystem::JobSystem(int numWorkers)
+	: m_numQueued(0)
+	, m_stop(false)
+{
+	if (numWorkers < 0)
+	{
+		numWorkers = max(1, int(thread::hardware_concurrency()) - 1);
+	}
+	for (int i = 0; i <= numWorkers; ++i)
+	{
+		m_queues.push_back(new JobQueue());
+	}
+	for (int i = 0; i < numWorkers; ++i)
+	{
+		m_threads.push_back(thread(&JobSystem::workerLoop, this, i));
+	}
+}
+
+JobSystem::~JobSystem()
+{
+	{
+		lock_guard<mutex> lock(m_sleepMutex);
+		m_stop = true;
+	}
+	m_jobAvailable.notify_all();
+	for (size_t i = 0; i < m_threads.size(); ++i)
+	{
+		m_threads[i].join();
+	}
+	for (size_t i = 0; i < m_queues.size(); ++i)
+	{
+		delete m_queues[i];
+	}
+}
+
+int JobSystem::currentQueue() const
+{
+	return currentSystem == this ? currentWorker : int(m_queues.size()) - 1;
+}
+
+void JobSystem::run(Counter &counter, const function<void()> &job)
+{
+	counter.fetch_add(1);
+	Job queued = { job, &counter };
+	JobQueue &queue = *m_queues[currentQueue()];
+	{
+		lock_guard<mutex> lock(queue.mutex);
+		queue.jobs.push_back(queued);
+	}
+	{
+		// Under the lock, so a worker about to sleep cannot miss it
+		lock_guard<mutex> lock(m_sleepMutex);
+		m_numQueued.fetch_add(1);
+	}
+	m_jobAvailable.notify_one();
+}
+
+bool JobSystem::tryRunJob(int ownQueue)
+{
+	Job job;
+	bool found = false;
+	int numQueues = int(m_queues.size());
+	for (int i = 0; i < numQueues && !found; ++i)
+	{
+		// Newest first from the own queue, oldest first when stealing
+		int index = (ownQueue + i) % numQueues;
+		JobQueue &queue = *m_queues[index];
+		lock_guard<mutex> lock(queue.mutex);
+		if (!queue.jobs.empty())
+		{
+			if (i == 0)
+			{
+				job = queue.jobs.back();
+				queue.jobs.pop_back();
+			}
+			else
+			{
+				job = queue.jobs.front();
+				queue.jobs.pop_front();
+			}
+			found = true;
+		}
+	}
+	if (!found)
+	{
+		return false;
+	}
+	m_numQueued.fetch_sub(1);
+	job.function();
+	job.counter->fetch_sub(1);
+	return true;
+}
+
+void JobSystem::wait(Counter &counter)
+{
+	int ownQueue = currentQueue();
+	while (counter.load() > 0)
+	{
+		if (!tryRunJob(ownQueue))
+		{
+			// The remaining jobs are running on other threads
+			this_thread::yield();
+		}
+	}
+}
+
+void JobSystem::parallelFor(int count, int grainSize, const function<void(int begin, int end)> &body)
+{
+	grainSize = max(1, grainSize);
+	Counter counter(0);
+	for (int begin = 0; begin < count; begin += grainSize)
+	{
+		int end = min(count, begin + grainSize);
+		run(counter, [&body, begin, end]() { body(begin, end); });
+	}
+	wait(counter);
+}
+
+void JobSystem::workerLoop(int index)
+{
+	currentSystem = this;
+	currentWorker = index;
+	for (;;)
+	{
+		if (tryRunJob(index))
+		{
+			continue;
+		}
+		unique_lock<mutex> lock(m_sleepMutex);
+		while (m_numQueued.load() <= 0 && !m_stop)
+		{
+			m_jobAvailable.wait(lock);
+		}
+		if (m_stop)
+		{
+			return;
+		}
+	}
+}
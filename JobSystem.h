@@ -0,0 +1,88 @@
+#ifndef JOB_SYSTEM_H
+#define JOB_SYSTEM_H
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+//*****************************************************************************
+//	Job system
+//
+//	Each worker thread owns a queue of jobs. A worker runs the newest job of
+//	its own queue first (jobs it spawned itself, whose data is likely still in
+//	its cache) and, when that is empty, steals the oldest job of another
+//	queue. Jobs started from other threads go to a shared queue that every
+//	worker steals from.
+//
+//	Completion is tracked with counters rather than per-job handles: run()
+//	increments a counter and the job decrements it when done. A thread that
+//	waits for a counter runs other jobs in the meantime, so jobs may spawn
+//	and wait for further jobs (e.g. a culling job splitting its work with
+//	parallelFor()) without blocking a worker.
+//*****************************************************************************
+
+class JobSystem
+{
+public:
+	typedef std::atomic<int> Counter;
+
+	/**
+	 * Starts numWorkers worker threads, -1 means one less than the number of
+	 * hardware threads, as the main thread takes part when it waits. With 0
+	 * workers all jobs run inside wait() on the waiting thread.
+	 */
+	explicit JobSystem(int numWorkers = -1);
+	~JobSystem();
+
+	/**
+	 * Queues a job. The counter must have been initialized (usually to 0) and
+	 * has to outlive the job.
+	 */
+	void run(Counter &counter, const std::function<void()> &job);
+
+	/**
+	 * Runs queued jobs until the counter has reached zero.
+	 */
+	void wait(Counter &counter);
+
+	/**
+	 * Calls body(begin, end) for consecutive ranges of at most grainSize of
+	 * [0, count), in parallel, and returns when all have finished.
+	 */
+	void parallelFor(int count, int grainSize, const std::function<void(int begin, int end)> &body);
+
+	/**
+	 * The number of threads running jobs while the calling thread waits.
+	 */
+	int getNumThreads() const { return int(m_threads.size()) + 1; }
+
+private:
+	struct Job
+	{
+		std::function<void()> function;
+		Counter *counter;
+	};
+
+	struct JobQueue
+	{
+		std::mutex mutex;
+		std::deque<Job> jobs;
+	};
+
+	int currentQueue() const;
+	bool tryRunJob(int ownQueue);
+	void workerLoop(int index);
+
+	std::vector<std::thread> m_threads;
+	std::vector<JobQueue *> m_queues;	// one per worker, then the shared queue
+	std::atomic<int> m_numQueued;
+	std::mutex m_sleepMutex;
+	std::condition_variable m_jobAvailable;
+	bool m_stop;
+};
+
+#endif // JOB_SYSTEM_H
@@ -0,0 +1,1927 @@
+#include "Mesh.h"
+
+#ifdef WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include <glutil.h>
+
+#include <math.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <map>
+#include <unordered_map>
+
+#include "GpuResources.h"
+#include "Timer.h"
+
+using namespace std;
+using namespace chag;
+
+//*****************************************************************************
+//	Cache file layout. The file is a header followed by the material
+//	libraries, the materials, the chunks and then the packed vertices and the
+//	indices, exactly as they are uploaded to the GPU.
+//*****************************************************************************
+static const char meshCacheMagic[4] = { 'M', 'S', 'H', 'C' };
+static const uint32_t meshCacheVersion = 6;
+static const int meshCacheMaxPath = 256;
+
+/**
+ * The size and modification time of a source file when the cache was written.
+ */
+struct MeshCacheSourceStamp
+{
+	uint64_t size;
+	int64_t modifiedTime;
+};
+
+struct MeshCacheHeader
+{
+	char magic[4];
+	uint32_t version;
+	MeshCacheSourceStamp source;	// of the OBJ file
+	uint32_t numVertices;
+	uint32_t numIndices;
+	uint32_t numChunks;
+	uint32_t numMaterials;
+	uint32_t numMaterialLibraries;
+	float positionScale;		// edge of the bounding cube of the positions
+	float positionOffset[3];	// its minimum corner
+	uint32_t numLodIndices;		// after the numIndices of the full detail
+	float vertexCacheMissRatio;	// of the full detail indices, as optimized
+	uint32_t padding;
+};
+
+struct MeshCacheMaterialLibrary
+{
+	char name[meshCacheMaxPath];	// relative to the OBJ file
+	MeshCacheSourceStamp source;
+};
+
+struct PackedVertex
+{
+	uint16_t position[3];		// unsigned normalized within the bounding cube
+	uint16_t padding;
+	int16_t normal[2];			// signed normalized, octahedron encoded
+	uint16_t texCoord[2];		// half floats
+};
+
+struct MeshCacheMaterial
+{
+	float diffuseColor[3];
+	float specularColor[3];
+	float emissiveColor[3];
+	float shininess;
+	char diffuseMap[meshCacheMaxPath];
+};
+
+struct MeshCacheChunk
+{
+	uint32_t material;
+	uint32_t numLods;
+	float boundsMin[3];
+	float boundsMax[3];
+	uint32_t firstIndex[MAX_MESH_LODS];
+	uint32_t numIndices[MAX_MESH_LODS];
+	float error[MAX_MESH_LODS];
+};
+
+// Chunks are split spatially until they hold at most this many triangles,
+// which is the granularity of frustum culling.
+static const size_t maxTrianglesPerChunk = 2048;
+
+// The size of the vertex cache the triangle order is optimized for, and of
+// the FIFO used to measure the result (smaller, as on most hardware).
+static const int optimizedCacheSize = 32;
+static const int measuredCacheSize = 16;
+
+// Each level of detail aims for half the triangles of the previous one, and
+// the chain ends when a level cannot remove at least this fraction.
+static const float minLodReduction = 0.2f;
+
+//*****************************************************************************
+//	Read only memory mapped files
+//*****************************************************************************
+struct MappedFile
+{
+	const unsigned char *data;
+	size_t size;
+#ifdef WIN32
+	HANDLE file;
+	HANDLE mapping;
+#else
+	int file;
+#endif
+};
+
+static bool mapFile(const string &fileName, MappedFile &mapped)
+{
+	mapped.data = 0;
+	mapped.size = 0;
+#ifdef WIN32
+	mapped.file = CreateFileA(fileName.c_str(), GENERIC_READ, FILE_SHARE_READ, 0,
+							  OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, 0);
+	if (mapped.file == INVALID_HANDLE_VALUE)
+	{
+		return false;
+	}
+	LARGE_INTEGER size;
+	GetFileSizeEx(mapped.file, &size);
+	mapped.size = size_t(size.QuadPart);
+	mapped.mapping = CreateFileMappingA(mapped.file, 0, PAGE_READONLY, 0, 0, 0);
+	if (mapped.mapping == 0)
+	{
+		CloseHandle(mapped.file);
+		return false;
+	}
+	mapped.data = (const unsigned char *)MapViewOfFile(mapped.mapping, FILE_MAP_READ, 0, 0, 0);
+	if (mapped.data == 0)
+	{
+		CloseHandle(mapped.mapping);
+		CloseHandle(mapped.file);
+		return false;
+	}
+#else
+	mapped.file = open(fileName.c_str(), O_RDONLY);
+	if (mapped.file < 0)
+	{
+		return false;
+	}
+	struct stat st;
+	fstat(mapped.file, &st);
+	mapped.size = size_t(st.st_size);
+	void *data = mmap(0, mapped.size, PROT_READ, MAP_PRIVATE, mapped.file, 0);
+	if (data == MAP_FAILED)
+	{
+		close(mapped.file);
+		return false;
+	}
+	mapped.data = (const unsigned char *)data;
+#endif
+	return true;
+}
+
+static void unmapFile(MappedFile &mapped)
+{
+	if (mapped.data == 0)
+	{
+		return;
+	}
+#ifdef WIN32
+	UnmapViewOfFile(mapped.data);
+	CloseHandle(mapped.mapping);
+	CloseHandle(mapped.file);
+#else
+	munmap((void *)mapped.data, mapped.size);
+	close(mapped.file);
+#endif
+	mapped.data = 0;
+}
+
+//*****************************************************************************
+//	Source stamps. A cache is up to date while its OBJ file and material
+//	libraries keep the size and modification time they had when it was
+//	written, sources that do not exist are not checked.
+//*****************************************************************************
+/**
+ * Returns false, with a zero stamp, if the file does not exist.
+ */
+static bool getSourceStamp(const string &fileName, MeshCacheSourceStamp &stamp)
+{
+	stamp.size = 0;
+	stamp.modifiedTime = 0;
+#ifdef WIN32
+	WIN32_FILE_ATTRIBUTE_DATA attributes;
+	if (!GetFileAttributesExA(fileName.c_str(), GetFileExInfoStandard, &attributes))
+	{
+		return false;
+	}
+	stamp.size = (uint64_t(attributes.nFileSizeHigh) << 32) | attributes.nFileSizeLow;
+	stamp.modifiedTime = int64_t((uint64_t(attributes.ftLastWriteTime.dwHighDateTime) << 32)
+		| attributes.ftLastWriteTime.dwLowDateTime);
+#else
+	struct stat st;
+	if (stat(fileName.c_str(), &st) != 0)
+	{
+		return false;
+	}
+	stamp.size = uint64_t(st.st_size);
+	stamp.modifiedTime = int64_t(st.st_mtime);
+#endif
+	return true;
+}
+
+static bool isSourceUnchanged(const string &fileName, const MeshCacheSourceStamp &stamp)
+{
+	// Without the source (e.g. when only the caches are shipped) the cache is
+	// all there is
+	MeshCacheSourceStamp current;
+	return !getSourceStamp(fileName, current)
+		|| (current.size == stamp.size && current.modifiedTime == stamp.modifiedTime);
+}
+
+static string directoryOf(const string &fileName)
+{
+	size_t slash = fileName.find_last_of("/\\");
+	return slash == string::npos ? string() : fileName.substr(0, slash + 1);
+}
+
+//*****************************************************************************
+//	OBJ / MTL parsing
+//*****************************************************************************
+static bool readFile(const string &fileName, string &contents)
+{
+	FILE *file = fopen(fileName.c_str(), "rb");
+	if (!file)
+	{
+		return false;
+	}
+	fseek(file, 0, SEEK_END);
+	long size = ftell(file);
+	fseek(file, 0, SEEK_SET);
+	contents.resize(size_t(size));
+	size_t read = size > 0 ? fread(&contents[0], 1, size_t(size), file) : 0;
+	fclose(file);
+	return read == size_t(size);
+}
+
+static const char *skipSpace(const char *p)
+{
+	while (*p == ' ' || *p == '\t')
+	{
+		++p;
+	}
+	return p;
+}
+
+static const char *nextLine(const char *p)
+{
+	while (*p && *p != '\n')
+	{
+		++p;
+	}
+	return *p ? p + 1 : p;
+}
+
+// Returns the rest of the line with trailing whitespace removed.
+static string restOfLine(const char *p)
+{
+	p = skipSpace(p);
+	const char *end = p;
+	while (*end && *end != '\n' && *end != '\r')
+	{
+		++end;
+	}
+	while (end > p && (end[-1] == ' ' || end[-1] == '\t'))
+	{
+		--end;
+	}
+	return string(p, end);
+}
+
+static bool startsWith(const char *p, const char *keyword)
+{
+	size_t n = strlen(keyword);
+	return strncmp(p, keyword, n) == 0 && (p[n] == ' ' || p[n] == '\t');
+}
+
+static float3 parseFloat3(const char *p)
+{
+	char *end;
+	float3 v;
+	v.x = strtof(p, &end);
+	v.y = strtof(end, &end);
+	v.z = strtof(end, &end);
+	return v;
+}
+
+static MeshMaterial defaultMaterial()
+{
+	MeshMaterial material;
+	material.diffuseColor = make_vector(0.8f, 0.8f, 0.8f);
+	material.specularColor = make_vector(0.0f, 0.0f, 0.0f);
+	material.emissiveColor = make_vector(0.0f, 0.0f, 0.0f);
+	material.shininess = 0.0f;
+	material.diffuseTexture = 0;
+	return material;
+}
+
+static void parseMTL(const string &fileName, vector<MeshMaterial> &materials, map<string, unsigned int> &materialIndices)
+{
+	string contents;
+	if (!readFile(fileName, contents))
+	{
+		printf("Warning: could not read material library '%s'\n", fileName.c_str());
+		return;
+	}
+	MeshMaterial *current = 0;
+	for (const char *p = contents.c_str(); *p; p = nextLine(p))
+	{
+		p = skipSpace(p);
+		if (startsWith(p, "newmtl"))
+		{
+			materialIndices[restOfLine(p + 6)] = (unsigned int)materials.size();
+			materials.push_back(defaultMaterial());
+			current = &materials.back();
+		}
+		else if (!current)
+		{
+			continue;
+		}
+		else if (startsWith(p, "Kd"))
+		{
+			current->diffuseColor = parseFloat3(p + 2);
+		}
+		else if (startsWith(p, "Ks"))
+		{
+			current->specularColor = parseFloat3(p + 2);
+		}
+		else if (startsWith(p, "Ke"))
+		{
+			current->emissiveColor = parseFloat3(p + 2);
+		}
+		else if (startsWith(p, "Ns"))
+		{
+			current->shininess = strtof(p + 2, 0);
+		}
+		else if (startsWith(p, "map_Kd"))
+		{
+			// options may precede the file name, which is always last
+			string map = restOfLine(p + 6);
+			size_t space = map.find_last_of(" \t");
+			current->diffuseMap = space == string::npos ? map : map.substr(space + 1);
+		}
+	}
+}
+
+struct VertexKey
+{
+	int position;
+	int texCoord;
+	int normal;
+	bool operator==(const VertexKey &other) const
+	{
+		return position == other.position && texCoord == other.texCoord && normal == other.normal;
+	}
+};
+
+struct VertexKeyHash
+{
+	size_t operator()(const VertexKey &key) const
+	{
+		return size_t(key.position) * 73856093u ^ size_t(key.texCoord) * 19349663u ^ size_t(key.normal) * 83492791u;
+	}
+};
+
+static bool isIndexStart(char c)
+{
+	return c == '-' || (c >= '0' && c <= '9');
+}
+
+// Resolves a 1-based (or negative, relative) OBJ index to a 0-based one.
+// Returns false if it does not refer to one of the count elements so far.
+static bool resolveIndex(long index, size_t count, int &resolved)
+{
+	long zeroBased = index > 0 ? index - 1 : long(count) + index;
+	resolved = int(zeroBased);
+	return index != 0 && zeroBased >= 0 && size_t(zeroBased) < count;
+}
+
+static AABB triangleBounds(const MeshData &data, const unsigned int *triangle)
+{
+	AABB bounds = makeEmptyAABB();
+	for (int i = 0; i < 3; ++i)
+	{
+		growAABB(bounds, data.positions[triangle[i]]);
+	}
+	return bounds;
+}
+
+/**
+ * Appends the triangles to the index buffer as one or more chunks, splitting
+ * them in halves at the median centroid along the longest axis of their
+ * bounds until each chunk is small enough. Reorders the triangles in place.
+ */
+static void addChunks(MeshData &data, unsigned int material, unsigned int *triangles, size_t numTriangles)
+{
+	AABB bounds = makeEmptyAABB();
+	for (size_t i = 0; i < numTriangles; ++i)
+	{
+		growAABB(bounds, triangleBounds(data, triangles + i * 3));
+	}
+	if (numTriangles <= maxTrianglesPerChunk)
+	{
+		MeshChunk chunk;
+		chunk.material = material;
+		chunk.bounds = bounds;
+		chunk.numLods = 1;
+		chunk.lods[0].firstIndex = (unsigned int)data.indices.size();
+		chunk.lods[0].numIndices = (unsigned int)(numTriangles * 3);
+		chunk.lods[0].error = 0.0f;
+		data.chunks.push_back(chunk);
+		data.indices.insert(data.indices.end(), triangles, triangles + numTriangles * 3);
+		return;
+	}
+
+	float3 extent = bounds.max - bounds.min;
+	int axis = extent.x > extent.y ? (extent.x > extent.z ? 0 : 2) : (extent.y > extent.z ? 1 : 2);
+	// Sort triangle indices (not the index triples) and gather afterwards
+	vector<unsigned int> order(numTriangles);
+	vector<float> centroids(numTriangles);
+	for (size_t i = 0; i < numTriangles; ++i)
+	{
+		order[i] = (unsigned int)i;
+		const unsigned int *tri = triangles + i * 3;
+		centroids[i] = (&data.positions[tri[0]].x)[axis] + (&data.positions[tri[1]].x)[axis]
+			+ (&data.positions[tri[2]].x)[axis];
+	}
+	size_t half = numTriangles / 2;
+	nth_element(order.begin(), order.begin() + half, order.end(),
+		[&centroids](unsigned int a, unsigned int b) { return centroids[a] < centroids[b]; });
+	vector<unsigned int> sorted(numTriangles * 3);
+	for (size_t i = 0; i < numTriangles; ++i)
+	{
+		memcpy(&sorted[i * 3], triangles + order[i] * 3, 3 * sizeof(unsigned int));
+	}
+	memcpy(triangles, &sorted[0], sorted.size() * sizeof(unsigned int));
+
+	addChunks(data, material, triangles, half);
+	addChunks(data, material, triangles + half * 3, numTriangles - half);
+}
+
+bool parseOBJ(const string &fileName, MeshData &data)
+{
+	string contents;
+	if (!readFile(fileName, contents))
+	{
+		return false;
+	}
+	string basePath = directoryOf(fileName);
+
+	vector<float3> positions;
+	vector<float3> normals;
+	vector<float2> texCoords;
+	map<string, unsigned int> materialIndices;
+	vector<vector<unsigned int> > trianglesPerMaterial;
+	unordered_map<VertexKey, unsigned int, VertexKeyHash> vertexIndices;
+	vector<bool> hasNormal;
+	int currentMaterial = -1;
+	vector<VertexKey> corners;
+	vector<unsigned int> polygon;
+	int numInvalidFaces = 0;
+
+	for (const char *p = contents.c_str(); *p; p = nextLine(p))
+	{
+		p = skipSpace(p);
+		if (startsWith(p, "v"))
+		{
+			positions.push_back(parseFloat3(p + 1));
+		}
+		else if (startsWith(p, "vn"))
+		{
+			normals.push_back(parseFloat3(p + 2));
+		}
+		else if (startsWith(p, "vt"))
+		{
+			char *end;
+			float2 t;
+			t.x = strtof(p + 2, &end);
+			t.y = strtof(end, &end);
+			texCoords.push_back(t);
+		}
+		else if (startsWith(p, "mtllib"))
+		{
+			string library = restOfLine(p + 6);
+			data.materialLibraries.push_back(library);
+			parseMTL(basePath + library, data.materials, materialIndices);
+		}
+		else if (startsWith(p, "usemtl"))
+		{
+			map<string, unsigned int>::iterator it = materialIndices.find(restOfLine(p + 6));
+			if (it == materialIndices.end())
+			{
+				it = materialIndices.insert(make_pair(restOfLine(p + 6), (unsigned int)data.materials.size())).first;
+				data.materials.push_back(defaultMaterial());
+			}
+			currentMaterial = int(it->second);
+		}
+		else if (startsWith(p, "f"))
+		{
+			if (currentMaterial < 0)
+			{
+				currentMaterial = int(data.materials.size());
+				data.materials.push_back(defaultMaterial());
+			}
+			if (trianglesPerMaterial.size() <= size_t(currentMaterial))
+			{
+				trianglesPerMaterial.resize(currentMaterial + 1);
+			}
+
+			// Parse the polygon and triangulate it as a fan, faces referring to
+			// elements that are not there are skipped
+			corners.clear();
+			bool valid = true;
+			const char *q = skipSpace(p + 1);
+			while (*q && *q != '\n' && *q != '\r')
+			{
+				char *end;
+				long position = strtol(q, &end, 10);
+				if (end == q)
+				{
+					break;
+				}
+				VertexKey key;
+				valid = resolveIndex(position, positions.size(), key.position) && valid;
+				key.texCoord = -1;
+				key.normal = -1;
+				if (*end == '/')
+				{
+					++end;
+					if (isIndexStart(*end))
+					{
+						valid = resolveIndex(strtol(end, &end, 10), texCoords.size(), key.texCoord) && valid;
+					}
+					if (*end == '/' && isIndexStart(end[1]))
+					{
+						valid = resolveIndex(strtol(end + 1, &end, 10), normals.size(), key.normal) && valid;
+					}
+					else if (*end == '/')
+					{
+						++end;
+					}
+				}
+				q = skipSpace(end);
+				corners.push_back(key);
+			}
+			if (!valid)
+			{
+				++numInvalidFaces;
+				continue;
+			}
+
+			polygon.clear();
+			for (size_t i = 0; i < corners.size(); ++i)
+			{
+				const VertexKey &key = corners[i];
+				unordered_map<VertexKey, unsigned int, VertexKeyHash>::iterator it = vertexIndices.find(key);
+				if (it == vertexIndices.end())
+				{
+					unsigned int index = (unsigned int)data.positions.size();
+					data.positions.push_back(positions[key.position]);
+					data.normals.push_back(key.normal >= 0 ? normals[key.normal] : make_vector(0.0f, 0.0f, 0.0f));
+					data.texCoords.push_back(key.texCoord >= 0 ? texCoords[key.texCoord] : make_vector(0.0f, 0.0f));
+					hasNormal.push_back(key.normal >= 0);
+					it = vertexIndices.insert(make_pair(key, index)).first;
+				}
+				polygon.push_back(it->second);
+			}
+			vector<unsigned int> &triangles = trianglesPerMaterial[currentMaterial];
+			for (size_t i = 2; i < polygon.size(); ++i)
+			{
+				triangles.push_back(polygon[0]);
+				triangles.push_back(polygon[i - 1]);
+				triangles.push_back(polygon[i]);
+			}
+		}
+	}
+	if (numInvalidFaces > 0)
+	{
+		printf("Warning: skipped %d faces with invalid vertex indices in '%s'\n", numInvalidFaces, fileName.c_str());
+	}
+
+	// The triangles of each material are stored contiguously, split into
+	// spatially compact chunks
+	for (size_t i = 0; i < trianglesPerMaterial.size(); ++i)
+	{
+		vector<unsigned int> &triangles = trianglesPerMaterial[i];
+		if (!triangles.empty())
+		{
+			addChunks(data, (unsigned int)i, &triangles[0], triangles.size() / 3);
+		}
+	}
+	data.numFullDetailIndices = data.indices.size();
+
+	// Vertices without a normal in the file get the area weighted average of
+	// the normals of the faces they belong to.
+	for (size_t i = 0; i + 2 < data.indices.size(); i += 3)
+	{
+		const unsigned int *tri = &data.indices[i];
+		float3 faceNormal = cross(data.positions[tri[1]] - data.positions[tri[0]],
+								  data.positions[tri[2]] - data.positions[tri[0]]);
+		for (int j = 0; j < 3; ++j)
+		{
+			if (!hasNormal[tri[j]])
+			{
+				data.normals[tri[j]] += faceNormal;
+			}
+		}
+	}
+	for (size_t i = 0; i < data.normals.size(); ++i)
+	{
+		if (!hasNormal[i] && length(data.normals[i]) > 0.0f)
+		{
+			data.normals[i] = normalize(data.normals[i]);
+		}
+	}
+	return true;
+}
+
+//*****************************************************************************
+//	Vertex cache optimization
+//*****************************************************************************
+/**
+ * Average number of vertex cache misses per triangle, simulating a FIFO
+ * cache. 3 is the worst case, around 0.6 is typical for an optimized mesh.
+ */
+static float vertexCacheMissRatio(const unsigned int *indices, size_t numIndices)
+{
+	if (numIndices < 3)
+	{
+		return 0.0f;
+	}
+	unsigned int cache[measuredCacheSize];
+	int cacheSize = 0;
+	int next = 0;
+	size_t misses = 0;
+	for (size_t i = 0; i < numIndices; ++i)
+	{
+		bool hit = false;
+		for (int j = 0; j < cacheSize && !hit; ++j)
+		{
+			hit = cache[j] == indices[i];
+		}
+		if (!hit)
+		{
+			++misses;
+			cache[next] = indices[i];
+			next = (next + 1) % measuredCacheSize;
+			cacheSize = min(cacheSize + 1, measuredCacheSize);
+		}
+	}
+	return float(misses) / float(numIndices / 3);
+}
+
+/**
+ * Tom Forsyth's linear-speed vertex cache optimization score: recently used
+ * vertices score high (except for the last triangle's, which are in the cache
+ * whatever comes next) and so do vertices with few triangles left, so that
+ * no isolated triangles are left behind.
+ */
+static float vertexScore(int cachePosition, int remainingTriangles)
+{
+	if (remainingTriangles == 0)
+	{
+		return -1.0f;
+	}
+	float score = 0.0f;
+	if (cachePosition >= 0)
+	{
+		score = cachePosition < 3 ? 0.75f
+			: powf(1.0f - float(cachePosition - 3) / float(optimizedCacheSize - 3), 1.5f);
+	}
+	return score + 2.0f / sqrtf(float(remainingTriangles));
+}
+
+/**
+ * Reorders the triangles of one chunk, greedily adding the triangle with the
+ * highest score of its vertices and keeping a simulated LRU cache.
+ */
+static void optimizeTriangleOrder(unsigned int *indices, size_t numIndices)
+{
+	size_t numTriangles = numIndices / 3;
+	if (numTriangles < 2)
+	{
+		return;
+	}
+
+	// Number the chunk's vertices locally, they are a small part of the mesh
+	unordered_map<unsigned int, int> localIndices;
+	vector<unsigned int> globalIndices;
+	vector<int> corners(numIndices);
+	for (size_t i = 0; i < numIndices; ++i)
+	{
+		unordered_map<unsigned int, int>::iterator it = localIndices.find(indices[i]);
+		if (it == localIndices.end())
+		{
+			it = localIndices.insert(make_pair(indices[i], int(globalIndices.size()))).first;
+			globalIndices.push_back(indices[i]);
+		}
+		corners[i] = it->second;
+	}
+	size_t numVertices = globalIndices.size();
+
+	// The triangles not yet added of vertex v are
+	// adjacency[firstTriangle[v], firstTriangle[v] + remaining[v])
+	vector<int> remaining(numVertices, 0);
+	for (size_t i = 0; i < numIndices; ++i)
+	{
+		++remaining[corners[i]];
+	}
+	vector<int> firstTriangle(numVertices + 1, 0);
+	for (size_t v = 0; v < numVertices; ++v)
+	{
+		firstTriangle[v + 1] = firstTriangle[v] + remaining[v];
+	}
+	vector<int> adjacency(numIndices);
+	vector<int> fill(firstTriangle.begin(), firstTriangle.end() - 1);
+	for (size_t i = 0; i < numIndices; ++i)
+	{
+		adjacency[fill[corners[i]]++] = int(i / 3);
+	}
+
+	vector<int> cachePosition(numVertices, -1);
+	vector<float> score(numVertices);
+	for (size_t v = 0; v < numVertices; ++v)
+	{
+		score[v] = vertexScore(-1, remaining[v]);
+	}
+	vector<float> triangleScore(numTriangles);
+	vector<bool> added(numTriangles, false);
+	for (size_t t = 0; t < numTriangles; ++t)
+	{
+		triangleScore[t] = score[corners[t * 3]] + score[corners[t * 3 + 1]] + score[corners[t * 3 + 2]];
+	}
+
+	vector<int> cache;
+	vector<int> newCache;
+	vector<unsigned int> result;
+	result.reserve(numIndices);
+	int best = -1;
+	for (size_t n = 0; n < numTriangles; ++n)
+	{
+		if (best < 0)
+		{
+			// Nothing adjacent to the cache is left, start over at the best
+			// triangle of the whole chunk
+			float bestScore = -1.0f;
+			for (size_t t = 0; t < numTriangles; ++t)
+			{
+				if (!added[t] && triangleScore[t] > bestScore)
+				{
+					bestScore = triangleScore[t];
+					best = int(t);
+				}
+			}
+		}
+		added[best] = true;
+		const int *triangle = &corners[best * 3];
+		newCache.assign(triangle, triangle + 3);
+		for (int i = 0; i < 3; ++i)
+		{
+			int v = triangle[i];
+			result.push_back(globalIndices[v]);
+			int *begin = &adjacency[firstTriangle[v]];
+			int *last = begin + remaining[v] - 1;
+			*find(begin, last + 1, best) = *last;
+			--remaining[v];
+		}
+		for (size_t i = 0; i < cache.size(); ++i)
+		{
+			if (cache[i] != triangle[0] && cache[i] != triangle[1] && cache[i] != triangle[2])
+			{
+				newCache.push_back(cache[i]);
+			}
+		}
+
+		// Rescore the vertices that moved in or out of the cache and pick the
+		// best of their triangles for the next step
+		for (size_t i = 0; i < newCache.size(); ++i)
+		{
+			int v = newCache[i];
+			cachePosition[v] = int(i) < optimizedCacheSize ? int(i) : -1;
+			score[v] = vertexScore(cachePosition[v], remaining[v]);
+		}
+		best = -1;
+		float bestScore = -1.0f;
+		for (size_t i = 0; i < newCache.size(); ++i)
+		{
+			int v = newCache[i];
+			for (int j = 0; j < remaining[v]; ++j)
+			{
+				int t = adjacency[firstTriangle[v] + j];
+				triangleScore[t] = score[corners[t * 3]] + score[corners[t * 3 + 1]] + score[corners[t * 3 + 2]];
+				if (triangleScore[t] > bestScore)
+				{
+					bestScore = triangleScore[t];
+					best = t;
+				}
+			}
+		}
+		if (newCache.size() > size_t(optimizedCacheSize))
+		{
+			newCache.resize(optimizedCacheSize);
+		}
+		cache.swap(newCache);
+	}
+	memcpy(indices, &result[0], numIndices * sizeof(unsigned int));
+}
+
+/**
+ * Reorders the triangles within each chunk (the chunks keep their ranges and
+ * bounds) and then renumbers the vertices in the order they are first used,
+ * so that the vertex fetches walk through memory. Unused vertices are dropped.
+ */
+static void optimizeVertexCache(MeshData &data)
+{
+	data.unoptimizedMissRatio = data.indices.empty() ? 0.0f
+		: vertexCacheMissRatio(&data.indices[0], data.indices.size());
+	for (size_t i = 0; i < data.chunks.size(); ++i)
+	{
+		const MeshChunkLod &lod = data.chunks[i].lods[0];
+		optimizeTriangleOrder(&data.indices[lod.firstIndex], lod.numIndices);
+	}
+
+	const unsigned int unused = ~0u;
+	vector<unsigned int> newIndices(data.positions.size(), unused);
+	vector<float3> positions;
+	vector<float3> normals;
+	vector<float2> texCoords;
+	for (size_t i = 0; i < data.indices.size(); ++i)
+	{
+		unsigned int &index = data.indices[i];
+		if (newIndices[index] == unused)
+		{
+			newIndices[index] = (unsigned int)positions.size();
+			positions.push_back(data.positions[index]);
+			normals.push_back(data.normals[index]);
+			texCoords.push_back(data.texCoords[index]);
+		}
+		index = newIndices[index];
+	}
+	data.positions.swap(positions);
+	data.normals.swap(normals);
+	data.texCoords.swap(texCoords);
+	data.optimizedMissRatio = data.indices.empty() ? 0.0f
+		: vertexCacheMissRatio(&data.indices[0], data.indices.size());
+}
+
+//*****************************************************************************
+//	Level of detail generation
+//*****************************************************************************
+/**
+ * The quadric error function of Garland and Heckbert, the sum of the squared
+ * distances to a set of planes, as the upper triangle of its symmetric 4x4
+ * matrix (xx xy xz xw yy yz yw zz zw ww).
+ */
+struct Quadric
+{
+	double a[10];
+};
+
+static void addPlane(Quadric &q, const float3 &normal, float distance)
+{
+	const double plane[4] = { normal.x, normal.y, normal.z, distance };
+	int k = 0;
+	for (int i = 0; i < 4; ++i)
+	{
+		for (int j = i; j < 4; ++j)
+		{
+			q.a[k++] += plane[i] * plane[j];
+		}
+	}
+}
+
+static Quadric addQuadrics(const Quadric &q, const Quadric &r)
+{
+	Quadric sum;
+	for (int i = 0; i < 10; ++i)
+	{
+		sum.a[i] = q.a[i] + r.a[i];
+	}
+	return sum;
+}
+
+static double evaluateQuadric(const Quadric &q, const float3 &p)
+{
+	double x = p.x, y = p.y, z = p.z;
+	const double *a = q.a;
+	double error = a[0] * x * x + a[4] * y * y + a[7] * z * z + a[9]
+		+ 2.0 * (a[1] * x * y + a[2] * x * z + a[3] * x + a[5] * y * z + a[6] * y + a[8] * z);
+	// Rounding can make it slightly negative
+	return max(0.0, error);
+}
+
+/**
+ * The vertices no level of detail may move: those used by more than one
+ * chunk, and those on edges without exactly two triangles, which are the
+ * open borders of the mesh and the seams where vertices are split for their
+ * normals or texture coordinates.
+ */
+static void findLockedVertices(const MeshData &data, vector<bool> &locked)
+{
+	locked.assign(data.positions.size(), false);
+	vector<int> chunkOf(data.positions.size(), -1);
+	unordered_map<uint64_t, int> edgeCounts;
+	for (size_t c = 0; c < data.chunks.size(); ++c)
+	{
+		const MeshChunkLod &lod = data.chunks[c].lods[0];
+		for (unsigned int i = lod.firstIndex; i < lod.firstIndex + lod.numIndices; ++i)
+		{
+			unsigned int v = data.indices[i];
+			if (chunkOf[v] >= 0 && chunkOf[v] != int(c))
+			{
+				locked[v] = true;
+			}
+			chunkOf[v] = int(c);
+
+			unsigned int w = data.indices[i % 3 == 2 ? i - 2 : i + 1];
+			++edgeCounts[(uint64_t(min(v, w)) << 32) | max(v, w)];
+		}
+	}
+	for (unordered_map<uint64_t, int>::const_iterator it = edgeCounts.begin(); it != edgeCounts.end(); ++it)
+	{
+		if (it->second != 2)
+		{
+			locked[it->first >> 32] = true;
+			locked[it->first & 0xffffffffu] = true;
+		}
+	}
+}
+
+struct EdgeCollapse
+{
+	int from;
+	int to;
+	double error;
+};
+
+static bool operator<(const EdgeCollapse &a, const EdgeCollapse &b)
+{
+	return a.error < b.error;
+}
+
+/**
+ * Simplifies the triangles of one chunk towards the target triangle count
+ * with passes of edge collapses, cheapest first, moving an unlocked vertex
+ * onto a neighbour. A vertex is only involved in one collapse per pass, so
+ * the triangles around it are still those the flip test saw. The triangles
+ * and quadrics (in local vertex numbering) are updated in place and maxError
+ * is raised to that of the worst collapse. Returns false if nothing could be
+ * collapsed.
+ */
+static bool collapseEdges(const vector<float3> &positions, const vector<bool> &locked, vector<Quadric> &quadrics,
+						  vector<int> &triangles, size_t targetTriangles, double &maxError)
+{
+	size_t numVertices = positions.size();
+	bool collapsedAny = false;
+	while (triangles.size() / 3 > targetTriangles)
+	{
+		size_t numTriangles = triangles.size() / 3;
+		vector<EdgeCollapse> collapses;
+		for (size_t i = 0; i < triangles.size(); ++i)
+		{
+			int from = triangles[i];
+			int to = triangles[i % 3 == 2 ? i - 2 : i + 1];
+			for (int direction = 0; direction < 2; ++direction, swap(from, to))
+			{
+				if (!locked[from])
+				{
+					EdgeCollapse collapse = { from, to,
+						evaluateQuadric(addQuadrics(quadrics[from], quadrics[to]), positions[to]) };
+					collapses.push_back(collapse);
+				}
+			}
+		}
+		sort(collapses.begin(), collapses.end());
+
+		// The triangles around each vertex
+		vector<int> firstTriangle(numVertices + 1, 0);
+		for (size_t i = 0; i < triangles.size(); ++i)
+		{
+			++firstTriangle[triangles[i] + 1];
+		}
+		for (size_t v = 0; v < numVertices; ++v)
+		{
+			firstTriangle[v + 1] += firstTriangle[v];
+		}
+		vector<int> adjacency(triangles.size());
+		vector<int> fill(firstTriangle.begin(), firstTriangle.end() - 1);
+		for (size_t i = 0; i < triangles.size(); ++i)
+		{
+			adjacency[fill[triangles[i]]++] = int(i / 3);
+		}
+
+		vector<bool> touched(numVertices, false);
+		vector<int> collapsedTo(numVertices, -1);
+		size_t numRemoved = 0;
+		for (size_t c = 0; c < collapses.size() && numTriangles - numRemoved > targetTriangles; ++c)
+		{
+			const EdgeCollapse &collapse = collapses[c];
+			if (touched[collapse.from] || touched[collapse.to])
+			{
+				continue;
+			}
+			// Reject collapses that fold a remaining triangle over
+			bool valid = true;
+			size_t numDegenerate = 0;
+			for (int a = firstTriangle[collapse.from]; a < firstTriangle[collapse.from + 1] && valid; ++a)
+			{
+				const int *triangle = &triangles[adjacency[a] * 3];
+				if (triangle[0] == collapse.to || triangle[1] == collapse.to || triangle[2] == collapse.to)
+				{
+					++numDegenerate;
+					continue;
+				}
+				float3 corners[3];
+				float3 moved[3];
+				for (int k = 0; k < 3; ++k)
+				{
+					corners[k] = positions[triangle[k]];
+					moved[k] = triangle[k] == collapse.from ? positions[collapse.to] : corners[k];
+				}
+				float3 before = cross(corners[1] - corners[0], corners[2] - corners[0]);
+				float3 after = cross(moved[1] - moved[0], moved[2] - moved[0]);
+				valid = dot(before, after) > 0.25f * length(before) * length(after);
+			}
+			if (!valid)
+			{
+				continue;
+			}
+			collapsedTo[collapse.from] = collapse.to;
+			quadrics[collapse.to] = addQuadrics(quadrics[collapse.from], quadrics[collapse.to]);
+			maxError = max(maxError, collapse.error);
+			for (int a = firstTriangle[collapse.from]; a < firstTriangle[collapse.from + 1]; ++a)
+			{
+				for (int k = 0; k < 3; ++k)
+				{
+					touched[triangles[adjacency[a] * 3 + k]] = true;
+				}
+			}
+			numRemoved += numDegenerate;
+		}
+		if (numRemoved == 0)
+		{
+			break;
+		}
+		collapsedAny = true;
+
+		size_t numKept = 0;
+		for (size_t t = 0; t < numTriangles; ++t)
+		{
+			int v[3];
+			for (int k = 0; k < 3; ++k)
+			{
+				v[k] = triangles[t * 3 + k];
+				v[k] = collapsedTo[v[k]] >= 0 ? collapsedTo[v[k]] : v[k];
+			}
+			if (v[0] != v[1] && v[1] != v[2] && v[2] != v[0])
+			{
+				memcpy(&triangles[numKept * 3], v, sizeof(v));
+				++numKept;
+			}
+		}
+		triangles.resize(numKept * 3);
+	}
+	return collapsedAny;
+}
+
+/**
+ * Builds the coarser levels of detail of every chunk, each simplified from
+ * the previous one and reordered for the vertex cache, and appends them to
+ * the index buffer.
+ */
+static void generateLods(MeshData &data)
+{
+	vector<bool> locked;
+	findLockedVertices(data, locked);
+	vector<unsigned int> lodIndices;
+	for (size_t c = 0; c < data.chunks.size(); ++c)
+	{
+		MeshChunk &chunk = data.chunks[c];
+		const unsigned int *indices = &data.indices[chunk.lods[0].firstIndex];
+		size_t numIndices = chunk.lods[0].numIndices;
+
+		// Local vertex numbering, with the quadrics of the full detail planes
+		unordered_map<unsigned int, int> localIndices;
+		vector<unsigned int> globalIndices;
+		vector<float3> positions;
+		vector<bool> localLocked;
+		vector<int> triangles(numIndices);
+		for (size_t i = 0; i < numIndices; ++i)
+		{
+			unordered_map<unsigned int, int>::iterator it = localIndices.find(indices[i]);
+			if (it == localIndices.end())
+			{
+				it = localIndices.insert(make_pair(indices[i], int(globalIndices.size()))).first;
+				globalIndices.push_back(indices[i]);
+				positions.push_back(data.positions[indices[i]]);
+				localLocked.push_back(locked[indices[i]]);
+			}
+			triangles[i] = it->second;
+		}
+		Quadric zero = { { 0.0 } };
+		vector<Quadric> quadrics(positions.size(), zero);
+		for (size_t i = 0; i < numIndices; i += 3)
+		{
+			const float3 &p = positions[triangles[i]];
+			float3 normal = cross(positions[triangles[i + 1]] - p, positions[triangles[i + 2]] - p);
+			if (length(normal) > 0.0f)
+			{
+				normal = normalize(normal);
+				for (int k = 0; k < 3; ++k)
+				{
+					addPlane(quadrics[triangles[i + k]], normal, -dot(normal, p));
+				}
+			}
+		}
+
+		double maxError = 0.0;
+		while (chunk.numLods < MAX_MESH_LODS)
+		{
+			size_t numTriangles = triangles.size() / 3;
+			if (!collapseEdges(positions, localLocked, quadrics, triangles, numTriangles / 2, maxError)
+				|| float(triangles.size() / 3) > float(numTriangles) * (1.0f - minLodReduction))
+			{
+				break;
+			}
+			MeshChunkLod &lod = chunk.lods[chunk.numLods++];
+			lod.firstIndex = (unsigned int)(data.indices.size() + lodIndices.size());
+			lod.numIndices = (unsigned int)triangles.size();
+			lod.error = float(sqrt(maxError));
+			size_t first = lodIndices.size();
+			for (size_t i = 0; i < triangles.size(); ++i)
+			{
+				lodIndices.push_back(globalIndices[triangles[i]]);
+			}
+			optimizeTriangleOrder(&lodIndices[first], triangles.size());
+		}
+	}
+	data.indices.insert(data.indices.end(), lodIndices.begin(), lodIndices.end());
+}
+
+/**
+ * The level of detail of a chunk for a view, see MeshLodSelection. bounds is
+ * that of the chunk, or of everything drawn with it, in the space of the
+ * view position.
+ */
+static int selectLod(const MeshChunk &chunk, const AABB &bounds, const MeshLodSelection *selection)
+{
+	if (!selection || selection->maxError <= 0.0f)
+	{
+		return 0;
+	}
+	float pixelsPerUnit = selection->pixelsPerUnit;
+	if (!selection->orthographic)
+	{
+		const float3 &eye = selection->viewPosition;
+		float3 closest = make_vector(max(bounds.min.x, min(bounds.max.x, eye.x)),
+									 max(bounds.min.y, min(bounds.max.y, eye.y)),
+									 max(bounds.min.z, min(bounds.max.z, eye.z)));
+		float distance = length(closest - eye);
+		if (distance <= 0.0f)
+		{
+			return 0;
+		}
+		pixelsPerUnit /= distance;
+	}
+	int level = 0;
+	while (level + 1 < chunk.numLods && chunk.lods[level + 1].error * pixelsPerUnit <= selection->maxError)
+	{
+		++level;
+	}
+	return level;
+}
+
+//*****************************************************************************
+//	Vertex compression
+//*****************************************************************************
+/**
+ * Rounds to the nearest half float, clamping to the largest finite one.
+ */
+static uint16_t floatToHalf(float value)
+{
+	uint32_t bits;
+	memcpy(&bits, &value, sizeof(bits));
+	uint32_t sign = (bits >> 16) & 0x8000;
+	int exponent = int((bits >> 23) & 0xff) - 127 + 15;
+	uint32_t mantissa = bits & 0x7fffff;
+	if (exponent >= 31)
+	{
+		return uint16_t(sign | 0x7bff);
+	}
+	if (exponent <= 0)
+	{
+		if (exponent < -10)
+		{
+			return uint16_t(sign);
+		}
+		// Denormal, with the implicit leading one made explicit
+		mantissa |= 0x800000;
+		int shift = 14 - exponent;
+		return uint16_t(sign | ((mantissa + (1u << (shift - 1))) >> shift));
+	}
+	// A carry out of the mantissa correctly increments the exponent
+	uint32_t half = ((uint32_t(exponent) << 10) | (mantissa >> 13)) + ((mantissa >> 12) & 1);
+	return uint16_t(sign | min(half, 0x7bffu));
+}
+
+static float halfToFloat(uint16_t half)
+{
+	int exponent = (half >> 10) & 0x1f;
+	int mantissa = half & 0x3ff;
+	// Denormals have no implicit leading one
+	float value = exponent == 0 ? ldexpf(float(mantissa), -24) : ldexpf(float(mantissa | 0x400), exponent - 25);
+	return (half & 0x8000) ? -value : value;
+}
+
+static int16_t toSnorm16(float value)
+{
+	return int16_t(lroundf(max(-1.0f, min(1.0f, value)) * 32767.0f));
+}
+
+/**
+ * Projects the unit normal onto the octahedron |x| + |y| + |z| = 1 and folds
+ * the lower half over the upper, see decodeOctahedral() in shader.vert.
+ */
+static void encodeOctahedral(const float3 &n, int16_t encoded[2])
+{
+	float sum = fabsf(n.x) + fabsf(n.y) + fabsf(n.z);
+	float x = sum > 0.0f ? n.x / sum : 0.0f;
+	float y = sum > 0.0f ? n.y / sum : 0.0f;
+	if (n.z < 0.0f)
+	{
+		float foldedX = (1.0f - fabsf(y)) * (x >= 0.0f ? 1.0f : -1.0f);
+		float foldedY = (1.0f - fabsf(x)) * (y >= 0.0f ? 1.0f : -1.0f);
+		x = foldedX;
+		y = foldedY;
+	}
+	encoded[0] = toSnorm16(x);
+	encoded[1] = toSnorm16(y);
+}
+
+/**
+ * Compresses the vertices, quantizing the positions within the bounding cube
+ * (offset, scale) of all of them.
+ */
+static void packVertices(const MeshData &data, vector<PackedVertex> &vertices, float3 &offset, float &scale)
+{
+	AABB bounds = makeEmptyAABB();
+	for (size_t i = 0; i < data.positions.size(); ++i)
+	{
+		growAABB(bounds, data.positions[i]);
+	}
+	offset = data.positions.empty() ? make_vector(0.0f, 0.0f, 0.0f) : bounds.min;
+	float3 extent = data.positions.empty() ? make_vector(0.0f, 0.0f, 0.0f) : bounds.max - bounds.min;
+	scale = max(extent.x, max(extent.y, extent.z));
+	if (scale <= 0.0f)
+	{
+		scale = 1.0f;
+	}
+
+	vertices.resize(data.positions.size());
+	for (size_t i = 0; i < data.positions.size(); ++i)
+	{
+		PackedVertex &v = vertices[i];
+		float3 p = (data.positions[i] - offset) * (65535.0f / scale);
+		for (int j = 0; j < 3; ++j)
+		{
+			v.position[j] = uint16_t(lroundf(max(0.0f, min(65535.0f, (&p.x)[j]))));
+		}
+		v.padding = 0;
+		encodeOctahedral(data.normals[i], v.normal);
+		v.texCoord[0] = floatToHalf(data.texCoords[i].x);
+		v.texCoord[1] = floatToHalf(data.texCoords[i].y);
+	}
+}
+
+static float3 unpackPosition(const PackedVertex &v, const float3 &offset, float scale)
+{
+	return offset + make_vector(float(v.position[0]), float(v.position[1]), float(v.position[2])) * (scale / 65535.0f);
+}
+
+static float4x4 makeDecodeMatrix(const float3 &offset, float scale)
+{
+	// Normalized attributes arrive as integer / 65535
+	return make_translation(offset) * make_scale<float4x4>(scale);
+}
+
+/**
+ * Points the vertex attributes at the packed vertices in the bound array
+ * buffer: position (0), normalIn (1) and texCoordIn (2).
+ */
+static void setPackedVertexFormat()
+{
+	glVertexAttribPointer(0, 3, GL_UNSIGNED_SHORT, GL_TRUE, sizeof(PackedVertex),
+						  (const GLvoid *)offsetof(PackedVertex, position));
+	glVertexAttribPointer(1, 2, GL_SHORT, GL_TRUE, sizeof(PackedVertex),
+						  (const GLvoid *)offsetof(PackedVertex, normal));
+	glVertexAttribPointer(2, 2, GL_HALF_FLOAT, GL_FALSE, sizeof(PackedVertex),
+						  (const GLvoid *)offsetof(PackedVertex, texCoord));
+	for (GLuint i = 0; i < 3; ++i)
+	{
+		glEnableVertexAttribArray(i);
+	}
+}
+
+//*****************************************************************************
+//	Cache writing
+//*****************************************************************************
+static void copyString(char *dest, const string &source)
+{
+	memset(dest, 0, meshCacheMaxPath);
+	strncpy(dest, source.c_str(), meshCacheMaxPath - 1);
+}
+
+static bool writeMeshCache(const string &objFileName, const string &cacheFileName, const MeshData &data)
+{
+	FILE *file = fopen(cacheFileName.c_str(), "wb");
+	if (!file)
+	{
+		return false;
+	}
+	MeshCacheHeader header;
+	memcpy(header.magic, meshCacheMagic, sizeof(header.magic));
+	header.version = meshCacheVersion;
+	getSourceStamp(objFileName, header.source);
+	header.numVertices = uint32_t(data.positions.size());
+	header.numIndices = uint32_t(data.numFullDetailIndices);
+	header.numLodIndices = uint32_t(data.indices.size() - data.numFullDetailIndices);
+	header.vertexCacheMissRatio = data.optimizedMissRatio;
+	header.padding = 0;
+	header.numChunks = uint32_t(data.chunks.size());
+	header.numMaterials = uint32_t(data.materials.size());
+	header.numMaterialLibraries = uint32_t(data.materialLibraries.size());
+	vector<PackedVertex> vertices;
+	float3 offset;
+	packVertices(data, vertices, offset, header.positionScale);
+	memcpy(header.positionOffset, &offset.x, sizeof(header.positionOffset));
+	fwrite(&header, sizeof(header), 1, file);
+
+	string basePath = directoryOf(objFileName);
+	for (size_t i = 0; i < data.materialLibraries.size(); ++i)
+	{
+		MeshCacheMaterialLibrary library;
+		copyString(library.name, data.materialLibraries[i]);
+		getSourceStamp(basePath + data.materialLibraries[i], library.source);
+		fwrite(&library, sizeof(library), 1, file);
+	}
+	for (size_t i = 0; i < data.materials.size(); ++i)
+	{
+		const MeshMaterial &m = data.materials[i];
+		MeshCacheMaterial material;
+		memcpy(material.diffuseColor, &m.diffuseColor.x, sizeof(material.diffuseColor));
+		memcpy(material.specularColor, &m.specularColor.x, sizeof(material.specularColor));
+		memcpy(material.emissiveColor, &m.emissiveColor.x, sizeof(material.emissiveColor));
+		material.shininess = m.shininess;
+		copyString(material.diffuseMap, m.diffuseMap);
+		fwrite(&material, sizeof(material), 1, file);
+	}
+	for (size_t i = 0; i < data.chunks.size(); ++i)
+	{
+		const MeshChunk &c = data.chunks[i];
+		MeshCacheChunk chunk;
+		memset(&chunk, 0, sizeof(chunk));
+		chunk.material = c.material;
+		chunk.numLods = uint32_t(c.numLods);
+		memcpy(chunk.boundsMin, &c.bounds.min.x, sizeof(chunk.boundsMin));
+		memcpy(chunk.boundsMax, &c.bounds.max.x, sizeof(chunk.boundsMax));
+		for (int j = 0; j < c.numLods; ++j)
+		{
+			chunk.firstIndex[j] = c.lods[j].firstIndex;
+			chunk.numIndices[j] = c.lods[j].numIndices;
+			chunk.error[j] = c.lods[j].error;
+		}
+		fwrite(&chunk, sizeof(chunk), 1, file);
+	}
+	if (header.numVertices > 0)
+	{
+		fwrite(&vertices[0], sizeof(PackedVertex), vertices.size(), file);
+	}
+	if (!data.indices.empty())
+	{
+		fwrite(&data.indices[0], sizeof(unsigned int), data.indices.size(), file);
+	}
+	bool ok = ferror(file) == 0;
+	fclose(file);
+	return ok;
+}
+
+bool convertOBJToMeshCache(const string &objFileName, const string &cacheFileName, MeshData &data)
+{
+	data = MeshData();
+	if (!parseOBJ(objFileName, data))
+	{
+		return false;
+	}
+	optimizeVertexCache(data);
+	generateLods(data);
+	if (!writeMeshCache(objFileName, cacheFileName, data))
+	{
+		printf("Warning: could not write mesh cache '%s'\n", cacheFileName.c_str());
+		return false;
+	}
+	return true;
+}
+
+//*****************************************************************************
+//	Mesh
+//*****************************************************************************
+Mesh::Mesh()
+	: m_numVertices(0)
+	, m_numIndices(0)
+	, m_numLodIndices(0)
+	, m_decodeMatrix(make_identity<float4x4>())
+	, m_vertexArrayObject(0)
+	, m_vertexBuffer(0)
+	, m_indexBuffer(0)
+	, m_pendingVertices(0)
+	, m_pendingIndices(0)
+	, m_mappedCache(0)
+{
+	m_loadStats.convertTime = 0.0;
+	m_loadStats.cachedLoadTime = 0.0;
+	m_loadStats.usedCache = false;
+	m_loadStats.vertexCacheMissRatio = 0.0f;
+}
+
+Mesh::~Mesh()
+{
+	releasePendingBuffers();
+	deleteResource(RESOURCE_BUFFER, m_vertexBuffer);
+	deleteResource(RESOURCE_BUFFER, m_indexBuffer);
+	deleteResource(RESOURCE_VERTEX_ARRAY, m_vertexArrayObject);
+	// Each material holds a reference to its texture, see requestTextures()
+	for (size_t i = 0; i < m_materials.size(); ++i)
+	{
+		deleteResource(RESOURCE_TEXTURE, m_materials[i].diffuseTexture);
+	}
+}
+
+/**
+ * Validates a mapped cache file against the current source files and, if it
+ * is up to date, fills in the material table and chunks and returns pointers
+ * to the vertex and index arrays inside the mapping.
+ */
+static bool readMeshCache(const MappedFile &mapped, const string &objFileName,
+						  vector<MeshMaterial> &materials, vector<MeshChunk> &chunks,
+						  const MeshCacheHeader *&header, const unsigned char *&arrays)
+{
+	if (mapped.size < sizeof(MeshCacheHeader))
+	{
+		return false;
+	}
+	header = (const MeshCacheHeader *)mapped.data;
+	if (memcmp(header->magic, meshCacheMagic, sizeof(meshCacheMagic)) != 0 || header->version != meshCacheVersion)
+	{
+		return false;
+	}
+	size_t expectedSize = sizeof(MeshCacheHeader)
+		+ header->numMaterialLibraries * sizeof(MeshCacheMaterialLibrary)
+		+ header->numMaterials * sizeof(MeshCacheMaterial)
+		+ header->numChunks * sizeof(MeshCacheChunk)
+		+ header->numVertices * sizeof(PackedVertex)
+		+ (size_t(header->numIndices) + header->numLodIndices) * sizeof(uint32_t);
+	if (mapped.size != expectedSize)
+	{
+		return false;
+	}
+
+	if (!isSourceUnchanged(objFileName, header->source))
+	{
+		return false;
+	}
+	const unsigned char *p = mapped.data + sizeof(MeshCacheHeader);
+	string basePath = directoryOf(objFileName);
+	for (uint32_t i = 0; i < header->numMaterialLibraries; ++i, p += sizeof(MeshCacheMaterialLibrary))
+	{
+		const MeshCacheMaterialLibrary *library = (const MeshCacheMaterialLibrary *)p;
+		if (!isSourceUnchanged(basePath + library->name, library->source))
+		{
+			return false;
+		}
+	}
+
+	materials.resize(header->numMaterials);
+	for (uint32_t i = 0; i < header->numMaterials; ++i, p += sizeof(MeshCacheMaterial))
+	{
+		const MeshCacheMaterial *m = (const MeshCacheMaterial *)p;
+		memcpy(&materials[i].diffuseColor.x, m->diffuseColor, sizeof(m->diffuseColor));
+		memcpy(&materials[i].specularColor.x, m->specularColor, sizeof(m->specularColor));
+		memcpy(&materials[i].emissiveColor.x, m->emissiveColor, sizeof(m->emissiveColor));
+		materials[i].shininess = m->shininess;
+		materials[i].diffuseMap = m->diffuseMap;
+		materials[i].diffuseTexture = 0;
+	}
+	chunks.resize(header->numChunks);
+	for (uint32_t i = 0; i < header->numChunks; ++i, p += sizeof(MeshCacheChunk))
+	{
+		const MeshCacheChunk *c = (const MeshCacheChunk *)p;
+		if (c->numLods < 1 || c->numLods > uint32_t(MAX_MESH_LODS))
+		{
+			return false;
+		}
+		chunks[i].material = c->material;
+		chunks[i].bounds.min = make_vector(c->boundsMin[0], c->boundsMin[1], c->boundsMin[2]);
+		chunks[i].bounds.max = make_vector(c->boundsMax[0], c->boundsMax[1], c->boundsMax[2]);
+		chunks[i].numLods = int(c->numLods);
+		for (int j = 0; j < chunks[i].numLods; ++j)
+		{
+			chunks[i].lods[j].firstIndex = c->firstIndex[j];
+			chunks[i].lods[j].numIndices = c->numIndices[j];
+			chunks[i].lods[j].error = c->error[j];
+		}
+	}
+	arrays = p;
+	return true;
+}
+
+static bool readMeshData(const string &fileName, const string &cacheFileName, MeshData &data)
+{
+	MappedFile mapped;
+	if (mapFile(cacheFileName, mapped))
+	{
+		data = MeshData();
+		const MeshCacheHeader *header;
+		const unsigned char *arrays;
+		bool valid = readMeshCache(mapped, fileName, data.materials, data.chunks, header, arrays);
+		if (valid)
+		{
+			const PackedVertex *vertices = (const PackedVertex *)arrays;
+			const unsigned int *cachedIndices = (const unsigned int *)(vertices + header->numVertices);
+			float3 offset = make_vector(header->positionOffset[0], header->positionOffset[1],
+										header->positionOffset[2]);
+			data.positions.resize(header->numVertices);
+			data.texCoords.resize(header->numVertices);
+			for (uint32_t i = 0; i < header->numVertices; ++i)
+			{
+				data.positions[i] = unpackPosition(vertices[i], offset, header->positionScale);
+				data.texCoords[i] = make_vector(halfToFloat(vertices[i].texCoord[0]),
+												halfToFloat(vertices[i].texCoord[1]));
+			}
+			data.indices.assign(cachedIndices, cachedIndices + header->numIndices + header->numLodIndices);
+			data.numFullDetailIndices = header->numIndices;
+			data.optimizedMissRatio = header->vertexCacheMissRatio;
+		}
+		unmapFile(mapped);
+		return valid;
+	}
+	return false;
+}
+
+bool loadMeshData(const string &fileName, MeshData &data)
+{
+	string cacheFileName = fileName + ".mesh";
+	if (readMeshData(fileName, cacheFileName, data))
+	{
+		return true;
+	}
+	// Missing or stale, convert and then read the cache we just wrote, so
+	// that every load sees the same (compressed) vertices
+	MeshData converted;
+	if (convertOBJToMeshCache(fileName, cacheFileName, converted) && readMeshData(fileName, cacheFileName, data))
+	{
+		return true;
+	}
+	data = converted;
+	return !data.positions.empty();
+}
+
+bool loadMeshGeometry(const string &fileName, vector<float3> &positions, vector<unsigned int> &indices)
+{
+	MeshData data;
+	if (!loadMeshData(fileName, data))
+	{
+		return false;
+	}
+	positions.swap(data.positions);
+	indices.assign(data.indices.begin(), data.indices.begin() + data.numFullDetailIndices);
+	return true;
+}
+
+void Mesh::load(const string &fileName, bool forceConvert)
+{
+	loadData(fileName, forceConvert);
+	upload();
+}
+
+void Mesh::loadData(const string &fileName, bool forceConvert)
+{
+	m_fileName = fileName;
+	string cacheFileName = fileName + ".mesh";
+	m_loadStats.convertTime = 0.0;
+	m_loadStats.cachedLoadTime = 0.0;
+	m_loadStats.usedCache = !forceConvert && loadFromCache(cacheFileName);
+	if (!m_loadStats.usedCache)
+	{
+		convertAndLoad(cacheFileName);
+	}
+
+	vector<AABB> chunkBounds(m_chunks.size());
+	m_bounds = makeEmptyAABB();
+	for (size_t i = 0; i < m_chunks.size(); ++i)
+	{
+		chunkBounds[i] = m_chunks[i].bounds;
+		growAABB(m_bounds, m_chunks[i].bounds);
+	}
+	m_bvh.build(chunkBounds);
+}
+
+void Mesh::convertAndLoad(const string &cacheFileName)
+{
+	// Missing or stale, convert and then load through the cache we just wrote
+	MeshData converted;
+	double start = getTimeMs();
+	bool written = convertOBJToMeshCache(m_fileName, cacheFileName, converted);
+	m_loadStats.convertTime = getTimeMs() - start;
+	if (!written || !loadFromCache(cacheFileName))
+	{
+		if (converted.positions.empty())
+		{
+			fatal_error("Could not load mesh '" + m_fileName + "'");
+		}
+		// The cache could not be written, use the converted data directly
+		m_materials = converted.materials;
+		m_chunks = converted.chunks;
+		m_numVertices = converted.positions.size();
+		m_numIndices = converted.numFullDetailIndices;
+		m_numLodIndices = converted.indices.size() - converted.numFullDetailIndices;
+		vector<PackedVertex> vertices;
+		float3 offset;
+		float scale;
+		packVertices(converted, vertices, offset, scale);
+		m_decodeMatrix = makeDecodeMatrix(offset, scale);
+		m_loadStats.vertexCacheMissRatio = converted.optimizedMissRatio;
+		keepBuffers(&vertices[0], &converted.indices[0]);
+	}
+}
+
+bool Mesh::loadFromCache(const string &cacheFileName)
+{
+	releasePendingBuffers();
+	double start = getTimeMs();
+	MappedFile mapped;
+	if (!mapFile(cacheFileName, mapped))
+	{
+		return false;
+	}
+	const MeshCacheHeader *header;
+	const unsigned char *arrays;
+	bool valid = readMeshCache(mapped, m_fileName, m_materials, m_chunks, header, arrays);
+	if (valid)
+	{
+		m_numVertices = header->numVertices;
+		m_numIndices = header->numIndices;
+		m_numLodIndices = header->numLodIndices;
+		const PackedVertex *vertices = (const PackedVertex *)arrays;
+		const unsigned int *indices = (const unsigned int *)(vertices + m_numVertices);
+		m_decodeMatrix = makeDecodeMatrix(make_vector(header->positionOffset[0], header->positionOffset[1],
+			header->positionOffset[2]), header->positionScale);
+		m_loadStats.vertexCacheMissRatio = header->vertexCacheMissRatio;
+		// upload() reads the arrays from the mapping
+		m_pendingVertices = vertices;
+		m_pendingIndices = indices;
+		m_mappedCache = new MappedFile(mapped);
+		m_loadStats.cachedLoadTime = getTimeMs() - start;
+	}
+	else
+	{
+		unmapFile(mapped);
+	}
+	return valid;
+}
+
+/**
+ * Copies the vertex and index arrays for upload(), when there is no cache
+ * file to map and they are about to be freed.
+ */
+void Mesh::keepBuffers(const PackedVertex *vertices, const unsigned int *indices)
+{
+	releasePendingBuffers();
+	m_pendingBuffers.resize(getVertexBufferSize() + getIndexBufferSize());
+	memcpy(&m_pendingBuffers[0], vertices, getVertexBufferSize());
+	memcpy(&m_pendingBuffers[getVertexBufferSize()], indices, getIndexBufferSize());
+	m_pendingVertices = (const PackedVertex *)&m_pendingBuffers[0];
+	m_pendingIndices = (const unsigned int *)&m_pendingBuffers[getVertexBufferSize()];
+}
+
+void Mesh::releasePendingBuffers()
+{
+	if (m_mappedCache != 0)
+	{
+		unmapFile(*m_mappedCache);
+		delete m_mappedCache;
+		m_mappedCache = 0;
+	}
+	vector<unsigned char>().swap(m_pendingBuffers);
+	m_pendingVertices = 0;
+	m_pendingIndices = 0;
+}
+
+void Mesh::upload()
+{
+	if (m_pendingVertices == 0)
+	{
+		return;
+	}
+	double start = getTimeMs();
+	m_vertexArrayObject = createResource(RESOURCE_VERTEX_ARRAY, RESOURCE_MESHES, m_fileName.c_str());
+	glBindVertexArray(m_vertexArrayObject);
+	m_vertexBuffer = createResource(RESOURCE_BUFFER, RESOURCE_MESHES, m_fileName.c_str());
+	glBindBuffer(GL_ARRAY_BUFFER, m_vertexBuffer);
+	glBufferData(GL_ARRAY_BUFFER, getVertexBufferSize(), m_pendingVertices, GL_STATIC_DRAW);
+	setResourceStorage(RESOURCE_BUFFER, m_vertexBuffer, getVertexBufferSize());
+	setPackedVertexFormat();
+
+	m_indexBuffer = createResource(RESOURCE_BUFFER, RESOURCE_MESHES, m_fileName.c_str());
+	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, m_indexBuffer);
+	glBufferData(GL_ELEMENT_ARRAY_BUFFER, getIndexBufferSize(), m_pendingIndices, GL_STATIC_DRAW);
+	setResourceStorage(RESOURCE_BUFFER, m_indexBuffer, getIndexBufferSize());
+	glBindVertexArray(0);
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
+	CHECK_GL_ERROR();
+	releasePendingBuffers();
+	m_loadStats.cachedLoadTime += getTimeMs() - start;
+}
+
+size_t Mesh::getVertexBufferSize() const
+{
+	return m_numVertices * sizeof(PackedVertex);
+}
+
+size_t Mesh::getIndexBufferSize() const
+{
+	return (m_numIndices + m_numLodIndices) * sizeof(unsigned int);
+}
+
+bool Mesh::hasTextures() const
+{
+	for (size_t i = 0; i < m_materials.size(); ++i)
+	{
+		if (!m_materials[i].diffuseMap.empty() && m_materials[i].diffuseTexture == 0)
+		{
+			return false;
+		}
+	}
+	return true;
+}
+
+void Mesh::requestTextures(TextureLoader &loader)
+{
+	string basePath = directoryOf(m_fileName);
+	for (size_t i = 0; i < m_materials.size(); ++i)
+	{
+		if (!m_materials[i].diffuseMap.empty())
+		{
+			loader.loadTexture(basePath + m_materials[i].diffuseMap, &m_materials[i].diffuseTexture);
+		}
+	}
+}
+
+int Mesh::render(RenderQueue &queue, int object, const float4x4 &modelViewProjection,
+				 const MeshLodSelection *lod) const
+{
+	vector<unsigned int> chunks(m_chunks.size());
+	for (size_t i = 0; i < m_chunks.size(); ++i)
+	{
+		chunks[i] = (unsigned int)i;
+	}
+	return queueChunks(queue, object, modelViewProjection, chunks, lod);
+}
+
+void Mesh::render(RenderQueue &queue, int object, const float4x4 &modelViewProjection, CullingStats &stats,
+				  const OcclusionBuffer *occlusion, const MeshLodSelection *lod) const
+{
+	// A local list, so that several views can be culled in parallel
+	vector<unsigned int> visibleChunks;
+	m_bvh.query(makeFrustum(modelViewProjection), visibleChunks);
+	if (occlusion)
+	{
+		size_t numInFrustum = visibleChunks.size();
+		size_t numVisible = 0;
+		for (size_t i = 0; i < numInFrustum; ++i)
+		{
+			if (occlusion->isVisible(m_chunks[visibleChunks[i]].bounds, modelViewProjection))
+			{
+				visibleChunks[numVisible++] = visibleChunks[i];
+			}
+		}
+		visibleChunks.resize(numVisible);
+		stats.numOccludedChunks += int(numInFrustum - numVisible);
+	}
+
+	stats.numChunks += int(m_chunks.size());
+	stats.numTriangles += int(m_numIndices / 3);
+	stats.numVisibleChunks += int(visibleChunks.size());
+	stats.numVisibleTriangles += queueChunks(queue, object, modelViewProjection, visibleChunks, lod);
+}
+
+int Mesh::queueChunks(RenderQueue &queue, int object, const float4x4 &modelViewProjection,
+					  const vector<unsigned int> &chunks, const MeshLodSelection *lod) const
+{
+	int numTriangles = 0;
+	for (size_t i = 0; i < chunks.size(); ++i)
+	{
+		const MeshChunk &chunk = m_chunks[chunks[i]];
+		const MeshChunkLod &level = chunk.lods[selectLod(chunk, chunk.bounds, lod)];
+		float3 center = (chunk.bounds.min + chunk.bounds.max) * 0.5f;
+		// Clip space w is the distance along the view direction
+		float depth = (modelViewProjection * make_vector(center.x, center.y, center.z, 1.0f)).w;
+		queue.addDraw(object, m_vertexArrayObject, &m_materials[chunk.material], chunk.material,
+					  level.firstIndex, level.numIndices, depth);
+		numTriangles += int(level.numIndices / 3);
+	}
+	return numTriangles;
+}
+
+MeshInstances::MeshInstances(const Mesh *mesh)
+	: m_mesh(mesh)
+	, m_capacity(0)
+{
+	m_instanceBuffer = createResource(RESOURCE_BUFFER, RESOURCE_STREAMING, "instance matrices");
+	m_vertexArrayObject = createResource(RESOURCE_VERTEX_ARRAY, RESOURCE_MESHES, "instanced mesh");
+	glBindVertexArray(m_vertexArrayObject);
+	glBindBuffer(GL_ARRAY_BUFFER, mesh->m_vertexBuffer);
+	setPackedVertexFormat();
+	glBindBuffer(GL_ARRAY_BUFFER, m_instanceBuffer);
+	for (GLuint i = 0; i < 4; ++i)
+	{
+		glVertexAttribPointer(INSTANCE_MATRIX_ATTRIBUTE + i, 4, GL_FLOAT, GL_FALSE, sizeof(float4x4),
+							  (const GLvoid *)(i * sizeof(float4)));
+		glVertexAttribDivisor(INSTANCE_MATRIX_ATTRIBUTE + i, 1);
+		glEnableVertexAttribArray(INSTANCE_MATRIX_ATTRIBUTE + i);
+	}
+	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, mesh->m_indexBuffer);
+	glBindVertexArray(0);
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
+	CHECK_GL_ERROR();
+}
+
+MeshInstances::~MeshInstances()
+{
+	deleteResource(RESOURCE_BUFFER, m_instanceBuffer);
+	deleteResource(RESOURCE_VERTEX_ARRAY, m_vertexArrayObject);
+}
+
+void MeshInstances::update(const MatrixArray &modelMatrices)
+{
+	if (modelMatrices.size() == 0)
+	{
+		return;
+	}
+
+	// The decoding of the positions comes before the instance transform
+	multiplyMatrices(modelMatrices, m_mesh->getDecodeMatrix(), m_decodedMatrices);
+	m_uploadMatrices.resize(modelMatrices.size());
+	m_decodedMatrices.store(&m_uploadMatrices[0]);
+
+	glBindBuffer(GL_ARRAY_BUFFER, m_instanceBuffer);
+	size_t size = m_uploadMatrices.size() * sizeof(float4x4);
+	if (m_uploadMatrices.size() > m_capacity)
+	{
+		m_capacity = m_uploadMatrices.size();
+		glBufferData(GL_ARRAY_BUFFER, size, &m_uploadMatrices[0], GL_STREAM_DRAW);
+		setResourceStorage(RESOURCE_BUFFER, m_instanceBuffer, size);
+	}
+	else
+	{
+		// Orphan the storage the previous frame may still be drawing from
+		glBufferData(GL_ARRAY_BUFFER, m_capacity * sizeof(float4x4), 0, GL_STREAM_DRAW);
+		glBufferSubData(GL_ARRAY_BUFFER, 0, size, &m_uploadMatrices[0]);
+	}
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
+}
+
+void MeshInstances::render(RenderQueue &queue, int object, const float4x4 &viewProjection,
+						   const AABB &instanceBounds, int numInstances, CullingStats &stats, bool cull,
+						   const MeshLodSelection *lod) const
+{
+	if (numInstances == 0)
+	{
+		return;
+	}
+	int numChunks = int(m_mesh->m_chunks.size()) * numInstances;
+	int numTriangles = int(m_mesh->m_numIndices / 3) * numInstances;
+	stats.numChunks += numChunks;
+	stats.numTriangles += numTriangles;
+	if (cull && !intersectsFrustum(makeFrustum(viewProjection), instanceBounds))
+	{
+		return;
+	}
+	stats.numVisibleChunks += numChunks;
+
+	float3 center = (instanceBounds.min + instanceBounds.max) * 0.5f;
+	float depth = (viewProjection * make_vector(center.x, center.y, center.z, 1.0f)).w;
+	for (size_t i = 0; i < m_mesh->m_chunks.size(); ++i)
+	{
+		const MeshChunk &chunk = m_mesh->m_chunks[i];
+		const MeshChunkLod &level = chunk.lods[selectLod(chunk, instanceBounds, lod)];
+		queue.addDraw(object, m_vertexArrayObject, &m_mesh->m_materials[chunk.material], chunk.material,
+					  level.firstIndex, level.numIndices, depth, numInstances);
+		stats.numVisibleTriangles += int(level.numIndices / 3) * numInstances;
+	}
+}
+
+GLuint Mesh::getDiffuseTexture(int material) const
+{
+	return m_materials[material].diffuseTexture;
+}
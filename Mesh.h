@@ -0,0 +1,305 @@
+#ifndef MESH_H
+#define MESH_H
+
+#include <GL/glew.h>
+#include <float4x4.h>
+#include <string>
+#include <vector>
+
+#include "BatchMath.h"
+#include "Culling.h"
+#include "OcclusionCulling.h"
+#include "RenderQueue.h"
+#include "ShaderUniforms.h"
+#include "TextureLoader.h"
+
+//*****************************************************************************
+//	Mesh
+//
+//	Replacement for OBJModel that never parses text at startup. The first time
+//	an OBJ file is loaded (or whenever the source has changed) it is converted
+//	into a binary cache file next to it, holding ready-to-upload vertex and
+//	index buffers, the material table and the texture references, along with
+//	the size and modification time of the source files. Subsequent loads
+//	memory map the cache and upload the buffers from it, possibly on a later
+//	frame than the reading (see loadData()). A cache whose sources are missing
+//	is used as it is.
+//
+//	The vertices are stored compressed and interleaved, 16 bytes each instead
+//	of 32 for separate float arrays: the position as three 16 bit fixed point
+//	coordinates within the bounds of the mesh, the normal octahedron encoded in
+//	two 16 bit signed normalized values and the texture coordinates as half
+//	floats. The bounds are a cube, so the decoding is a uniform scale and a
+//	translation that is folded into the model matrix (see getDecodeMatrix()).
+//	The converter reorders the triangles of each chunk for the post-transform
+//	vertex cache and then the vertices in the order they are first used.
+//
+//	Each chunk also gets a chain of coarser levels of detail, simplified with
+//	quadric error edge collapses onto the existing vertices, so all levels are
+//	ranges of the same index buffer after the full detail ones. The borders
+//	between chunks are kept, so neighbouring chunks can use different levels
+//	without cracks. render() picks the coarsest level whose simplification
+//	error, projected to the view, is small enough.
+//*****************************************************************************
+
+const int MAX_MESH_LODS = 4;
+
+struct MeshMaterial
+{
+	chag::float3 diffuseColor;
+	chag::float3 specularColor;
+	chag::float3 emissiveColor;
+	float shininess;
+	std::string diffuseMap;		// relative to the OBJ file, empty if none
+	GLuint diffuseTexture;
+};
+
+/**
+ * One level of detail of a chunk: a range of the index buffer and an estimate
+ * of how far (in model space units) the simplification moved the surface.
+ */
+struct MeshChunkLod
+{
+	unsigned int firstIndex;
+	unsigned int numIndices;
+	float error;
+};
+
+/**
+ * Spatially close triangles that share one material, and their bounds (in
+ * model space), at one or more levels of detail.
+ */
+struct MeshChunk
+{
+	unsigned int material;
+	AABB bounds;
+	int numLods;
+	MeshChunkLod lods[MAX_MESH_LODS];	// lods[0] is the full detail
+};
+
+/**
+ * How render() picks the level of detail of each chunk: the coarsest one
+ * whose error, projected to the view, is at most maxError pixels.
+ */
+struct MeshLodSelection
+{
+	chag::float3 viewPosition;	// perspective views, in the space of the bounds
+	float pixelsPerUnit;		// at unit distance, or everywhere when orthographic
+	bool orthographic;
+	float maxError;				// 0 always draws the full detail
+};
+
+/**
+ * The CPU side representation produced by the OBJ converter, before the
+ * vertices are compressed for the cache file.
+ */
+struct MeshData
+{
+	std::vector<chag::float3> positions;
+	std::vector<chag::float3> normals;
+	std::vector<chag::float2> texCoords;
+	std::vector<unsigned int> indices;	// the full detail ones first, then the coarser levels
+	size_t numFullDetailIndices;
+	std::vector<MeshMaterial> materials;
+	std::vector<MeshChunk> chunks;
+	std::vector<std::string> materialLibraries;
+	// Average vertex cache misses per triangle before and after the converter
+	// reordered the triangles
+	float unoptimizedMissRatio;
+	float optimizedMissRatio;
+};
+
+/**
+ * Timings of the last Mesh::load(), in milliseconds. convertTime is zero when
+ * a valid cache was found.
+ */
+struct MeshLoadStats
+{
+	double convertTime;
+	double cachedLoadTime;
+	bool usedCache;
+	float vertexCacheMissRatio;	// average misses per triangle, 16 entry FIFO
+};
+
+struct PackedVertex;
+struct MappedFile;
+
+// The per-instance model matrix of instanced draws occupies this attribute
+// location and the three following it (one per column).
+const GLuint INSTANCE_MATRIX_ATTRIBUTE = 4;
+
+class Mesh
+{
+public:
+	Mesh();
+	~Mesh();
+
+	/**
+	 * Loads the OBJ file through its binary cache (fileName + ".mesh"),
+	 * converting it first when the cache is missing, stale or when
+	 * forceConvert is set.
+	 */
+	void load(const std::string &fileName, bool forceConvert = false);
+
+	/**
+	 * The two halves of load(): loadData() reads (or converts) the mesh into
+	 * memory and makes no GL calls, so it may run on a worker thread. upload()
+	 * then creates the buffers on the main thread, straight from the cache
+	 * file, which stays mapped until then.
+	 */
+	void loadData(const std::string &fileName, bool forceConvert = false);
+	void upload();
+
+	/**
+	 * Queues the diffuse textures of all materials on the loader, they are
+	 * resident once the loader has finished. Each material keeps a reference
+	 * to its texture, which the mesh releases when it is deleted.
+	 */
+	void requestTextures(TextureLoader &loader);
+
+	/**
+	 * Queues all chunks as draws of the given render queue object and returns
+	 * the number of triangles queued. modelViewProjection is only used to
+	 * order the draws by depth. Without a LOD selection (whose view position
+	 * is in model space) the full detail is drawn.
+	 */
+	int render(RenderQueue &queue, int object, const chag::float4x4 &modelViewProjection,
+			   const MeshLodSelection *lod = 0) const;
+
+	/**
+	 * Queues the chunks that intersect the frustum of modelViewProjection,
+	 * adding the draw counts before and after culling to stats. With an
+	 * occlusion buffer (rasterized with the same view-projection) the chunks
+	 * hidden behind its occluders are skipped as well. The visible triangles
+	 * are counted at the level of detail drawn.
+	 */
+	void render(RenderQueue &queue, int object, const chag::float4x4 &modelViewProjection,
+				CullingStats &stats, const OcclusionBuffer *occlusion = 0,
+				const MeshLodSelection *lod = 0) const;
+
+	/**
+	 * Whether the loader has written the textures of all materials that have
+	 * one.
+	 */
+	bool hasTextures() const;
+
+	GLuint getDiffuseTexture(int material) const;
+	int getNumMaterials() const { return int(m_materials.size()); }
+	int getNumChunks() const { return int(m_chunks.size()); }
+	int getNumTriangles() const { return int(m_numIndices / 3); }	// at full detail
+	const AABB &getBounds() const { return m_bounds; }	// in model space
+	const MeshLoadStats &getLoadStats() const { return m_loadStats; }
+	size_t getNumVertices() const { return m_numVertices; }
+	size_t getVertexBufferSize() const;		// in bytes
+	size_t getIndexBufferSize() const;		// in bytes
+
+	/**
+	 * Maps the compressed positions in the vertex buffer (0 to 1 within the
+	 * bounding cube of the mesh) to model space. The model matrix given to
+	 * the shaders is the object's model matrix times this.
+	 */
+	const chag::float4x4 &getDecodeMatrix() const { return m_decodeMatrix; }
+
+private:
+	friend class MeshInstances;
+
+	bool loadFromCache(const std::string &cacheFileName);
+	void convertAndLoad(const std::string &cacheFileName);
+	int queueChunks(RenderQueue &queue, int object, const chag::float4x4 &modelViewProjection,
+					const std::vector<unsigned int> &chunks, const MeshLodSelection *lod) const;
+	void keepBuffers(const PackedVertex *vertices, const unsigned int *indices);
+	void releasePendingBuffers();
+
+	std::string m_fileName;
+	std::vector<MeshMaterial> m_materials;
+	std::vector<MeshChunk> m_chunks;
+	AABB m_bounds;
+	BVH m_bvh;
+	size_t m_numVertices;
+	size_t m_numIndices;		// full detail
+	size_t m_numLodIndices;		// of the coarser levels
+	chag::float4x4 m_decodeMatrix;
+	GLuint m_vertexArrayObject;
+	GLuint m_vertexBuffer;
+	GLuint m_indexBuffer;
+	// The vertices and indices for upload(), in the mapped cache file or, if
+	// it could not be written, in a copy of the converted ones
+	const PackedVertex *m_pendingVertices;
+	const unsigned int *m_pendingIndices;
+	MappedFile *m_mappedCache;
+	std::vector<unsigned char> m_pendingBuffers;
+	MeshLoadStats m_loadStats;
+};
+
+/**
+ * Many copies of a mesh, each with its own model matrix, drawn with one
+ * instanced draw call per chunk. The matrices are streamed to a buffer that
+ * a separate vertex array (sharing the vertex and index buffers of the mesh)
+ * reads with one step per instance. The instances are culled as a group.
+ */
+class MeshInstances
+{
+public:
+	explicit MeshInstances(const Mesh *mesh);
+	~MeshInstances();
+
+	/**
+	 * Uploads the model matrices, replacing those of the previous call. The
+	 * draws queued for them must be submitted after this. The decode matrix
+	 * of the mesh is applied to each on the way.
+	 */
+	void update(const MatrixArray &modelMatrices);
+
+	/**
+	 * Queues the chunks of the mesh for numInstances instances, the object's
+	 * model matrix is applied on top of the instance matrices. When culling,
+	 * nothing is queued unless instanceBounds (the bounds of all instances)
+	 * intersects the frustum of viewProjection. All instances use the level
+	 * of detail needed by the closest point of instanceBounds (the LOD view
+	 * position is in the same space). Makes no GL calls.
+	 */
+	void render(RenderQueue &queue, int object, const chag::float4x4 &viewProjection,
+				const AABB &instanceBounds, int numInstances, CullingStats &stats, bool cull,
+				const MeshLodSelection *lod = 0) const;
+
+	/**
+	 * The bounds of the mesh, before the instance matrices are applied.
+	 */
+	const AABB &getMeshBounds() const { return m_mesh->getBounds(); }
+
+private:
+	const Mesh *m_mesh;
+	GLuint m_vertexArrayObject;
+	GLuint m_instanceBuffer;
+	size_t m_capacity;			// in matrices
+	MatrixArray m_decodedMatrices;
+	std::vector<chag::float4x4> m_uploadMatrices;
+};
+
+/**
+ * The offline converter: parses the OBJ file (and its material libraries)
+ * and writes the binary cache. Returns false if the source could not be read
+ * or the cache could not be written; in the former case 'data' is empty.
+ */
+bool convertOBJToMeshCache(const std::string &objFileName, const std::string &cacheFileName, MeshData &data);
+
+/**
+ * Reads an OBJ file into MeshData through its cache like Mesh::load(), but
+ * without any GL calls. When the cache is used the normals, the material
+ * libraries and the unoptimized miss ratio are left empty.
+ */
+bool loadMeshData(const std::string &fileName, MeshData &data);
+
+/**
+ * Reads only the positions and full detail indices of an OBJ file, as
+ * loadMeshData() (e.g. to build occluders from it).
+ */
+bool loadMeshGeometry(const std::string &fileName, std::vector<chag::float3> &positions,
+					  std::vector<unsigned int> &indices);
+
+/**
+ * Parses an OBJ file and its material libraries into MeshData.
+ */
+bool parseOBJ(const std::string &fileName, MeshData &data);
+
+#endif // MESH_H
@@ -0,0 +1,675 @@
+#include "OcclusionCulling.h"
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#else
+#include <emmintrin.h>
+#endif
+
+#include <float.h>
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <algorithm>
+#include <unordered_map>
+
+#include "Benchmark.h"
+#include "JobSystem.h"
+#include "Timer.h"
+
+using namespace std;
+using namespace chag;
+
+//*****************************************************************************
+//	SIMD wrappers, the rasterizer below is written once against these
+//*****************************************************************************
+#if defined(__AVX2__)
+static const int SIMD_WIDTH = 8;
+typedef __m256 SimdFloat;
+typedef __m256i SimdInt;
+
+static inline SimdInt simdSet(int v) { return _mm256_set1_epi32(v); }
+static inline SimdInt simdLoad(const int *p) { return _mm256_loadu_si256((const __m256i *)p); }
+static inline SimdInt simdAdd(SimdInt a, SimdInt b) { return _mm256_add_epi32(a, b); }
+static inline SimdInt simdOr(SimdInt a, SimdInt b) { return _mm256_or_si256(a, b); }
+// All bits set in the lanes where v is negative
+static inline SimdInt simdNegativeMask(SimdInt v) { return _mm256_srai_epi32(v, 31); }
+static inline SimdFloat simdSet(float v) { return _mm256_set1_ps(v); }
+static inline SimdFloat simdToFloat(SimdInt v) { return _mm256_cvtepi32_ps(v); }
+static inline SimdFloat simdLoad(const float *p) { return _mm256_loadu_ps(p); }
+static inline void simdStore(float *p, SimdFloat v) { _mm256_storeu_ps(p, v); }
+static inline SimdFloat simdAdd(SimdFloat a, SimdFloat b) { return _mm256_add_ps(a, b); }
+static inline SimdFloat simdMul(SimdFloat a, SimdFloat b) { return _mm256_mul_ps(a, b); }
+static inline SimdFloat simdMin(SimdFloat a, SimdFloat b) { return _mm256_min_ps(a, b); }
+static inline SimdFloat simdMax(SimdFloat a, SimdFloat b) { return _mm256_max_ps(a, b); }
+// a where the mask is clear, b where it is set
+static inline SimdFloat simdSelect(SimdFloat a, SimdFloat b, SimdInt mask) { return _mm256_blendv_ps(a, b, _mm256_castsi256_ps(mask)); }
+static inline int simdAnySet(SimdInt mask) { return _mm256_movemask_ps(_mm256_castsi256_ps(mask)); }
+#else
+static const int SIMD_WIDTH = 4;
+typedef __m128 SimdFloat;
+typedef __m128i SimdInt;
+
+static inline SimdInt simdSet(int v) { return _mm_set1_epi32(v); }
+static inline SimdInt simdLoad(const int *p) { return _mm_loadu_si128((const __m128i *)p); }
+static inline SimdInt simdAdd(SimdInt a, SimdInt b) { return _mm_add_epi32(a, b); }
+static inline SimdInt simdOr(SimdInt a, SimdInt b) { return _mm_or_si128(a, b); }
+static inline SimdInt simdNegativeMask(SimdInt v) { return _mm_srai_epi32(v, 31); }
+static inline SimdFloat simdSet(float v) { return _mm_set1_ps(v); }
+static inline SimdFloat simdToFloat(SimdInt v) { return _mm_cvtepi32_ps(v); }
+static inline SimdFloat simdLoad(const float *p) { return _mm_loadu_ps(p); }
+static inline void simdStore(float *p, SimdFloat v) { _mm_storeu_ps(p, v); }
+static inline SimdFloat simdAdd(SimdFloat a, SimdFloat b) { return _mm_add_ps(a, b); }
+static inline SimdFloat simdMul(SimdFloat a, SimdFloat b) { return _mm_mul_ps(a, b); }
+static inline SimdFloat simdMin(SimdFloat a, SimdFloat b) { return _mm_min_ps(a, b); }
+static inline SimdFloat simdMax(SimdFloat a, SimdFloat b) { return _mm_max_ps(a, b); }
+static inline SimdFloat simdSelect(SimdFloat a, SimdFloat b, SimdInt mask)
+{
+	__m128 m = _mm_castsi128_ps(mask);
+	return _mm_or_ps(_mm_andnot_ps(m, a), _mm_and_ps(m, b));
+}
+static inline int simdAnySet(SimdInt mask) { return _mm_movemask_ps(_mm_castsi128_ps(mask)); }
+#endif
+
+// Vertex positions are snapped to 1/16th of a pixel
+static const int SUBPIXEL_BITS = 4;
+static const float SUBPIXEL_SCALE = float(1 << SUBPIXEL_BITS);
+// Triangles are clipped to this many times the screen size (around its
+// center), which bounds the fixed point edge values to well within 32 bits.
+static const float GUARD_BAND = 2.0f;
+static const int MAX_BUFFER_SIZE = 1024;
+
+//*****************************************************************************
+//	Occluder simplification
+//*****************************************************************************
+void simplifyOccluder(const OccluderMesh &source, float cellSize, OccluderMesh &simplified)
+{
+	simplified.positions.clear();
+	simplified.indices.clear();
+
+	// All vertices in a cell are merged into their average
+	unordered_map<uint64_t, unsigned int> cells;
+	vector<unsigned int> remap(source.positions.size());
+	vector<float> counts;
+	for (size_t i = 0; i < source.positions.size(); ++i)
+	{
+		const float3 &p = source.positions[i];
+		uint64_t x = uint64_t(int64_t(floorf(p.x / cellSize)) & 0x1fffff);
+		uint64_t y = uint64_t(int64_t(floorf(p.y / cellSize)) & 0x1fffff);
+		uint64_t z = uint64_t(int64_t(floorf(p.z / cellSize)) & 0x1fffff);
+		uint64_t key = x | (y << 21) | (z << 42);
+		unordered_map<uint64_t, unsigned int>::iterator it = cells.find(key);
+		if (it == cells.end())
+		{
+			it = cells.insert(make_pair(key, (unsigned int)simplified.positions.size())).first;
+			simplified.positions.push_back(make_vector(0.0f, 0.0f, 0.0f));
+			counts.push_back(0.0f);
+		}
+		simplified.positions[it->second] += p;
+		counts[it->second] += 1.0f;
+		remap[i] = it->second;
+	}
+	for (size_t i = 0; i < simplified.positions.size(); ++i)
+	{
+		simplified.positions[i] = simplified.positions[i] * (1.0f / counts[i]);
+	}
+
+	for (size_t i = 0; i + 2 < source.indices.size(); i += 3)
+	{
+		unsigned int a = remap[source.indices[i + 0]];
+		unsigned int b = remap[source.indices[i + 1]];
+		unsigned int c = remap[source.indices[i + 2]];
+		if (a != b && b != c && c != a)
+		{
+			simplified.indices.push_back(a);
+			simplified.indices.push_back(b);
+			simplified.indices.push_back(c);
+		}
+	}
+}
+
+void makeTerrainOccluder(OccluderMesh &mesh)
+{
+	const int gridSize = 128;
+	const float extent = 60.0f;
+	mesh.positions.clear();
+	mesh.indices.clear();
+	for (int z = 0; z <= gridSize; ++z)
+	{
+		for (int x = 0; x <= gridSize; ++x)
+		{
+			float px = (float(x) / gridSize * 2.0f - 1.0f) * extent;
+			float pz = (float(z) / gridSize * 2.0f - 1.0f) * extent;
+			// Hills that fall off towards the shore
+			float falloff = max(0.0f, 1.0f - (px * px + pz * pz) / (extent * extent));
+			float height = (10.0f + 6.0f * sinf(px * 0.11f) * cosf(pz * 0.09f)) * falloff - 6.0f;
+			mesh.positions.push_back(make_vector(px, height, pz));
+		}
+	}
+	for (int z = 0; z < gridSize; ++z)
+	{
+		for (int x = 0; x < gridSize; ++x)
+		{
+			unsigned int i = (unsigned int)(z * (gridSize + 1) + x);
+			unsigned int quad[6] = { i, i + gridSize + 1, i + 1, i + 1, i + gridSize + 1, i + gridSize + 2 };
+			mesh.indices.insert(mesh.indices.end(), quad, quad + 6);
+		}
+	}
+}
+
+//*****************************************************************************
+//	Occlusion buffer
+//*****************************************************************************
+int OcclusionBuffer::getSimdWidth()
+{
+	return SIMD_WIDTH;
+}
+
+OcclusionBuffer::OcclusionBuffer(int width, int height, JobSystem *jobs)
+	: m_jobs(jobs)
+{
+	// Whole tiles only, which also keeps every SIMD step inside a row
+	width = min(max(width, 1), MAX_BUFFER_SIZE);
+	height = min(max(height, 1), MAX_BUFFER_SIZE);
+	m_tilesX = (width + TILE_WIDTH - 1) / TILE_WIDTH;
+	m_tilesY = (height + TILE_HEIGHT - 1) / TILE_HEIGHT;
+	m_width = m_tilesX * TILE_WIDTH;
+	m_height = m_tilesY * TILE_HEIGHT;
+	m_depth.resize(size_t(m_width) * m_height);
+	m_tileMaxDepth.resize(size_t(m_tilesX) * m_tilesY);
+	m_bins.resize(size_t(m_tilesX) * m_tilesY);
+	clear();
+}
+
+void OcclusionBuffer::clear()
+{
+	fill(m_depth.begin(), m_depth.end(), 1.0f);
+	fill(m_tileMaxDepth.begin(), m_tileMaxDepth.end(), 1.0f);
+	m_triangles.clear();
+	for (size_t i = 0; i < m_bins.size(); ++i)
+	{
+		m_bins[i].clear();
+	}
+}
+
+// The planes (inside where dot(plane, v) >= 0) clip space triangles are
+// clipped against: near, far and the guard band.
+static const float4 clipPlanes[6] =
+{
+	{ 0.0f, 0.0f, 1.0f, 1.0f },
+	{ 0.0f, 0.0f, -1.0f, 1.0f },
+	{ 1.0f, 0.0f, 0.0f, GUARD_BAND },
+	{ -1.0f, 0.0f, 0.0f, GUARD_BAND },
+	{ 0.0f, 1.0f, 0.0f, GUARD_BAND },
+	{ 0.0f, -1.0f, 0.0f, GUARD_BAND },
+};
+
+static float planeDistance(const float4 &plane, const float4 &v)
+{
+	return plane.x * v.x + plane.y * v.y + plane.z * v.z + plane.w * v.w;
+}
+
+void OcclusionBuffer::addOccluder(const OccluderMesh &mesh, const float4x4 &modelViewProjection)
+{
+	vector<float4> clip(mesh.positions.size());
+	vector<unsigned char> outcodes(mesh.positions.size());
+	for (size_t i = 0; i < mesh.positions.size(); ++i)
+	{
+		const float3 &p = mesh.positions[i];
+		clip[i] = modelViewProjection * make_vector(p.x, p.y, p.z, 1.0f);
+		outcodes[i] = 0;
+		for (int j = 0; j < 6; ++j)
+		{
+			if (planeDistance(clipPlanes[j], clip[i]) < 0.0f)
+			{
+				outcodes[i] |= (unsigned char)(1 << j);
+			}
+		}
+	}
+
+	for (size_t i = 0; i + 2 < mesh.indices.size(); i += 3)
+	{
+		const unsigned int *tri = &mesh.indices[i];
+		unsigned char outside = outcodes[tri[0]] & outcodes[tri[1]] & outcodes[tri[2]];
+		unsigned char crossing = outcodes[tri[0]] | outcodes[tri[1]] | outcodes[tri[2]];
+		if (outside)
+		{
+			continue;
+		}
+		float4 polygon[9] = { clip[tri[0]], clip[tri[1]], clip[tri[2]] };
+		int numVertices = 3;
+		// Sutherland-Hodgman against the planes the triangle crosses
+		for (int j = 0; j < 6 && numVertices >= 3 && crossing; ++j)
+		{
+			if (!(crossing & (1 << j)))
+			{
+				continue;
+			}
+			float4 clipped[9];
+			int numClipped = 0;
+			for (int k = 0; k < numVertices; ++k)
+			{
+				const float4 &a = polygon[k];
+				const float4 &b = polygon[(k + 1) % numVertices];
+				float da = planeDistance(clipPlanes[j], a);
+				float db = planeDistance(clipPlanes[j], b);
+				if (da >= 0.0f)
+				{
+					clipped[numClipped++] = a;
+				}
+				if ((da >= 0.0f) != (db >= 0.0f))
+				{
+					float t = da / (da - db);
+					clipped[numClipped++] = a + (b - a) * t;
+				}
+			}
+			numVertices = numClipped;
+			copy(clipped, clipped + numClipped, polygon);
+		}
+		for (int k = 2; k < numVertices; ++k)
+		{
+			float4 fan[3] = { polygon[0], polygon[k - 1], polygon[k] };
+			setupTriangle(fan);
+		}
+	}
+}
+
+void OcclusionBuffer::setupTriangle(const float4 clip[3])
+{
+	int x[3];
+	int y[3];
+	float sx[3];
+	float sy[3];
+	float z[3];
+	for (int i = 0; i < 3; ++i)
+	{
+		float invW = 1.0f / clip[i].w;
+		x[i] = int(floorf((clip[i].x * invW * 0.5f + 0.5f) * float(m_width) * SUBPIXEL_SCALE + 0.5f));
+		y[i] = int(floorf((clip[i].y * invW * 0.5f + 0.5f) * float(m_height) * SUBPIXEL_SCALE + 0.5f));
+		sx[i] = float(x[i]) / SUBPIXEL_SCALE;
+		sy[i] = float(y[i]) / SUBPIXEL_SCALE;
+		z[i] = min(max(clip[i].z * invW * 0.5f + 0.5f, 0.0f), 1.0f);
+	}
+	int64_t area = int64_t(x[1] - x[0]) * (y[2] - y[0]) - int64_t(x[2] - x[0]) * (y[1] - y[0]);
+	if (area == 0)
+	{
+		return;
+	}
+	if (area < 0)
+	{
+		// Both windings occlude, make it counter clockwise
+		swap(x[1], x[2]);
+		swap(y[1], y[2]);
+		swap(sx[1], sx[2]);
+		swap(sy[1], sy[2]);
+		swap(z[1], z[2]);
+	}
+
+	Triangle triangle;
+	int minX = min(x[0], min(x[1], x[2]));
+	int maxX = max(x[0], max(x[1], x[2]));
+	int minY = min(y[0], min(y[1], y[2]));
+	int maxY = max(y[0], max(y[1], y[2]));
+	// Pixels whose centers (at +8 sub pixels) may be inside
+	triangle.minX = max(0, (minX - 8 + 15) >> SUBPIXEL_BITS);
+	triangle.maxX = min(m_width - 1, (maxX - 8) >> SUBPIXEL_BITS);
+	triangle.minY = max(0, (minY - 8 + 15) >> SUBPIXEL_BITS);
+	triangle.maxY = min(m_height - 1, (maxY - 8) >> SUBPIXEL_BITS);
+	if (triangle.minX > triangle.maxX || triangle.minY > triangle.maxY)
+	{
+		return;
+	}
+
+	for (int i = 0; i < 3; ++i)
+	{
+		int j = (i + 1) % 3;
+		// Edge function at sub pixel position (X, Y), in whole pixels for the
+		// center of pixel (px, py) where X = 16 px + 8 and Y = 16 py + 8
+		int a = y[i] - y[j];
+		int b = x[j] - x[i];
+		int c = x[i] * y[j] - y[i] * x[j];
+		triangle.a[i] = a << SUBPIXEL_BITS;
+		triangle.b[i] = b << SUBPIXEL_BITS;
+		triangle.c[i] = c + (a + b) * (1 << (SUBPIXEL_BITS - 1));
+	}
+
+	float det = (sx[1] - sx[0]) * (sy[2] - sy[0]) - (sx[2] - sx[0]) * (sy[1] - sy[0]);
+	triangle.zx = ((z[1] - z[0]) * (sy[2] - sy[0]) - (z[2] - z[0]) * (sy[1] - sy[0])) / det;
+	triangle.zy = ((z[2] - z[0]) * (sx[1] - sx[0]) - (z[1] - z[0]) * (sx[2] - sx[0])) / det;
+	triangle.z0 = z[0] - triangle.zx * sx[0] - triangle.zy * sy[0];
+
+	int index = int(m_triangles.size());
+	m_triangles.push_back(triangle);
+	for (int ty = triangle.minY / TILE_HEIGHT; ty <= triangle.maxY / TILE_HEIGHT; ++ty)
+	{
+		for (int tx = triangle.minX / TILE_WIDTH; tx <= triangle.maxX / TILE_WIDTH; ++tx)
+		{
+			m_bins[ty * m_tilesX + tx].push_back(index);
+		}
+	}
+}
+
+void OcclusionBuffer::rasterizeTriangleScalar(const Triangle &t, int x0, int y0, int x1, int y1)
+{
+	for (int y = y0; y <= y1; ++y)
+	{
+		float *row = &m_depth[size_t(y) * m_width];
+		float zRow = t.zy * (float(y) + 0.5f) + t.z0;
+		for (int x = x0; x <= x1; ++x)
+		{
+			int e0 = t.a[0] * x + t.b[0] * y + t.c[0];
+			int e1 = t.a[1] * x + t.b[1] * y + t.c[1];
+			int e2 = t.a[2] * x + t.b[2] * y + t.c[2];
+			if ((e0 | e1 | e2) >= 0)
+			{
+				float z = min(max(t.zx * (float(x) + 0.5f) + zRow, 0.0f), 1.0f);
+				row[x] = min(row[x], z);
+			}
+		}
+	}
+}
+
+void OcclusionBuffer::rasterizeTriangleSimd(const Triangle &t, int x0, int y0, int x1, int y1)
+{
+	// Tiles start at multiples of the SIMD width, so aligning down stays in
+	// the tile. The extra pixels are outside the triangle and fail the edge
+	// tests.
+	x0 -= x0 % SIMD_WIDTH;
+	int laneIndices[SIMD_WIDTH];
+	int laneSteps[3][SIMD_WIDTH];
+	for (int i = 0; i < SIMD_WIDTH; ++i)
+	{
+		laneIndices[i] = i;
+		laneSteps[0][i] = t.a[0] * i;
+		laneSteps[1][i] = t.a[1] * i;
+		laneSteps[2][i] = t.a[2] * i;
+	}
+	const SimdInt lanes = simdLoad(laneIndices);
+	const SimdInt lanes0 = simdLoad(laneSteps[0]);
+	const SimdInt lanes1 = simdLoad(laneSteps[1]);
+	const SimdInt lanes2 = simdLoad(laneSteps[2]);
+	const SimdInt step0 = simdSet(t.a[0] * SIMD_WIDTH);
+	const SimdInt step1 = simdSet(t.a[1] * SIMD_WIDTH);
+	const SimdInt step2 = simdSet(t.a[2] * SIMD_WIDTH);
+	const SimdInt stepX = simdSet(SIMD_WIDTH);
+	const SimdFloat zx = simdSet(t.zx);
+	const SimdFloat half = simdSet(0.5f);
+	const SimdFloat zero = simdSet(0.0f);
+	const SimdFloat one = simdSet(1.0f);
+
+	for (int y = y0; y <= y1; ++y)
+	{
+		float *row = &m_depth[size_t(y) * m_width];
+		SimdFloat zRow = simdSet(t.zy * (float(y) + 0.5f) + t.z0);
+		SimdInt e0 = simdAdd(simdSet(t.a[0] * x0 + t.b[0] * y + t.c[0]), lanes0);
+		SimdInt e1 = simdAdd(simdSet(t.a[1] * x0 + t.b[1] * y + t.c[1]), lanes1);
+		SimdInt e2 = simdAdd(simdSet(t.a[2] * x0 + t.b[2] * y + t.c[2]), lanes2);
+		SimdInt xs = simdAdd(simdSet(x0), lanes);
+		for (int x = x0; x <= x1; x += SIMD_WIDTH)
+		{
+			SimdInt outside = simdNegativeMask(simdOr(simdOr(e0, e1), e2));
+			if (simdAnySet(outside) != (1 << SIMD_WIDTH) - 1)
+			{
+				SimdFloat z = simdAdd(simdMul(zx, simdAdd(simdToFloat(xs), half)), zRow);
+				z = simdMin(simdMax(z, zero), one);
+				SimdFloat depth = simdLoad(row + x);
+				simdStore(row + x, simdSelect(simdMin(depth, z), depth, outside));
+			}
+			e0 = simdAdd(e0, step0);
+			e1 = simdAdd(e1, step1);
+			e2 = simdAdd(e2, step2);
+			xs = simdAdd(xs, stepX);
+		}
+	}
+}
+
+void OcclusionBuffer::rasterizeTile(int tile, bool useSimd)
+{
+	int tileX0 = (tile % m_tilesX) * TILE_WIDTH;
+	int tileY0 = (tile / m_tilesX) * TILE_HEIGHT;
+	int tileX1 = tileX0 + TILE_WIDTH - 1;
+	int tileY1 = tileY0 + TILE_HEIGHT - 1;
+	const vector<int> &bin = m_bins[tile];
+	for (size_t i = 0; i < bin.size(); ++i)
+	{
+		const Triangle &t = m_triangles[bin[i]];
+		int x0 = max(t.minX, tileX0);
+		int y0 = max(t.minY, tileY0);
+		int x1 = min(t.maxX, tileX1);
+		int y1 = min(t.maxY, tileY1);
+		if (useSimd)
+		{
+			rasterizeTriangleSimd(t, x0, y0, x1, y1);
+		}
+		else
+		{
+			rasterizeTriangleScalar(t, x0, y0, x1, y1);
+		}
+	}
+
+	float maxDepth = 0.0f;
+	for (int y = tileY0; y <= tileY1; ++y)
+	{
+		const float *row = &m_depth[size_t(y) * m_width];
+		for (int x = tileX0; x <= tileX1; ++x)
+		{
+			maxDepth = max(maxDepth, row[x]);
+		}
+	}
+	m_tileMaxDepth[tile] = maxDepth;
+}
+
+void OcclusionBuffer::rasterize(bool useSimd, bool useThreads)
+{
+	int numTiles = m_tilesX * m_tilesY;
+	if (!useThreads || !m_jobs)
+	{
+		for (int tile = 0; tile < numTiles; ++tile)
+		{
+			rasterizeTile(tile, useSimd);
+		}
+		return;
+	}
+	// A few tiles per job, idle threads steal the jobs of busy ones
+	m_jobs->parallelFor(numTiles, 4, [this, useSimd](int begin, int end)
+	{
+		for (int tile = begin; tile < end; ++tile)
+		{
+			rasterizeTile(tile, useSimd);
+		}
+	});
+}
+
+bool OcclusionBuffer::isVisible(const AABB &box, const float4x4 &modelViewProjection) const
+{
+	float minX = FLT_MAX;
+	float minY = FLT_MAX;
+	float maxX = -FLT_MAX;
+	float maxY = -FLT_MAX;
+	float minZ = FLT_MAX;
+	for (int i = 0; i < 8; ++i)
+	{
+		float4 corner = make_vector((i & 1) ? box.max.x : box.min.x, (i & 2) ? box.max.y : box.min.y,
+									(i & 4) ? box.max.z : box.min.z, 1.0f);
+		float4 clip = modelViewProjection * corner;
+		if (clip.z < -clip.w || clip.w <= 0.0f)
+		{
+			return true;
+		}
+		float invW = 1.0f / clip.w;
+		float x = (clip.x * invW * 0.5f + 0.5f) * float(m_width);
+		float y = (clip.y * invW * 0.5f + 0.5f) * float(m_height);
+		minX = min(minX, x);
+		maxX = max(maxX, x);
+		minY = min(minY, y);
+		maxY = max(maxY, y);
+		minZ = min(minZ, clip.z * invW * 0.5f + 0.5f);
+	}
+	// Every pixel the box touches, not only those whose centers it covers
+	int x0 = max(0, int(floorf(minX)));
+	int y0 = max(0, int(floorf(minY)));
+	int x1 = min(m_width - 1, int(floorf(maxX)));
+	int y1 = min(m_height - 1, int(floorf(maxY)));
+	if (x0 > x1 || y0 > y1)
+	{
+		return false;
+	}
+
+	for (int ty = y0 / TILE_HEIGHT; ty <= y1 / TILE_HEIGHT; ++ty)
+	{
+		for (int tx = x0 / TILE_WIDTH; tx <= x1 / TILE_WIDTH; ++tx)
+		{
+			if (m_tileMaxDepth[ty * m_tilesX + tx] < minZ)
+			{
+				continue;	// everything in the tile is in front of the box
+			}
+			int px1 = min(x1, tx * TILE_WIDTH + TILE_WIDTH - 1);
+			int py1 = min(y1, ty * TILE_HEIGHT + TILE_HEIGHT - 1);
+			for (int y = max(y0, ty * TILE_HEIGHT); y <= py1; ++y)
+			{
+				const float *row = &m_depth[size_t(y) * m_width];
+				for (int x = max(x0, tx * TILE_WIDTH); x <= px1; ++x)
+				{
+					if (row[x] >= minZ)
+					{
+						return true;
+					}
+				}
+			}
+		}
+	}
+	return false;
+}
+
+//*****************************************************************************
+//	Standalone benchmark and correctness check
+//*****************************************************************************
+
+/**
+ * Counts the pixels whose depth differs by more than rounding, coverage
+ * must match exactly as it is computed with the same integer arithmetic.
+ */
+static int countDepthMismatches(const OcclusionBuffer &a, const OcclusionBuffer &b)
+{
+	const vector<float> &da = a.getDepth();
+	const vector<float> &db = b.getDepth();
+	int mismatches = 0;
+	for (size_t i = 0; i < da.size(); ++i)
+	{
+		if (fabsf(da[i] - db[i]) > 1.0e-5f)
+		{
+			++mismatches;
+		}
+	}
+	return mismatches;
+}
+
+static bool checkFullScreenOccluder(int width, int height)
+{
+	// Two triangles covering the screen at depth 0.5, a box in front of it
+	// must be visible and one behind it hidden.
+	OccluderMesh quad;
+	quad.positions.push_back(make_vector(-1.0f, -1.0f, 0.0f));
+	quad.positions.push_back(make_vector(1.0f, -1.0f, 0.0f));
+	quad.positions.push_back(make_vector(1.0f, 1.0f, 0.0f));
+	quad.positions.push_back(make_vector(-1.0f, 1.0f, 0.0f));
+	unsigned int indices[] = { 0, 1, 2, 0, 2, 3 };
+	quad.indices.assign(indices, indices + 6);
+
+	OcclusionBuffer buffer(width, height);
+	buffer.addOccluder(quad, make_identity<float4x4>());
+	buffer.rasterize(true, false);
+	int numWrong = 0;
+	for (size_t i = 0; i < buffer.getDepth().size(); ++i)
+	{
+		numWrong += fabsf(buffer.getDepth()[i] - 0.5f) > 1.0e-6f ? 1 : 0;
+	}
+	AABB front = { make_vector(-0.2f, -0.2f, -0.5f), make_vector(0.2f, 0.2f, -0.1f) };
+	AABB behind = { make_vector(-0.2f, -0.2f, 0.1f), make_vector(0.2f, 0.2f, 0.5f) };
+	bool ok = numWrong == 0 && buffer.isVisible(front, make_identity<float4x4>())
+		&& !buffer.isVisible(behind, make_identity<float4x4>());
+	printf("  full screen occluder: %s (%d pixels wrong)\n", ok ? "ok" : "FAILED", numWrong);
+	return ok;
+}
+
+bool runOcclusionSelfTest(const OccluderMesh &occluder, int width, int height, int numViews)
+{
+	JobSystem jobs;
+	printf("Occlusion rasterizer self test: %d occluder triangles, %dx%d, %d-wide SIMD, %d threads\n",
+		int(occluder.indices.size() / 3), width, height, SIMD_WIDTH, jobs.getNumThreads());
+	bool ok = checkFullScreenOccluder(width, height);
+
+	AABB bounds = makeEmptyAABB();
+	for (size_t i = 0; i < occluder.positions.size(); ++i)
+	{
+		growAABB(bounds, occluder.positions[i]);
+	}
+	float3 size = bounds.max - bounds.min;
+
+	OcclusionBuffer reference(width, height);
+	OcclusionBuffer simd(width, height, &jobs);
+	double referenceTime = 0.0;
+	double simdTime = 0.0;
+	double threadedTime = 0.0;
+	int numBoxes = 0;
+	int numOccluded = 0;
+	int numDepthMismatches = 0;
+	int numVisibilityMismatches = 0;
+	unsigned int random = 12345;
+	for (int view = 0; view < numViews; ++view)
+	{
+		float theta, phi, r;
+		getBenchmarkCamera(float(view) * 20.0f / float(max(1, numViews)), theta, phi, r);
+		float3 eye = make_vector(r * sinf(theta) * sinf(phi), r * cosf(phi), r * cosf(theta) * sinf(phi));
+		float4x4 viewProjection = perspectiveMatrix(45.0f, float(width) / float(height), 0.1f, 1000.0f)
+			* lookAt(eye, make_vector(0.0f, 5.2f, 0.0f), make_vector(0.0f, 1.0f, 0.0f));
+
+		double start = getTimeMs();
+		reference.clear();
+		reference.addOccluder(occluder, viewProjection);
+		reference.rasterize(false, false);
+		referenceTime += getTimeMs() - start;
+
+		start = getTimeMs();
+		simd.clear();
+		simd.addOccluder(occluder, viewProjection);
+		simd.rasterize(true, false);
+		simdTime += getTimeMs() - start;
+
+		start = getTimeMs();
+		simd.clear();
+		simd.addOccluder(occluder, viewProjection);
+		simd.rasterize(true, true);
+		threadedTime += getTimeMs() - start;
+
+		numDepthMismatches += countDepthMismatches(reference, simd);
+
+		// Random boxes within the bounds of the occluder
+		for (int i = 0; i < 256; ++i)
+		{
+			float v[6];
+			for (int j = 0; j < 6; ++j)
+			{
+				random = random * 1664525u + 1013904223u;
+				v[j] = float(random >> 8) / float(1 << 24);
+			}
+			AABB box;
+			box.min = bounds.min + make_vector(v[0] * size.x, v[1] * size.y, v[2] * size.z);
+			box.max = box.min + make_vector(v[3], v[4], v[5]) * (0.05f * max(size.x, size.z));
+			bool visible = reference.isVisible(box, viewProjection);
+			numVisibilityMismatches += visible != simd.isVisible(box, viewProjection) ? 1 : 0;
+			numOccluded += visible ? 0 : 1;
+			++numBoxes;
+		}
+	}
+
+	double views = double(max(1, numViews));
+	printf("  scalar reference:        %8.3f ms per view\n", referenceTime / views);
+	printf("  SIMD, one thread:        %8.3f ms per view\n", simdTime / views);
+	printf("  SIMD, %2d threads:        %8.3f ms per view\n", jobs.getNumThreads(), threadedTime / views);
+	printf("  %d of %d boxes occluded\n", numOccluded, numBoxes);
+	printf("  depth mismatches: %d, visibility mismatches: %d\n", numDepthMismatches, numVisibilityMismatches);
+	ok = ok && numDepthMismatches == 0 && numVisibilityMismatches == 0;
+	printf("Occlusion rasterizer self test %s\n", ok ? "passed" : "FAILED");
+	return ok;
+}
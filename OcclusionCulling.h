@@ -0,0 +1,141 @@
+#ifndef OCCLUSION_CULLING_H
+#define OCCLUSION_CULLING_H
+
+#include <float4x4.h>
+#include <vector>
+
+#include "Culling.h"
+
+class JobSystem;
+
+//*****************************************************************************
+//	CPU occlusion culling
+//
+//	A small number of large occluders (e.g. a simplified version of the
+//	island) are rasterized on the CPU into a low resolution depth buffer,
+//	against which the bounding boxes of chunks are tested before any GL
+//	calls are made for them. The buffer is divided into tiles: triangles are
+//	first binned to the tiles they overlap, then the tiles are rasterized in
+//	parallel as jobs, each with SIMD (SSE2, or AVX2 when enabled at
+//	compile time) evaluating several pixels per step. Edge functions use
+//	fixed point, so coverage is exact and identical to the scalar reference
+//	rasterizer, which is kept for validation.
+//
+//	Each tile also keeps the farthest depth it contains, a box in front of
+//	that is visible without looking at individual pixels.
+//*****************************************************************************
+
+/**
+ * Occluder geometry in model space.
+ */
+struct OccluderMesh
+{
+	std::vector<chag::float3> positions;
+	std::vector<unsigned int> indices;
+};
+
+/**
+ * Simplifies a mesh by clustering its vertices on a grid with the given cell
+ * size, dropping the triangles that collapse. Good enough for terrain-like
+ * occluders, the result may deviate from the source by up to a cell.
+ */
+void simplifyOccluder(const OccluderMesh &source, float cellSize, OccluderMesh &simplified);
+
+/**
+ * A generated hilly terrain roughly the size of the island, for testing the
+ * rasterizer without the scene files.
+ */
+void makeTerrainOccluder(OccluderMesh &mesh);
+
+class OcclusionBuffer
+{
+public:
+	/**
+	 * Tiles are rasterized as jobs if a job system is given, otherwise on the
+	 * calling thread.
+	 */
+	OcclusionBuffer(int width, int height, JobSystem *jobs = 0);
+
+	/**
+	 * Resets the depth buffer to the far plane and removes all occluders.
+	 */
+	void clear();
+
+	/**
+	 * Transforms, clips and bins the triangles of an occluder. They are
+	 * rasterized by the next call to rasterize().
+	 */
+	void addOccluder(const OccluderMesh &mesh, const chag::float4x4 &modelViewProjection);
+
+	/**
+	 * Rasterizes the binned occluders. useSimd = false selects the scalar
+	 * reference rasterizer, useThreads = false runs all tiles in order on
+	 * the calling thread.
+	 */
+	void rasterize(bool useSimd = true, bool useThreads = true);
+
+	/**
+	 * Returns false if the box is certainly hidden behind the occluders.
+	 * Boxes that cross the near plane are always visible.
+	 */
+	bool isVisible(const AABB &box, const chag::float4x4 &modelViewProjection) const;
+
+	int getWidth() const { return m_width; }
+	int getHeight() const { return m_height; }
+	int getNumTriangles() const { return int(m_triangles.size()); }
+	const std::vector<float> &getDepth() const { return m_depth; }
+
+	static const int TILE_WIDTH = 32;
+	static const int TILE_HEIGHT = 16;
+
+	/**
+	 * The number of pixels the SIMD rasterizer evaluates per step.
+	 */
+	static int getSimdWidth();
+
+private:
+	/**
+	 * A screen space triangle ready for rasterization: for pixel (x, y) it is
+	 * covered when all edge values a * x + b * y + c are >= 0, and its depth
+	 * is zx * (x + 0.5) + zy * (y + 0.5) + z0.
+	 */
+	struct Triangle
+	{
+		int a[3];
+		int b[3];
+		int c[3];
+		float zx;
+		float zy;
+		float z0;
+		int minX;
+		int minY;
+		int maxX;
+		int maxY;
+	};
+
+	void setupTriangle(const chag::float4 clip[3]);
+	void rasterizeTile(int tile, bool useSimd);
+	void rasterizeTriangleScalar(const Triangle &triangle, int x0, int y0, int x1, int y1);
+	void rasterizeTriangleSimd(const Triangle &triangle, int x0, int y0, int x1, int y1);
+
+	int m_width;
+	int m_height;
+	int m_tilesX;
+	int m_tilesY;
+	JobSystem *m_jobs;
+	std::vector<float> m_depth;
+	std::vector<float> m_tileMaxDepth;
+	std::vector<Triangle> m_triangles;
+	std::vector<std::vector<int> > m_bins;
+};
+
+/**
+ * The standalone benchmark and correctness check (--occlusion-test), which
+ * needs no GL context. Renders the occluder from a number of views along the
+ * benchmark camera path with the scalar single threaded reference and with
+ * the SIMD multithreaded rasterizer, checks that their depth buffers and box
+ * visibility agree, and prints the timings. Returns false on a mismatch.
+ */
+bool runOcclusionSelfTest(const OccluderMesh &occluder, int width, int height, int numViews);
+
+#endif // OCCLUSION_CULLING_H
@@ -0,0 +1,335 @@
+#include "Profiler.h"
+
+#include <GL/glew.h>
+#include <GL/freeglut.h>
+
+#include <glutil.h>
+
+#include <stdio.h>
+#include <vector>
+
+#include "GpuResources.h"
+#include "Timer.h"
+
+using namespace std;
+
+struct PassRecord
+{
+	const char *name;
+	int depth;
+	double cpuBegin;
+	double cpuEnd;
+	double gpuBegin;
+	double gpuEnd;
+};
+
+struct FrameRecord
+{
+	vector<PassRecord> passes;
+	vector<GLuint> queries;		// two timestamps per pass
+	bool pending;
+};
+
+struct PassStatistics
+{
+	const char *name;
+	int depth;
+	double cpuTime;
+	double gpuTime;
+};
+
+struct PassTotals
+{
+	string name;
+	double cpuTime;
+	double gpuTime;
+	int count;
+};
+
+// Two sets of queries, one being recorded while the other is in flight
+static const int NUM_FRAME_SETS = 2;
+static FrameRecord frames[NUM_FRAME_SETS];
+static int frameCounter = -1;
+static vector<int> openPasses;
+// Added to GPU timestamps (in ms) to put them on the CPU timeline
+static double gpuToCpuOffset = 0.0;
+static int droppedFrames = 0;
+
+// Exponentially smoothed times for the overlay, in order of appearance
+static vector<PassStatistics> statistics;
+// Summed times per pass name, for reports
+static vector<PassTotals> totals;
+
+static bool tracing = false;
+static vector<PassRecord> traceCpuEvents;
+static vector<PassRecord> traceGpuEvents;
+
+static void synchronizeClocks()
+{
+	GLint64 gpuTime = 0;
+	glGetInteger64v(GL_TIMESTAMP, &gpuTime);
+	gpuToCpuOffset = getTimeMs() - double(gpuTime) / 1.0e6;
+}
+
+void profilerInit()
+{
+	synchronizeClocks();
+}
+
+static void addToTotals(const PassRecord &pass)
+{
+	size_t i = 0;
+	while (i < totals.size() && totals[i].name != pass.name)
+	{
+		++i;
+	}
+	if (i == totals.size())
+	{
+		PassTotals added = { pass.name, 0.0, 0.0, 0 };
+		totals.push_back(added);
+	}
+	totals[i].cpuTime += pass.cpuEnd - pass.cpuBegin;
+	totals[i].gpuTime += pass.gpuEnd - pass.gpuBegin;
+	++totals[i].count;
+}
+
+static void updateStatistics(const PassRecord &pass, size_t index)
+{
+	const double smoothing = 0.9;
+	double cpuTime = pass.cpuEnd - pass.cpuBegin;
+	double gpuTime = pass.gpuEnd - pass.gpuBegin;
+	if (index >= statistics.size() || statistics[index].name != pass.name)
+	{
+		// The set of passes changed, start over from this frame
+		statistics.resize(index + 1);
+		statistics[index].name = pass.name;
+		statistics[index].depth = pass.depth;
+		statistics[index].cpuTime = cpuTime;
+		statistics[index].gpuTime = gpuTime;
+		return;
+	}
+	statistics[index].cpuTime = smoothing * statistics[index].cpuTime + (1.0 - smoothing) * cpuTime;
+	statistics[index].gpuTime = smoothing * statistics[index].gpuTime + (1.0 - smoothing) * gpuTime;
+}
+
+/**
+ * Reads back the GPU timestamps of a previously recorded frame, unless they
+ * are not available yet in which case the frame is dropped rather than
+ * waiting for the GPU.
+ */
+static void resolveFrame(FrameRecord &frame)
+{
+	frame.pending = false;
+	if (frame.passes.empty())
+	{
+		return;
+	}
+	GLint available = 0;
+	glGetQueryObjectiv(frame.queries[frame.passes.size() * 2 - 1], GL_QUERY_RESULT_AVAILABLE, &available);
+	if (!available)
+	{
+		++droppedFrames;
+		return;
+	}
+	for (size_t i = 0; i < frame.passes.size(); ++i)
+	{
+		GLuint64 begin = 0;
+		GLuint64 end = 0;
+		glGetQueryObjectui64v(frame.queries[i * 2 + 0], GL_QUERY_RESULT, &begin);
+		glGetQueryObjectui64v(frame.queries[i * 2 + 1], GL_QUERY_RESULT, &end);
+		PassRecord &pass = frame.passes[i];
+		pass.gpuBegin = double(begin) / 1.0e6 + gpuToCpuOffset;
+		pass.gpuEnd = double(end) / 1.0e6 + gpuToCpuOffset;
+		updateStatistics(pass, i);
+		addToTotals(pass);
+	}
+	statistics.resize(frame.passes.size());
+
+	if (tracing)
+	{
+		traceCpuEvents.insert(traceCpuEvents.end(), frame.passes.begin(), frame.passes.end());
+		traceGpuEvents.insert(traceGpuEvents.end(), frame.passes.begin(), frame.passes.end());
+	}
+}
+
+void profilerBeginFrame()
+{
+	++frameCounter;
+	FrameRecord &frame = frames[frameCounter % NUM_FRAME_SETS];
+	if (frame.pending)
+	{
+		resolveFrame(frame);
+	}
+	frame.passes.clear();
+	openPasses.clear();
+}
+
+void profilerEndFrame()
+{
+	// Close any pass left open so the record stays consistent
+	while (!openPasses.empty())
+	{
+		profilerEndPass();
+	}
+	frames[frameCounter % NUM_FRAME_SETS].pending = true;
+}
+
+void profilerFinish()
+{
+	for (int i = 1; i <= NUM_FRAME_SETS; ++i)
+	{
+		FrameRecord &frame = frames[(frameCounter + i) % NUM_FRAME_SETS];
+		if (frame.pending)
+		{
+			resolveFrame(frame);
+		}
+	}
+}
+
+void profilerBeginPass(const char *name)
+{
+	if (frameCounter < 0)
+	{
+		return;
+	}
+	FrameRecord &frame = frames[frameCounter % NUM_FRAME_SETS];
+	PassRecord pass;
+	pass.name = name;
+	pass.depth = int(openPasses.size());
+	pass.cpuBegin = getTimeMs();
+	pass.cpuEnd = pass.cpuBegin;
+	pass.gpuBegin = pass.gpuEnd = 0.0;
+	frame.passes.push_back(pass);
+	while (frame.queries.size() < frame.passes.size() * 2)
+	{
+		GLuint query;
+		glGenQueries(1, &query);
+		frame.queries.push_back(query);
+	}
+	openPasses.push_back(int(frame.passes.size()) - 1);
+	glQueryCounter(frame.queries[openPasses.back() * 2 + 0], GL_TIMESTAMP);
+}
+
+void profilerEndPass()
+{
+	if (openPasses.empty())
+	{
+		return;
+	}
+	FrameRecord &frame = frames[frameCounter % NUM_FRAME_SETS];
+	int index = openPasses.back();
+	openPasses.pop_back();
+	glQueryCounter(frame.queries[index * 2 + 1], GL_TIMESTAMP);
+	frame.passes[index].cpuEnd = getTimeMs();
+}
+
+bool profilerGetPassTotals(const char *name, double &cpuTime, double &gpuTime, int &count)
+{
+	for (size_t i = 0; i < totals.size(); ++i)
+	{
+		if (totals[i].name == name)
+		{
+			cpuTime = totals[i].cpuTime;
+			gpuTime = totals[i].gpuTime;
+			count = totals[i].count;
+			return true;
+		}
+	}
+	cpuTime = gpuTime = 0.0;
+	count = 0;
+	return false;
+}
+
+void profilerResetTotals()
+{
+	totals.clear();
+}
+
+void profilerDrawOverlay(int /*width*/, int height)
+{
+	GLboolean depthTest = glIsEnabled(GL_DEPTH_TEST);
+	glDisable(GL_DEPTH_TEST);
+	glUseProgram(0);
+	glColor3f(1.0f, 1.0f, 0.0f);
+
+	char line[128];
+	int y = height - 20;
+	snprintf(line, sizeof(line), "%-24s %8s %8s", "pass", "CPU ms", "GPU ms");
+	glWindowPos2i(10, y);
+	glutBitmapString(GLUT_BITMAP_8_BY_13, (const unsigned char *)line);
+	for (size_t i = 0; i < statistics.size(); ++i)
+	{
+		y -= 15;
+		char name[32];
+		snprintf(name, sizeof(name), "%*s%s", statistics[i].depth * 2, "", statistics[i].name);
+		snprintf(line, sizeof(line), "%-24s %8.3f %8.3f", name, statistics[i].cpuTime, statistics[i].gpuTime);
+		glWindowPos2i(10, y);
+		glutBitmapString(GLUT_BITMAP_8_BY_13, (const unsigned char *)line);
+	}
+	if (droppedFrames > 0)
+	{
+		y -= 15;
+		snprintf(line, sizeof(line), "%d frames not ready in time", droppedFrames);
+		glWindowPos2i(10, y);
+		glutBitmapString(GLUT_BITMAP_8_BY_13, (const unsigned char *)line);
+	}
+	ResourceUsage usage = getTotalResourceUsage();
+	y -= 15;
+	snprintf(line, sizeof(line), "GPU memory %.1f MB, peak %.1f MB", usage.bytes / (1024.0 * 1024.0),
+		usage.peakBytes / (1024.0 * 1024.0));
+	glWindowPos2i(10, y);
+	glutBitmapString(GLUT_BITMAP_8_BY_13, (const unsigned char *)line);
+
+	if (depthTest)
+	{
+		glEnable(GL_DEPTH_TEST);
+	}
+}
+
+void profilerStartTrace()
+{
+	synchronizeClocks();
+	traceCpuEvents.clear();
+	traceGpuEvents.clear();
+	tracing = true;
+}
+
+bool profilerIsTracing()
+{
+	return tracing;
+}
+
+static void writeTraceEvents(FILE *file, const vector<PassRecord> &events, bool gpu, bool &first)
+{
+	for (size_t i = 0; i < events.size(); ++i)
+	{
+		double begin = gpu ? events[i].gpuBegin : events[i].cpuBegin;
+		double end = gpu ? events[i].gpuEnd : events[i].cpuEnd;
+		// Trace event timestamps and durations are in microseconds
+		fprintf(file, "%s\n{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f}",
+			first ? "" : ",", events[i].name, gpu ? "gpu" : "cpu", gpu ? 2 : 1,
+			begin * 1000.0, (end - begin) * 1000.0);
+		first = false;
+	}
+}
+
+bool profilerStopTrace(const string &fileName)
+{
+	tracing = false;
+	FILE *file = fopen(fileName.c_str(), "w");
+	if (!file)
+	{
+		printf("Warning: could not write trace '%s'\n", fileName.c_str());
+		return false;
+	}
+	fprintf(file, "{\"traceEvents\":[");
+	fprintf(file, "\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":1,\"args\":{\"name\":\"CPU\"}},");
+	fprintf(file, "\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":2,\"args\":{\"name\":\"GPU\"}}");
+	bool first = false;
+	writeTraceEvents(file, traceCpuEvents, false, first);
+	writeTraceEvents(file, traceGpuEvents, true, first);
+	fprintf(file, "\n]}\n");
+	fclose(file);
+	printf("Wrote %d passes to %s\n", int(traceCpuEvents.size()), fileName.c_str());
+	return true;
+}
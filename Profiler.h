@@ -0,0 +1,61 @@
+#ifndef PROFILER_H
+#define PROFILER_H
+
+#include <string>
+
+//*****************************************************************************
+//	Per-pass profiler
+//
+//	Every pass between profilerBeginFrame() and profilerEndFrame() is timed
+//	on the CPU and, with GL_TIMESTAMP queries, on the GPU. The queries are
+//	double buffered: the results of a frame are read back when the same
+//	query set is reused two frames later, and only if they are available, so
+//	the profiler never stalls the pipeline.
+//*****************************************************************************
+
+void profilerInit();
+void profilerBeginFrame();
+void profilerEndFrame();
+
+/**
+ * Resolves the frames still in flight, call after glFinish() to get the
+ * results of the last frames (e.g. before exporting a trace).
+ */
+void profilerFinish();
+
+void profilerBeginPass(const char *name);
+void profilerEndPass();
+
+/**
+ * Times the enclosing scope as one pass. Passes may be nested.
+ */
+struct ProfileScope
+{
+	explicit ProfileScope(const char *name) { profilerBeginPass(name); }
+	~ProfileScope() { profilerEndPass(); }
+};
+
+/**
+ * The summed CPU and GPU times, in ms, of the passes of this name in the
+ * frames resolved since profilerResetTotals(), and how many there were.
+ * Returns false if there were none.
+ */
+bool profilerGetPassTotals(const char *name, double &cpuTime, double &gpuTime, int &count);
+void profilerResetTotals();
+
+/**
+ * Draws the smoothed CPU and GPU time of each pass as text in the top left
+ * corner of the current framebuffer.
+ */
+void profilerDrawOverlay(int width, int height);
+
+/**
+ * Starts recording every completed frame for export. profilerStopTrace()
+ * writes everything recorded so far as Chrome trace event JSON (load it in
+ * chrome://tracing or https://ui.perfetto.dev).
+ */
+void profilerStartTrace();
+bool profilerStopTrace(const std::string &fileName);
+bool profilerIsTracing();
+
+#endif // PROFILER_H
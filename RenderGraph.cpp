@@ -0,0 +1,388 @@
+#include "RenderGraph.h"
+
+#include <glutil.h>
+
+#include <math.h>
+#include <stdio.h>
+#include <algorithm>
+
+#include "GpuResources.h"
+#include "Profiler.h"
+
+using namespace std;
+
+// Pooled targets that no frame has used for this many frames are released
+static const int RELEASE_AFTER_FRAMES = 60;
+
+FBOInfo createPostProcessFBO(int width, int height, bool withDepth, GLenum internalFormat, const char *name)
+{
+	FBOInfo fbo;
+
+	fbo.width = width;
+	fbo.height = height;
+
+	fbo.colorTextureTarget = createResource(RESOURCE_TEXTURE, RESOURCE_RENDER_TARGETS, name);
+	glBindTexture(GL_TEXTURE_RECTANGLE_ARB, fbo.colorTextureTarget);
+	glTexParameteri(GL_TEXTURE_RECTANGLE_ARB, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+	glTexParameteri(GL_TEXTURE_RECTANGLE_ARB, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+	glTexImage2D(GL_TEXTURE_RECTANGLE_ARB, 0, internalFormat, width, height, 0, GL_RGBA, GL_UNSIGNED_BYTE, NULL);
+	setResourceStorage(RESOURCE_TEXTURE, fbo.colorTextureTarget, getTextureBytes(internalFormat, width, height),
+		internalFormat);
+
+	fbo.id = createResource(RESOURCE_FRAMEBUFFER, RESOURCE_RENDER_TARGETS, name);
+	// Bind the framebuffer such that following commands will affect it
+	glBindFramebuffer(GL_FRAMEBUFFER, fbo.id);
+	glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0,
+							GL_TEXTURE_RECTANGLE_ARB, fbo.colorTextureTarget, 0);
+	glDrawBuffer(GL_COLOR_ATTACHMENT0);
+
+	// Only targets that geometry is rendered to need depth, the full screen
+	// post processing passes do not.
+	fbo.depthBuffer = 0;
+	if (withDepth)
+	{
+		fbo.depthBuffer = createResource(RESOURCE_RENDERBUFFER, RESOURCE_RENDER_TARGETS, name);
+		glBindRenderbuffer(GL_RENDERBUFFER, fbo.depthBuffer);
+		glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH_COMPONENT, width, height);
+		setResourceStorage(RESOURCE_RENDERBUFFER, fbo.depthBuffer,
+			getTextureBytes(GL_DEPTH_COMPONENT, width, height), GL_DEPTH_COMPONENT);
+		// Associate our created depth buffer with the FBO
+		glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT,
+									GL_RENDERBUFFER, fbo.depthBuffer);
+	}
+
+	GLuint status = glCheckFramebufferStatus(GL_FRAMEBUFFER);
+	if (status != GL_FRAMEBUFFER_COMPLETE)
+	{
+		fatal_error("Framebuffer not complete");
+	}
+
+	return fbo;
+}
+
+void deletePostProcessFBO(FBOInfo &fbo)
+{
+	deleteResource(RESOURCE_FRAMEBUFFER, fbo.id);
+	deleteResource(RESOURCE_TEXTURE, fbo.colorTextureTarget);
+	deleteResource(RESOURCE_RENDERBUFFER, fbo.depthBuffer);
+}
+
+/**
+ * Estimates the video memory used by a target, drivers may pad this.
+ */
+static size_t getTargetBytes(const RenderTargetDesc &desc)
+{
+	size_t bytes = getTextureBytes(desc.internalFormat, desc.width, desc.height);
+	if (desc.withDepth)
+	{
+		bytes += getTextureBytes(GL_DEPTH_COMPONENT, desc.width, desc.height);
+	}
+	return bytes;
+}
+
+/**
+ * A pooled target can stand in for a requested one if it has the same size
+ * and format. One with a depth buffer may serve a request without.
+ */
+static bool isCompatible(const RenderTargetDesc &pooled, const RenderTargetDesc &desc)
+{
+	return pooled.width == desc.width && pooled.height == desc.height
+		&& pooled.internalFormat == desc.internalFormat
+		&& (pooled.withDepth || !desc.withDepth);
+}
+
+static double toMB(size_t bytes)
+{
+	return double(bytes) / (1024.0 * 1024.0);
+}
+
+RenderGraph::RenderGraph()
+	: m_frame(0)
+	, m_numCulled(0)
+	, m_transientBytes(0)
+	, m_usedBytes(0)
+	, m_poolBytes(0)
+	, m_peakBytes(0)
+{
+}
+
+RenderGraph::~RenderGraph()
+{
+	for (size_t i = 0; i < m_pool.size(); ++i)
+	{
+		deletePostProcessFBO(m_pool[i].fbo);
+	}
+}
+
+void RenderGraph::beginFrame()
+{
+	++m_frame;
+	m_targets.clear();
+	m_passes.clear();
+	m_outputs.clear();
+	releaseUnusedTargets();
+}
+
+RenderTargetHandle RenderGraph::createTarget(const char *name, const RenderTargetDesc &desc, float scale)
+{
+	VirtualTarget target;
+	target.name = name;
+	target.desc = desc;
+	target.imported = false;
+	target.fbo.id = target.fbo.colorTextureTarget = target.fbo.depthBuffer = 0;
+	target.fbo.width = desc.width;
+	target.fbo.height = desc.height;
+	target.viewportWidth = max(1, min(desc.width, int(ceilf(float(desc.width) * scale))));
+	target.viewportHeight = max(1, min(desc.height, int(ceilf(float(desc.height) * scale))));
+	target.firstPass = target.lastPass = -1;
+	m_targets.push_back(target);
+	return RenderTargetHandle(m_targets.size() - 1);
+}
+
+RenderTargetHandle RenderGraph::importTarget(const char *name, GLuint framebuffer, GLuint texture,
+											 int width, int height)
+{
+	RenderTargetDesc desc = { width, height, GL_NONE, false };
+	RenderTargetHandle handle = createTarget(name, desc);
+	VirtualTarget &target = m_targets[handle];
+	target.imported = true;
+	target.fbo.id = framebuffer;
+	target.fbo.colorTextureTarget = texture;
+	return handle;
+}
+
+void RenderGraph::markOutput(RenderTargetHandle target)
+{
+	m_outputs.push_back(target);
+}
+
+void RenderGraph::addPass(const char *name, const vector<RenderTargetHandle> &inputs,
+						  RenderTargetHandle output, ExecuteFunction execute)
+{
+	Pass pass;
+	pass.name = name;
+	pass.inputs = inputs;
+	pass.output = output;
+	pass.execute = execute;
+	pass.culled = false;
+	m_passes.push_back(pass);
+}
+
+/**
+ * Walks the passes backwards from the outputs, keeping a pass only if a
+ * later kept pass (or the outside) reads what it writes.
+ */
+void RenderGraph::cullPasses()
+{
+	vector<bool> needed(m_targets.size(), false);
+	for (size_t i = 0; i < m_outputs.size(); ++i)
+	{
+		needed[m_outputs[i]] = true;
+	}
+	m_numCulled = 0;
+	for (int i = int(m_passes.size()) - 1; i >= 0; --i)
+	{
+		Pass &pass = m_passes[i];
+		pass.culled = !needed[pass.output];
+		if (pass.culled)
+		{
+			++m_numCulled;
+			continue;
+		}
+		// Anything written before this pass is overwritten, unless it is read
+		needed[pass.output] = false;
+		for (size_t j = 0; j < pass.inputs.size(); ++j)
+		{
+			needed[pass.inputs[j]] = true;
+		}
+	}
+}
+
+void RenderGraph::computeLifetimes()
+{
+	for (size_t i = 0; i < m_passes.size(); ++i)
+	{
+		const Pass &pass = m_passes[i];
+		if (pass.culled)
+		{
+			continue;
+		}
+		for (size_t j = 0; j <= pass.inputs.size(); ++j)
+		{
+			VirtualTarget &target = m_targets[j < pass.inputs.size() ? pass.inputs[j] : pass.output];
+			if (target.firstPass < 0)
+			{
+				target.firstPass = int(i);
+			}
+			target.lastPass = int(i);
+		}
+	}
+}
+
+RenderGraph::PooledTarget *RenderGraph::acquire(const RenderTargetDesc &desc, int firstPass)
+{
+	for (size_t i = 0; i < m_pool.size(); ++i)
+	{
+		PooledTarget &pooled = m_pool[i];
+		// Free if unused this frame, or if its last user came before firstPass
+		bool free = pooled.lastUsedFrame != m_frame || pooled.busyUntilPass < firstPass;
+		if (free && isCompatible(pooled.desc, desc))
+		{
+			if (pooled.lastUsedFrame != m_frame)
+			{
+				m_usedBytes += pooled.bytes;
+			}
+			return &pooled;
+		}
+	}
+	PooledTarget pooled;
+	pooled.desc = desc;
+	pooled.fbo = createPostProcessFBO(desc.width, desc.height, desc.withDepth, desc.internalFormat,
+		"render graph pool");
+	pooled.bytes = getTargetBytes(desc);
+	pooled.lastUsedFrame = -1;
+	pooled.busyUntilPass = -1;
+	m_pool.push_back(pooled);
+	m_poolBytes += pooled.bytes;
+	m_usedBytes += pooled.bytes;
+	return &m_pool.back();
+}
+
+/**
+ * Hands out pooled framebuffers in pass order. A target is acquired at the
+ * first pass that uses it and stays busy until its last one, after which
+ * its framebuffer may be reused by a target first used in a later pass.
+ */
+void RenderGraph::assignPooledTargets()
+{
+	m_transientBytes = 0;
+	m_usedBytes = 0;
+	for (size_t i = 0; i < m_passes.size(); ++i)
+	{
+		if (m_passes[i].culled)
+		{
+			continue;
+		}
+		for (size_t j = 0; j < m_targets.size(); ++j)
+		{
+			VirtualTarget &target = m_targets[j];
+			if (target.imported || target.firstPass != int(i))
+			{
+				continue;
+			}
+			PooledTarget *pooled = acquire(target.desc, target.firstPass);
+			pooled->lastUsedFrame = m_frame;
+			pooled->busyUntilPass = target.lastPass;
+			target.fbo = pooled->fbo;
+			m_transientBytes += getTargetBytes(target.desc);
+		}
+	}
+}
+
+void RenderGraph::releaseUnusedTargets()
+{
+	for (size_t i = 0; i < m_pool.size(); )
+	{
+		if (m_frame - m_pool[i].lastUsedFrame > RELEASE_AFTER_FRAMES)
+		{
+			m_poolBytes -= m_pool[i].bytes;
+			deletePostProcessFBO(m_pool[i].fbo);
+			m_pool.erase(m_pool.begin() + i);
+		}
+		else
+		{
+			++i;
+		}
+	}
+}
+
+void RenderGraph::releaseTargets()
+{
+	for (size_t i = 0; i < m_pool.size(); ++i)
+	{
+		deletePostProcessFBO(m_pool[i].fbo);
+	}
+	m_pool.clear();
+	m_poolBytes = 0;
+}
+
+void RenderGraph::compile()
+{
+	int previousCulled = m_numCulled;
+	size_t previousPoolSize = m_pool.size();
+	cullPasses();
+	computeLifetimes();
+	assignPooledTargets();
+
+	bool newPeak = m_poolBytes > m_peakBytes;
+	if (newPeak)
+	{
+		m_peakBytes = m_poolBytes;
+	}
+	if (newPeak || m_numCulled != previousCulled || m_pool.size() != previousPoolSize)
+	{
+		printf("Render graph: %d of %d passes culled, render targets %.2f MB (%.2f MB without aliasing), peak %.2f MB\n",
+			m_numCulled, int(m_passes.size()), toMB(m_usedBytes), toMB(m_transientBytes), toMB(m_peakBytes));
+	}
+}
+
+void RenderGraph::execute()
+{
+	for (size_t i = 0; i < m_passes.size(); ++i)
+	{
+		const Pass &pass = m_passes[i];
+		if (pass.culled)
+		{
+			continue;
+		}
+		const VirtualTarget &output = m_targets[pass.output];
+		profilerBeginPass(pass.name);
+		glBindFramebuffer(GL_FRAMEBUFFER, output.fbo.id);
+		glViewport(0, 0, output.viewportWidth, output.viewportHeight);
+		pass.execute(*this);
+		profilerEndPass();
+	}
+	CHECK_GL_ERROR();
+}
+
+GLuint RenderGraph::getTexture(RenderTargetHandle target) const
+{
+	return m_targets[target].fbo.colorTextureTarget;
+}
+
+const FBOInfo &RenderGraph::getTarget(RenderTargetHandle target) const
+{
+	return m_targets[target].fbo;
+}
+
+void RenderGraph::printStatistics() const
+{
+	printf("Render graph passes:\n");
+	for (size_t i = 0; i < m_passes.size(); ++i)
+	{
+		const Pass &pass = m_passes[i];
+		const VirtualTarget &output = m_targets[pass.output];
+		printf("  %-24s -> %-20s %s\n", pass.name, output.name, pass.culled ? "(culled)" : "");
+	}
+	printf("Render graph targets:\n");
+	for (size_t i = 0; i < m_targets.size(); ++i)
+	{
+		const VirtualTarget &target = m_targets[i];
+		if (target.imported)
+		{
+			printf("  %-20s imported\n", target.name);
+		}
+		else if (target.firstPass < 0)
+		{
+			printf("  %-20s unused\n", target.name);
+		}
+		else
+		{
+			printf("  %-20s %4dx%-4d (rendered %4dx%-4d) passes %d-%d, framebuffer %u\n", target.name,
+				target.desc.width, target.desc.height, target.viewportWidth, target.viewportHeight,
+				target.firstPass, target.lastPass, target.fbo.id);
+		}
+	}
+	printf("Render target memory: %.2f MB used (%.2f MB without aliasing), %d pooled targets %.2f MB, peak %.2f MB\n",
+		toMB(m_usedBytes), toMB(m_transientBytes), int(m_pool.size()), toMB(m_poolBytes), toMB(m_peakBytes));
+}
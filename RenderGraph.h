@@ -0,0 +1,167 @@
+#ifndef RENDER_GRAPH_H
+#define RENDER_GRAPH_H
+
+#include <GL/glew.h>
+#include <stddef.h>
+#include <functional>
+#include <vector>
+
+//*****************************************************************************
+//	Render graph
+//
+//	Each frame the passes are declared up front together with the render
+//	targets they read and the one target they write. compile() then culls
+//	every pass that does not contribute to an output, works out during which
+//	passes each transient target is needed, and assigns it a framebuffer from
+//	a pool so that targets whose lifetimes do not overlap share the same
+//	memory. execute() runs the remaining passes in declaration order.
+//*****************************************************************************
+
+struct FBOInfo
+{
+	GLuint id;
+	GLuint colorTextureTarget;
+	GLuint depthBuffer;
+	int width;
+	int height;
+};
+
+/**
+ * Creates a framebuffer with a rectangle texture as colour attachment and,
+ * optionally, a depth renderbuffer. Its objects are registered as render
+ * targets under name (see GpuResources.h).
+ */
+FBOInfo createPostProcessFBO(int width, int height, bool withDepth = false,
+							 GLenum internalFormat = GL_RGBA, const char *name = "post processing");
+void deletePostProcessFBO(FBOInfo &fbo);
+
+typedef int RenderTargetHandle;
+const RenderTargetHandle INVALID_RENDER_TARGET = -1;
+
+struct RenderTargetDesc
+{
+	int width;
+	int height;
+	GLenum internalFormat;
+	bool withDepth;
+};
+
+class RenderGraph
+{
+public:
+	/**
+	 * Records the GL commands of a pass. The output of the pass is already
+	 * bound, with the viewport covering all of it, when this is called.
+	 */
+	typedef std::function<void(const RenderGraph &)> ExecuteFunction;
+
+	RenderGraph();
+	~RenderGraph();
+
+	/**
+	 * Starts declaring the passes of a new frame. The pooled targets are kept,
+	 * those not used for a while are released.
+	 */
+	void beginFrame();
+
+	/**
+	 * Declares a target that only lives within the frame, its framebuffer is
+	 * assigned by compile(). With a scale below 1 the passes only render to
+	 * the lower left part of it, so that the rendered resolution can change
+	 * every frame without reallocating the target.
+	 */
+	RenderTargetHandle createTarget(const char *name, const RenderTargetDesc &desc,
+									float scale = 1.0f);
+
+	/**
+	 * Declares a target owned outside the graph, e.g. the shadow map or the
+	 * framebuffer that is displayed.
+	 */
+	RenderTargetHandle importTarget(const char *name, GLuint framebuffer, GLuint texture,
+									int width, int height);
+
+	/**
+	 * Marks a target as used after the frame. Only passes that (indirectly)
+	 * contribute to such a target are executed.
+	 */
+	void markOutput(RenderTargetHandle target);
+
+	/**
+	 * Adds a pass. A pass that blends into its output must also list the
+	 * output among its inputs, as it depends on the previous contents.
+	 */
+	void addPass(const char *name, const std::vector<RenderTargetHandle> &inputs,
+				 RenderTargetHandle output, ExecuteFunction execute);
+
+	void compile();
+	void execute();
+
+	GLuint getTexture(RenderTargetHandle target) const;
+	const FBOInfo &getTarget(RenderTargetHandle target) const;
+
+	/**
+	 * Releases all pooled targets, e.g. after the window has been resized and
+	 * the old ones are no longer of use. Call between frames.
+	 */
+	void releaseTargets();
+
+	/**
+	 * Prints the passes and target assignments of the last compiled frame,
+	 * and the render target memory in use and at its peak.
+	 */
+	void printStatistics() const;
+
+	size_t getPeakMemory() const { return m_peakBytes; }
+
+private:
+	struct VirtualTarget
+	{
+		const char *name;
+		RenderTargetDesc desc;
+		bool imported;
+		FBOInfo fbo;
+		int viewportWidth;
+		int viewportHeight;
+		int firstPass;
+		int lastPass;
+	};
+
+	struct Pass
+	{
+		const char *name;
+		std::vector<RenderTargetHandle> inputs;
+		RenderTargetHandle output;
+		ExecuteFunction execute;
+		bool culled;
+	};
+
+	struct PooledTarget
+	{
+		RenderTargetDesc desc;
+		FBOInfo fbo;
+		size_t bytes;
+		int lastUsedFrame;
+		int busyUntilPass;
+	};
+
+	void cullPasses();
+	void computeLifetimes();
+	void assignPooledTargets();
+	void releaseUnusedTargets();
+	PooledTarget *acquire(const RenderTargetDesc &desc, int firstPass);
+
+	std::vector<VirtualTarget> m_targets;
+	std::vector<Pass> m_passes;
+	std::vector<RenderTargetHandle> m_outputs;
+	std::vector<PooledTarget> m_pool;
+	int m_frame;
+
+	// Statistics of the last compiled frame
+	int m_numCulled;
+	size_t m_transientBytes;	// if every transient target had its own memory
+	size_t m_usedBytes;			// pooled memory used by this frame
+	size_t m_poolBytes;			// all pooled memory
+	size_t m_peakBytes;
+};
+
+#endif // RENDER_GRAPH_H
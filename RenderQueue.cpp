@@ -0,0 +1,276 @@
+#include "RenderQueue.h"
+
+#include <string.h>
+#include <algorithm>
+
+#include "Mesh.h"
+#include "ShaderCache.h"
+
+using namespace std;
+using namespace chag;
+
+RenderQueue::RenderQueue()
+{
+	clear();
+}
+
+void RenderQueue::clear()
+{
+	m_objects.clear();
+	m_packets.clear();
+	m_order.clear();
+	m_sorted = false;
+	memset(&m_stats, 0, sizeof(m_stats));
+}
+
+int RenderQueue::addObject(const RenderObject &object)
+{
+	m_objects.push_back(object);
+	return int(m_objects.size()) - 1;
+}
+
+/**
+ * The top 16 bits of the depth, the bit pattern of a non-negative float
+ * increases with its value so no range needs to be known.
+ */
+static uint64_t quantizeDepth(float depth)
+{
+	float clamped = max(depth, 0.0f);
+	uint32_t bits;
+	memcpy(&bits, &clamped, sizeof(bits));
+	return bits >> 16;
+}
+
+void RenderQueue::addDraw(int object, GLuint vertexArray, const MeshMaterial *material, unsigned int materialIndex,
+						  unsigned int firstIndex, unsigned int numIndices, float depth, int numInstances)
+{
+	const RenderObject &o = m_objects[object];
+	const ShaderProgram *shader = o.program;
+	if (o.permutations)
+	{
+		int features = o.shaderFeatures | (material && material->diffuseTexture != 0 ? SHADER_TEXTURED : 0);
+		shader = &o.permutations->programs[features];
+	}
+	// E.g. the shadow pass has no material uniforms, its draws only need to
+	// be grouped by vertex array
+	bool withMaterial = material && shader->uniforms[UNIFORM_MATERIAL_DIFFUSE_COLOR] >= 0;
+	uint64_t program = shader->id & 0xff;
+	uint64_t texture = withMaterial ? material->diffuseTexture & 0xfff : 0;
+	uint64_t meshMaterial = (uint64_t(vertexArray & 0xff) << 10) | (withMaterial ? materialIndex & 0x3ff : 0);
+	uint64_t depthBits = quantizeDepth(depth);
+	uint64_t objectBits = uint64_t(object & 0xfff);
+
+	uint64_t key = (uint64_t(o.pass & 0xf) << 60) | (uint64_t(o.layer) << 58);
+	switch (o.layer)
+	{
+	case RENDER_LAYER_OPAQUE:
+		key |= (program << 50) | (texture << 38) | (meshMaterial << 20) | (depthBits << 4);
+		break;
+	case RENDER_LAYER_SKY:
+		key |= (objectBits << 46) | (meshMaterial << 28);
+		break;
+	case RENDER_LAYER_TRANSPARENT:
+		key |= ((0xffff - depthBits) << 42) | (objectBits << 30) | (program << 22) | (meshMaterial << 4);
+		break;
+	}
+
+	DrawPacket packet = { object, shader, vertexArray, withMaterial ? material : 0, firstIndex, numIndices, numInstances, depth };
+	SortEntry entry = { key, (unsigned int)m_packets.size() };
+	m_packets.push_back(packet);
+	m_order.push_back(entry);
+	m_sorted = false;
+	++m_stats.numPackets;
+}
+
+void RenderQueue::copyOpaqueDraws(int fromPass, int toPass, const ShaderProgram *program)
+{
+	// Each object is copied once, when its first packet is
+	vector<int> copies(m_objects.size(), -1);
+	size_t numPackets = m_packets.size();
+	for (size_t i = 0; i < numPackets; ++i)
+	{
+		DrawPacket packet = m_packets[i];
+		const RenderObject &o = m_objects[packet.object];
+		if (o.pass != fromPass || o.layer != RENDER_LAYER_OPAQUE)
+		{
+			continue;
+		}
+		if (copies[packet.object] < 0)
+		{
+			RenderObject copy = o;
+			copy.pass = toPass;
+			copy.program = program;
+			copy.permutations = 0;
+			copies[packet.object] = addObject(copy);
+		}
+		addDraw(copies[packet.object], packet.vertexArray, 0, 0, packet.firstIndex, packet.numIndices,
+				packet.depth, packet.numInstances);
+	}
+}
+
+void RenderQueue::sort()
+{
+	// LSD radix sort, one byte of the key per round
+	size_t n = m_order.size();
+	m_scratch.resize(n);
+	for (int shift = 0; shift < 64 && n > 1; shift += 8)
+	{
+		size_t counts[256] = { 0 };
+		for (size_t i = 0; i < n; ++i)
+		{
+			++counts[(m_order[i].key >> shift) & 0xff];
+		}
+		// A byte that all keys share does not change the order
+		if (counts[(m_order[0].key >> shift) & 0xff] == n)
+		{
+			continue;
+		}
+		size_t offset = 0;
+		for (int digit = 0; digit < 256; ++digit)
+		{
+			size_t count = counts[digit];
+			counts[digit] = offset;
+			offset += count;
+		}
+		for (size_t i = 0; i < n; ++i)
+		{
+			m_scratch[counts[(m_order[i].key >> shift) & 0xff]++] = m_order[i];
+		}
+		m_order.swap(m_scratch);
+	}
+	m_sorted = true;
+}
+
+static void setLayerState(RenderLayer layer)
+{
+	switch (layer)
+	{
+	case RENDER_LAYER_OPAQUE:
+		glDepthMask(GL_TRUE);
+		glDepthFunc(GL_LESS);
+		glDisable(GL_BLEND);
+		break;
+	case RENDER_LAYER_SKY:
+		// Drawn at the far plane, only where the depth buffer is still clear
+		glDepthMask(GL_FALSE);
+		glDepthFunc(GL_LEQUAL);
+		glDisable(GL_BLEND);
+		break;
+	case RENDER_LAYER_TRANSPARENT:
+		glDepthMask(GL_FALSE);
+		glDepthFunc(GL_LESS);
+		glEnable(GL_BLEND);
+		glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+		break;
+	}
+}
+
+void RenderQueue::submit(int pass)
+{
+	if (!m_sorted)
+	{
+		sort();
+	}
+
+	// The pass is in the top bits, so its packets are consecutive
+	size_t begin = 0;
+	while (begin < m_order.size() && int(m_order[begin].key >> 60) < pass)
+	{
+		++begin;
+	}
+
+	RenderLayer layer = RENDER_LAYER_OPAQUE;
+	const ShaderProgram *program = 0;
+	GLuint vertexArray = 0;
+	GLuint texture = 0;
+	const MeshMaterial *material = 0;
+	int object = -1;
+	// The per-object uniforms last set in the current program
+	bool uniformsValid = false;
+	float4x4 modelMatrix;
+	float alpha = 0.0f;
+	float reflectiveness = 0.0f;
+
+	glActiveTexture(GL_TEXTURE0);
+	for (size_t i = begin; i < m_order.size() && int(m_order[i].key >> 60) == pass; ++i)
+	{
+		const DrawPacket &packet = m_packets[m_order[i].packet];
+		const RenderObject &o = m_objects[packet.object];
+		if (o.layer != layer)
+		{
+			setLayerState(o.layer);
+			layer = o.layer;
+			++m_stats.numBlendStateChanges;
+		}
+		if (packet.program != program)
+		{
+			glUseProgram(packet.program->id);
+			program = packet.program;
+			// Uniforms are program state, none of the values apply any more
+			uniformsValid = false;
+			material = 0;
+			object = -1;
+			++m_stats.numProgramChanges;
+		}
+		if (packet.vertexArray != vertexArray)
+		{
+			glBindVertexArray(packet.vertexArray);
+			vertexArray = packet.vertexArray;
+			++m_stats.numVertexArrayChanges;
+		}
+		if (packet.object != object)
+		{
+			object = packet.object;
+			if (!uniformsValid || memcmp(&modelMatrix, &o.modelMatrix, sizeof(modelMatrix)) != 0)
+			{
+				setUniform(*program, UNIFORM_MODEL_MATRIX, o.modelMatrix);
+				modelMatrix = o.modelMatrix;
+				++m_stats.numUniformUpdates;
+			}
+			if (!uniformsValid || alpha != o.alpha)
+			{
+				setUniform(*program, UNIFORM_OBJECT_ALPHA, o.alpha);
+				alpha = o.alpha;
+				++m_stats.numUniformUpdates;
+			}
+			if (!uniformsValid || reflectiveness != o.reflectiveness)
+			{
+				setUniform(*program, UNIFORM_OBJECT_REFLECTIVENESS, o.reflectiveness);
+				reflectiveness = o.reflectiveness;
+				++m_stats.numUniformUpdates;
+			}
+			uniformsValid = true;
+		}
+		if (packet.material && packet.material != material)
+		{
+			material = packet.material;
+			setUniform(*program, UNIFORM_MATERIAL_DIFFUSE_COLOR, material->diffuseColor);
+			setUniform(*program, UNIFORM_MATERIAL_SPECULAR_COLOR, material->specularColor);
+			setUniform(*program, UNIFORM_MATERIAL_EMISSIVE_COLOR, material->emissiveColor);
+			setUniform(*program, UNIFORM_MATERIAL_SHININESS, material->shininess);
+			++m_stats.numMaterialChanges;
+			if (material->diffuseTexture != 0 && material->diffuseTexture != texture)
+			{
+				glBindTexture(GL_TEXTURE_2D, material->diffuseTexture);
+				texture = material->diffuseTexture;
+				++m_stats.numTextureChanges;
+			}
+		}
+		const GLvoid *indices = (const GLvoid *)(packet.firstIndex * sizeof(unsigned int));
+		if (packet.numInstances > 0)
+		{
+			glDrawElementsInstanced(GL_TRIANGLES, packet.numIndices, GL_UNSIGNED_INT, indices, packet.numInstances);
+			m_stats.numInstances += packet.numInstances;
+		}
+		else
+		{
+			glDrawElements(GL_TRIANGLES, packet.numIndices, GL_UNSIGNED_INT, indices);
+		}
+		++m_stats.numDraws;
+	}
+	glBindVertexArray(0);
+	if (layer != RENDER_LAYER_OPAQUE)
+	{
+		setLayerState(RENDER_LAYER_OPAQUE);
+	}
+}
@@ -0,0 +1,147 @@
+#ifndef RENDER_QUEUE_H
+#define RENDER_QUEUE_H
+
+#include <GL/glew.h>
+#include <float4x4.h>
+#include <stdint.h>
+#include <vector>
+
+#include "ShaderUniforms.h"
+
+struct MeshMaterial;
+struct ShaderPermutations;
+
+//*****************************************************************************
+//	Render queue
+//
+//	Rather than issuing GL calls as the scene is traversed, every draw is
+//	queued as a packet with a 64-bit sort key. The keys order the packets by
+//	pass, then by layer (opaque geometry before the sky and the transparent
+//	draws), then by the state that is most expensive to change:
+//
+//	  opaque       pass:4 layer:2 program:8 texture:12 vertex array:8 material:10 depth:16
+//	  sky          pass:4 layer:2 object:12 vertex array:8 material:10
+//	  transparent  pass:4 layer:2 (inverted) depth:16 object:12 program:8 material:10
+//
+//	Opaque draws go front to back within equal state, transparent ones back
+//	to front. The packets are sorted once per frame with a radix sort, which
+//	is stable, so draws with equal keys keep the order they were queued in. Submitting a pass skips every bind or uniform
+//	update that would not change anything and counts the remaining ones.
+//*****************************************************************************
+
+enum RenderLayer
+{
+	RENDER_LAYER_OPAQUE,		// depth tested and written, not blended
+	RENDER_LAYER_SKY,			// at the far plane, depth tested with GL_LEQUAL, no depth writes
+	RENDER_LAYER_TRANSPARENT,	// blended back to front, no depth writes
+};
+
+/**
+ * The per-object state shared by all packets of one model instance, set
+ * through the uniforms of its program. With permutations, each draw uses the
+ * variant for shaderFeatures, plus SHADER_TEXTURED if its material has a
+ * texture, instead of program.
+ */
+struct RenderObject
+{
+	const ShaderProgram *program;
+	int pass;					// 0-15, see RenderQueue::submit()
+	RenderLayer layer;
+	chag::float4x4 modelMatrix;
+	float alpha;
+	float reflectiveness;
+	const ShaderPermutations *permutations;
+	int shaderFeatures;			// ShaderFeature bits
+};
+
+/**
+ * The GL calls made by the submitted passes since the last clear().
+ */
+struct RenderQueueStats
+{
+	int numPackets;
+	int numDraws;
+	int numInstances;			// drawn by instanced draws
+	int numProgramChanges;
+	int numVertexArrayChanges;
+	int numMaterialChanges;
+	int numTextureChanges;
+	int numUniformUpdates;		// per-object uniforms only
+	int numBlendStateChanges;
+};
+
+class RenderQueue
+{
+public:
+	RenderQueue();
+
+	/**
+	 * Removes all objects and packets and resets the statistics, called once
+	 * at the start of each frame.
+	 */
+	void clear();
+
+	/**
+	 * Adds an object and returns the index its packets refer to.
+	 */
+	int addObject(const RenderObject &object);
+
+	/**
+	 * Queues the indexed triangles firstIndex .. firstIndex + numIndices of a
+	 * vertex array. The material is only set if the program of the object
+	 * uses material uniforms. materialIndex identifies the material within
+	 * the vertex array's mesh, and depth is the view depth used for ordering.
+	 * With numInstances > 0 it is an instanced draw of that many instances.
+	 */
+	void addDraw(int object, GLuint vertexArray, const MeshMaterial *material, unsigned int materialIndex,
+				 unsigned int firstIndex, unsigned int numIndices, float depth, int numInstances = 0);
+
+	/**
+	 * Queues the opaque draws of one pass again for another pass, drawn with
+	 * another program and without materials. E.g. a depth pre-pass draws the
+	 * same visible chunks as the colour pass, with a cheaper program.
+	 */
+	void copyOpaqueDraws(int fromPass, int toPass, const ShaderProgram *program);
+
+	/**
+	 * Sorts the packets by key, done by the first submit() if not called.
+	 */
+	void sort();
+
+	/**
+	 * Issues the draws of one pass. The caller sets up the framebuffer and
+	 * the per-pass uniforms; the queue leaves the program of the last draw
+	 * current and restores the depth state and blending for opaque geometry.
+	 */
+	void submit(int pass);
+
+	const RenderQueueStats &getStats() const { return m_stats; }
+
+private:
+	struct DrawPacket
+	{
+		int object;
+		const ShaderProgram *program;
+		GLuint vertexArray;
+		const MeshMaterial *material;
+		unsigned int firstIndex;
+		unsigned int numIndices;
+		int numInstances;
+		float depth;
+	};
+
+	struct SortEntry
+	{
+		uint64_t key;
+		unsigned int packet;
+	};
+
+	std::vector<RenderObject> m_objects;
+	std::vector<DrawPacket> m_packets;
+	std::vector<SortEntry> m_order;
+	std::vector<SortEntry> m_scratch;
+	bool m_sorted;
+	RenderQueueStats m_stats;
+};
+
+#endif // RENDER_QUEUE_H
@@ -0,0 +1,65 @@
+#include "SampleCounter.h"
+
+SampleCounter::SampleCounter()
+	: m_numIssued(0)
+	, m_numCollected(0)
+	, m_active(false)
+	, m_samplesPerPixel(0.0f)
+{
+	glGenQueries(NUM_QUERIES, m_queries);
+	resetTotals();
+}
+
+SampleCounter::~SampleCounter()
+{
+	glDeleteQueries(NUM_QUERIES, m_queries);
+}
+
+void SampleCounter::begin()
+{
+	collect();
+	// If all queries are still in flight, this pass is not counted rather
+	// than waiting for the oldest one
+	m_active = m_numIssued - m_numCollected < NUM_QUERIES;
+	if (m_active)
+	{
+		glBeginQuery(GL_SAMPLES_PASSED, m_queries[m_numIssued % NUM_QUERIES]);
+	}
+}
+
+void SampleCounter::end(double numPixels)
+{
+	if (m_active)
+	{
+		glEndQuery(GL_SAMPLES_PASSED);
+		m_numPixels[m_numIssued % NUM_QUERIES] = numPixels;
+		++m_numIssued;
+		m_active = false;
+	}
+}
+
+void SampleCounter::collect()
+{
+	while (m_numCollected < m_numIssued)
+	{
+		int query = m_numCollected % NUM_QUERIES;
+		GLint available = 0;
+		glGetQueryObjectiv(m_queries[query], GL_QUERY_RESULT_AVAILABLE, &available);
+		if (!available)
+		{
+			break;
+		}
+		GLuint samples = 0;
+		glGetQueryObjectuiv(m_queries[query], GL_QUERY_RESULT, &samples);
+		m_samplesPerPixel = m_numPixels[query] > 0.0 ? float(double(samples) / m_numPixels[query]) : 0.0f;
+		m_totalSamples += double(samples);
+		m_totalPixels += m_numPixels[query];
+		++m_numCollected;
+	}
+}
+
+void SampleCounter::resetTotals()
+{
+	m_totalSamples = 0.0;
+	m_totalPixels = 0.0;
+}
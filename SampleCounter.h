@@ -0,0 +1,60 @@
+#ifndef SAMPLE_COUNTER_H
+#define SAMPLE_COUNTER_H
+
+#include <GL/glew.h>
+
+//*****************************************************************************
+//	Sample counter
+//
+//	Counts the samples that pass the depth test during a pass with
+//	GL_SAMPLES_PASSED queries, i.e. the fragments that are shaded and
+//	written. Divided by the pixels the pass covers this is its overdraw, 1
+//	when every pixel is shaded exactly once. As with DynamicResolution the
+//	results are read a few frames late, and only when available.
+//*****************************************************************************
+
+class SampleCounter
+{
+public:
+	SampleCounter();
+	~SampleCounter();
+
+	/**
+	 * Counts the samples between begin() and end() of a pass covering
+	 * numPixels pixels. Passes are not counted while all queries are in
+	 * flight.
+	 */
+	void begin();
+	void end(double numPixels);
+
+	/**
+	 * Collects the finished results, without waiting.
+	 */
+	void collect();
+
+	/**
+	 * The samples per pixel of the last collected pass, 0 if none yet.
+	 */
+	float getSamplesPerPixel() const { return m_samplesPerPixel; }
+
+	/**
+	 * Sums over all passes collected since resetTotals().
+	 */
+	double getTotalSamples() const { return m_totalSamples; }
+	double getTotalPixels() const { return m_totalPixels; }
+	void resetTotals();
+
+private:
+	static const int NUM_QUERIES = 4;
+	GLuint m_queries[NUM_QUERIES];
+	double m_numPixels[NUM_QUERIES];
+	int m_numIssued;
+	int m_numCollected;
+	bool m_active;
+
+	float m_samplesPerPixel;
+	double m_totalSamples;
+	double m_totalPixels;
+};
+
+#endif // SAMPLE_COUNTER_H
@@ -0,0 +1,429 @@
+#include "SceneStreamer.h"
+
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+#include <algorithm>
+#include <chrono>
+#include <map>
+#include <set>
+#include <sstream>
+#include <thread>
+
+#include "GpuResources.h"
+#include "Timer.h"
+
+using namespace std;
+using namespace chag;
+
+//*****************************************************************************
+//	Scene description
+//*****************************************************************************
+bool loadSceneDescription(const string &fileName, SceneDescription &scene)
+{
+	FILE *file = fopen(fileName.c_str(), "r");
+	if (!file)
+	{
+		printf("Warning: could not open scene '%s'\n", fileName.c_str());
+		return false;
+	}
+	scene.chunkSize = 256.0f;
+	scene.objects.clear();
+	char buffer[1024];
+	int lineNumber = 0;
+	bool ok = true;
+	while (ok && fgets(buffer, sizeof(buffer), file))
+	{
+		++lineNumber;
+		istringstream line(buffer);
+		string keyword;
+		if (!(line >> keyword) || keyword[0] == '#')
+		{
+			continue;
+		}
+		if (keyword == "chunk-size")
+		{
+			ok = (line >> scene.chunkSize) && scene.chunkSize > 0.0f;
+		}
+		else if (keyword == "object")
+		{
+			SceneObject object;
+			object.reflectiveness = 0.0f;
+			object.castsShadows = true;
+			object.radius = 0.0f;
+			ok = bool(line >> object.name >> object.modelFile >> object.position.x >> object.position.y
+				>> object.position.z);
+			string option;
+			while (ok && line >> option)
+			{
+				if (option == "reflect")
+				{
+					ok = bool(line >> object.reflectiveness);
+				}
+				else if (option == "radius")
+				{
+					ok = bool(line >> object.radius);
+				}
+				else if (option == "no-shadow")
+				{
+					object.castsShadows = false;
+				}
+				else
+				{
+					ok = false;
+				}
+			}
+			if (ok)
+			{
+				scene.objects.push_back(object);
+			}
+		}
+		else
+		{
+			ok = false;
+		}
+	}
+	fclose(file);
+	if (!ok)
+	{
+		printf("Warning: could not parse line %d of scene '%s'\n", lineNumber, fileName.c_str());
+		return false;
+	}
+	return true;
+}
+
+const SceneObject *findSceneObject(const SceneDescription &scene, const string &name)
+{
+	for (size_t i = 0; i < scene.objects.size(); ++i)
+	{
+		if (scene.objects[i].name == name)
+		{
+			return &scene.objects[i];
+		}
+	}
+	return 0;
+}
+
+//*****************************************************************************
+//	SceneStreamer
+//*****************************************************************************
+static size_t getFileSize(const string &fileName)
+{
+	FILE *file = fopen(fileName.c_str(), "rb");
+	if (!file)
+	{
+		return 0;
+	}
+	fseek(file, 0, SEEK_END);
+	long size = ftell(file);
+	fclose(file);
+	return size_t(max(size, 0L));
+}
+
+static float distanceToAABB(const float3 &point, const AABB &box)
+{
+	float dx = max(max(box.min.x - point.x, point.x - box.max.x), 0.0f);
+	float dy = max(max(box.min.y - point.y, point.y - box.max.y), 0.0f);
+	float dz = max(max(box.min.z - point.z, point.z - box.max.z), 0.0f);
+	return sqrtf(dx * dx + dy * dy + dz * dz);
+}
+
+static double toMB(size_t bytes)
+{
+	return double(bytes) / (1024.0 * 1024.0);
+}
+
+SceneStreamer::SceneStreamer(const SceneDescription &scene, size_t memoryBudget, float loadDistance,
+							 bool forceConvert, bool useCompressedTextures)
+	: m_scene(scene)
+	, m_memoryBudget(memoryBudget)
+	, m_loadDistance(loadDistance)
+	, m_unloadDistance(loadDistance * 1.25f)
+	, m_forceConvert(forceConvert)
+	, m_numReading(0)
+	, m_numWaiting(0)
+	, m_version(0)
+	, m_measuredBytes(0.0)
+	, m_measuredFileBytes(0.0)
+	, m_pool(2)
+	, m_textureLoader(new TextureLoader(m_pool))
+{
+	m_textureLoader->setUseCompressed(useCompressedTextures);
+	map<pair<int, int>, int> chunkByCell;
+	for (size_t i = 0; i < m_scene.objects.size(); ++i)
+	{
+		const SceneObject &object = m_scene.objects[i];
+		int x = int(floorf(object.position.x / m_scene.chunkSize));
+		int z = int(floorf(object.position.z / m_scene.chunkSize));
+		map<pair<int, int>, int>::iterator it = chunkByCell.find(make_pair(x, z));
+		if (it == chunkByCell.end())
+		{
+			Chunk chunk;
+			chunk.x = x;
+			chunk.z = z;
+			chunk.bounds = makeEmptyAABB();
+			chunk.state = CHUNK_UNLOADED;
+			chunk.fileBytes = 0;
+			chunk.bytes = 0;
+			chunk.requestTime = 0.0;
+			it = chunkByCell.insert(make_pair(make_pair(x, z), int(m_chunks.size()))).first;
+			m_chunks.push_back(chunk);
+		}
+		Chunk &chunk = m_chunks[it->second];
+		chunk.objects.push_back(int(i));
+		float3 extent = make_vector(object.radius, object.radius, object.radius);
+		growAABB(chunk.bounds, object.position - extent);
+		growAABB(chunk.bounds, object.position + extent);
+		chunk.fileBytes += getFileSize(object.modelFile + ".mesh");
+	}
+	printf("Scene: %d objects in %d chunks of %.0f units, streaming budget %.0f MB within %.0f units\n",
+		int(m_scene.objects.size()), int(m_chunks.size()), m_scene.chunkSize, toMB(m_memoryBudget),
+		m_loadDistance);
+}
+
+SceneStreamer::~SceneStreamer()
+{
+	// The texture requests point into the meshes, the reads write them
+	delete m_textureLoader;
+	m_pool.wait();
+	for (size_t i = 0; i < m_chunks.size(); ++i)
+	{
+		for (size_t j = 0; j < m_chunks[i].meshes.size(); ++j)
+		{
+			delete m_chunks[i].meshes[j];
+		}
+	}
+}
+
+void SceneStreamer::startLoading(int index)
+{
+	Chunk &chunk = m_chunks[index];
+	chunk.state = CHUNK_READING;
+	chunk.requestTime = getTimeMs();
+	for (size_t i = 0; i < chunk.objects.size(); ++i)
+	{
+		chunk.meshes.push_back(new Mesh());
+	}
+	++m_numReading;
+	m_pool.submit([this, index]() { read(index); });
+}
+
+/**
+ * Runs on a worker thread, only touches the meshes of the chunk.
+ */
+void SceneStreamer::read(int index)
+{
+	Chunk &chunk = m_chunks[index];
+	for (size_t i = 0; i < chunk.objects.size(); ++i)
+	{
+		chunk.meshes[i]->loadData(m_scene.objects[chunk.objects[i]].modelFile, m_forceConvert);
+	}
+	lock_guard<mutex> lock(m_mutex);
+	m_read.push_back(index);
+}
+
+/**
+ * Called once the textures are in, the chunk is drawn from here on.
+ */
+void SceneStreamer::finishUpload(Chunk &chunk)
+{
+	chunk.state = CHUNK_RESIDENT;
+	chunk.bounds = makeEmptyAABB();
+	bool measured = chunk.bytes != 0;
+	chunk.bytes = 0;
+	// Materials that share a texture hold a reference each, count it once
+	set<GLuint> textures;
+	for (size_t i = 0; i < chunk.meshes.size(); ++i)
+	{
+		const Mesh *mesh = chunk.meshes[i];
+		float4x4 modelMatrix = make_translation(m_scene.objects[chunk.objects[i]].position);
+		growAABB(chunk.bounds, transformAABB(mesh->getBounds(), modelMatrix));
+		chunk.bytes += mesh->getVertexBufferSize() + mesh->getIndexBufferSize();
+		for (int j = 0; j < mesh->getNumMaterials(); ++j)
+		{
+			GLuint texture = mesh->getDiffuseTexture(j);
+			if (texture != 0 && textures.insert(texture).second)
+			{
+				chunk.bytes += getResourceBytes(RESOURCE_TEXTURE, texture);
+			}
+		}
+	}
+	if (!measured)
+	{
+		m_measuredBytes += double(chunk.bytes);
+		m_measuredFileBytes += double(chunk.fileBytes);
+	}
+	++m_version;
+	printf("Streamed in chunk (%d, %d): %d objects, %.2f MB in %.2f ms\n", chunk.x, chunk.z,
+		int(chunk.objects.size()), toMB(chunk.bytes), getTimeMs() - chunk.requestTime);
+}
+
+void SceneStreamer::unload(Chunk &chunk)
+{
+	for (size_t i = 0; i < chunk.meshes.size(); ++i)
+	{
+		delete chunk.meshes[i];
+	}
+	chunk.meshes.clear();
+	chunk.state = CHUNK_UNLOADED;
+	++m_version;
+	printf("Streamed out chunk (%d, %d): %.2f MB\n", chunk.x, chunk.z, toMB(chunk.bytes));
+}
+
+size_t SceneStreamer::estimateBytes(const Chunk &chunk) const
+{
+	if (chunk.bytes != 0)
+	{
+		return chunk.bytes;
+	}
+	double scale = m_measuredFileBytes > 0.0 ? m_measuredBytes / m_measuredFileBytes : 1.0;
+	return size_t(double(chunk.fileBytes) * scale);
+}
+
+void SceneStreamer::update(const float3 &cameraPosition, const function<void()> &beforeUnload)
+{
+	// The meshes read since the last update are uploaded here, their
+	// textures are decoded on the workers while frames are drawn
+	vector<int> read;
+	{
+		lock_guard<mutex> lock(m_mutex);
+		read.swap(m_read);
+	}
+	for (size_t i = 0; i < read.size(); ++i)
+	{
+		Chunk &chunk = m_chunks[read[i]];
+		for (size_t j = 0; j < chunk.meshes.size(); ++j)
+		{
+			chunk.meshes[j]->upload();
+			chunk.meshes[j]->requestTextures(*m_textureLoader);
+		}
+		chunk.state = CHUNK_UPLOADING;
+		--m_numReading;
+	}
+	m_textureLoader->update();
+	for (size_t i = 0; i < m_chunks.size(); ++i)
+	{
+		Chunk &chunk = m_chunks[i];
+		bool hasTextures = chunk.state == CHUNK_UPLOADING;
+		for (size_t j = 0; hasTextures && j < chunk.meshes.size(); ++j)
+		{
+			hasTextures = chunk.meshes[j]->hasTextures();
+		}
+		if (hasTextures)
+		{
+			finishUpload(chunk);
+		}
+	}
+
+	// Wanted are the chunks within the load distance, nearest first, as
+	// long as they fit in the budget. The nearest one always does. Loaded
+	// chunks count as closer by the ratio of the two distances, so they are
+	// kept until the unload distance and are only replaced by chunks that
+	// are clearly closer.
+	float hysteresis = m_loadDistance / m_unloadDistance;
+	vector<pair<float, int> > order;
+	for (size_t i = 0; i < m_chunks.size(); ++i)
+	{
+		float distance = distanceToAABB(cameraPosition, m_chunks[i].bounds);
+		order.push_back(make_pair(m_chunks[i].state != CHUNK_UNLOADED ? distance * hysteresis : distance, int(i)));
+	}
+	sort(order.begin(), order.end());
+	vector<bool> wanted(m_chunks.size(), false);
+	size_t wantedBytes = 0;
+	for (size_t i = 0; i < order.size() && order[i].first <= m_loadDistance; ++i)
+	{
+		size_t bytes = estimateBytes(m_chunks[order[i].second]);
+		if (i > 0 && wantedBytes + bytes > m_memoryBudget)
+		{
+			break;
+		}
+		wantedBytes += bytes;
+		wanted[order[i].second] = true;
+	}
+
+	// Chunks still being read or waiting for their textures are left until
+	// they are resident
+	bool waited = false;
+	for (size_t i = 0; i < m_chunks.size(); ++i)
+	{
+		if (m_chunks[i].state != CHUNK_RESIDENT || wanted[i])
+		{
+			continue;
+		}
+		if (!waited)
+		{
+			beforeUnload();
+			waited = true;
+		}
+		unload(m_chunks[i]);
+	}
+
+	m_numWaiting = 0;
+	for (size_t i = 0; i < order.size(); ++i)
+	{
+		int index = order[i].second;
+		if (!wanted[index] || m_chunks[index].state == CHUNK_RESIDENT)
+		{
+			continue;
+		}
+		++m_numWaiting;
+		if (m_chunks[index].state == CHUNK_UNLOADED && m_numReading < MAX_READING_CHUNKS)
+		{
+			startLoading(index);
+		}
+	}
+}
+
+void SceneStreamer::finishLoading(const float3 &cameraPosition, const function<void()> &beforeUnload)
+{
+	double start = getTimeMs();
+	update(cameraPosition, beforeUnload);
+	while (m_numWaiting > 0)
+	{
+		// Only before the first frame, polling keeps the uploads on this thread
+		this_thread::sleep_for(chrono::milliseconds(1));
+		update(cameraPosition, beforeUnload);
+	}
+	printf("Nearby chunks loaded in %.2f ms: %d of %d resident, %.2f MB\n", getTimeMs() - start,
+		getNumResidentChunks(), getNumChunks(), toMB(getResidentBytes()));
+}
+
+void SceneStreamer::getResidentObjects(vector<SceneInstance> &instances) const
+{
+	instances.clear();
+	for (size_t i = 0; i < m_chunks.size(); ++i)
+	{
+		const Chunk &chunk = m_chunks[i];
+		if (chunk.state != CHUNK_RESIDENT)
+		{
+			continue;
+		}
+		for (size_t j = 0; j < chunk.objects.size(); ++j)
+		{
+			const SceneObject &object = m_scene.objects[chunk.objects[j]];
+			SceneInstance instance = { chunk.meshes[j], make_translation(object.position), object.reflectiveness,
+				object.castsShadows };
+			instances.push_back(instance);
+		}
+	}
+}
+
+int SceneStreamer::getNumResidentChunks() const
+{
+	int count = 0;
+	for (size_t i = 0; i < m_chunks.size(); ++i)
+	{
+		count += m_chunks[i].state == CHUNK_RESIDENT ? 1 : 0;
+	}
+	return count;
+}
+
+size_t SceneStreamer::getResidentBytes() const
+{
+	size_t bytes = 0;
+	for (size_t i = 0; i < m_chunks.size(); ++i)
+	{
+		bytes += m_chunks[i].state == CHUNK_RESIDENT ? m_chunks[i].bytes : 0;
+	}
+	return bytes;
+}
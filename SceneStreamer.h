@@ -0,0 +1,175 @@
+#ifndef SCENE_STREAMER_H
+#define SCENE_STREAMER_H
+
+#include <float4x4.h>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "Culling.h"
+#include "Mesh.h"
+#include "TextureLoader.h"
+#include "ThreadPool.h"
+
+//*****************************************************************************
+//	Scene description and streaming
+//
+//	The scene is read from a text file listing the objects, each a model
+//	placed at a position. The objects are grouped into square chunks on the
+//	ground plane by their position, and the SceneStreamer keeps the chunks
+//	around the camera resident under a memory budget.
+//
+//	Each frame update() picks the chunks within the load distance, nearest
+//	first, as long as their GPU memory fits the budget. Those that are not
+//	resident are read (or converted) on worker threads, and then uploaded on
+//	the main thread along with their textures, a chunk becomes visible once
+//	all of it is. The others are unloaded. Loaded chunks are measured against
+//	a somewhat larger unload distance, so a camera moving along the edge of a
+//	chunk, or between two that do not both fit, does not page the same chunk
+//	in and out.
+//
+//	The size of a chunk is only known once it has been loaded, until then it
+//	is estimated from its mesh cache files, scaled by how the GPU memory of
+//	the chunks loaded so far compared to theirs (which takes the textures
+//	into account). Its bounds come from the radius of its objects in the
+//	description until then.
+//*****************************************************************************
+
+struct SceneObject
+{
+	std::string name;
+	std::string modelFile;
+	chag::float3 position;
+	float reflectiveness;
+	bool castsShadows;
+	float radius;		// around position, bounds the model before it has been loaded
+};
+
+struct SceneDescription
+{
+	float chunkSize;
+	std::vector<SceneObject> objects;
+};
+
+/**
+ * Reads a scene file, made of lines of the form
+ *
+ *   chunk-size <units>
+ *   object <name> <model file> <x> <y> <z> [reflect <amount>] [no-shadow] [radius <units>]
+ *
+ * and # comments. Returns false, with a warning, if it cannot be read.
+ */
+bool loadSceneDescription(const std::string &fileName, SceneDescription &scene);
+
+/**
+ * The first object with the name, 0 if there is none.
+ */
+const SceneObject *findSceneObject(const SceneDescription &scene, const std::string &name);
+
+/**
+ * A resident object as the frames draw it.
+ */
+struct SceneInstance
+{
+	const Mesh *mesh;
+	chag::float4x4 modelMatrix;
+	float reflectiveness;
+	bool castsShadows;
+};
+
+class SceneStreamer
+{
+public:
+	/**
+	 * memoryBudget is in bytes, of vertex and index buffers and textures.
+	 */
+	SceneStreamer(const SceneDescription &scene, size_t memoryBudget, float loadDistance,
+				  bool forceConvert, bool useCompressedTextures);
+	~SceneStreamer();
+
+	/**
+	 * Uploads the chunks that have been read, unloads those no longer wanted
+	 * and starts reading the nearest missing ones. beforeUnload is called
+	 * before the first chunk is unloaded, to wait for anything still using
+	 * the objects of getResidentObjects(). Main thread only.
+	 */
+	void update(const chag::float3 &cameraPosition, const std::function<void()> &beforeUnload);
+
+	/**
+	 * Calls update() until every chunk wanted at cameraPosition is resident,
+	 * e.g. before the first frame.
+	 */
+	void finishLoading(const chag::float3 &cameraPosition, const std::function<void()> &beforeUnload);
+
+	/**
+	 * Replaces instances with the objects of the resident chunks. The meshes
+	 * stay valid until update() calls beforeUnload.
+	 */
+	void getResidentObjects(std::vector<SceneInstance> &instances) const;
+
+	/**
+	 * Changes whenever a chunk becomes resident or is unloaded.
+	 */
+	int getVersion() const { return m_version; }
+
+	/**
+	 * Whether chunks the last update() wanted are still on their way.
+	 */
+	bool isStreaming() const { return m_numWaiting > 0; }
+
+	int getNumChunks() const { return int(m_chunks.size()); }
+	int getNumResidentChunks() const;
+	size_t getResidentBytes() const;
+	size_t getMemoryBudget() const { return m_memoryBudget; }
+
+private:
+	enum ChunkState
+	{
+		CHUNK_UNLOADED,
+		CHUNK_READING,		// on a worker thread
+		CHUNK_UPLOADING,	// buffers uploaded, waiting for the textures
+		CHUNK_RESIDENT
+	};
+
+	struct Chunk
+	{
+		int x;
+		int z;
+		std::vector<int> objects;
+		AABB bounds;				// world space
+		ChunkState state;
+		std::vector<Mesh *> meshes;	// one per object, empty while unloaded
+		size_t fileBytes;			// of the mesh cache files
+		size_t bytes;				// GPU memory, 0 until loaded once
+		double requestTime;
+	};
+
+	void startLoading(int chunk);
+	void read(int chunk);
+	void finishUpload(Chunk &chunk);
+	void unload(Chunk &chunk);
+	size_t estimateBytes(const Chunk &chunk) const;
+
+	static const int MAX_READING_CHUNKS = 2;
+	SceneDescription m_scene;
+	std::vector<Chunk> m_chunks;
+	size_t m_memoryBudget;
+	float m_loadDistance;
+	float m_unloadDistance;
+	bool m_forceConvert;
+	int m_numReading;
+	int m_numWaiting;			// chunks the last update() wanted that are not resident
+	int m_version;
+	double m_measuredBytes;		// of the chunks loaded so far
+	double m_measuredFileBytes;	// their mesh cache files
+	// Mesh reads and texture decodes, so streaming never takes more than
+	// these threads from the frame preparation
+	ThreadPool m_pool;
+	TextureLoader *m_textureLoader;
+	// Chunks whose meshes the workers have read
+	std::mutex m_mutex;
+	std::vector<int> m_read;
+};
+
+#endif // SCENE_STREAMER_H
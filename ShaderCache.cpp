@@ -0,0 +1,323 @@
+#include "ShaderCache.h"
+
+#include <glutil.h>
+
+#include <stdio.h>
+#include <string.h>
+#include <algorithm>
+
+#include "Timer.h"
+
+using namespace std;
+
+//*****************************************************************************
+//	Cache file layout: a header, then for each program its key, binary format
+//	and size followed by the binary.
+//*****************************************************************************
+static const char shaderCacheMagic[4] = { 'S', 'H', 'D', 'C' };
+static const uint32_t shaderCacheVersion = 1;
+
+struct ShaderCacheHeader
+{
+	char magic[4];
+	uint32_t version;
+	uint64_t driverHash;
+	uint32_t numPrograms;
+	uint32_t padding;
+};
+
+struct ShaderCacheEntry
+{
+	uint64_t key;
+	uint32_t format;
+	uint32_t size;
+};
+
+// 64 bit FNV-1a
+static const uint64_t hashSeed = 14695981039346656037ULL;
+
+static uint64_t hashBytes(uint64_t hash, const void *data, size_t size)
+{
+	const unsigned char *bytes = (const unsigned char *)data;
+	for (size_t i = 0; i < size; ++i)
+	{
+		hash ^= bytes[i];
+		hash *= 1099511628211ULL;
+	}
+	return hash;
+}
+
+static uint64_t hashString(uint64_t hash, const string &s)
+{
+	// With the terminator, so that "ab" + "c" and "a" + "bc" differ
+	return hashBytes(hash, s.c_str(), s.size() + 1);
+}
+
+static bool readTextFile(const char *fileName, string &contents)
+{
+	FILE *file = fopen(fileName, "rb");
+	if (!file)
+	{
+		return false;
+	}
+	char buffer[4096];
+	size_t read;
+	contents.clear();
+	while ((read = fread(buffer, 1, sizeof(buffer), file)) > 0)
+	{
+		contents.append(buffer, read);
+	}
+	fclose(file);
+	return true;
+}
+
+/**
+ * The source with the defines inserted after its #version line, which has
+ * to come first.
+ */
+static string insertDefines(const string &source, const string &defines)
+{
+	size_t lineEnd = source.compare(0, 8, "#version") == 0 ? source.find('\n') : string::npos;
+	if (lineEnd == string::npos)
+	{
+		return defines + source;
+	}
+	return source.substr(0, lineEnd + 1) + defines + source.substr(lineEnd + 1);
+}
+
+static GLuint compileShader(GLenum type, const char *fileName, const string &source)
+{
+	GLuint shader = glCreateShader(type);
+	const char *text = source.c_str();
+	glShaderSource(shader, 1, &text, 0);
+	glCompileShader(shader);
+	GLint compiled = 0;
+	glGetShaderiv(shader, GL_COMPILE_STATUS, &compiled);
+	if (!compiled)
+	{
+		GLint length = 0;
+		glGetShaderiv(shader, GL_INFO_LOG_LENGTH, &length);
+		vector<char> log(max(1, int(length)));
+		glGetShaderInfoLog(shader, GLsizei(log.size()), 0, &log[0]);
+		fatal_error(&log[0], string("Shader compiler error in ") + fileName);
+	}
+	return shader;
+}
+
+ShaderCache::ShaderCache(const string &fileName)
+	: m_fileName(fileName)
+	, m_binariesSupported(GLEW_ARB_get_program_binary != 0)
+	, m_driverHash(hashSeed)
+	, m_modified(false)
+	, m_numLoaded(0)
+	, m_numCompiled(0)
+	, m_loadTime(0.0)
+{
+	GLenum strings[] = { GL_VENDOR, GL_RENDERER, GL_VERSION, GL_SHADING_LANGUAGE_VERSION };
+	for (int i = 0; i < 4; ++i)
+	{
+		const char *value = (const char *)glGetString(strings[i]);
+		m_driverHash = hashString(m_driverHash, value ? value : "");
+	}
+	GLint numFormats = 0;
+	if (m_binariesSupported)
+	{
+		glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS, &numFormats);
+	}
+	// Some drivers expose the extension without any format
+	m_binariesSupported = numFormats > 0;
+	if (!m_binariesSupported)
+	{
+		return;
+	}
+
+	FILE *file = fopen(m_fileName.c_str(), "rb");
+	if (!file)
+	{
+		return;
+	}
+	ShaderCacheHeader header;
+	if (fread(&header, sizeof(header), 1, file) == 1
+		&& memcmp(header.magic, shaderCacheMagic, sizeof(shaderCacheMagic)) == 0
+		&& header.version == shaderCacheVersion && header.driverHash == m_driverHash)
+	{
+		for (uint32_t i = 0; i < header.numPrograms; ++i)
+		{
+			ShaderCacheEntry entry;
+			if (fread(&entry, sizeof(entry), 1, file) != 1 || entry.size == 0)
+			{
+				break;
+			}
+			Binary &binary = m_binaries[entry.key];
+			binary.format = entry.format;
+			binary.data.resize(entry.size);
+			if (fread(&binary.data[0], 1, entry.size, file) != entry.size)
+			{
+				// Truncated, the rest is compiled again
+				m_binaries.erase(entry.key);
+				break;
+			}
+		}
+	}
+	fclose(file);
+}
+
+void ShaderCache::bindAttribute(const char *name, GLuint location)
+{
+	m_attributes.push_back(make_pair(string(name), location));
+	char text[128];
+	snprintf(text, sizeof(text), "attribute %s %u\n", name, location);
+	m_bindings += text;
+}
+
+void ShaderCache::bindFragData(const char *name, GLuint location)
+{
+	m_fragData.push_back(make_pair(string(name), location));
+	char text[128];
+	snprintf(text, sizeof(text), "fragdata %s %u\n", name, location);
+	m_bindings += text;
+}
+
+GLuint ShaderCache::compile(const char *vertexShader, const string &vertexSource,
+							const char *fragmentShader, const string &fragmentSource, const string &defines)
+{
+	GLuint program = glCreateProgram();
+	GLuint shaders[2] = {
+		compileShader(GL_VERTEX_SHADER, vertexShader, insertDefines(vertexSource, defines)),
+		compileShader(GL_FRAGMENT_SHADER, fragmentShader, insertDefines(fragmentSource, defines))
+	};
+	for (int i = 0; i < 2; ++i)
+	{
+		glAttachShader(program, shaders[i]);
+		// Only flagged for deletion, they go with the program
+		glDeleteShader(shaders[i]);
+	}
+	for (size_t i = 0; i < m_attributes.size(); ++i)
+	{
+		glBindAttribLocation(program, m_attributes[i].second, m_attributes[i].first.c_str());
+	}
+	for (size_t i = 0; i < m_fragData.size(); ++i)
+	{
+		glBindFragDataLocation(program, m_fragData[i].second, m_fragData[i].first.c_str());
+	}
+	if (m_binariesSupported)
+	{
+		glProgramParameteri(program, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
+	}
+	linkShaderProgram(program);
+	return program;
+}
+
+ShaderProgram ShaderCache::load(const char *vertexShader, const char *fragmentShader, const string &defines)
+{
+	double start = getTimeMs();
+	string vertexSource;
+	string fragmentSource;
+	if (!readTextFile(vertexShader, vertexSource) || !readTextFile(fragmentShader, fragmentSource))
+	{
+		fatal_error(string("Could not read ") + vertexShader + " or " + fragmentShader);
+	}
+	uint64_t key = hashString(hashSeed, vertexSource);
+	key = hashString(key, fragmentSource);
+	key = hashString(key, defines);
+	key = hashString(key, m_bindings);
+	m_used.insert(key);
+	++m_numLoaded;
+
+	map<uint64_t, Binary>::iterator cached = m_binaries.find(key);
+	if (cached != m_binaries.end())
+	{
+		GLuint program = glCreateProgram();
+		glProgramBinary(program, cached->second.format, &cached->second.data[0], GLsizei(cached->second.data.size()));
+		GLint linked = 0;
+		glGetProgramiv(program, GL_LINK_STATUS, &linked);
+		if (linked)
+		{
+			m_loadTime += getTimeMs() - start;
+			return makeShaderProgram(program);
+		}
+		// E.g. the driver was updated without changing its version string
+		glDeleteProgram(program);
+		m_binaries.erase(cached);
+	}
+
+	GLuint program = compile(vertexShader, vertexSource, fragmentShader, fragmentSource, defines);
+	++m_numCompiled;
+	if (m_binariesSupported)
+	{
+		GLint size = 0;
+		glGetProgramiv(program, GL_PROGRAM_BINARY_LENGTH, &size);
+		if (size > 0)
+		{
+			Binary &binary = m_binaries[key];
+			binary.data.resize(size);
+			glGetProgramBinary(program, size, 0, &binary.format, &binary.data[0]);
+			m_modified = true;
+		}
+	}
+	m_loadTime += getTimeMs() - start;
+	return makeShaderProgram(program);
+}
+
+void ShaderCache::loadPermutations(const char *vertexShader, const char *fragmentShader,
+								   ShaderPermutations &permutations)
+{
+	static const char *featureNames[] = { "TEXTURED", "REFLECTIVE", "SHADOWED" };
+	for (int features = 0; features < NUM_SHADER_PERMUTATIONS; ++features)
+	{
+		string defines;
+		for (int bit = 0; bit < 3; ++bit)
+		{
+			if (features & (1 << bit))
+			{
+				defines += string("#define ") + featureNames[bit] + "\n";
+			}
+		}
+		permutations.programs[features] = load(vertexShader, fragmentShader, defines);
+	}
+}
+
+void ShaderCache::save()
+{
+	printf("Shaders: %d programs in %.1f ms, %d compiled, %d from %s%s\n", m_numLoaded, m_loadTime,
+		m_numCompiled, m_numLoaded - m_numCompiled, m_fileName.c_str(),
+		m_binariesSupported ? "" : " (program binaries not supported)");
+	// Programs of earlier sources are dropped
+	for (map<uint64_t, Binary>::iterator it = m_binaries.begin(); it != m_binaries.end();)
+	{
+		if (m_used.count(it->first) == 0)
+		{
+			m_binaries.erase(it++);
+			m_modified = true;
+		}
+		else
+		{
+			++it;
+		}
+	}
+	if (!m_modified || !m_binariesSupported)
+	{
+		return;
+	}
+	FILE *file = fopen(m_fileName.c_str(), "wb");
+	if (!file)
+	{
+		printf("Warning: could not write '%s'\n", m_fileName.c_str());
+		return;
+	}
+	ShaderCacheHeader header;
+	memcpy(header.magic, shaderCacheMagic, sizeof(header.magic));
+	header.version = shaderCacheVersion;
+	header.driverHash = m_driverHash;
+	header.numPrograms = uint32_t(m_binaries.size());
+	header.padding = 0;
+	fwrite(&header, sizeof(header), 1, file);
+	for (map<uint64_t, Binary>::const_iterator it = m_binaries.begin(); it != m_binaries.end(); ++it)
+	{
+		ShaderCacheEntry entry = { it->first, uint32_t(it->second.format), uint32_t(it->second.data.size()) };
+		fwrite(&entry, sizeof(entry), 1, file);
+		fwrite(&it->second.data[0], 1, it->second.data.size(), file);
+	}
+	fclose(file);
+	m_modified = false;
+}
@@ -0,0 +1,103 @@
+#ifndef SHADER_CACHE_H
+#define SHADER_CACHE_H
+
+#include <GL/glew.h>
+#include <stdint.h>
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+
+#include "ShaderUniforms.h"
+
+//*****************************************************************************
+//	Shader permutations and the program binary cache
+//
+//	A program is built from its two source files with a #define in front of
+//	both for each enabled feature, so every variant only pays for what it
+//	uses. Linked programs are kept with glGetProgramBinary in a cache file,
+//	keyed by a hash of everything that goes into them (sources, defines and
+//	bound locations). The whole file belongs to the driver that wrote it, a
+//	different GL vendor, renderer or version discards it. A warm start then
+//	creates every program with glProgramBinary and compiles nothing.
+//*****************************************************************************
+
+/**
+ * The features of shader.frag, each is a #define of the same name when set.
+ */
+enum ShaderFeature
+{
+	SHADER_TEXTURED = 1 << 0,		// TEXTURED: the material colours are modulated by diffuse_texture
+	SHADER_REFLECTIVE = 1 << 1,		// REFLECTIVE: adds the cube map reflection, by object_reflectiveness
+	SHADER_SHADOWED = 1 << 2,		// SHADOWED: the light is looked up in the shadow map
+	NUM_SHADER_PERMUTATIONS = 1 << 3
+};
+
+/**
+ * The variants of one program, programs[features] is compiled with the
+ * features (a combination of ShaderFeature bits).
+ */
+struct ShaderPermutations
+{
+	ShaderProgram programs[NUM_SHADER_PERMUTATIONS];
+};
+
+class ShaderCache
+{
+public:
+	/**
+	 * Reads the cache file, if it exists and was written by this driver.
+	 */
+	explicit ShaderCache(const std::string &fileName);
+
+	/**
+	 * Locations bound for every program loaded after the call, before it is
+	 * linked.
+	 */
+	void bindAttribute(const char *name, GLuint location);
+	void bindFragData(const char *name, GLuint location);
+
+	/**
+	 * Loads the program from the cache, or compiles and links it (with the
+	 * defines, e.g. "#define TEXTURED\n", after the #version line of both
+	 * sources) and adds it to the cache.
+	 */
+	ShaderProgram load(const char *vertexShader, const char *fragmentShader, const std::string &defines = "");
+
+	/**
+	 * Loads all NUM_SHADER_PERMUTATIONS variants of a program.
+	 */
+	void loadPermutations(const char *vertexShader, const char *fragmentShader, ShaderPermutations &permutations);
+
+	/**
+	 * Writes the cache file if programs were added or are no longer used
+	 * (their binaries are dropped), and prints how many programs were loaded,
+	 * how many of them from the cache, and the time.
+	 */
+	void save();
+
+private:
+	struct Binary
+	{
+		GLenum format;
+		std::vector<unsigned char> data;
+	};
+
+	GLuint compile(const char *vertexShader, const std::string &vertexSource,
+				   const char *fragmentShader, const std::string &fragmentSource, const std::string &defines);
+
+	std::string m_fileName;
+	bool m_binariesSupported;
+	uint64_t m_driverHash;
+	std::string m_bindings;		// the bindings as text, part of every key
+	std::vector<std::pair<std::string, GLuint> > m_attributes;
+	std::vector<std::pair<std::string, GLuint> > m_fragData;
+	std::map<uint64_t, Binary> m_binaries;
+	std::set<uint64_t> m_used;	// keys loaded since the cache was read
+	bool m_modified;
+	int m_numLoaded;
+	int m_numCompiled;
+	double m_loadTime;			// ms
+};
+
+#endif // SHADER_CACHE_H
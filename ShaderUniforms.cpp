@@ -0,0 +1,117 @@
+#include "ShaderUniforms.h"
+
+#include <glutil.h>
+
+#include "GpuResources.h"
+
+using namespace chag;
+
+// Names of the uniforms, in the same order as the UniformId enum.
+static const char *uniformNames[NUM_UNIFORMS] =
+{
+	"modelMatrix",
+	"viewMatrix",
+	"projectionMatrix",
+	"object_alpha",
+	"object_reflectiveness",
+	"material_shininess",
+	"material_diffuse_color",
+	"material_specular_color",
+	"material_emissive_color",
+	"bloom_threshold",
+	"bloom_intensity",
+	"render_scale",
+};
+
+static int uniformNameLookups = 0;
+static GLuint perFrameUniformBuffer = 0;
+
+static GLint lookupUniform(GLuint programId, const char *name)
+{
+	++uniformNameLookups;
+	return glGetUniformLocation(programId, name);
+}
+
+ShaderProgram linkProgram(GLuint programId)
+{
+	linkShaderProgram(programId);
+	return makeShaderProgram(programId);
+}
+
+ShaderProgram makeShaderProgram(GLuint programId)
+{
+	ShaderProgram program;
+	program.id = programId;
+	for (int i = 0; i < NUM_UNIFORMS; ++i)
+	{
+		program.uniforms[i] = lookupUniform(programId, uniformNames[i]);
+	}
+
+	GLuint blockIndex = glGetUniformBlockIndex(programId, "PerFrame");
+	if (blockIndex != GL_INVALID_INDEX)
+	{
+		glUniformBlockBinding(programId, blockIndex, PER_FRAME_UNIFORM_BINDING);
+	}
+	CHECK_GL_ERROR();
+	return program;
+}
+
+void bindSamplerUnit(const ShaderProgram &program, const char *name, GLint unit)
+{
+	GLint currentProgram;
+	glGetIntegerv(GL_CURRENT_PROGRAM, &currentProgram);
+	glUseProgram(program.id);
+	glUniform1i(lookupUniform(program.id, name), unit);
+	glUseProgram(currentProgram);
+}
+
+void setUniform(const ShaderProgram &program, UniformId uniform, const float4x4 &value)
+{
+	glUniformMatrix4fv(program.uniforms[uniform], 1, false, &value.c1.x);
+}
+
+void setUniform(const ShaderProgram &program, UniformId uniform, float value)
+{
+	glUniform1f(program.uniforms[uniform], value);
+}
+
+void setUniform(const ShaderProgram &program, UniformId uniform, int value)
+{
+	glUniform1i(program.uniforms[uniform], value);
+}
+
+void setUniform(const ShaderProgram &program, UniformId uniform, const float3 &value)
+{
+	glUniform3fv(program.uniforms[uniform], 1, &value.x);
+}
+
+void createPerFrameUniformBuffer()
+{
+	perFrameUniformBuffer = createResource(RESOURCE_BUFFER, RESOURCE_STREAMING, "per frame uniforms");
+	glBindBuffer(GL_UNIFORM_BUFFER, perFrameUniformBuffer);
+	glBufferData(GL_UNIFORM_BUFFER, sizeof(PerFrameUniforms), 0, GL_DYNAMIC_DRAW);
+	setResourceStorage(RESOURCE_BUFFER, perFrameUniformBuffer, sizeof(PerFrameUniforms));
+	glBindBufferBase(GL_UNIFORM_BUFFER, PER_FRAME_UNIFORM_BINDING, perFrameUniformBuffer);
+	glBindBuffer(GL_UNIFORM_BUFFER, 0);
+	CHECK_GL_ERROR();
+}
+
+void deletePerFrameUniformBuffer()
+{
+	deleteResource(RESOURCE_BUFFER, perFrameUniformBuffer);
+}
+
+void updatePerFrameUniforms(const PerFrameUniforms &perFrame)
+{
+	glBindBuffer(GL_UNIFORM_BUFFER, perFrameUniformBuffer);
+	// Orphan the previous contents so that we do not wait for the GPU to
+	// finish reading last frame's data.
+	glBufferData(GL_UNIFORM_BUFFER, sizeof(PerFrameUniforms), 0, GL_DYNAMIC_DRAW);
+	glBufferSubData(GL_UNIFORM_BUFFER, 0, sizeof(PerFrameUniforms), &perFrame);
+	glBindBuffer(GL_UNIFORM_BUFFER, 0);
+}
+
+int getUniformNameLookupCount()
+{
+	return uniformNameLookups;
+}
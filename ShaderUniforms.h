@@ -0,0 +1,119 @@
+#ifndef SHADER_UNIFORMS_H
+#define SHADER_UNIFORMS_H
+
+#include <GL/glew.h>
+#include <float4x4.h>
+
+#include "ShadowMap.h"
+
+//*****************************************************************************
+//	Uniform binding layer
+//
+//	Uniform locations are looked up by name exactly once, right after a
+//	program has been linked. From then on all uniforms are set through the
+//	cached locations. Data that is shared by all draws in a frame lives in a
+//	single uniform buffer object (the 'PerFrame' block) that is updated once
+//	per frame.
+//*****************************************************************************
+
+/**
+ * Identifies the per-draw / per-pass uniforms used by the programs in the
+ * scene. The names are listed in the same order in ShaderUniforms.cpp.
+ */
+enum UniformId
+{
+	UNIFORM_MODEL_MATRIX,
+	UNIFORM_VIEW_MATRIX,
+	UNIFORM_PROJECTION_MATRIX,
+	UNIFORM_OBJECT_ALPHA,
+	UNIFORM_OBJECT_REFLECTIVENESS,
+	UNIFORM_MATERIAL_SHININESS,
+	UNIFORM_MATERIAL_DIFFUSE_COLOR,
+	UNIFORM_MATERIAL_SPECULAR_COLOR,
+	UNIFORM_MATERIAL_EMISSIVE_COLOR,
+	UNIFORM_BLOOM_THRESHOLD,
+	UNIFORM_BLOOM_INTENSITY,
+	UNIFORM_RENDER_SCALE,
+	NUM_UNIFORMS
+};
+
+/**
+ * A linked shader program together with its cached uniform locations.
+ * A location of -1 means the program does not use that uniform, setting it
+ * is then a no-op (just as with glUniform).
+ */
+struct ShaderProgram
+{
+	GLuint id;
+	GLint uniforms[NUM_UNIFORMS];
+};
+
+/**
+ * CPU side mirror of the 'PerFrame' uniform block, laid out according to
+ * the std140 rules (see shaders/shader.vert).
+ */
+struct PerFrameUniforms
+{
+	chag::float4x4 viewMatrix;
+	chag::float4x4 projectionMatrix;
+	chag::float4x4 inverseViewNormalMatrix;
+	// From view space to the shadow map of each cascade (see ShadowMap.h),
+	// cascade i covers the view depths up to shadowCascadeSplits[i]
+	chag::float4x4 lightMatrices[MAX_SHADOW_CASCADES];
+	chag::float4 shadowCascadeSplits;
+	chag::float4 viewSpaceLightPosition;
+	float time;
+	int numShadowCascades;
+	float padding[2];
+};
+
+// Binding point that the 'PerFrame' block of every program is attached to.
+const GLuint PER_FRAME_UNIFORM_BINDING = 0;
+
+/**
+ * Links the program, then resolves and caches all uniform locations and
+ * attaches the 'PerFrame' block (if used) to PER_FRAME_UNIFORM_BINDING.
+ * The attribute and frag data locations must be bound before calling this.
+ */
+ShaderProgram linkProgram(GLuint programId);
+
+/**
+ * As linkProgram(), for a program that is already linked (e.g. by
+ * ShaderCache, or created from a program binary).
+ */
+ShaderProgram makeShaderProgram(GLuint programId);
+
+/**
+ * Sets a sampler uniform once, at initialization. Sampler units never change
+ * during rendering so these are not part of the cached set.
+ */
+void bindSamplerUnit(const ShaderProgram &program, const char *name, GLint unit);
+
+/**
+ * Fast path setters, the program must be current (as with glUniform).
+ */
+void setUniform(const ShaderProgram &program, UniformId uniform, const chag::float4x4 &value);
+void setUniform(const ShaderProgram &program, UniformId uniform, float value);
+void setUniform(const ShaderProgram &program, UniformId uniform, int value);
+void setUniform(const ShaderProgram &program, UniformId uniform, const chag::float3 &value);
+
+/**
+ * Creates the uniform buffer backing the 'PerFrame' block and binds it to
+ * PER_FRAME_UNIFORM_BINDING.
+ */
+void createPerFrameUniformBuffer();
+void deletePerFrameUniformBuffer();
+
+/**
+ * Uploads the shared per-frame data, should be called once per frame before
+ * any draw calls are made.
+ */
+void updatePerFrameUniforms(const PerFrameUniforms &perFrame);
+
+/**
+ * Debug counter of uniform lookups by name performed through this layer.
+ * After initialization it should stay constant.
+ */
+int getUniformNameLookupCount();
+
+#endif // SHADER_UNIFORMS_H
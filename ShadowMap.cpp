@@ -0,0 +1,125 @@
+#include "ShadowMap.h"
+
+#include <math.h>
+#include <algorithm>
+
+using namespace std;
+using namespace chag;
+
+static float4x4 orthographicMatrix(float left, float right, float bottom, float top, float nearPlane, float farPlane)
+{
+	float4x4 m = make_identity<float4x4>();
+	m.c1.x = 2.0f / (right - left);
+	m.c2.y = 2.0f / (top - bottom);
+	m.c3.z = -2.0f / (farPlane - nearPlane);
+	m.c4 = make_vector(-(right + left) / (right - left), -(top + bottom) / (top - bottom),
+		-(farPlane + nearPlane) / (farPlane - nearPlane), 1.0f);
+	return m;
+}
+
+/**
+ * Rounds a size up to one of eight steps per octave, so that it only
+ * changes when the fitted size has changed noticeably.
+ */
+static float quantizeSize(float size)
+{
+	float octave = powf(2.0f, floorf(log2f(max(size, 1.0e-3f))));
+	float step = octave / 8.0f;
+	return ceilf(size / step) * step;
+}
+
+/**
+ * The depth range of the camera view in which the box is visible.
+ */
+static void getViewDepthRange(const AABB &box, const float4x4 &viewMatrix, float &nearDepth, float &farDepth)
+{
+	AABB viewBox = transformAABB(box, viewMatrix);
+	// The camera looks down -z
+	nearDepth = -viewBox.max.z;
+	farDepth = -viewBox.min.z;
+}
+
+void fitShadowCascades(const float3 &lightDirection, const ShadowCamera &camera,
+					   const AABB &receivers, const AABB &casters, int numCascades, int resolution,
+					   float splitBlend, ShadowCascade *cascades)
+{
+	numCascades = min(max(numCascades, 1), MAX_SHADOW_CASCADES);
+
+	// Only the part of the view range where there are receivers is covered
+	float receiverNear;
+	float receiverFar;
+	getViewDepthRange(receivers, camera.viewMatrix, receiverNear, receiverFar);
+	float nearDepth = max(camera.nearPlane, receiverNear);
+	float farDepth = min(camera.farPlane, receiverFar);
+	if (farDepth <= nearDepth)
+	{
+		nearDepth = camera.nearPlane;
+		farDepth = nearDepth + 1.0f;
+	}
+
+	// A fixed up vector keeps the orientation of the map from following the
+	// camera, which would make the edges shimmer. The sun moves in the y-z
+	// plane, so x is never close to the light direction.
+	float3 direction = normalize(lightDirection);
+	float3 up = fabsf(direction.x) < 0.9f ? make_vector(1.0f, 0.0f, 0.0f) : make_vector(0.0f, 1.0f, 0.0f);
+	float4x4 lightViewMatrix = lookAt(direction, make_vector(0.0f, 0.0f, 0.0f), up);
+	float4x4 cameraToWorld = inverse(camera.viewMatrix);
+	AABB lightReceivers = transformAABB(receivers, lightViewMatrix);
+	AABB lightCasters = transformAABB(casters, lightViewMatrix);
+
+	float tanHalfFov = tanf(camera.fieldOfView * float(M_PI) / 360.0f);
+	for (int i = 0; i < numCascades; ++i)
+	{
+		ShadowCascade &cascade = cascades[i];
+		float splits[2];
+		for (int j = 0; j < 2; ++j)
+		{
+			float t = float(i + j) / float(numCascades);
+			float logarithmic = nearDepth * powf(farDepth / nearDepth, t);
+			float uniform = nearDepth + (farDepth - nearDepth) * t;
+			splits[j] = splitBlend * logarithmic + (1.0f - splitBlend) * uniform;
+		}
+		cascade.nearDepth = splits[0];
+		cascade.farDepth = splits[1];
+
+		// The corners of the slice, in light view space
+		AABB slice = makeEmptyAABB();
+		for (int j = 0; j < 8; ++j)
+		{
+			float depth = splits[j >> 2];
+			float halfHeight = depth * tanHalfFov;
+			float halfWidth = halfHeight * camera.aspectRatio;
+			float3 corner = make_vector((j & 1) ? halfWidth : -halfWidth, (j & 2) ? halfHeight : -halfHeight, -depth);
+			growAABB(slice, transformPoint(lightViewMatrix, transformPoint(cameraToWorld, corner)));
+		}
+
+		// Clipped to the receivers sideways and at the far end, extended to
+		// the casters towards the light
+		float3 fitMin = max(slice.min, lightReceivers.min);
+		float3 fitMax = min(slice.max, lightReceivers.max);
+		fitMax.z = max(fitMax.z, lightCasters.max.z);
+		if (fitMin.x >= fitMax.x || fitMin.y >= fitMax.y || fitMin.z >= fitMax.z)
+		{
+			// No receivers in this slice, cover the slice as is
+			fitMin = slice.min;
+			fitMax = slice.max;
+		}
+
+		float size = quantizeSize(max(fitMax.x - fitMin.x, fitMax.y - fitMin.y));
+		float texelSize = size / float(resolution);
+		float2 center = make_vector((fitMin.x + fitMax.x) * 0.5f, (fitMin.y + fitMax.y) * 0.5f);
+		float left = floorf((center.x - size * 0.5f) / texelSize) * texelSize;
+		float bottom = floorf((center.y - size * 0.5f) / texelSize) * texelSize;
+
+		cascade.viewMatrix = lightViewMatrix;
+		// The light looks down -z, so the near plane is at the largest z
+		cascade.projectionMatrix = orthographicMatrix(left, left + size, bottom, bottom + size, -fitMax.z, -fitMin.z);
+		cascade.texelsPerUnit = 1.0f / texelSize;
+	}
+}
+
+float4x4 getShadowTextureMatrix(const ShadowCascade &cascade, const float4x4 &cameraViewMatrix)
+{
+	return make_translation(make_vector(0.5f, 0.5f, 0.5f)) * make_scale<float4x4>(0.5f)
+		* cascade.projectionMatrix * cascade.viewMatrix * inverse(cameraViewMatrix);
+}
@@ -0,0 +1,62 @@
+#ifndef SHADOW_MAP_H
+#define SHADOW_MAP_H
+
+#include <float4x4.h>
+
+#include "Culling.h"
+
+//*****************************************************************************
+//	Shadow map fitting
+//
+//	The sun is far enough away to be treated as a directional light, so the
+//	shadow map uses an orthographic projection along the light direction.
+//	Rather than covering the whole scene, each cascade covers one slice of
+//	the camera frustum: the slice is clipped to the bounds of the shadow
+//	receivers and the projection is fitted around what is left, extended
+//	towards the light so that casters outside the view still cast into it.
+//
+//	The slices split the depth range where receivers are visible, partly
+//	logarithmically and partly uniformly. The projected extent is rounded up
+//	to a few sizes per octave and its position snapped to whole texels, so
+//	that the shadow edges do not shimmer while the camera moves.
+//*****************************************************************************
+
+const int MAX_SHADOW_CASCADES = 4;
+
+struct ShadowCascade
+{
+	chag::float4x4 viewMatrix;
+	chag::float4x4 projectionMatrix;
+	float nearDepth;		// the slice of the camera view depth covered
+	float farDepth;
+	float texelsPerUnit;	// the resolution of the map on the receivers
+};
+
+/**
+ * The camera a shadow map is fitted to, as passed to perspectiveMatrix().
+ */
+struct ShadowCamera
+{
+	chag::float4x4 viewMatrix;
+	float fieldOfView;		// vertical, in degrees
+	float aspectRatio;
+	float nearPlane;
+	float farPlane;
+};
+
+/**
+ * Fits numCascades cascades of resolution x resolution texels each.
+ * lightDirection points from the scene towards the light. splitBlend
+ * blends between uniform (0) and logarithmic (1) split depths.
+ */
+void fitShadowCascades(const chag::float3 &lightDirection, const ShadowCamera &camera,
+					   const AABB &receivers, const AABB &casters, int numCascades, int resolution,
+					   float splitBlend, ShadowCascade *cascades);
+
+/**
+ * The matrix from the camera's view space to the [0, 1] texture coordinates
+ * and depth of a cascade.
+ */
+chag::float4x4 getShadowTextureMatrix(const ShadowCascade &cascade, const chag::float4x4 &cameraViewMatrix);
+
+#endif // SHADOW_MAP_H
@@ -0,0 +1,287 @@
+#include "Skybox.h"
+
+#include <math.h>
+#include <stdio.h>
+#include <algorithm>
+
+#include "Mesh.h"
+#include "TextureLoader.h"
+
+using namespace std;
+using namespace chag;
+
+static bool readFile(const string &fileName, vector<unsigned char> &contents)
+{
+	FILE *file = fopen(fileName.c_str(), "rb");
+	if (!file)
+	{
+		return false;
+	}
+	fseek(file, 0, SEEK_END);
+	long size = ftell(file);
+	fseek(file, 0, SEEK_SET);
+	contents.resize(size_t(max(size, 0L)));
+	size_t read = size > 0 ? fread(&contents[0], 1, size_t(size), file) : 0;
+	fclose(file);
+	return read == contents.size();
+}
+
+static string directoryOf(const string &fileName)
+{
+	size_t slash = fileName.find_last_of("/\\");
+	return slash == string::npos ? string() : fileName.substr(0, slash + 1);
+}
+
+// 64 bit FNV-1a, continued over several arrays
+static uint64_t hashBytes(uint64_t hash, const void *data, size_t size)
+{
+	const unsigned char *bytes = (const unsigned char *)data;
+	for (size_t i = 0; i < size; ++i)
+	{
+		hash ^= bytes[i];
+		hash *= 1099511628211ULL;
+	}
+	return hash;
+}
+
+/**
+ * Bilinear RGBA8 lookup of a texture coordinate (with v pointing up, as in
+ * OBJ files) in an image whose first row is at the top, clamped to the edge.
+ */
+static void sampleBilinear(const SkyboxModel::Image &image, float u, float v, unsigned char *result)
+{
+	float x = min(max(u * image.width - 0.5f, 0.0f), float(image.width - 1));
+	float y = min(max((1.0f - v) * image.height - 0.5f, 0.0f), float(image.height - 1));
+	int x0 = int(x);
+	int y0 = int(y);
+	int x1 = min(x0 + 1, image.width - 1);
+	int y1 = min(y0 + 1, image.height - 1);
+	float fx = x - float(x0);
+	float fy = y - float(y0);
+	const unsigned char *p00 = &image.pixels[(size_t(y0) * image.width + x0) * 4];
+	const unsigned char *p10 = &image.pixels[(size_t(y0) * image.width + x1) * 4];
+	const unsigned char *p01 = &image.pixels[(size_t(y1) * image.width + x0) * 4];
+	const unsigned char *p11 = &image.pixels[(size_t(y1) * image.width + x1) * 4];
+	for (int c = 0; c < 3; ++c)
+	{
+		float top = p00[c] + (p10[c] - p00[c]) * fx;
+		float bottom = p01[c] + (p11[c] - p01[c]) * fx;
+		result[c] = (unsigned char)(top + (bottom - top) * fy + 0.5f);
+	}
+}
+
+/**
+ * The direction through the texel centre (x, y) of a size x size cube map
+ * face, the first row at the top as the faces are specified.
+ */
+static float3 cubeMapDirection(int face, int x, int y, int size)
+{
+	float s = 2.0f * (float(x) + 0.5f) / float(size) - 1.0f;
+	float t = 2.0f * (float(y) + 0.5f) / float(size) - 1.0f;
+	switch (face)
+	{
+	case 0: return make_vector(1.0f, -t, -s);
+	case 1: return make_vector(-1.0f, -t, s);
+	case 2: return make_vector(s, 1.0f, t);
+	case 3: return make_vector(s, -1.0f, -t);
+	case 4: return make_vector(s, -t, 1.0f);
+	default: return make_vector(-s, -t, -1.0f);
+	}
+}
+
+/**
+ * Whether any direction from the centre through the triangle can lie in the
+ * pyramid of a cube map face, where the face's axis is the major one. The
+ * pyramid is bounded by four planes through the centre, and the triangle is
+ * outside if all its corners are behind one of them.
+ */
+static bool mayBeSeenThroughFace(const float3 corners[3], int face)
+{
+	int axis = face / 2;
+	float sign = face % 2 == 0 ? 1.0f : -1.0f;
+	for (int other = 0; other < 3; ++other)
+	{
+		if (other == axis)
+		{
+			continue;
+		}
+		for (float side = -1.0f; side <= 1.0f; side += 2.0f)
+		{
+			bool behind = true;
+			for (int i = 0; i < 3 && behind; ++i)
+			{
+				const float *d = &corners[i].x;
+				behind = sign * d[axis] + side * d[other] < 0.0f;
+			}
+			if (behind)
+			{
+				return false;
+			}
+		}
+	}
+	return true;
+}
+
+bool loadSkyboxModel(const string &objFileName, SkyboxModel &model)
+{
+	MeshData data;
+	if (!loadMeshData(objFileName, data) || data.numFullDetailIndices == 0)
+	{
+		printf("Warning: could not load skybox '%s'\n", objFileName.c_str());
+		return false;
+	}
+
+	string basePath = directoryOf(objFileName);
+	model.images.resize(data.materials.size());
+	model.faceSize = 1;
+	for (size_t i = 0; i < data.materials.size(); ++i)
+	{
+		SkyboxModel::Image &image = model.images[i];
+		string fileName = basePath + data.materials[i].diffuseMap;
+		vector<unsigned char> file;
+		if (data.materials[i].diffuseMap.empty()
+			|| !loadImage(fileName, file, image.width, image.height, image.pixels))
+		{
+			if (!data.materials[i].diffuseMap.empty())
+			{
+				printf("Warning: could not decode texture '%s'\n", fileName.c_str());
+			}
+			image.width = image.height = 1;
+			image.pixels.assign(4, 255);
+		}
+		model.faceSize = max(model.faceSize, max(image.width, image.height));
+	}
+	model.faceSize = min(model.faceSize, MAX_SKYBOX_FACE_SIZE);
+
+	AABB bounds = makeEmptyAABB();
+	for (size_t i = 0; i < data.chunks.size(); ++i)
+	{
+		growAABB(bounds, data.chunks[i].bounds);
+	}
+	float3 centre = (bounds.min + bounds.max) * 0.5f;
+
+	for (int face = 0; face < 6; ++face)
+	{
+		model.faceTriangles[face].clear();
+	}
+	for (size_t i = 0; i < data.chunks.size(); ++i)
+	{
+		const MeshChunkLod &lod = data.chunks[i].lods[0];
+		for (unsigned int j = lod.firstIndex; j < lod.firstIndex + lod.numIndices; j += 3)
+		{
+			const unsigned int *tri = &data.indices[j];
+			float3 corners[3];
+			SkyboxModel::Triangle triangle;
+			for (int k = 0; k < 3; ++k)
+			{
+				corners[k] = data.positions[tri[k]] - centre;
+				triangle.texCoords[k] = data.texCoords[tri[k]];
+			}
+			float3 edge1 = corners[1] - corners[0];
+			float3 edge2 = corners[2] - corners[0];
+			float3 toCentre = -corners[0];
+			triangle.determinant = cross(edge2, edge1);
+			triangle.u = cross(edge2, toCentre);
+			triangle.v = cross(toCentre, edge1);
+			triangle.distance = dot(edge2, triangle.v);
+			triangle.material = data.chunks[i].material;
+			for (int face = 0; face < 6; ++face)
+			{
+				if (mayBeSeenThroughFace(corners, face))
+				{
+					model.faceTriangles[face].push_back(triangle);
+				}
+			}
+		}
+	}
+	return true;
+}
+
+void renderSkyboxFace(const SkyboxModel &model, int face, vector<unsigned char> &pixels)
+{
+	int size = model.faceSize;
+	const vector<SkyboxModel::Triangle> &triangles = model.faceTriangles[face];
+	pixels.assign(size_t(size) * size * 4, 0);
+	for (int y = 0; y < size; ++y)
+	{
+		for (int x = 0; x < size; ++x)
+		{
+			unsigned char *texel = &pixels[(size_t(y) * size + x) * 4];
+			texel[3] = 255;
+			// The closest triangle hit
+			float3 direction = cubeMapDirection(face, x, y, size);
+			const SkyboxModel::Triangle *hit = 0;
+			float closest = 0.0f;
+			float hitU = 0.0f;
+			float hitV = 0.0f;
+			for (size_t i = 0; i < triangles.size(); ++i)
+			{
+				const SkyboxModel::Triangle &triangle = triangles[i];
+				float determinant = dot(direction, triangle.determinant);
+				if (fabsf(determinant) < 1e-12f)
+				{
+					continue;
+				}
+				float u = dot(direction, triangle.u) / determinant;
+				float v = dot(direction, triangle.v) / determinant;
+				float distance = triangle.distance / determinant;
+				// A little slack, so rays through the shared edges hit either
+				const float epsilon = 1e-5f;
+				if (u >= -epsilon && v >= -epsilon && u + v <= 1.0f + epsilon && distance > 0.0f
+					&& (hit == 0 || distance < closest))
+				{
+					hit = &triangle;
+					closest = distance;
+					hitU = u;
+					hitV = v;
+				}
+			}
+			if (hit == 0)
+			{
+				continue;
+			}
+			float w = 1.0f - hitU - hitV;
+			float u = hit->texCoords[0].x * w + hit->texCoords[1].x * hitU + hit->texCoords[2].x * hitV;
+			float v = hit->texCoords[0].y * w + hit->texCoords[1].y * hitU + hit->texCoords[2].y * hitV;
+			sampleBilinear(model.images[hit->material], u, v, texel);
+		}
+	}
+}
+
+bool hashSkyboxSources(const string &objFileName, uint64_t &hash)
+{
+	MeshData data;
+	if (!loadMeshData(objFileName, data) || data.numFullDetailIndices == 0)
+	{
+		return false;
+	}
+	hash = 14695981039346656037ULL;
+	hash = hashBytes(hash, &data.positions[0], data.positions.size() * sizeof(float3));
+	hash = hashBytes(hash, &data.texCoords[0], data.texCoords.size() * sizeof(float2));
+	hash = hashBytes(hash, &data.indices[0], data.numFullDetailIndices * sizeof(unsigned int));
+	for (size_t i = 0; i < data.chunks.size(); ++i)
+	{
+		const MeshChunk &chunk = data.chunks[i];
+		hash = hashBytes(hash, &chunk.material, sizeof(chunk.material));
+		hash = hashBytes(hash, &chunk.lods[0].firstIndex, sizeof(chunk.lods[0].firstIndex));
+		hash = hashBytes(hash, &chunk.lods[0].numIndices, sizeof(chunk.lods[0].numIndices));
+	}
+	string basePath = directoryOf(objFileName);
+	for (size_t i = 0; i < data.materials.size(); ++i)
+	{
+		const string &diffuseMap = data.materials[i].diffuseMap;
+		vector<unsigned char> file;
+		hash = hashBytes(hash, diffuseMap.c_str(), diffuseMap.size() + 1);
+		if (!diffuseMap.empty() && readFile(basePath + diffuseMap, file) && !file.empty())
+		{
+			hash = hashBytes(hash, &file[0], file.size());
+		}
+	}
+	return true;
+}
+
+string getSkyboxFaceFile(const string &objFileName, int face)
+{
+	static const char *faceNames[6] = { "px", "nx", "py", "ny", "pz", "nz" };
+	return objFileName + "." + faceNames[face];
+}
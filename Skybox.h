@@ -0,0 +1,79 @@
+#ifndef SKYBOX_H
+#define SKYBOX_H
+
+#include <float4x4.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+//*****************************************************************************
+//	Skybox cube maps
+//
+//	The sky is drawn from cube maps, rendered from the skybox models (OBJ
+//	files whose faces carry the sky in their diffuse maps) as seen from the
+//	centre of their bounds. --build-texture-cache renders them offline into
+//	compressed DDS files, one per face (see TextureCompression.h), keyed by
+//	a hash of the model and its diffuse maps. The TextureLoader only renders
+//	them when loading if those are missing or out of date.
+//*****************************************************************************
+
+// Every texel of a face tests the triangles that can be seen through it
+const int MAX_SKYBOX_FACE_SIZE = 1024;
+
+struct SkyboxModel
+{
+	/**
+	 * Moller-Trumbore with every ray starting at the centre: the determinant
+	 * and the barycentric coordinates are each a dot product of the direction
+	 * with a vector of the triangle, and the distance is a constant over the
+	 * determinant.
+	 */
+	struct Triangle
+	{
+		chag::float3 determinant;
+		chag::float3 u;
+		chag::float3 v;
+		float distance;
+		chag::float2 texCoords[3];
+		unsigned int material;
+	};
+
+	struct Image
+	{
+		int width;
+		int height;
+		std::vector<unsigned char> pixels;	// RGBA8, first row at the top
+	};
+
+	std::vector<Triangle> faceTriangles[6];	// those that may be seen through each face
+	std::vector<Image> images;				// the diffuse map of each material
+	int faceSize;							// the largest diffuse map, up to MAX_SKYBOX_FACE_SIZE
+};
+
+/**
+ * Reads a skybox model through its mesh cache, along with its diffuse maps.
+ * Returns false, with a warning, if it cannot be read. Safe to call from any
+ * thread.
+ */
+bool loadSkyboxModel(const std::string &objFileName, SkyboxModel &model);
+
+/**
+ * Renders one face (in the order +x, -x, +y, -y, +z, -z) into faceSize x
+ * faceSize opaque RGBA8 pixels, first row at the top as GL takes cube map
+ * faces.
+ */
+void renderSkyboxFace(const SkyboxModel &model, int face, std::vector<unsigned char> &pixels);
+
+/**
+ * The hash the DDS files of a skybox are keyed by, over its geometry and
+ * texture coordinates (as in the mesh cache) and the contents of its diffuse
+ * maps. Returns false if the model cannot be read.
+ */
+bool hashSkyboxSources(const std::string &objFileName, uint64_t &hash);
+
+/**
+ * The name a face is known by, its DDS file is this plus ".dds".
+ */
+std::string getSkyboxFaceFile(const std::string &objFileName, int face);
+
+#endif // SKYBOX_H
@@ -0,0 +1,708 @@
+#include "TextureCompression.h"
+
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <cmath>
+
+#include "Skybox.h"
+#include "TextureLoader.h"
+#include "Timer.h"
+
+using namespace std;
+
+//*****************************************************************************
+//	DDS layout: "DDS ", then the header with the format as a FourCC, then the
+//	levels one after the other. The otherwise unused reserved1 words hold a
+//	tag, the converter version, the source hash and the row order.
+//*****************************************************************************
+static const uint32_t ddsMagic = 0x20534444;				// "DDS "
+static const uint32_t ddsTag = 0x58455443;					// "CTEX"
+static const uint32_t textureCacheVersion = 1;
+
+static const uint32_t DDSD_CAPS = 0x1;
+static const uint32_t DDSD_HEIGHT = 0x2;
+static const uint32_t DDSD_WIDTH = 0x4;
+static const uint32_t DDSD_PIXELFORMAT = 0x1000;
+static const uint32_t DDSD_MIPMAPCOUNT = 0x20000;
+static const uint32_t DDSD_LINEARSIZE = 0x80000;
+static const uint32_t DDPF_FOURCC = 0x4;
+static const uint32_t DDSCAPS_COMPLEX = 0x8;
+static const uint32_t DDSCAPS_TEXTURE = 0x1000;
+static const uint32_t DDSCAPS_MIPMAP = 0x400000;
+static const uint32_t fourCCDXT1 = 0x31545844;				// "DXT1"
+static const uint32_t fourCCDXT5 = 0x35545844;				// "DXT5"
+
+struct DDSPixelFormat
+{
+	uint32_t size;
+	uint32_t flags;
+	uint32_t fourCC;
+	uint32_t rgbBitCount;
+	uint32_t masks[4];
+};
+
+struct DDSHeader
+{
+	uint32_t magic;
+	uint32_t size;
+	uint32_t flags;
+	uint32_t height;
+	uint32_t width;
+	uint32_t linearSize;
+	uint32_t depth;
+	uint32_t mipMapCount;
+	uint32_t reserved1[11];	// tag, version, source hash (low, high), cube face
+	DDSPixelFormat pixelFormat;
+	uint32_t caps[4];
+	uint32_t reserved2;
+};
+
+// Block rows compressed by one task
+static const int bandBlockRows = 8;
+
+GLenum getCompressedInternalFormat(TextureCompression format)
+{
+	return format == TEXTURE_BC1 ? GL_COMPRESSED_RGB_S3TC_DXT1_EXT : GL_COMPRESSED_RGBA_S3TC_DXT5_EXT;
+}
+
+size_t getCompressedSize(TextureCompression format, int width, int height)
+{
+	size_t blockSize = format == TEXTURE_BC1 ? 8 : 16;
+	return size_t(max(1, (width + 3) / 4)) * size_t(max(1, (height + 3) / 4)) * blockSize;
+}
+
+uint64_t hashTextureSource(const vector<unsigned char> &file)
+{
+	// 64 bit FNV-1a
+	uint64_t hash = 14695981039346656037ULL;
+	for (size_t i = 0; i < file.size(); ++i)
+	{
+		hash ^= file[i];
+		hash *= 1099511628211ULL;
+	}
+	return hash;
+}
+
+/**
+ * The level sizes of a full mip chain, and the bytes they take together.
+ */
+static size_t layoutLevels(TextureCompression format, int width, int height, vector<CompressedLevel> &levels)
+{
+	levels.clear();
+	size_t offset = 0;
+	for (;;)
+	{
+		CompressedLevel level = { width, height, offset, getCompressedSize(format, width, height) };
+		levels.push_back(level);
+		offset += level.size;
+		if (width == 1 && height == 1)
+		{
+			return offset;
+		}
+		width = max(1, width / 2);
+		height = max(1, height / 2);
+	}
+}
+
+//*****************************************************************************
+//	Block encoders
+//*****************************************************************************
+
+static uint16_t packColor565(const float color[3])
+{
+	int r = int(min(max(color[0], 0.0f), 255.0f) * (31.0f / 255.0f) + 0.5f);
+	int g = int(min(max(color[1], 0.0f), 255.0f) * (63.0f / 255.0f) + 0.5f);
+	int b = int(min(max(color[2], 0.0f), 255.0f) * (31.0f / 255.0f) + 0.5f);
+	return uint16_t((r << 11) | (g << 5) | b);
+}
+
+static void unpackColor565(uint16_t packed, int color[3])
+{
+	int r = packed >> 11;
+	int g = (packed >> 5) & 63;
+	int b = packed & 31;
+	color[0] = (r << 3) | (r >> 2);
+	color[1] = (g << 2) | (g >> 4);
+	color[2] = (b << 3) | (b >> 2);
+}
+
+/**
+ * Picks the nearest of the four colours of the endpoints for every pixel
+ * (color0 > color1, the four colour mode), returns the squared error.
+ */
+static int selectColorIndices(const unsigned char *block, uint16_t color0, uint16_t color1, int indices[16])
+{
+	int palette[4][3];
+	unpackColor565(color0, palette[0]);
+	unpackColor565(color1, palette[1]);
+	for (int c = 0; c < 3; ++c)
+	{
+		palette[2][c] = (2 * palette[0][c] + palette[1][c]) / 3;
+		palette[3][c] = (palette[0][c] + 2 * palette[1][c]) / 3;
+	}
+	int error = 0;
+	for (int i = 0; i < 16; ++i)
+	{
+		int best = 0;
+		int bestError = INT_MAX;
+		for (int j = 0; j < 4; ++j)
+		{
+			int dr = block[i * 4 + 0] - palette[j][0];
+			int dg = block[i * 4 + 1] - palette[j][1];
+			int db = block[i * 4 + 2] - palette[j][2];
+			int e = dr * dr + dg * dg + db * db;
+			if (e < bestError)
+			{
+				bestError = e;
+				best = j;
+			}
+		}
+		indices[i] = best;
+		error += bestError;
+	}
+	return error;
+}
+
+/**
+ * Quantizes the endpoints and orders them for the four colour mode, returns
+ * false if they end up the same.
+ */
+static bool quantizeEndpoints(const float end0[3], const float end1[3], uint16_t &color0, uint16_t &color1)
+{
+	color0 = packColor565(end0);
+	color1 = packColor565(end1);
+	if (color0 < color1)
+	{
+		swap(color0, color1);
+	}
+	return color0 != color1;
+}
+
+/**
+ * BC1 block of 16 RGBA pixels: the endpoints span the principal axis of the
+ * colours, then are refined once by least squares for the chosen indices.
+ */
+static void encodeColorBlock(const unsigned char *block, unsigned char *out)
+{
+	float mean[3] = { 0.0f, 0.0f, 0.0f };
+	for (int i = 0; i < 16; ++i)
+	{
+		for (int c = 0; c < 3; ++c)
+		{
+			mean[c] += block[i * 4 + c];
+		}
+	}
+	for (int c = 0; c < 3; ++c)
+	{
+		mean[c] /= 16.0f;
+	}
+	// Covariance rr, rg, rb, gg, gb, bb
+	float covariance[6] = { 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f };
+	for (int i = 0; i < 16; ++i)
+	{
+		float d[3] = { block[i * 4 + 0] - mean[0], block[i * 4 + 1] - mean[1], block[i * 4 + 2] - mean[2] };
+		covariance[0] += d[0] * d[0];
+		covariance[1] += d[0] * d[1];
+		covariance[2] += d[0] * d[2];
+		covariance[3] += d[1] * d[1];
+		covariance[4] += d[1] * d[2];
+		covariance[5] += d[2] * d[2];
+	}
+	// Power iteration for the principal axis
+	float axis[3] = { 1.0f, 1.0f, 1.0f };
+	for (int iteration = 0; iteration < 8; ++iteration)
+	{
+		float next[3] = {
+			covariance[0] * axis[0] + covariance[1] * axis[1] + covariance[2] * axis[2],
+			covariance[1] * axis[0] + covariance[3] * axis[1] + covariance[4] * axis[2],
+			covariance[2] * axis[0] + covariance[4] * axis[1] + covariance[5] * axis[2]
+		};
+		float largest = max(fabsf(next[0]), max(fabsf(next[1]), fabsf(next[2])));
+		if (largest < 1e-6f)
+		{
+			break;	// all pixels (nearly) the same colour
+		}
+		for (int c = 0; c < 3; ++c)
+		{
+			axis[c] = next[c] / largest;
+		}
+	}
+	float minT = 0.0f;
+	float maxT = 0.0f;
+	for (int i = 0; i < 16; ++i)
+	{
+		float t = (block[i * 4 + 0] - mean[0]) * axis[0] + (block[i * 4 + 1] - mean[1]) * axis[1]
+			+ (block[i * 4 + 2] - mean[2]) * axis[2];
+		minT = min(minT, t);
+		maxT = max(maxT, t);
+	}
+	float axisLength2 = axis[0] * axis[0] + axis[1] * axis[1] + axis[2] * axis[2];
+	float end0[3];
+	float end1[3];
+	for (int c = 0; c < 3; ++c)
+	{
+		end0[c] = mean[c] + axis[c] * maxT / axisLength2;
+		end1[c] = mean[c] + axis[c] * minT / axisLength2;
+	}
+
+	uint16_t color0;
+	uint16_t color1;
+	int indices[16] = { 0 };
+	if (quantizeEndpoints(end0, end1, color0, color1))
+	{
+		int error = selectColorIndices(block, color0, color1, indices);
+
+		// Least squares endpoints for these indices
+		static const float weight0[4] = { 1.0f, 0.0f, 2.0f / 3.0f, 1.0f / 3.0f };
+		float aa = 0.0f, ab = 0.0f, bb = 0.0f;
+		float ax[3] = { 0.0f, 0.0f, 0.0f };
+		float bx[3] = { 0.0f, 0.0f, 0.0f };
+		for (int i = 0; i < 16; ++i)
+		{
+			float a = weight0[indices[i]];
+			float b = 1.0f - a;
+			aa += a * a;
+			ab += a * b;
+			bb += b * b;
+			for (int c = 0; c < 3; ++c)
+			{
+				ax[c] += a * block[i * 4 + c];
+				bx[c] += b * block[i * 4 + c];
+			}
+		}
+		float determinant = aa * bb - ab * ab;
+		if (fabsf(determinant) > 1e-6f)
+		{
+			for (int c = 0; c < 3; ++c)
+			{
+				end0[c] = (bb * ax[c] - ab * bx[c]) / determinant;
+				end1[c] = (aa * bx[c] - ab * ax[c]) / determinant;
+			}
+			uint16_t refined0;
+			uint16_t refined1;
+			int refinedIndices[16];
+			if (quantizeEndpoints(end0, end1, refined0, refined1)
+				&& selectColorIndices(block, refined0, refined1, refinedIndices) < error)
+			{
+				color0 = refined0;
+				color1 = refined1;
+				memcpy(indices, refinedIndices, sizeof(indices));
+			}
+		}
+	}
+	// With equal endpoints every index stays 0, which is color0 in either mode
+
+	out[0] = (unsigned char)(color0 & 0xff);
+	out[1] = (unsigned char)(color0 >> 8);
+	out[2] = (unsigned char)(color1 & 0xff);
+	out[3] = (unsigned char)(color1 >> 8);
+	for (int row = 0; row < 4; ++row)
+	{
+		out[4 + row] = (unsigned char)(indices[row * 4] | (indices[row * 4 + 1] << 2)
+			| (indices[row * 4 + 2] << 4) | (indices[row * 4 + 3] << 6));
+	}
+}
+
+/**
+ * BC3 alpha block: the extremes as endpoints (alpha0 > alpha1 selects the
+ * eight value mode) and the nearest of the eight values for every pixel.
+ */
+static void encodeAlphaBlock(const unsigned char *block, unsigned char *out)
+{
+	int alpha0 = 0;
+	int alpha1 = 255;
+	for (int i = 0; i < 16; ++i)
+	{
+		alpha0 = max(alpha0, int(block[i * 4 + 3]));
+		alpha1 = min(alpha1, int(block[i * 4 + 3]));
+	}
+	uint64_t bits = 0;
+	if (alpha0 != alpha1)
+	{
+		int palette[8] = { alpha0, alpha1 };
+		for (int j = 1; j < 7; ++j)
+		{
+			palette[j + 1] = ((7 - j) * alpha0 + j * alpha1) / 7;
+		}
+		for (int i = 0; i < 16; ++i)
+		{
+			int best = 0;
+			for (int j = 1; j < 8; ++j)
+			{
+				if (abs(block[i * 4 + 3] - palette[j]) < abs(block[i * 4 + 3] - palette[best]))
+				{
+					best = j;
+				}
+			}
+			bits |= uint64_t(best) << (3 * i);
+		}
+	}
+	out[0] = (unsigned char)alpha0;
+	out[1] = (unsigned char)alpha1;
+	for (int i = 0; i < 6; ++i)
+	{
+		out[2 + i] = (unsigned char)(bits >> (8 * i));
+	}
+}
+
+/**
+ * Compresses the block rows [firstRow, lastRow) of an RGBA8 image, the
+ * blocks on the right and top edges repeat the last pixels.
+ */
+static void compressBlockRows(TextureCompression format, int width, int height, const unsigned char *pixels,
+							  int firstRow, int lastRow, unsigned char *out)
+{
+	int blocksPerRow = max(1, (width + 3) / 4);
+	size_t blockSize = format == TEXTURE_BC1 ? 8 : 16;
+	out += size_t(firstRow) * blocksPerRow * blockSize;
+	unsigned char block[16 * 4];
+	for (int by = firstRow; by < lastRow; ++by)
+	{
+		for (int bx = 0; bx < blocksPerRow; ++bx)
+		{
+			for (int y = 0; y < 4; ++y)
+			{
+				int sy = min(by * 4 + y, height - 1);
+				for (int x = 0; x < 4; ++x)
+				{
+					int sx = min(bx * 4 + x, width - 1);
+					memcpy(&block[(y * 4 + x) * 4], &pixels[(size_t(sy) * width + sx) * 4], 4);
+				}
+			}
+			if (format == TEXTURE_BC3)
+			{
+				encodeAlphaBlock(block, out);
+				out += 8;
+			}
+			encodeColorBlock(block, out);
+			out += 8;
+		}
+	}
+}
+
+//*****************************************************************************
+//	DDS files
+//*****************************************************************************
+
+static bool writeCompressedTexture(const string &fileName, uint64_t sourceHash, bool cubeFace,
+								   const CompressedTexture &texture)
+{
+	FILE *file = fopen(fileName.c_str(), "wb");
+	if (!file)
+	{
+		return false;
+	}
+	DDSHeader header;
+	memset(&header, 0, sizeof(header));
+	header.magic = ddsMagic;
+	header.size = sizeof(DDSHeader) - sizeof(header.magic);
+	header.flags = DDSD_CAPS | DDSD_HEIGHT | DDSD_WIDTH | DDSD_PIXELFORMAT | DDSD_MIPMAPCOUNT | DDSD_LINEARSIZE;
+	header.height = uint32_t(texture.levels[0].height);
+	header.width = uint32_t(texture.levels[0].width);
+	header.linearSize = uint32_t(texture.levels[0].size);
+	header.mipMapCount = uint32_t(texture.levels.size());
+	header.reserved1[0] = ddsTag;
+	header.reserved1[1] = textureCacheVersion;
+	header.reserved1[2] = uint32_t(sourceHash);
+	header.reserved1[3] = uint32_t(sourceHash >> 32);
+	header.reserved1[4] = cubeFace ? 1 : 0;
+	header.pixelFormat.size = sizeof(DDSPixelFormat);
+	header.pixelFormat.flags = DDPF_FOURCC;
+	header.pixelFormat.fourCC = texture.format == TEXTURE_BC1 ? fourCCDXT1 : fourCCDXT5;
+	header.caps[0] = DDSCAPS_TEXTURE | DDSCAPS_COMPLEX | DDSCAPS_MIPMAP;
+	bool ok = fwrite(&header, sizeof(header), 1, file) == 1
+		&& fwrite(&texture.data[0], 1, texture.data.size(), file) == texture.data.size();
+	return fclose(file) == 0 && ok;
+}
+
+bool readCompressedTexture(const string &fileName, uint64_t sourceHash, bool cubeFace, CompressedTexture &texture)
+{
+	FILE *file = fopen(fileName.c_str(), "rb");
+	if (!file)
+	{
+		return false;
+	}
+	DDSHeader header;
+	bool ok = fread(&header, sizeof(header), 1, file) == 1
+		&& header.magic == ddsMagic
+		&& header.reserved1[0] == ddsTag
+		&& header.reserved1[1] == textureCacheVersion
+		&& header.reserved1[2] == uint32_t(sourceHash)
+		&& header.reserved1[3] == uint32_t(sourceHash >> 32)
+		&& header.reserved1[4] == (cubeFace ? 1u : 0u)
+		&& (header.pixelFormat.fourCC == fourCCDXT1 || header.pixelFormat.fourCC == fourCCDXT5)
+		&& header.width > 0 && header.height > 0;
+	if (ok)
+	{
+		texture.format = header.pixelFormat.fourCC == fourCCDXT1 ? TEXTURE_BC1 : TEXTURE_BC3;
+		size_t size = layoutLevels(texture.format, int(header.width), int(header.height), texture.levels);
+		texture.data.resize(size);
+		ok = header.mipMapCount == texture.levels.size()
+			&& fread(&texture.data[0], 1, size, file) == size;
+	}
+	fclose(file);
+	if (!ok)
+	{
+		texture.levels.clear();
+		texture.data.clear();
+	}
+	return ok;
+}
+
+//*****************************************************************************
+//	Converter
+//*****************************************************************************
+
+struct MipLevel
+{
+	int width;
+	int height;
+	vector<unsigned char> pixels;
+};
+
+struct ConvertedTexture
+{
+	TextureSource source;	// the DDS file is source.fileName + ".dds"
+	uint64_t sourceHash;
+	bool decoded;
+	double decodeTime;		// ms, reading and decoding (or rendering) the source image
+	double readTime;		// ms, reading the DDS file back
+	vector<MipLevel> mips;
+	size_t uncompressedSize;	// RGBA8 with all the levels
+	CompressedTexture compressed;
+};
+
+/**
+ * Box filters a level down to half its size, odd sizes repeat the last
+ * column or row.
+ */
+static void downsample(const MipLevel &source, MipLevel &level)
+{
+	level.width = max(1, source.width / 2);
+	level.height = max(1, source.height / 2);
+	level.pixels.resize(size_t(level.width) * level.height * 4);
+	for (int y = 0; y < level.height; ++y)
+	{
+		int y0 = min(y * 2, source.height - 1);
+		int y1 = min(y * 2 + 1, source.height - 1);
+		for (int x = 0; x < level.width; ++x)
+		{
+			int x0 = min(x * 2, source.width - 1);
+			int x1 = min(x * 2 + 1, source.width - 1);
+			for (int c = 0; c < 4; ++c)
+			{
+				int sum = source.pixels[(size_t(y0) * source.width + x0) * 4 + c]
+					+ source.pixels[(size_t(y0) * source.width + x1) * 4 + c]
+					+ source.pixels[(size_t(y1) * source.width + x0) * 4 + c]
+					+ source.pixels[(size_t(y1) * source.width + x1) * 4 + c];
+				level.pixels[(size_t(y) * level.width + x) * 4 + c] = (unsigned char)((sum + 2) / 4);
+			}
+		}
+	}
+}
+
+/**
+ * Picks the format from the base level and builds the rest of the mip chain.
+ */
+static void buildMipChain(ConvertedTexture &texture)
+{
+	MipLevel &base = texture.mips[0];
+	bool opaque = true;
+	for (size_t i = 3; i < base.pixels.size() && opaque; i += 4)
+	{
+		opaque = base.pixels[i] == 255;
+	}
+	texture.compressed.format = opaque ? TEXTURE_BC1 : TEXTURE_BC3;
+	texture.compressed.data.resize(layoutLevels(texture.compressed.format, base.width, base.height,
+		texture.compressed.levels));
+	// (base is invalidated from here on)
+	texture.mips.resize(texture.compressed.levels.size());
+	texture.uncompressedSize = texture.mips[0].pixels.size();
+	for (size_t i = 1; i < texture.mips.size(); ++i)
+	{
+		downsample(texture.mips[i - 1], texture.mips[i]);
+		texture.uncompressedSize += texture.mips[i].pixels.size();
+	}
+}
+
+/**
+ * Decodes the source in the order GL takes it, builds its mip chain and
+ * picks the format.
+ */
+static void prepareTexture(ConvertedTexture &texture)
+{
+	double start = getTimeMs();
+	vector<unsigned char> file;
+	texture.mips.resize(1);
+	MipLevel &base = texture.mips[0];
+	texture.decoded = loadImage(texture.source.fileName, file, base.width, base.height, base.pixels);
+	if (!texture.decoded)
+	{
+		return;
+	}
+	if (texture.source.cubeFace)
+	{
+		makeSquare(max(base.width, base.height), base.width, base.height, base.pixels);
+	}
+	else
+	{
+		flipRows(base.width, base.height, base.pixels);
+	}
+	texture.decodeTime = getTimeMs() - start;
+	texture.sourceHash = hashTextureSource(file);
+	buildMipChain(texture);
+}
+
+/**
+ * Compresses the prepared textures, writes and reads back their DDS files
+ * and prints what they cost against the uncompressed images, timed from
+ * start.
+ */
+static bool compressTextures(vector<ConvertedTexture> &textures, ThreadPool &pool, double start)
+{
+	// Every level is split into bands of block rows, which are compressed
+	// independently into their part of the data.
+	for (size_t i = 0; i < textures.size(); ++i)
+	{
+		ConvertedTexture &texture = textures[i];
+		if (!texture.decoded)
+		{
+			continue;
+		}
+		for (size_t j = 0; j < texture.mips.size(); ++j)
+		{
+			const MipLevel *mip = &texture.mips[j];
+			TextureCompression format = texture.compressed.format;
+			unsigned char *out = &texture.compressed.data[texture.compressed.levels[j].offset];
+			int blockRows = max(1, (mip->height + 3) / 4);
+			for (int row = 0; row < blockRows; row += bandBlockRows)
+			{
+				int lastRow = min(row + bandBlockRows, blockRows);
+				pool.submit([format, mip, row, lastRow, out]() {
+					compressBlockRows(format, mip->width, mip->height, &mip->pixels[0], row, lastRow, out);
+				});
+			}
+		}
+	}
+	pool.wait();
+	double convertTime = getTimeMs() - start;
+
+	bool ok = true;
+	size_t uncompressedTotal = 0;
+	size_t compressedTotal = 0;
+	double decodeTotal = 0.0;
+	double readTotal = 0.0;
+	for (size_t i = 0; i < textures.size(); ++i)
+	{
+		ConvertedTexture &texture = textures[i];
+		string ddsFile = texture.source.fileName + ".dds";
+		if (!texture.decoded)
+		{
+			printf("Warning: could not decode texture '%s'\n", texture.source.fileName.c_str());
+			ok = false;
+			continue;
+		}
+		if (!writeCompressedTexture(ddsFile, texture.sourceHash, texture.source.cubeFace, texture.compressed))
+		{
+			printf("Warning: could not write '%s'\n", ddsFile.c_str());
+			ok = false;
+			continue;
+		}
+		// What loading it costs now, against decoding the source
+		double readStart = getTimeMs();
+		CompressedTexture check;
+		if (!readCompressedTexture(ddsFile, texture.sourceHash, texture.source.cubeFace, check)
+			|| check.data != texture.compressed.data)
+		{
+			printf("Warning: '%s' does not read back\n", ddsFile.c_str());
+			ok = false;
+			continue;
+		}
+		texture.readTime = getTimeMs() - readStart;
+		printf("  %-36s %4dx%-4d %s %2d levels, %8.1f KB -> %7.1f KB, decode %7.2f ms -> read %5.2f ms\n",
+			ddsFile.c_str(), texture.mips[0].width, texture.mips[0].height,
+			texture.compressed.format == TEXTURE_BC1 ? "BC1" : "BC3", int(texture.mips.size()),
+			texture.uncompressedSize / 1024.0f, texture.compressed.data.size() / 1024.0f,
+			texture.decodeTime, texture.readTime);
+		uncompressedTotal += texture.uncompressedSize;
+		compressedTotal += texture.compressed.data.size();
+		decodeTotal += texture.decodeTime;
+		readTotal += texture.readTime;
+	}
+	printf("Converted in %.2f ms: %.2f MB as RGBA8 with mips -> %.2f MB (%.1fx less), load %.2f ms -> %.2f ms\n",
+		convertTime, uncompressedTotal / (1024.0f * 1024.0f), compressedTotal / (1024.0f * 1024.0f),
+		compressedTotal > 0 ? double(uncompressedTotal) / compressedTotal : 0.0, decodeTotal, readTotal);
+	return ok;
+}
+
+bool convertTextures(const vector<TextureSource> &sources, ThreadPool &pool)
+{
+	double start = getTimeMs();
+	printf("Converting %d textures on %d threads\n", int(sources.size()), pool.getNumThreads());
+	vector<ConvertedTexture> textures(sources.size());
+	for (size_t i = 0; i < sources.size(); ++i)
+	{
+		ConvertedTexture *texture = &textures[i];
+		texture->source = sources[i];
+		pool.submit([texture]() { prepareTexture(*texture); });
+	}
+	pool.wait();
+	return compressTextures(textures, pool, start);
+}
+
+bool convertSkyboxes(const vector<string> &objFileNames, ThreadPool &pool)
+{
+	double start = getTimeMs();
+	printf("Rendering %d skyboxes on %d threads\n", int(objFileNames.size()), pool.getNumThreads());
+	vector<SkyboxModel> models(objFileNames.size());
+	vector<uint64_t> hashes(objFileNames.size());
+	vector<char> loaded(objFileNames.size());
+	for (size_t i = 0; i < objFileNames.size(); ++i)
+	{
+		const string *objFileName = &objFileNames[i];
+		SkyboxModel *model = &models[i];
+		uint64_t *hash = &hashes[i];
+		char *modelLoaded = &loaded[i];
+		pool.submit([objFileName, model, hash, modelLoaded]() {
+			*modelLoaded = loadSkyboxModel(*objFileName, *model) && hashSkyboxSources(*objFileName, *hash);
+		});
+	}
+	pool.wait();
+
+	// Every face is rendered on its own
+	bool ok = true;
+	vector<ConvertedTexture> textures;
+	textures.reserve(objFileNames.size() * 6);
+	for (size_t i = 0; i < objFileNames.size(); ++i)
+	{
+		if (!loaded[i])
+		{
+			ok = false;
+			continue;
+		}
+		for (int face = 0; face < 6; ++face)
+		{
+			textures.push_back(ConvertedTexture());
+			ConvertedTexture *texture = &textures.back();
+			texture->source.fileName = getSkyboxFaceFile(objFileNames[i], face);
+			texture->source.cubeFace = true;
+			texture->sourceHash = hashes[i];
+			const SkyboxModel *model = &models[i];
+			pool.submit([model, face, texture]() {
+				double renderStart = getTimeMs();
+				texture->mips.resize(1);
+				MipLevel &base = texture->mips[0];
+				base.width = base.height = model->faceSize;
+				renderSkyboxFace(*model, face, base.pixels);
+				texture->decoded = true;
+				texture->decodeTime = getTimeMs() - renderStart;
+				buildMipChain(*texture);
+			});
+		}
+	}
+	pool.wait();
+	return compressTextures(textures, pool, start) && ok;
+}
@@ -0,0 +1,91 @@
+#ifndef TEXTURE_COMPRESSION_H
+#define TEXTURE_COMPRESSION_H
+
+#include <GL/glew.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+#include "ThreadPool.h"
+
+//*****************************************************************************
+//	Texture compression
+//
+//	Textures are converted offline into block compressed DDS files next to
+//	their sources (<image>.dds), with the whole mip chain precomputed by a
+//	box filter. Opaque images become BC1 (4 bits per pixel) and images with
+//	alpha BC3 (8 bits per pixel), instead of 32 for RGBA8. A file holds a
+//	hash of the contents of its source image and is ignored once they no
+//	longer match (unlike the mesh cache, which goes by the size and
+//	modification time of its sources). The blocks are stored in the order
+//	GL takes them, so they are uploaded as they are: 2D textures bottom row
+//	first, cube map faces top row first and square.
+//*****************************************************************************
+
+enum TextureCompression
+{
+	TEXTURE_BC1,	// DXT1, RGB
+	TEXTURE_BC3		// DXT5, RGB as BC1 plus interpolated alpha
+};
+
+struct CompressedLevel
+{
+	int width;
+	int height;
+	size_t offset;		// into CompressedTexture::data
+	size_t size;
+};
+
+struct CompressedTexture
+{
+	TextureCompression format;
+	std::vector<CompressedLevel> levels;	// the largest first, down to 1x1
+	std::vector<unsigned char> data;
+};
+
+/**
+ * The source of a compressed texture, cube map faces are stored top row first
+ * and resampled to be square.
+ */
+struct TextureSource
+{
+	std::string fileName;
+	bool cubeFace;
+};
+
+/**
+ * The GL internal format of the blocks (EXT_texture_compression_s3tc).
+ */
+GLenum getCompressedInternalFormat(TextureCompression format);
+
+/**
+ * Bytes of one level of width x height pixels.
+ */
+size_t getCompressedSize(TextureCompression format, int width, int height);
+
+/**
+ * The hash a DDS file stores of the source image file contents.
+ */
+uint64_t hashTextureSource(const std::vector<unsigned char> &file);
+
+/**
+ * Reads a DDS file written by convertTextures(), fails if it is missing, was
+ * made from a different source (sourceHash), for the other row order or by
+ * another version.
+ */
+bool readCompressedTexture(const std::string &fileName, uint64_t sourceHash, bool cubeFace,
+						   CompressedTexture &texture);
+
+/**
+ * Compresses every source to <fileName>.dds on the threads of the pool, and
+ * prints the size and load time of each against the uncompressed image.
+ */
+bool convertTextures(const std::vector<TextureSource> &sources, ThreadPool &pool);
+
+/**
+ * Renders the cube map faces of every skybox model (see Skybox.h) and
+ * compresses them as convertTextures() does, keyed by hashSkyboxSources().
+ */
+bool convertSkyboxes(const std::vector<std::string> &objFileNames, ThreadPool &pool);
+
+#endif // TEXTURE_COMPRESSION_H
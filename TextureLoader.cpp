@@ -0,0 +1,566 @@
+#include "TextureLoader.h"
+
+#include <IL/il.h>
+
+#include <glutil.h>
+
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+
+#include "GpuResources.h"
+#include "Skybox.h"
+#include "Timer.h"
+
+using namespace std;
+
+// DevIL keeps the currently bound image in global state and is not thread
+// safe, so its decoding is serialized. File reading and the PPM decoder below
+// run fully in parallel.
+static mutex devilMutex;
+
+static bool readFile(const string &fileName, vector<unsigned char> &contents)
+{
+	FILE *file = fopen(fileName.c_str(), "rb");
+	if (!file)
+	{
+		return false;
+	}
+	fseek(file, 0, SEEK_END);
+	long size = ftell(file);
+	fseek(file, 0, SEEK_SET);
+	contents.resize(size_t(max(size, 0L)));
+	size_t read = size > 0 ? fread(&contents[0], 1, size_t(size), file) : 0;
+	fclose(file);
+	return read == contents.size();
+}
+
+static const unsigned char *ppmNextValue(const unsigned char *p, const unsigned char *end, int &value)
+{
+	// skip whitespace and comments
+	while (p < end && (isspace(*p) || *p == '#'))
+	{
+		if (*p == '#')
+		{
+			while (p < end && *p != '\n')
+			{
+				++p;
+			}
+		}
+		else
+		{
+			++p;
+		}
+	}
+	value = 0;
+	while (p < end && *p >= '0' && *p <= '9')
+	{
+		value = value * 10 + (*p++ - '0');
+	}
+	return p;
+}
+
+/**
+ * Decodes binary (P6) and ascii (P3) 8-bit PPM files into RGBA, with the
+ * first row at the top (as in the file).
+ */
+static bool decodePPM(const vector<unsigned char> &file, int &width, int &height, vector<unsigned char> &pixels)
+{
+	if (file.size() < 2 || file[0] != 'P' || (file[1] != '6' && file[1] != '3'))
+	{
+		return false;
+	}
+	const unsigned char *p = &file[0] + 2;
+	const unsigned char *end = &file[0] + file.size();
+	int maxValue;
+	p = ppmNextValue(p, end, width);
+	p = ppmNextValue(p, end, height);
+	p = ppmNextValue(p, end, maxValue);
+	if (width <= 0 || height <= 0 || maxValue <= 0 || maxValue > 255)
+	{
+		return false;
+	}
+	size_t numPixels = size_t(width) * size_t(height);
+	pixels.resize(numPixels * 4);
+	if (file[1] == '6')
+	{
+		++p;	// single whitespace after the header
+		if (size_t(end - p) < numPixels * 3)
+		{
+			return false;
+		}
+		for (size_t i = 0; i < numPixels; ++i, p += 3)
+		{
+			pixels[i * 4 + 0] = p[0];
+			pixels[i * 4 + 1] = p[1];
+			pixels[i * 4 + 2] = p[2];
+			pixels[i * 4 + 3] = 255;
+		}
+	}
+	else
+	{
+		for (size_t i = 0; i < numPixels; ++i)
+		{
+			int r, g, b;
+			p = ppmNextValue(p, end, r);
+			p = ppmNextValue(p, end, g);
+			p = ppmNextValue(p, end, b);
+			pixels[i * 4 + 0] = (unsigned char)r;
+			pixels[i * 4 + 1] = (unsigned char)g;
+			pixels[i * 4 + 2] = (unsigned char)b;
+			pixels[i * 4 + 3] = 255;
+		}
+	}
+	return true;
+}
+
+void flipRows(int width, int height, vector<unsigned char> &pixels)
+{
+	size_t rowSize = size_t(width) * 4;
+	for (int y = 0; y < height / 2; ++y)
+	{
+		swap_ranges(pixels.begin() + y * rowSize, pixels.begin() + (y + 1) * rowSize,
+					pixels.begin() + (height - 1 - y) * rowSize);
+	}
+}
+
+static bool decodeWithDevIL(const vector<unsigned char> &file, int &width, int &height, vector<unsigned char> &pixels)
+{
+	lock_guard<mutex> lock(devilMutex);
+	ILuint image;
+	ilGenImages(1, &image);
+	ilBindImage(image);
+	// Always decode with the first row at the top, flipping is done outside the lock
+	ilEnable(IL_ORIGIN_SET);
+	ilOriginFunc(IL_ORIGIN_UPPER_LEFT);
+	bool ok = ilLoadL(IL_TYPE_UNKNOWN, &file[0], ILuint(file.size()))
+		&& ilConvertImage(IL_RGBA, IL_UNSIGNED_BYTE);
+	if (ok)
+	{
+		width = ilGetInteger(IL_IMAGE_WIDTH);
+		height = ilGetInteger(IL_IMAGE_HEIGHT);
+		const ILubyte *data = ilGetData();
+		pixels.assign(data, data + size_t(width) * size_t(height) * 4);
+	}
+	ilDeleteImages(1, &image);
+	return ok;
+}
+
+static bool decodeImage(const vector<unsigned char> &file, int &width, int &height, vector<unsigned char> &pixels)
+{
+	return !file.empty()
+		&& (decodePPM(file, width, height, pixels) || decodeWithDevIL(file, width, height, pixels));
+}
+
+bool loadImage(const string &fileName, vector<unsigned char> &file, int &width, int &height,
+			   vector<unsigned char> &pixels)
+{
+	return readFile(fileName, file) && decodeImage(file, width, height, pixels);
+}
+
+/**
+ * Pixels in a full mip chain down to 1x1.
+ */
+static size_t mipChainPixels(int width, int height)
+{
+	size_t pixels = 0;
+	for (;;)
+	{
+		pixels += size_t(width) * height;
+		if (width == 1 && height == 1)
+		{
+			return pixels;
+		}
+		width = max(1, width / 2);
+		height = max(1, height / 2);
+	}
+}
+
+TextureLoader::TextureLoader(ThreadPool &pool)
+	: m_pool(pool)
+	, m_numPending(0)
+	, m_numRequests(0)
+	, m_decodeTotal(0.0)
+	, m_uploadTotal(0.0)
+	, m_startTime(getTimeMs())
+	, m_pixelBuffer(0)
+	, m_useCompressed(GLEW_EXT_texture_compression_s3tc != 0)
+	, m_numCompressed(0)
+	, m_textureBytes(0.0)
+	, m_uncompressedBytes(0.0)
+{
+}
+
+TextureLoader::~TextureLoader()
+{
+	m_pool.wait();
+	for (size_t i = 0; i < m_requests.size(); ++i)
+	{
+		delete m_requests[i];
+	}
+	deleteResource(RESOURCE_BUFFER, m_pixelBuffer);
+}
+
+void TextureLoader::setUseCompressed(bool useCompressed)
+{
+	m_useCompressed = useCompressed && GLEW_EXT_texture_compression_s3tc;
+}
+
+void TextureLoader::loadTexture(const string &fileName, GLuint *texture)
+{
+	map<string, Request *>::iterator it = m_requestByFile.find(fileName);
+	if (it != m_requestByFile.end())
+	{
+		it->second->targets.push_back(texture);
+		return;
+	}
+	Request *request = new Request;
+	request->fileNames.push_back(fileName);
+	request->targets.push_back(texture);
+	m_requestByFile[fileName] = request;
+	submit(request);
+}
+
+void TextureLoader::loadCubeMap(const char *faces[6], GLuint *texture)
+{
+	Request *request = new Request;
+	request->fileNames.assign(faces, faces + 6);
+	request->targets.push_back(texture);
+	submit(request);
+}
+
+void TextureLoader::loadSkybox(const string &objFileName, GLuint *texture)
+{
+	Request *request = new Request;
+	for (int i = 0; i < 6; ++i)
+	{
+		request->fileNames.push_back(getSkyboxFaceFile(objFileName, i));
+	}
+	request->targets.push_back(texture);
+	request->skybox = objFileName;
+	submit(request);
+}
+
+void TextureLoader::submit(Request *request)
+{
+	request->decodeTime = 0.0;
+	request->uploadTime = 0.0;
+	request->useCompressed = m_useCompressed;
+	m_requests.push_back(request);
+	++m_numPending;
+	++m_numRequests;
+	m_pool.submit([this, request]() { decode(request); });
+}
+
+void TextureLoader::decode(Request *request)
+{
+	double start = getTimeMs();
+	size_t numFiles = request->fileNames.size();
+	bool isCubeMap = numFiles == 6;
+	bool isSkybox = !request->skybox.empty();
+	vector<vector<unsigned char> > files(numFiles);
+	bool compressed = request->useCompressed;
+	request->compressed.resize(compressed ? numFiles : 0);
+	// Skybox faces have no source files of their own, their DDS files are
+	// keyed by the sources of the model
+	uint64_t skyboxHash = 0;
+	if (isSkybox && compressed)
+	{
+		compressed = hashSkyboxSources(request->skybox, skyboxHash);
+	}
+	for (size_t i = 0; i < numFiles; ++i)
+	{
+		if (!isSkybox && !readFile(request->fileNames[i], files[i]))
+		{
+			files[i].clear();
+			compressed = false;
+		}
+		else if (compressed)
+		{
+			// The faces of a cube map have to agree on the size and format
+			CompressedTexture &texture = request->compressed[i];
+			uint64_t sourceHash = isSkybox ? skyboxHash : hashTextureSource(files[i]);
+			compressed = readCompressedTexture(request->fileNames[i] + ".dds", sourceHash, isCubeMap, texture)
+				&& (i == 0 || (texture.format == request->compressed[0].format
+					&& texture.levels[0].width == request->compressed[0].levels[0].width
+					&& texture.levels[0].height == request->compressed[0].levels[0].height));
+		}
+	}
+	if (!compressed)
+	{
+		request->compressed.clear();
+	}
+
+	request->images.resize(numFiles);
+	if (isSkybox && !compressed)
+	{
+		decodeSkybox(request);
+	}
+	else
+	{
+		for (size_t i = 0; i < numFiles; ++i)
+		{
+			Image &image = request->images[i];
+			if (compressed)
+			{
+				// Only the size, for the report
+				image.width = request->compressed[i].levels[0].width;
+				image.height = request->compressed[i].levels[0].height;
+				continue;
+			}
+			if (!decodeImage(files[i], image.width, image.height, image.pixels))
+			{
+				printf("Warning: could not decode texture '%s'\n", request->fileNames[i].c_str());
+				image.width = image.height = 1;
+				image.pixels.assign(4, 255);
+			}
+			// GL wants the first row at the bottom for 2D textures, cube map faces
+			// are specified top row first.
+			if (!isCubeMap)
+			{
+				flipRows(image.width, image.height, image.pixels);
+			}
+		}
+	}
+	request->decodeTime = getTimeMs() - start;
+
+	{
+		lock_guard<mutex> lock(m_mutex);
+		m_decoded.push_back(request);
+	}
+	m_decodedAvailable.notify_one();
+}
+
+/**
+ * The fallback when a skybox has no up to date DDS files: its six faces
+ * rendered from the model here, each a single white texel if it cannot be
+ * read.
+ */
+void TextureLoader::decodeSkybox(Request *request)
+{
+	if (request->useCompressed)
+	{
+		printf("Warning: no up to date DDS files for skybox '%s', rendering it (see --build-texture-cache)\n",
+			request->skybox.c_str());
+	}
+	SkyboxModel model;
+	bool ok = loadSkyboxModel(request->skybox, model);
+	request->images.resize(6);
+	for (int i = 0; i < 6; ++i)
+	{
+		Image &image = request->images[i];
+		image.width = image.height = ok ? model.faceSize : 1;
+		if (ok)
+		{
+			renderSkyboxFace(model, i, image.pixels);
+		}
+		else
+		{
+			image.pixels.assign(4, 255);
+		}
+	}
+}
+
+void makeSquare(int size, int &width, int &height, vector<unsigned char> &pixels)
+{
+	if (width == size && height == size)
+	{
+		return;
+	}
+	vector<unsigned char> resampled(size_t(size) * size * 4);
+	for (int y = 0; y < size; ++y)
+	{
+		for (int x = 0; x < size; ++x)
+		{
+			int sx = x * width / size;
+			int sy = y * height / size;
+			memcpy(&resampled[(size_t(y) * size + x) * 4], &pixels[(size_t(sy) * width + sx) * 4], 4);
+		}
+	}
+	pixels.swap(resampled);
+	width = height = size;
+}
+
+void TextureLoader::upload(Request *request)
+{
+	double start = getTimeMs();
+	if (m_pixelBuffer == 0)
+	{
+		m_pixelBuffer = createResource(RESOURCE_BUFFER, RESOURCE_STREAMING, "texture upload");
+	}
+
+	bool isCubeMap = request->images.size() == 6;
+	bool isCompressed = !request->compressed.empty();
+	size_t textureBytes = 0;
+	GLenum target = isCubeMap ? GL_TEXTURE_CUBE_MAP : GL_TEXTURE_2D;
+	GLuint texture = createResource(RESOURCE_TEXTURE, RESOURCE_TEXTURES, request->fileNames[0].c_str());
+	glBindTexture(target, texture);
+	glBindBuffer(GL_PIXEL_UNPACK_BUFFER, m_pixelBuffer);
+	if (isCompressed)
+	{
+		textureBytes = uploadCompressed(request, target);
+	}
+	else
+	{
+		for (size_t i = 0; i < request->images.size(); ++i)
+		{
+			Image &image = request->images[i];
+			if (isCubeMap)
+			{
+				makeSquare(request->images[0].width, image.width, image.height, image.pixels);
+			}
+			// Orphan the buffer so that we never wait for the previous transfer,
+			// then let the driver copy from it asynchronously.
+			GLsizeiptr size = GLsizeiptr(image.pixels.size());
+			glBufferData(GL_PIXEL_UNPACK_BUFFER, size, 0, GL_STREAM_DRAW);
+			setResourceStorage(RESOURCE_BUFFER, m_pixelBuffer, size_t(size));
+			void *mapped = glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, 0, size,
+											GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_BUFFER_BIT);
+			memcpy(mapped, &image.pixels[0], image.pixels.size());
+			glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+			GLenum face = isCubeMap ? GLenum(GL_TEXTURE_CUBE_MAP_POSITIVE_X + i) : GL_TEXTURE_2D;
+			glTexImage2D(face, 0, GL_RGBA, image.width, image.height, 0, GL_RGBA, GL_UNSIGNED_BYTE, 0);
+			// Uncompressed cube maps have no mip levels
+			size_t bytes = 4 * (isCubeMap ? size_t(image.width) * image.height
+				: mipChainPixels(image.width, image.height));
+			m_textureBytes += double(bytes);
+			m_uncompressedBytes += double(bytes);
+			textureBytes += bytes;
+		}
+	}
+	setResourceStorage(RESOURCE_TEXTURE, texture, textureBytes, isCompressed
+		? getCompressedInternalFormat(request->compressed[0].format) : GLenum(GL_RGBA8));
+	glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+
+	if (!isCubeMap && !isCompressed)
+	{
+		glGenerateMipmap(target);
+	}
+	bool isMipmapped = !isCubeMap || isCompressed;
+	glTexParameteri(target, GL_TEXTURE_MIN_FILTER, isMipmapped ? GL_LINEAR_MIPMAP_LINEAR : GL_LINEAR);
+	glTexParameteri(target, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+	if (isCubeMap)
+	{
+		glTexParameteri(target, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+		glTexParameteri(target, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+		glTexParameteri(target, GL_TEXTURE_WRAP_R, GL_CLAMP_TO_EDGE);
+	}
+	else
+	{
+		glTexParameteri(target, GL_TEXTURE_WRAP_S, GL_REPEAT);
+		glTexParameteri(target, GL_TEXTURE_WRAP_T, GL_REPEAT);
+	}
+	glBindTexture(target, 0);
+	CHECK_GL_ERROR();
+
+	for (size_t i = 0; i < request->targets.size(); ++i)
+	{
+		if (i > 0)
+		{
+			retainResource(RESOURCE_TEXTURE, texture);
+		}
+		*request->targets[i] = texture;
+	}
+	request->uploadTime = getTimeMs() - start;
+
+	const char *format = !isCompressed ? "RGBA"
+		: request->compressed[0].format == TEXTURE_BC1 ? "BC1 " : "BC3 ";
+	printf("  %-36s %4dx%-4d %s %s %s %8.2f ms, upload %6.2f ms\n",
+		request->fileNames[0].c_str(), request->images[0].width, request->images[0].height,
+		isCubeMap ? "cube" : "2D  ", format, isCompressed ? "read  " : "decode", request->decodeTime,
+		request->uploadTime);
+	// The pixels are no longer needed
+	request->images.clear();
+	request->compressed.clear();
+}
+
+/**
+ * Uploads all the levels of every face from one buffer, the blocks are
+ * already in the order GL takes them.
+ */
+size_t TextureLoader::uploadCompressed(Request *request, GLenum target)
+{
+	size_t textureBytes = 0;
+	for (size_t i = 0; i < request->compressed.size(); ++i)
+	{
+		const CompressedTexture &compressed = request->compressed[i];
+		GLsizeiptr size = GLsizeiptr(compressed.data.size());
+		glBufferData(GL_PIXEL_UNPACK_BUFFER, size, 0, GL_STREAM_DRAW);
+		setResourceStorage(RESOURCE_BUFFER, m_pixelBuffer, size_t(size));
+		void *mapped = glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, 0, size,
+										GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_BUFFER_BIT);
+		memcpy(mapped, &compressed.data[0], compressed.data.size());
+		glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+		GLenum face = target == GL_TEXTURE_CUBE_MAP ? GLenum(GL_TEXTURE_CUBE_MAP_POSITIVE_X + i) : target;
+		for (size_t level = 0; level < compressed.levels.size(); ++level)
+		{
+			const CompressedLevel &l = compressed.levels[level];
+			glCompressedTexImage2D(face, GLint(level), getCompressedInternalFormat(compressed.format),
+				l.width, l.height, 0, GLsizei(l.size), (const void *)l.offset);
+		}
+		textureBytes += compressed.data.size();
+		m_textureBytes += double(compressed.data.size());
+		m_uncompressedBytes += double(mipChainPixels(compressed.levels[0].width, compressed.levels[0].height) * 4);
+	}
+	glTexParameteri(target, GL_TEXTURE_MAX_LEVEL, GLint(request->compressed[0].levels.size() - 1));
+	++m_numCompressed;
+	return textureBytes;
+}
+
+/**
+ * Uploads the decoded requests and forgets them, later requests for the same
+ * files load them again.
+ */
+void TextureLoader::uploadDecoded(const vector<Request *> &decoded)
+{
+	for (size_t i = 0; i < decoded.size(); ++i)
+	{
+		Request *request = decoded[i];
+		upload(request);
+		m_decodeTotal += request->decodeTime;
+		m_uploadTotal += request->uploadTime;
+		--m_numPending;
+		map<string, Request *>::iterator it = m_requestByFile.find(request->fileNames[0]);
+		if (it != m_requestByFile.end() && it->second == request)
+		{
+			m_requestByFile.erase(it);
+		}
+		m_requests.erase(find(m_requests.begin(), m_requests.end(), request));
+		delete request;
+	}
+}
+
+bool TextureLoader::update()
+{
+	vector<Request *> decoded;
+	{
+		lock_guard<mutex> lock(m_mutex);
+		decoded.swap(m_decoded);
+	}
+	uploadDecoded(decoded);
+	return m_numPending == 0;
+}
+
+void TextureLoader::finish()
+{
+	while (m_numPending > 0)
+	{
+		vector<Request *> decoded;
+		{
+			unique_lock<mutex> lock(m_mutex);
+			while (m_decoded.empty())
+			{
+				m_decodedAvailable.wait(lock);
+			}
+			decoded.swap(m_decoded);
+		}
+		uploadDecoded(decoded);
+	}
+	printf("Loaded %d textures in %.2f ms using %d decode threads (decode %.2f ms, upload %.2f ms summed)\n",
+		m_numRequests, getTimeMs() - m_startTime, m_pool.getNumThreads(), m_decodeTotal, m_uploadTotal);
+	printf("Texture memory: %.2f MB, %d of %d textures block compressed (%.2f MB as RGBA8)\n",
+		m_textureBytes / (1024.0 * 1024.0), m_numCompressed, m_numRequests,
+		m_uncompressedBytes / (1024.0 * 1024.0));
+}
@@ -0,0 +1,141 @@
+#ifndef TEXTURE_LOADER_H
+#define TEXTURE_LOADER_H
+
+#include <GL/glew.h>
+#include <condition_variable>
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "TextureCompression.h"
+#include "ThreadPool.h"
+
+//*****************************************************************************
+//	TextureLoader
+//
+//	Decodes images on the worker threads of a ThreadPool while the main
+//	thread uploads whatever has finished decoding through a pixel buffer
+//	object. Textures are requested up front and finish() then blocks until
+//	all of them are resident, printing the decode and upload time of each.
+//	Loaders that stream textures in while frames are drawn call update()
+//	once per frame instead.
+//
+//	Where the texture converter has written an up to date <image>.dds (see
+//	TextureCompression.h) and the driver has S3TC, the blocks and their
+//	mip chain are read from it and uploaded as they are instead.
+//*****************************************************************************
+
+/**
+ * Reads an image file into file and decodes it (PPM, or anything DevIL
+ * reads) to RGBA8, first row at the top. Safe to call from any thread.
+ */
+bool loadImage(const std::string &fileName, std::vector<unsigned char> &file,
+			   int &width, int &height, std::vector<unsigned char> &pixels);
+
+/**
+ * Turns RGBA8 pixels upside down, GL wants 2D textures bottom row first.
+ */
+void flipRows(int width, int height, std::vector<unsigned char> &pixels);
+
+/**
+ * Makes a cube map face size x size (as GL requires) by nearest neighbour
+ * resampling, some of the face images are off by a pixel.
+ */
+void makeSquare(int size, int &width, int &height, std::vector<unsigned char> &pixels);
+
+class TextureLoader
+{
+public:
+	explicit TextureLoader(ThreadPool &pool);
+	~TextureLoader();
+
+	/**
+	 * Whether up to date DDS files are used, on unless the driver lacks
+	 * EXT_texture_compression_s3tc. Applies to later requests.
+	 */
+	void setUseCompressed(bool useCompressed);
+
+	/**
+	 * Requests a mipmapped, repeating 2D texture. The texture name is written
+	 * to *texture once it has been uploaded. Requests for a file that is
+	 * still waiting to be uploaded share the texture. Every request holds a
+	 * reference, to be dropped with deleteResource(RESOURCE_TEXTURE, ...).
+	 */
+	void loadTexture(const std::string &fileName, GLuint *texture);
+
+	/**
+	 * Requests a cube map from six faces given in the order +x, -x, +y, -y,
+	 * +z, -z (as for glutil's loadCubeMap).
+	 */
+	void loadCubeMap(const char *faces[6], GLuint *texture);
+
+	/**
+	 * Requests the cube map of a skybox model (see Skybox.h), read from the
+	 * DDS files --build-texture-cache renders it to, or rendered here when
+	 * those are missing or out of date.
+	 */
+	void loadSkybox(const std::string &objFileName, GLuint *texture);
+
+	/**
+	 * Uploads textures as they finish decoding, returns when all requested
+	 * textures are uploaded. Prints the texture memory against what the same
+	 * textures would take as RGBA8.
+	 */
+	void finish();
+
+	/**
+	 * Uploads whatever has finished decoding without waiting for the rest,
+	 * for loaders that keep taking requests while frames are drawn. Returns
+	 * true once nothing is pending.
+	 */
+	bool update();
+
+private:
+	struct Image
+	{
+		int width;
+		int height;
+		std::vector<unsigned char> pixels;	// RGBA8
+	};
+
+	struct Request
+	{
+		std::vector<std::string> fileNames;	// 1 for 2D textures, 6 for cube maps
+		std::vector<GLuint *> targets;
+		std::vector<Image> images;
+		std::vector<CompressedTexture> compressed;	// one per file, or empty
+		bool useCompressed;
+		std::string skybox;	// the model the faces are rendered from, empty otherwise
+		double decodeTime;
+		double uploadTime;
+	};
+
+	void submit(Request *request);
+	void decode(Request *request);
+	void decodeSkybox(Request *request);
+	void upload(Request *request);
+	size_t uploadCompressed(Request *request, GLenum target);
+	void uploadDecoded(const std::vector<Request *> &decoded);
+
+	ThreadPool &m_pool;
+	// Requests are heap allocated so workers can hold on to them while
+	// more are being added. Only those not yet uploaded are kept.
+	std::vector<Request *> m_requests;
+	std::map<std::string, Request *> m_requestByFile;
+	std::vector<Request *> m_decoded;
+	std::mutex m_mutex;
+	std::condition_variable m_decodedAvailable;
+	size_t m_numPending;
+	int m_numRequests;
+	double m_decodeTotal;			// ms, summed over the uploaded requests
+	double m_uploadTotal;
+	double m_startTime;
+	GLuint m_pixelBuffer;
+	bool m_useCompressed;
+	int m_numCompressed;
+	double m_textureBytes;			// as uploaded, with the mip levels
+	double m_uncompressedBytes;		// the same levels in RGBA8
+};
+
+#endif // TEXTURE_LOADER_H
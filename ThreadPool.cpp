@@ -0,0 +1,76 @@
+#include "ThreadPool.h"
+
+using namespace std;
+
+ThreadPool::ThreadPool(int numThreads)
+	: m_busy(0)
+	, m_stop(false)
+{
+	if (numThreads <= 0)
+	{
+		numThreads = max(1, int(thread::hardware_concurrency()));
+	}
+	for (int i = 0; i < numThreads; ++i)
+	{
+		m_threads.push_back(thread(&ThreadPool::workerLoop, this));
+	}
+}
+
+ThreadPool::~ThreadPool()
+{
+	{
+		lock_guard<mutex> lock(m_mutex);
+		m_stop = true;
+	}
+	m_taskAvailable.notify_all();
+	for (size_t i = 0; i < m_threads.size(); ++i)
+	{
+		m_threads[i].join();
+	}
+}
+
+void ThreadPool::submit(const function<void()> &task)
+{
+	{
+		lock_guard<mutex> lock(m_mutex);
+		m_tasks.push_back(task);
+	}
+	m_taskAvailable.notify_one();
+}
+
+void ThreadPool::wait()
+{
+	unique_lock<mutex> lock(m_mutex);
+	while (!m_tasks.empty() || m_busy > 0)
+	{
+		m_idle.wait(lock);
+	}
+}
+
+void ThreadPool::workerLoop()
+{
+	for (;;)
+	{
+		function<void()> task;
+		{
+			unique_lock<mutex> lock(m_mutex);
+			while (m_tasks.empty() && !m_stop)
+			{
+				m_taskAvailable.wait(lock);
+			}
+			if (m_tasks.empty())
+			{
+				return;
+			}
+			task = m_tasks.front();
+			m_tasks.pop_front();
+			++m_busy;
+		}
+		task();
+		{
+			lock_guard<mutex> lock(m_mutex);
+			--m_busy;
+		}
+		m_idle.notify_all();
+	}
+}
@@ -0,0 +1,45 @@
+#ifndef THREAD_POOL_H
+#define THREAD_POOL_H
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/**
+ * A fixed set of worker threads executing tasks from a shared FIFO queue.
+ * Tasks must not touch GL, the context only lives on the main thread.
+ */
+class ThreadPool
+{
+public:
+	/**
+	 * Creates numThreads workers, 0 means one per hardware thread.
+	 */
+	explicit ThreadPool(int numThreads = 0);
+	~ThreadPool();
+
+	void submit(const std::function<void()> &task);
+
+	/**
+	 * Blocks until the queue is empty and all workers are idle.
+	 */
+	void wait();
+
+	int getNumThreads() const { return int(m_threads.size()); }
+
+private:
+	void workerLoop();
+
+	std::vector<std::thread> m_threads;
+	std::deque<std::function<void()> > m_tasks;
+	std::mutex m_mutex;
+	std::condition_variable m_taskAvailable;
+	std::condition_variable m_idle;
+	int m_busy;
+	bool m_stop;
+};
+
+#endif // THREAD_POOL_H
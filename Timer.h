@@ -0,0 +1,16 @@
+#ifndef TIMER_H
+#define TIMER_H
+
+#include <chrono>
+
+/**
+ * Returns a monotonic wall clock time in milliseconds, with sub-millisecond
+ * resolution (unlike GLUT_ELAPSED_TIME). Only differences are meaningful.
+ */
+inline double getTimeMs()
+{
+	using namespace std::chrono;
+	return duration<double, std::milli>(steady_clock::now().time_since_epoch()).count();
+}
+
+#endif // TIMER_H
@@ -5,18 +5,44 @@
 
 #include <GL/glew.h>
 #include <GL/freeglut.h>
+#if defined(USE_OSMESA)
+#include <GL/osmesa.h>
+#endif // USE_OSMESA
 
 #include <IL/il.h>
 #include <IL/ilut.h>
 
 #include <stdlib.h>
+#include <string.h>
 #include <algorithm>
 
-#include <OBJModel.h>
 #include <glutil.h>
 #include <float4x4.h>
 #include <float3x3.h>
 
+#include "Benchmark.h"
+#include "BatchMath.h"
+#include "Culling.h"
+#include "DynamicResolution.h"
+#include "FrameCapture.h"
+#include "FramePacer.h"
+#include "GpuResources.h"
+#include "JobSystem.h"
+#include "Mesh.h"
+#include "OcclusionCulling.h"
+#include "Profiler.h"
+#include "RenderGraph.h"
+#include "RenderQueue.h"
+#include "SampleCounter.h"
+#include "SceneStreamer.h"
+#include "ShaderCache.h"
+#include "ShaderUniforms.h"
+#include "ShadowMap.h"
+#include "TextureCompression.h"
+#include "TextureLoader.h"
+#include "ThreadPool.h"
+#include "Timer.h"
+
 using namespace std;
 using namespace chag;
 
@@ -25,19 +51,41 @@ using namespace chag;
 //*****************************************************************************
 bool paused = false;				// Tells us wether sun animation is paused
 float currentTime = 0.0f;		// Tells us the current time
-GLuint shaderProgram, postFxShader, horizontalBlurShader,
-		verticalBlurShader, cutoffShader;
+ShaderPermutations sceneShaders;	// shader.frag, picked per draw (see ShaderCache.h)
+ShaderProgram postFxShader, bloomDownsampleShader,
+		bloomUpsampleShader, mosaicShader, mushroomsShader, sepiaShader, skyShader;
 const float3 up = {0.0f, 1.0f, 0.0f};
+int windowWidth = 800;			// Size of the window, or of the offscreen
+int windowHeight = 512;			// output in benchmark mode
+GLuint outputFramebuffer = 0;	// Target of the final post processing pass
 GLuint cubeMapTexture;
 GLuint cubeMap2;
+GLuint skyDayCubeMapTexture;	// blended by the time of day in sky.frag
+GLuint skyNightCubeMapTexture;
+GpuResource skyVertexArray;		// one triangle covering the screen
+GpuResource skyPositionBuffer;
+GpuResource skyIndexBuffer;
+const char *cubeMapFaces[6] = { "cube0.png", "cube1.png",
+								"cube2.png", "cube3.png",
+								"cube4.png", "cube5.png" };
+// The sky cube maps are rendered from these when loaded
+const char *skyboxDayFile = "../scenes/skybox.obj";
+const char *skyboxNightFile = "../scenes/skyboxnight.obj";
+// Textures come from the DDS files of --build-texture-cache when those are
+// up to date, see TextureCompression.h. Off with --no-compressed-textures.
+bool compressedTexturesEnabled = true;
 //*****************************************************************************
-//	OBJ Model declarations
+//	The scene, read from sceneFile and paged in around the camera (see
+//	SceneStreamer.h). The models are loaded through the binary mesh cache,
+//	see Mesh.h.
 //*****************************************************************************
-OBJModel *world; 
-OBJModel *water; 
-OBJModel *skybox; 
-OBJModel *skyboxnight; 
-OBJModel *car; 
+string sceneFile = "island.scene";		// --scene FILE
+SceneDescription sceneDescription;
+bool sceneDescriptionLoaded = false;
+SceneStreamer *sceneStreamer;
+int streamingBudgetMB = 512;			// --streaming-budget MB
+float streamingDistance = 500.0f;		// --streaming-distance D, to the chunk bounds
+bool forceMeshConversion = false;	// Set by --rebuild-mesh-cache
 
 //*****************************************************************************
 //	Camera state variables (updated in motion())
@@ -47,11 +95,6 @@ float camera_phi = M_PI / 4.0f;
 float camera_r = 30.0; 
 float camera_target_altitude = 5.2; 
 
-//*****************************************************************************
-//	Light state variables (updated in idle())
-//*****************************************************************************
-float3 lightPosition;
-
 //*****************************************************************************
 //	Mouse input state variables
 //*****************************************************************************
@@ -62,31 +105,234 @@ int prev_x = 0;
 int prev_y = 0;
 
 //*****************************************************************************
-//	Shadow map
+//	Shadow map, fitted to the view each frame (see ShadowMap.h). The
+//	cascades are laid out side by side in one texture. When neither the
+//	cascades nor the casters have changed since the last frame, e.g. while
+//	paused, the map is reused rather than drawn again.
 //*****************************************************************************
-GLuint shadowShaderProgram;
-GLuint shadowMapTexture;
-GLuint shadowMapFBO;
-const int shadowMapResolution = 1024;
+ShaderProgram shadowShaderProgram;
+GpuResource shadowMapTexture;
+GpuResource shadowMapFBO;
+int shadowMapResolution = 1024;		// --shadow-resolution N, per cascade
+int numShadowCascades = 1;			// --shadow-cascades N
+bool shadowsEnabled = true;			// --no-shadows, toggled with 's'
+bool shadowCachingEnabled = true;	// --no-shadow-cache
+const float shadowSplitBlend = 0.75f;
 
-struct FBOInfo
+/**
+* What the contents of the shadow map depend on.
+*/
+struct ShadowMapKey
 {
-	GLuint id;
-	GLuint colorTextureTarget;
-	GLuint depthBuffer;
+	float4x4 viewProjectionMatrices[MAX_SHADOW_CASCADES];
+	int numCascades;
+	float casterTime;	// the time the moving casters were placed at
+	int sceneVersion;	// of the resident chunks, see SceneStreamer::getVersion()
+	int generation;		// see invalidateShadowMap()
+};
+// Of the last frame prepared, frames are prepared in the order they are drawn.
+// Only the frame preparation touches these.
+ShadowMapKey preparedShadowMapKey;
+bool preparedShadowMapValid = false;
+// Bumped on the main thread by invalidateShadowMap(), the frames carry it
+// into their key
+int shadowMapGeneration = 0;
+
+//*****************************************************************************
+//	Post processing, the passes and their targets are declared to the render
+//	graph each frame (see RenderGraph.h)
+//*****************************************************************************
+RenderGraph *renderGraph;
+
+// The bloom pyramid, level 0 is half the window size and each following
+// level half the size of the previous one.
+const int numBloomLevels = 5;
+
+bool bloomEnabled = true;		// Toggled with 'b'
+bool mosaicEnabled = false;		// Toggled with '1'
+bool mushroomsEnabled = false;	// Toggled with '2'
+bool sepiaEnabled = false;		// Toggled with '3'
+
+// Dynamic resolution, the scene is rendered at a scale that keeps the GPU
+// frame time within the budget and is upscaled in the postFx pass.
+DynamicResolution *dynamicResolution;
+bool dynamicResolutionEnabled = false;	// --dynamic-resolution FPS, toggled with 'r'
+float targetFrameRate = 60.0f;
+
+//*****************************************************************************
+//	Frame pacing (see FramePacer.h). The animation advances in fixed steps,
+//	and frames are scheduled with GLUT timers rather than drawn from the idle
+//	callback, so GLUT sleeps in between. With render on demand, frames are
+//	only drawn when the camera, the time or a setting has changed, and a
+//	static view costs no CPU or GPU time at all.
+//*****************************************************************************
+SimulationClock simulationClock;	// --sim-rate N steps per second
+FramePacer framePacer;				// --max-fps N
+bool renderOnDemand = false;		// --on-demand, toggled with 'd'
+int framesToDraw = 0;				// requested by input, see requestRedraw()
+bool frameScheduled = false;
+
+//*****************************************************************************
+//	Depth pre-pass. The opaque draws of the scene are first drawn with the
+//	cheap shadow program to fill the depth buffer only, after which the
+//	colour pass (GL_EQUAL, no depth writes) shades each pixel once. The
+//	fragments shaded by the colour pass are counted to measure overdraw.
+//*****************************************************************************
+bool depthPrepassEnabled = false;	// --depth-prepass, toggled with 'z'
+SampleCounter *sceneSampleCounter;
+
+//*****************************************************************************
+//	Mesh levels of detail (see Mesh.h). Each chunk is drawn at the coarsest
+//	level whose error covers at most lodPixelError pixels on screen; the
+//	shadow map measures the error in its texels and tolerates more of it.
+//*****************************************************************************
+bool meshLodEnabled = true;			// --no-lod, toggled with 'l'
+float lodPixelError = 1.0f;			// --lod-error PIXELS
+const float shadowLodErrorScale = 4.0f;
+
+//*****************************************************************************
+//	Frustum culling (see Culling.h)
+//*****************************************************************************
+bool frustumCullingEnabled = true;	// Toggled with 'c'
+
+/**
+* A pass that draws are queued for: the view-projection matrix they are culled
+* against, the statistics they are counted in, the program they use and the
+* queue they go to.
+*/
+struct CullingView
+{
+	float4x4 viewProjectionMatrix;
+	CullingStats *stats;
+	const OcclusionBuffer *occlusion;	// rasterized for this view, or 0
+	int pass;							// QUEUE_PASS_*
+	const ShaderProgram *program;
+	RenderQueue *queue;
+	bool cull;
+	const MeshLodSelection *lod;		// in world space, 0 for full detail
+	const ShaderPermutations *permutations;	// instead of program, if set
+	int shaderFeatures;					// of all draws, see RenderObject
+};
+
+//*****************************************************************************
+//	Stress scene (--cars N), N instances of the car driving around the island
+//	in one instanced draw per chunk of the car
+//*****************************************************************************
+int numStressCars = 0;
+MeshInstances *stressCars;
+Mesh *stressCarMesh;			// the scene's "car", loaded for good rather than streamed
+
+// The highest point of the island in each cell of a grid over its bounds,
+// the cars follow it
+const int terrainGridSize = 64;
+vector<float> terrainHeights;
+AABB terrainBounds;
+
+//*****************************************************************************
+//	Frame preparation (see JobSystem.h). The scene is animated and culled and
+//	its draws are queued (see RenderQueue.h) on the worker threads. With
+//	pipelining, frame N + 1 is prepared while the main thread submits frame
+//	N to GL; each frame has its own FrameState so the two never share data.
+//*****************************************************************************
+enum
+{
+	QUEUE_PASS_SHADOW_MAP,		// one per cascade
+	QUEUE_PASS_SCENE = QUEUE_PASS_SHADOW_MAP + MAX_SHADOW_CASCADES,
+	NUM_QUEUE_PASSES,
+	// Copied from the scene pass into the same queue
+	QUEUE_PASS_DEPTH_PREPASS = NUM_QUEUE_PASSES
+};
+
+struct FrameState
+{
+	// Inputs, copied from the globals on the main thread when the
+	// preparation is started
+	float time;
+	float cameraTheta;
+	float cameraPhi;
+	float cameraR;
+	float cameraTargetAltitude;
 	int width;
 	int height;
+	bool frustumCulling;
+	bool occlusionCulling;
+	int numShadowCascades;
+	bool shadows;
+	bool depthPrepass;
+	bool meshLod;
+	vector<SceneInstance> sceneObjects;	// those resident, see SceneStreamer
+	int sceneVersion;
+	int shadowMapGeneration;
+
+	// Prepared on the worker threads
+	ShadowCascade shadowCascades[MAX_SHADOW_CASCADES];
+	bool shadowMapCached;				// drawn for an earlier frame, nothing queued
+	PerFrameUniforms perFrame;
+	float3 cameraPosition;
+	MatrixArray carMatrices;
+	BoxArray carBoxes;
+	AABB carBounds;
+	RenderQueue queues[NUM_QUEUE_PASSES];
+	CullingStats cullingStats[NUM_QUEUE_PASSES];
+	double prepareTime;					// ms
+
+	JobSystem::Counter preparing;		// non-zero until prepared
 };
 
-FBOInfo postProcessFBO;
-FBOInfo horizontalBlurFBO;
-FBOInfo verticalBlurFBO;
-FBOInfo cutoffFBO;
+JobSystem *jobSystem;
+int numJobWorkers = -1;				// --threads N, workers besides the main thread
+bool framePipeliningEnabled = true;	// --no-pipelining
+FrameState frameStates[2];
+int nextFrameState = 0;				// the one the next runFrame() submits
+bool pipelineStarted = false;
+const FrameState *displayedFrame;	// the last one submitted
+bool jobScalingBenchmark = false;	// --job-scaling
+
+//*****************************************************************************
+//	Occlusion culling (see OcclusionCulling.h), the chunks hidden behind the
+//	island are skipped in both the shadow map and the scene
+//*****************************************************************************
+bool occlusionCullingEnabled = true;	// --no-occlusion, toggled with 'o'
+OcclusionBuffer *occlusionBuffers[NUM_QUEUE_PASSES];
+OccluderMesh islandOccluder;			// the scene's "island", simplified
+const int occlusionBufferWidth = 256;
+const int occlusionBufferHeight = 128;
+
+//*****************************************************************************
+//	Benchmark mode (--benchmark N), see Benchmark.h
+//*****************************************************************************
+bool benchmarkMode = false;
+BenchmarkSettings benchmarkSettings;
+FBOInfo benchmarkOutputFBO;
+string benchmarkTraceFile;		// --trace, export the benchmark run as a trace
+
+//*****************************************************************************
+//	Frame capture (--capture N, or 'v' to start and stop), see FrameCapture.h
+//*****************************************************************************
+bool captureMode = false;
+string capturePrefix = "frame_";	// --capture-prefix
+FrameCapture::Format captureFormat = FrameCapture::FORMAT_PNG;	// --capture-raw
+ThreadPool *captureWriters = 0;
+FrameCapture *frameCapture = 0;		// while recording
+int numCaptureTakes = 0;
+
+//*****************************************************************************
+//	Profiling (see Profiler.h)
+//*****************************************************************************
+bool showProfilerOverlay = false;	// Toggled with 'p'
 
 void createShadowMap(int width, int height);
 void drawFullScreenQuad();
-FBOInfo createPostProcessFBO(int width, int height);
-void renderBlur();
+RenderTargetHandle addBloomPasses(RenderTargetHandle scene, float scale);
+bool loadIslandOccluder();
+void initStressCars(TextureLoader &textureLoader);
+void createSkyTriangle();
+void createJobSystem(int numWorkers);
+void measureBenchmarkFrames(double &cpuTime, double &gpuTime, double triangles[2]);
+void startCapture(const string &prefix);
+void stopCapture();
+void finishPreparingFrames();
+void shutdownGL();
 
 // Helper function to turn spherical coordinates into cartesian (x,y,z)
 float3 sphericalToCartesian(float theta, float phi, float r)
@@ -96,6 +342,137 @@ float3 sphericalToCartesian(float theta, float phi, float r)
 						r * cosf(theta)*sinf(phi) );
 }
 
+/**
+* The scene read from sceneFile on first use. Without the file it is the
+* island, its water and the car, all in one chunk.
+*/
+const SceneDescription &getSceneDescription()
+{
+	if (!sceneDescriptionLoaded && !loadSceneDescription(sceneFile, sceneDescription))
+	{
+		printf("Using the built-in island scene\n");
+		SceneObject objects[] = {
+			{ "island", "../scenes/island2.obj", make_vector(0.0f, 0.0f, 0.0f), 0.0f, true, 200.0f },
+			{ "water", "../scenes/water.obj", make_vector(0.0f, -6.0f, 0.0f), 0.0f, false, 400.0f },
+			{ "car", "../scenes/car.obj", make_vector(0.0f, 0.0f, 0.0f), 0.5f, true, 5.0f },
+		};
+		sceneDescription.chunkSize = 256.0f;
+		sceneDescription.objects.assign(objects, objects + 3);
+	}
+	sceneDescriptionLoaded = true;
+	return sceneDescription;
+}
+
+/**
+* Every model file the scene uses, once each.
+*/
+vector<string> getSceneModelFiles()
+{
+	const SceneDescription &scene = getSceneDescription();
+	vector<string> files;
+	for (size_t i = 0; i < scene.objects.size(); ++i)
+	{
+		if (find(files.begin(), files.end(), scene.objects[i].modelFile) == files.end())
+		{
+			files.push_back(scene.objects[i].modelFile);
+		}
+	}
+	return files;
+}
+
+/**
+* The positions and indices of the scene object named "island", in world
+* space, for the occluder and the terrain of the stress scene.
+*/
+bool loadIslandGeometry(vector<float3> &positions, vector<unsigned int> &indices)
+{
+	const SceneObject *island = findSceneObject(getSceneDescription(), "island");
+	if (!island || !loadMeshGeometry(island->modelFile, positions, indices))
+	{
+		return false;
+	}
+	for (size_t i = 0; i < positions.size(); ++i)
+	{
+		positions[i] = positions[i] + island->position;
+	}
+	return true;
+}
+
+
+/**
+* Loads a model through its mesh cache and reports the time spent, for both
+* the cold (text conversion) and the cached path when the cache was rebuilt,
+* and the size of its buffers.
+*/
+Mesh *loadMesh(const char *fileName, TextureLoader &textureLoader)
+{
+	Mesh *mesh = new Mesh();
+	mesh->load(fileName, forceMeshConversion);
+	mesh->requestTextures(textureLoader);
+	const MeshLoadStats &stats = mesh->getLoadStats();
+	if (stats.usedCache)
+	{
+		printf("%-28s cached load %8.2f ms\n", fileName, stats.cachedLoadTime);
+	}
+	else
+	{
+		printf("%-28s cold convert %8.2f ms, cached load %8.2f ms\n", fileName,
+			stats.convertTime, stats.cachedLoadTime);
+	}
+
+	size_t unpackedSize = mesh->getNumVertices() * (2 * sizeof(float3) + sizeof(float2));
+	printf("%-28s %8d vertices, %8.1f kB (%.1f kB unpacked), indices %8.1f kB, ACMR %.2f\n", "",
+		int(mesh->getNumVertices()), mesh->getVertexBufferSize() / 1024.0f, unpackedSize / 1024.0f,
+		mesh->getIndexBufferSize() / 1024.0f, stats.vertexCacheMissRatio);
+	return mesh;
+}
+
+/**
+* Converts every texture the scene loads (the diffuse maps of the models'
+* materials and the cube map faces) to compressed DDS files next to them.
+*/
+bool buildTextureCache()
+{
+	vector<TextureSource> sources;
+	vector<string> modelFiles = getSceneModelFiles();
+	for (size_t i = 0; i < modelFiles.size(); ++i)
+	{
+		MeshData data;
+		if (!parseOBJ(modelFiles[i], data))
+		{
+			printf("Warning: could not read %s\n", modelFiles[i].c_str());
+			continue;
+		}
+		// Diffuse maps are relative to the model
+		const string &fileName = modelFiles[i];
+		string basePath = fileName.substr(0, fileName.find_last_of("/\\") + 1);
+		for (size_t j = 0; j < data.materials.size(); ++j)
+		{
+			TextureSource source = { basePath + data.materials[j].diffuseMap, false };
+			bool isNew = true;
+			for (size_t k = 0; k < sources.size(); ++k)
+			{
+				isNew = isNew && sources[k].fileName != source.fileName;
+			}
+			if (!data.materials[j].diffuseMap.empty() && isNew)
+			{
+				sources.push_back(source);
+			}
+		}
+	}
+	for (int i = 0; i < 6; ++i)
+	{
+		TextureSource cubeFace = { cubeMapFaces[i], true };
+		sources.push_back(cubeFace);
+	}
+	vector<string> skyboxFiles;
+	skyboxFiles.push_back(skyboxDayFile);
+	skyboxFiles.push_back(skyboxNightFile);
+	ThreadPool converterThreads;
+	bool texturesOk = convertTextures(sources, converterThreads);
+	bool skyboxesOk = convertSkyboxes(skyboxFiles, converterThreads);
+	return texturesOk && skyboxesOk;
+}
 
 void initGL()
 {
@@ -113,153 +490,420 @@ void initGL()
 	{
 		glBindFragDataLocation = glBindFragDataLocationEXT;
 	}
+	// Instancing is only core in later versions than the context we ask for
+	if (!glVertexAttribDivisor)
+	{
+		glVertexAttribDivisor = glVertexAttribDivisorARB;
+	}
+	if (!glDrawElementsInstanced)
+	{
+		glDrawElementsInstanced = glDrawElementsInstancedARB;
+	}
 
 	//*************************************************************************
 	//	Load shaders
 	//*************************************************************************
-	shaderProgram = loadShaderProgram("shaders/shader.vert", "shaders/shader.frag");
-	glBindAttribLocation(shaderProgram, 0, "position"); 	
-	glBindAttribLocation(shaderProgram, 2, "texCoordIn");
-	glBindAttribLocation(shaderProgram, 1, "normalIn");
-	glBindFragDataLocation(shaderProgram, 0, "fragmentColor");
-	linkShaderProgram(shaderProgram);
-
-	shadowShaderProgram = loadShaderProgram("shaders/shadow.vert", "shaders/shadow.frag");
-	glBindAttribLocation(shadowShaderProgram, 0, "position"); 	
-	glBindFragDataLocation(shadowShaderProgram, 0, "fragmentColor");
-	linkShaderProgram(shadowShaderProgram);
+	// All programs bind the same attribute and output locations. Linked
+	// programs are kept in a program binary cache, so unless the sources or
+	// the driver changed nothing is compiled here.
+	ShaderCache shaderCache("shaders/programs.cache");
+	shaderCache.bindAttribute("position", 0);
+	shaderCache.bindAttribute("normalIn", 1);
+	shaderCache.bindAttribute("texCoordIn", 2);
+	shaderCache.bindAttribute("instanceMatrix", INSTANCE_MATRIX_ATTRIBUTE);
+	shaderCache.bindFragData("fragmentColor", 0);
+
+	// Every combination of the features of shader.frag, the render queue
+	// picks one per draw by the material and the object
+	shaderCache.loadPermutations("shaders/shader.vert", "shaders/shader.frag", sceneShaders);
+	for (int i = 0; i < NUM_SHADER_PERMUTATIONS; ++i)
+	{
+		bindSamplerUnit(sceneShaders.programs[i], "diffuse_texture", 0);
+		bindSamplerUnit(sceneShaders.programs[i], "shadowMap", 1);
+		bindSamplerUnit(sceneShaders.programs[i], "cubeMap", 2);
+	}
+
+	shadowShaderProgram = shaderCache.load("shaders/shadow.vert", "shaders/shadow.frag");
+
+	skyShader = shaderCache.load("shaders/sky.vert", "shaders/sky.frag");
+	bindSamplerUnit(skyShader, "skyDayCubeMap", 3);
+	bindSamplerUnit(skyShader, "skyNightCubeMap", 4);
+
+	// Non-instanced draws leave the instanceMatrix attribute disabled, it
+	// then reads this constant identity matrix
+	for (GLuint i = 0; i < 4; ++i)
+	{
+		glVertexAttrib4f(INSTANCE_MATRIX_ATTRIBUTE + i, i == 0 ? 1.0f : 0.0f, i == 1 ? 1.0f : 0.0f,
+			i == 2 ? 1.0f : 0.0f, i == 3 ? 1.0f : 0.0f);
+	}
 
 	// load and set up post processing shader
- 	postFxShader = loadShaderProgram("shaders/postFx.vert", "shaders/postFx.frag");
-	glBindAttribLocation(postFxShader, 0, "position");	
-	glBindFragDataLocation(postFxShader, 0, "fragmentColor");
-	linkShaderProgram(postFxShader);
+	postFxShader = shaderCache.load("shaders/postFx.vert", "shaders/postFx.frag");
+	bindSamplerUnit(postFxShader, "frameBufferTexture", 0);
+	bindSamplerUnit(postFxShader, "blurredFrameBufferTexture", 1);
 	CHECK_GL_ERROR();
 
-	// load and set up horizontal blur shader
- 	horizontalBlurShader = loadShaderProgram("shaders/postFx.vert", "shaders/horizontal_blur.frag");
-	glBindAttribLocation(horizontalBlurShader, 0, "position");
-	glBindFragDataLocation(horizontalBlurShader, 0, "fragmentColor");
-	linkShaderProgram(horizontalBlurShader);
+	// load and set up the bloom downsample shader, which also does the bright pass
+	bloomDownsampleShader = shaderCache.load("shaders/postFx.vert", "shaders/bloom_downsample.frag");
+	bindSamplerUnit(bloomDownsampleShader, "frameBufferTexture", 0);
 	CHECK_GL_ERROR();
 
-	// load and set up vertical blur shader
- 	verticalBlurShader = loadShaderProgram("shaders/postFx.vert", "shaders/vertical_blur.frag");	
-	glBindAttribLocation(verticalBlurShader, 0, "position");
-	glBindFragDataLocation(verticalBlurShader, 0, "fragmentColor");
-	linkShaderProgram(verticalBlurShader);
+	// load and set up the bloom upsample shader
+	bloomUpsampleShader = shaderCache.load("shaders/postFx.vert", "shaders/bloom_upsample.frag");
+	bindSamplerUnit(bloomUpsampleShader, "frameBufferTexture", 0);
 	CHECK_GL_ERROR();
 
-	// load and set up cutoff shader
- 	cutoffShader = loadShaderProgram("shaders/postFx.vert", "shaders/cutoff.frag");	
-	glBindAttribLocation(cutoffShader, 0, "position");
-	glBindFragDataLocation(cutoffShader, 0, "fragmentColor");
-	linkShaderProgram(cutoffShader);
+	// load and set up the optional post processing effects, one pass each
+	const char *effectShaders[] = { "shaders/mosaic.frag", "shaders/mushrooms.frag", "shaders/sepia.frag" };
+	ShaderProgram *effectPrograms[] = { &mosaicShader, &mushroomsShader, &sepiaShader };
+	for (int i = 0; i < 3; ++i)
+	{
+		*effectPrograms[i] = shaderCache.load("shaders/postFx.vert", effectShaders[i]);
+		bindSamplerUnit(*effectPrograms[i], "frameBufferTexture", 0);
+	}
+	shaderCache.save();
 	CHECK_GL_ERROR();
 
+	// The view, projection and light data shared by all draws in a frame
+	createPerFrameUniformBuffer();
+
 	glEnable(GL_DEPTH_TEST);	// enable Z-buffering 
 	glEnable(GL_CULL_FACE);		// enable backface culling
 
 	// Create the shadow map
-	createShadowMap(shadowMapResolution, shadowMapResolution);
+	// The cascades side by side have to fit in one texture
+	GLint maxTextureSize = 0;
+	glGetIntegerv(GL_MAX_TEXTURE_SIZE, &maxTextureSize);
+	shadowMapResolution = min(shadowMapResolution, int(maxTextureSize) / numShadowCascades);
+	createShadowMap(shadowMapResolution * numShadowCascades, shadowMapResolution);
 	
+	// Textures are decoded on worker threads while the models load, and
+	// uploaded when textureLoader.finish() is called below.
+	ThreadPool loaderThreads;
+	TextureLoader textureLoader(loaderThreads);
+	textureLoader.setUseCompressed(compressedTexturesEnabled);
+
 	// Create the cube map
-	cubeMapTexture = loadCubeMap("cube0.png", "cube1.png",
-								"cube2.png", "cube3.png",
-								"cube4.png", "cube5.png");
+	textureLoader.loadCubeMap(cubeMapFaces, &cubeMapTexture);
+	textureLoader.loadSkybox(skyboxDayFile, &skyDayCubeMapTexture);
+	textureLoader.loadSkybox(skyboxNightFile, &skyNightCubeMapTexture);
+	createSkyTriangle();
+
+	// The post processing targets are created on first use
+	renderGraph = new RenderGraph();
+	sceneSampleCounter = new SampleCounter();
+	dynamicResolution = new DynamicResolution(1000.0f / targetFrameRate);
 
-	setUniformSlow(shaderProgram, "cubeMap", 2);
+	//*************************************************************************
+	// Start streaming in the scene, the chunks around the camera are read on
+	// worker threads while the rest is set up. Nothing is unloaded yet.
+	//*************************************************************************
+	float3 cameraPosition = sphericalToCartesian(camera_theta, camera_phi, camera_r);
+	sceneStreamer = new SceneStreamer(getSceneDescription(), size_t(streamingBudgetMB) * 1024 * 1024,
+		streamingDistance, forceMeshConversion, compressedTexturesEnabled);
+	sceneStreamer->update(cameraPosition, finishPreparingFrames);
+
+	if (numStressCars > 0)
+	{
+		initStressCars(textureLoader);
+	}
+
+	createJobSystem(numJobWorkers);
+	if (!loadIslandOccluder())
+	{
+		occlusionCullingEnabled = false;
+	}
+
+	textureLoader.finish();
+	// The first frame only waits for the nearby chunks, the rest stream in
+	// while frames are drawn
+	sceneStreamer->finishLoading(cameraPosition, finishPreparingFrames);
 	glActiveTexture(GL_TEXTURE2);
 	glBindTexture(GL_TEXTURE_CUBE_MAP, cubeMapTexture);
+	glActiveTexture(GL_TEXTURE3);
+	glBindTexture(GL_TEXTURE_CUBE_MAP, skyDayCubeMapTexture);
+	glActiveTexture(GL_TEXTURE4);
+	glBindTexture(GL_TEXTURE_CUBE_MAP, skyNightCubeMapTexture);
+	glActiveTexture(GL_TEXTURE0);
+	// Filter across the cube faces, so the edges of the sky do not show
+	if (GLEW_ARB_seamless_cube_map)
+	{
+		glEnable(GL_TEXTURE_CUBE_MAP_SEAMLESS);
+	}
+	CHECK_GL_ERROR();
+	printResourceUsage();
 
-	int w = glutGet((GLenum)GLUT_WINDOW_WIDTH);
-	int h = glutGet((GLenum)GLUT_WINDOW_HEIGHT);
+	profilerInit();
+}
 
-	// Post processing
-	postProcessFBO = createPostProcessFBO(w, h);
+/**
+* Releases what initGL() and the frames created, then reports the GPU objects
+* that are still alive. Call with the context current, before exiting.
+*/
+void shutdownGL()
+{
+	finishPreparingFrames();
+	if (frameCapture)
+	{
+		stopCapture();
+	}
+	delete captureWriters;
+	captureWriters = 0;
+	for (int i = 0; i < NUM_QUEUE_PASSES; ++i)
+	{
+		delete occlusionBuffers[i];
+		occlusionBuffers[i] = 0;
+	}
+	delete jobSystem;
+	jobSystem = 0;
+
+	delete stressCars;
+	stressCars = 0;
+	delete stressCarMesh;
+	stressCarMesh = 0;
+	delete sceneStreamer;
+	sceneStreamer = 0;
+	deleteResource(RESOURCE_TEXTURE, cubeMapTexture);
+	deleteResource(RESOURCE_TEXTURE, skyDayCubeMapTexture);
+	deleteResource(RESOURCE_TEXTURE, skyNightCubeMapTexture);
+	skyVertexArray.reset();
+	skyPositionBuffer.reset();
+	skyIndexBuffer.reset();
+	shadowMapTexture.reset();
+	shadowMapFBO.reset();
+	deletePostProcessFBO(benchmarkOutputFBO);
+	outputFramebuffer = 0;
+	delete renderGraph;
+	renderGraph = 0;
+	delete sceneSampleCounter;
+	sceneSampleCounter = 0;
+	delete dynamicResolution;
+	dynamicResolution = 0;
+	deletePerFrameUniformBuffer();
+	reportLeakedResources();
+}
 
-	// Cutoff
-	cutoffFBO = createPostProcessFBO(w, h);
+void drawModel(const Mesh *model, const float4x4 &modelMatrix, const CullingView &view,
+			   RenderLayer layer = RENDER_LAYER_OPAQUE, float alpha = 1.0f, float reflectiveness = 0.0f)
+{
+	// The shaders see the compressed positions, culling the model space ones
+	RenderObject object = { view.program, view.pass, layer, modelMatrix * model->getDecodeMatrix(),
+		alpha, reflectiveness, view.permutations, view.shaderFeatures | (reflectiveness > 0.0f ? SHADER_REFLECTIVE : 0) };
+	int index = view.queue->addObject(object);
+	float4x4 modelViewProjection = view.viewProjectionMatrix * modelMatrix;
+	// The chunk bounds are in model space (the model matrices do not scale)
+	MeshLodSelection lod;
+	if (view.lod)
+	{
+		lod = *view.lod;
+		lod.viewPosition = transformPoint(inverse(modelMatrix), view.lod->viewPosition);
+	}
+	if (view.cull)
+	{
+		model->render(*view.queue, index, modelViewProjection, *view.stats, view.occlusion, view.lod ? &lod : 0);
+	}
+	else
+	{
+		view.stats->numVisibleTriangles += model->render(*view.queue, index, modelViewProjection,
+			view.lod ? &lod : 0);
+		view.stats->numChunks += model->getNumChunks();
+		view.stats->numVisibleChunks += model->getNumChunks();
+		view.stats->numTriangles += model->getNumTriangles();
+	}
+}
 
-	// Blur
-	horizontalBlurFBO = createPostProcessFBO(w, h);
-	verticalBlurFBO = createPostProcessFBO(w, h);
+/**
+* In this function, add all scene elements that should cast shadow, that way
+* they are declared once for both the shadow map and the scene.
+*/
+void drawShadowCasters(const FrameState &frame, const CullingView &view)
+{
+	for (size_t i = 0; i < frame.sceneObjects.size(); ++i)
+	{
+		const SceneInstance &object = frame.sceneObjects[i];
+		if (object.castsShadows)
+		{
+			drawModel(object.mesh, object.modelMatrix, view, RENDER_LAYER_OPAQUE, 1.0f, object.reflectiveness);
+		}
+	}
+	if (stressCars)
+	{
+		RenderObject object = { view.program, view.pass, RENDER_LAYER_OPAQUE, make_identity<float4x4>(), 1.0f, 0.5f,
+			view.permutations, view.shaderFeatures | SHADER_REFLECTIVE };
+		int index = view.queue->addObject(object);
+		stressCars->render(*view.queue, index, view.viewProjectionMatrix, frame.carBounds,
+			int(frame.carMatrices.size()), *view.stats, view.cull, view.lod);
+	}
+}
 
-	glBindFramebuffer(GL_FRAMEBUFFER, 0);
-	CHECK_GL_ERROR();
+/**
+* Simplifies the island into the occluder used for occlusion culling. The
+* result is lowered by a cell so that it stays behind the real surface and
+* does not hide the island's own chunks.
+*/
+bool loadIslandOccluder()
+{
+	OccluderMesh island;
+	if (!loadIslandGeometry(island.positions, island.indices))
+	{
+		return false;
+	}
+	AABB bounds = makeEmptyAABB();
+	for (size_t i = 0; i < island.positions.size(); ++i)
+	{
+		growAABB(bounds, island.positions[i]);
+	}
+	float cellSize = max(bounds.max.x - bounds.min.x, bounds.max.z - bounds.min.z) / 64.0f;
+	simplifyOccluder(island, cellSize, islandOccluder);
+	for (size_t i = 0; i < islandOccluder.positions.size(); ++i)
+	{
+		islandOccluder.positions[i].y -= cellSize;
+	}
+	printf("Island occluder: %d triangles (from %d)\n", int(islandOccluder.indices.size() / 3),
+		int(island.indices.size() / 3));
+	return true;
+}
 
-	//*************************************************************************
-	// Load the models from disk
-	//*************************************************************************
-	world = new OBJModel(); 
-	world->load("../scenes/island2.obj");
-	skybox = new OBJModel();
-	skybox->load("../scenes/skybox.obj");
-	skyboxnight = new OBJModel();
-	skyboxnight->load("../scenes/skyboxnight.obj");
-	// Make the textures of the skyboxes use clamp to edge to avoid seams
-	for(int i=0; i<6; i++){
-		glBindTexture(GL_TEXTURE_2D, skybox->getDiffuseTexture(i)); 
-		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
-		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
-		glBindTexture(GL_TEXTURE_2D, skyboxnight->getDiffuseTexture(i)); 
-		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
-		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
-	}
-	water = new OBJModel(); 
-	water->load("../scenes/water.obj");
-	car = new OBJModel(); 
-	car->load("../scenes/car.obj");
-	CHECK_GL_ERROR();
+/**
+* The cell of terrainHeights that (x, z) falls in, clamped to the grid.
+*/
+float &terrainHeight(float x, float z)
+{
+	int i = int((x - terrainBounds.min.x) / (terrainBounds.max.x - terrainBounds.min.x) * terrainGridSize);
+	int j = int((z - terrainBounds.min.z) / (terrainBounds.max.z - terrainBounds.min.z) * terrainGridSize);
+	i = min(max(i, 0), terrainGridSize - 1);
+	j = min(max(j, 0), terrainGridSize - 1);
+	return terrainHeights[j * terrainGridSize + i];
 }
 
-void drawModel(GLuint shaderProgram, OBJModel *model, const float4x4 &modelMatrix)
+void initStressCars(TextureLoader &textureLoader)
 {
-	setUniformSlow(shaderProgram, "modelMatrix", modelMatrix);
-	model->render();
+	vector<float3> positions;
+	vector<unsigned int> indices;
+	const SceneObject *car = findSceneObject(getSceneDescription(), "car");
+	if (!car || !loadIslandGeometry(positions, indices))
+	{
+		fatal_error("Could not load the island and the car for the stress scene");
+	}
+	terrainBounds = makeEmptyAABB();
+	for (size_t i = 0; i < positions.size(); ++i)
+	{
+		growAABB(terrainBounds, positions[i]);
+	}
+	// Cells without vertices are at sea level
+	terrainHeights.assign(terrainGridSize * terrainGridSize, -6.0f);
+	for (size_t i = 0; i < positions.size(); ++i)
+	{
+		float &cell = terrainHeight(positions[i].x, positions[i].z);
+		cell = max(cell, positions[i].y);
+	}
+
+	stressCarMesh = loadMesh(car->modelFile.c_str(), textureLoader);
+	stressCars = new MeshInstances(stressCarMesh);
+	printf("Stress scene: %d car instances\n", numStressCars);
 }
 
 /**
-* In this function, add all scene elements that should cast shadow, that way
-* there is only one draw call to each of these, as this function is called twice.
+* Each car drives on a circle around the center of the island, at its own
+* radius, speed and direction. The cars are split into blocks that are
+* updated in parallel, their bounds are then computed with the batched
+* kernels (see BatchMath.h).
+*/
+void updateStressCars(FrameState &frame)
+{
+	frame.carMatrices.resize(stressCars ? numStressCars : 0);
+	frame.carBounds = makeEmptyAABB();
+	if (frame.carMatrices.size() == 0)
+	{
+		return;
+	}
+	float islandRadius = 0.45f * min(terrainBounds.max.x - terrainBounds.min.x, terrainBounds.max.z - terrainBounds.min.z);
+	float3 center = (terrainBounds.min + terrainBounds.max) * 0.5f;
+	const int blockSize = 256;
+	jobSystem->parallelFor(numStressCars, blockSize, [&](int begin, int end)
+	{
+		for (int i = begin; i < end; ++i)
+		{
+			// A fixed hash of the index, so the scene is the same every run
+			unsigned int hash = unsigned(i) * 2654435761u;
+			float radius = islandRadius * (0.1f + 0.9f * float((hash >> 8) & 0xff) / 255.0f);
+			float speed = (0.2f + float((hash >> 16) & 0xff) / 255.0f) * ((hash & 1) ? 1.0f : -1.0f) * 4.0f / radius;
+			float angle = float(i) * 2.399963f + speed * frame.time;
+			float x = center.x + radius * cosf(angle);
+			float z = center.z + radius * sinf(angle);
+			frame.carMatrices.set(i, make_translation(make_vector(x, terrainHeight(x, z), z))
+				* make_rotation_y<float4x4>(speed > 0.0f ? -angle : float(M_PI) - angle));
+		}
+	});
+	transformBoxes(stressCars->getMeshBounds(), frame.carMatrices, frame.carBoxes);
+	frame.carBounds = boundsOfBoxes(frame.carBoxes);
+}
+
+/**
+* (Re)creates the job system and the occlusion buffers rasterized on it.
+*/
+void createJobSystem(int numWorkers)
+{
+	for (int i = 0; i < NUM_QUEUE_PASSES; ++i)
+	{
+		delete occlusionBuffers[i];
+	}
+	delete jobSystem;
+	jobSystem = new JobSystem(numWorkers);
+	// One per view, so the views can be culled in parallel
+	for (int i = 0; i < NUM_QUEUE_PASSES; ++i)
+	{
+		occlusionBuffers[i] = new OcclusionBuffer(occlusionBufferWidth, occlusionBufferHeight, jobSystem);
+	}
+}
+
+/**
+* Rasterizes the occluders for a view, returns the buffer to cull against or 0
+* when occlusion culling is off.
 */
-void drawShadowCasters(GLuint shaderProgram, const float4x4 &viewMatrix, const float4x4 &projectionMatrix)
+const OcclusionBuffer *rasterizeOccluders(const FrameState &frame, int pass, const float4x4 &viewProjectionMatrix)
 {
-	drawModel(shaderProgram, world, make_identity<float4x4>());
-	setUniformSlow(shaderProgram, "object_reflectiveness", 0.5f); 
-	drawModel(shaderProgram, car, make_translation(make_vector(0.0f, 0.0f, 0.0f))); 
-	setUniformSlow(shaderProgram, "object_reflectiveness", 0.0f); 
+	if (!frame.occlusionCulling || !frame.frustumCulling)
+	{
+		return 0;
+	}
+	OcclusionBuffer *buffer = occlusionBuffers[pass];
+	buffer->clear();
+	buffer->addOccluder(islandOccluder, viewProjectionMatrix);
+	buffer->rasterize();
+	return buffer;
 }
 
-void drawShadowMap(const float4x4 &viewMatrix, const float4x4 &projectionMatrix)
+void drawShadowMap(FrameState &frame)
 {
 	glPolygonOffset(2.5, 10);
 	glEnable(GL_POLYGON_OFFSET_FILL);
 
-	glBindFramebuffer(GL_FRAMEBUFFER, shadowMapFBO);
-	glViewport(0, 0, shadowMapResolution, shadowMapResolution);
 	glClearColor(1.0, 1.0, 1.0, 1.0);
 	glClearDepth(1.0);
 	glClear(GL_DEPTH_BUFFER_BIT | GL_COLOR_BUFFER_BIT);
 	// Shader Program
 	GLint current_program; 
 	glGetIntegerv(GL_CURRENT_PROGRAM, &current_program);
-	glUseProgram(shadowShaderProgram);
-
-	setUniformSlow(shadowShaderProgram, "viewMatrix", viewMatrix);
-	setUniformSlow(shadowShaderProgram, "projectionMatrix", projectionMatrix);
+	glUseProgram(shadowShaderProgram.id);
 
-	drawShadowCasters(shadowShaderProgram, viewMatrix, projectionMatrix);
+	for (int i = 0; i < frame.numShadowCascades; ++i)
+	{
+		const ShadowCascade &cascade = frame.shadowCascades[i];
+		glViewport(i * shadowMapResolution, 0, shadowMapResolution, shadowMapResolution);
+		setUniform(shadowShaderProgram, UNIFORM_VIEW_MATRIX, cascade.viewMatrix);
+		setUniform(shadowShaderProgram, UNIFORM_PROJECTION_MATRIX, cascade.projectionMatrix);
+		frame.queues[QUEUE_PASS_SHADOW_MAP + i].submit(QUEUE_PASS_SHADOW_MAP + i);
+	}
 
 	glUseProgram(current_program);	
 
 	glDisable(GL_POLYGON_OFFSET_FILL);
-	glBindFramebuffer(GL_FRAMEBUFFER, 0);
 
 	CHECK_GL_ERROR();
 }
 
-void drawScene(const float4x4 &lightViewMatrix, const float4x4 &lightProjectionMatrix)
+void drawScene(FrameState &frame)
 {
 	//*************************************************************************
 	// Render the scene from the cameras viewpoint
@@ -267,108 +911,596 @@ void drawScene(const float4x4 &lightViewMatrix, const float4x4 &lightProjectionM
 	glClearColor(0.2,0.2,0.8,1.0);						
 	glClearDepth(1);
 	glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT); 
-	int w = glutGet((GLenum)GLUT_WINDOW_WIDTH);
-	int h = glutGet((GLenum)GLUT_WINDOW_HEIGHT);
-	glViewport(0, 0, w, h);
-	// Use shader and set up uniforms
-	glUseProgram(shaderProgram);
-	float3 camera_position = sphericalToCartesian(camera_theta, camera_phi, camera_r);
-	float3 camera_lookAt = make_vector(0.0f, camera_target_altitude, 0.0f);
+	RenderQueue &queue = frame.queues[QUEUE_PASS_SCENE];
+	if (frame.depthPrepass)
+	{
+		// Depth only, with the same transforms as shader.vert (both declare
+		// gl_Position invariant, so the colour pass gets equal depths)
+		glColorMask(GL_FALSE, GL_FALSE, GL_FALSE, GL_FALSE);
+		glUseProgram(shadowShaderProgram.id);
+		setUniform(shadowShaderProgram, UNIFORM_VIEW_MATRIX, frame.perFrame.viewMatrix);
+		setUniform(shadowShaderProgram, UNIFORM_PROJECTION_MATRIX, frame.perFrame.projectionMatrix);
+		queue.submit(QUEUE_PASS_DEPTH_PREPASS);
+		glColorMask(GL_TRUE, GL_TRUE, GL_TRUE, GL_TRUE);
+		// Only the nearest fragment of each pixel is shaded
+		glDepthFunc(GL_EQUAL);
+		glDepthMask(GL_FALSE);
+	}
+
+	// The camera and light matrices are in the per-frame uniforms, the queue
+	// draws the opaque geometry first and then the sky where nothing covers it
+	GLint viewport[4];
+	glGetIntegerv(GL_VIEWPORT, viewport);
+	sceneSampleCounter->begin();
+	queue.submit(QUEUE_PASS_SCENE);
+	sceneSampleCounter->end(double(viewport[2]) * double(viewport[3]));
+	glDepthFunc(GL_LESS);
+	glDepthMask(GL_TRUE);
+
+	glUseProgram(0);	
+	CHECK_GL_ERROR();
+}
+
+/**
+* Copies the state the frame is prepared from, the globals are only read on
+* the main thread.
+*/
+void captureFrameInputs(FrameState &frame)
+{
+	frame.time = currentTime;
+	frame.cameraTheta = camera_theta;
+	frame.cameraPhi = camera_phi;
+	frame.cameraR = camera_r;
+	frame.cameraTargetAltitude = camera_target_altitude;
+	frame.width = windowWidth;
+	frame.height = windowHeight;
+	frame.frustumCulling = frustumCullingEnabled;
+	frame.occlusionCulling = occlusionCullingEnabled;
+	frame.numShadowCascades = numShadowCascades;
+	frame.shadows = shadowsEnabled;
+	frame.depthPrepass = depthPrepassEnabled;
+	frame.meshLod = meshLodEnabled;
+	sceneStreamer->getResidentObjects(frame.sceneObjects);
+	frame.sceneVersion = sceneStreamer->getVersion();
+	frame.shadowMapGeneration = shadowMapGeneration;
+}
+
+float3 computeLightPosition(float time)
+{
+	// rotate light around X axis, sunlike fashion.
+	// do one full revolution every 20 seconds.
+	float4x4 rotateLight = make_rotation_x<float4x4>(2.0f * M_PI * time / 20.0f);
+	return make_vector3(rotateLight * make_vector(30.1f, 450.0f, 0.1f, 1.0f));
+}
+
+/**
+* Culls and queues the draws of one pass, along with the occluders of its view.
+*/
+void queueView(FrameState &frame, int pass)
+{
+	RenderQueue &queue = frame.queues[pass];
+	CullingStats &stats = frame.cullingStats[pass];
+	queue.clear();
+	resetCullingStats(stats);
+	if (pass < QUEUE_PASS_SCENE)
+	{
+		int cascadeIndex = pass - QUEUE_PASS_SHADOW_MAP;
+		if (!frame.shadows || cascadeIndex >= frame.numShadowCascades || frame.shadowMapCached)
+		{
+			return;
+		}
+		// Culled against the light frustum of the cascade
+		const ShadowCascade &cascade = frame.shadowCascades[cascadeIndex];
+		float4x4 viewProjectionMatrix = cascade.projectionMatrix * cascade.viewMatrix;
+		MeshLodSelection lod = { make_vector(0.0f, 0.0f, 0.0f), cascade.texelsPerUnit, true,
+			lodPixelError * shadowLodErrorScale };
+		CullingView shadowView = { viewProjectionMatrix, &stats,
+			rasterizeOccluders(frame, pass, viewProjectionMatrix), pass, &shadowShaderProgram,
+			&queue, frame.frustumCulling, frame.meshLod ? &lod : 0, 0, 0 };
+		drawShadowCasters(frame, shadowView);
+	}
+	else
+	{
+		// Culled against the camera frustum
+		float4x4 viewProjectionMatrix = frame.perFrame.projectionMatrix * frame.perFrame.viewMatrix;
+		// Pixels per unit at unit distance, the projection scales y by
+		// cot(fov / 2) onto half the window height
+		MeshLodSelection lod = { frame.cameraPosition,
+			frame.perFrame.projectionMatrix.c2.y * 0.5f * float(frame.height), false, lodPixelError };
+		CullingView view = { viewProjectionMatrix, &stats,
+			rasterizeOccluders(frame, pass, viewProjectionMatrix), pass, 0,
+			&queue, frame.frustumCulling, frame.meshLod ? &lod : 0, &sceneShaders, frame.shadows ? SHADER_SHADOWED : 0 };
+		// What casts no shadow is only drawn here, e.g. the water
+		for (size_t i = 0; i < frame.sceneObjects.size(); ++i)
+		{
+			const SceneInstance &object = frame.sceneObjects[i];
+			if (!object.castsShadows)
+			{
+				drawModel(object.mesh, object.modelMatrix, view, RENDER_LAYER_OPAQUE, 1.0f, object.reflectiveness);
+			}
+		}
+		drawShadowCasters(frame, view);
+
+		// The sky is drawn once, at the far plane, after the opaque geometry
+		RenderObject sky = { &skyShader, pass, RENDER_LAYER_SKY, make_identity<float4x4>(), 1.0f, 0.0f, 0, 0 };
+		queue.addDraw(queue.addObject(sky), skyVertexArray, 0, 0, 0, 3, 0.0f);
+		if (frame.depthPrepass)
+		{
+			queue.copyOpaqueDraws(QUEUE_PASS_SCENE, QUEUE_PASS_DEPTH_PREPASS, &shadowShaderProgram);
+		}
+	}
+	queue.sort();
+}
+
+/**
+* Computes the camera and light matrices and the per-frame uniforms, animates
+* the cars and queues the draws of both passes. Runs on the worker threads
+* and touches neither GL nor the globals changed by the main thread.
+*/
+void prepareFrame(FrameState &frame)
+{
+	double start = getTimeMs();
+	float3 lightPosition = computeLightPosition(frame.time);
+
+	float3 camera_position = sphericalToCartesian(frame.cameraTheta, frame.cameraPhi, frame.cameraR);
+	float3 camera_lookAt = make_vector(0.0f, frame.cameraTargetAltitude, 0.0f);
 	float3 camera_up = make_vector(0.0f, 1.0f, 0.0f);
 	float4x4 viewMatrix = lookAt(camera_position, camera_lookAt, camera_up);
-	float4x4 projectionMatrix = perspectiveMatrix(45.0f, float(w) / float(h), 0.1f, 1000.0f);
-	setUniformSlow(shaderProgram, "viewMatrix", viewMatrix);
-	setUniformSlow(shaderProgram, "projectionMatrix", projectionMatrix);
-	setUniformSlow(shaderProgram, "inverseViewNormalMatrix", transpose(viewMatrix));
+	frame.cameraPosition = camera_position;
+	ShadowCamera camera = { viewMatrix, 45.0f, float(frame.width) / float(frame.height), 0.1f, 1000.0f };
 
-	drawModel(shaderProgram, water, make_translation(make_vector(0.0f, -6.0f, 0.0f)));
+	// Both the shadow map and the views cull the cars, so they are moved first
+	updateStressCars(frame);
 
-	// Shadows
+	// The shadow map only needs to cover what is in view and can receive
+	// shadows, and whatever can cast shadows onto that
+	AABB casters = makeEmptyAABB();
+	AABB receivers = makeEmptyAABB();
+	for (size_t i = 0; i < frame.sceneObjects.size(); ++i)
+	{
+		const SceneInstance &object = frame.sceneObjects[i];
+		AABB bounds = transformAABB(object.mesh->getBounds(), object.modelMatrix);
+		growAABB(object.castsShadows ? casters : receivers, bounds);
+	}
+	growAABB(casters, frame.carBounds);
+	if (casters.min.x > casters.max.x)
+	{
+		// Nothing resident that casts shadows, the map stays empty
+		growAABB(casters, camera_lookAt);
+	}
+	growAABB(receivers, casters);
+	fitShadowCascades(lightPosition, camera, receivers, casters, frame.numShadowCascades, shadowMapResolution,
+		shadowSplitBlend, frame.shadowCascades);
+
+	ShadowMapKey key;
+	memset(&key, 0, sizeof(key));
+	for (int i = 0; i < frame.numShadowCascades; ++i)
+	{
+		key.viewProjectionMatrices[i] = frame.shadowCascades[i].projectionMatrix * frame.shadowCascades[i].viewMatrix;
+	}
+	key.numCascades = frame.numShadowCascades;
+	key.casterTime = stressCars ? frame.time : 0.0f;
+	key.sceneVersion = frame.sceneVersion;
+	key.generation = frame.shadowMapGeneration;
+	frame.shadowMapCached = shadowCachingEnabled && preparedShadowMapValid
+		&& memcmp(&key, &preparedShadowMapKey, sizeof(key)) == 0;
+	preparedShadowMapKey = key;
+	// Without shadows the map is not drawn, and is stale once they are back
+	preparedShadowMapValid = frame.shadows;
+
+	PerFrameUniforms &perFrame = frame.perFrame;
+	perFrame.viewMatrix = viewMatrix;
+	perFrame.projectionMatrix = perspectiveMatrix(camera.fieldOfView, camera.aspectRatio, camera.nearPlane, camera.farPlane);
+	perFrame.inverseViewNormalMatrix = transpose(viewMatrix);
+	for (int i = 0; i < frame.numShadowCascades; ++i)
+	{
+		perFrame.lightMatrices[i] = getShadowTextureMatrix(frame.shadowCascades[i], viewMatrix);
+		(&perFrame.shadowCascadeSplits.x)[i] = frame.shadowCascades[i].farDepth;
+	}
+	perFrame.numShadowCascades = frame.numShadowCascades;
 	float3 viewSpaceLightPos = transformPoint(viewMatrix, lightPosition);
-	setUniformSlow(shaderProgram, "viewSpaceLightPosition", viewSpaceLightPos);
+	perFrame.viewSpaceLightPosition = make_vector(viewSpaceLightPos.x, viewSpaceLightPos.y, viewSpaceLightPos.z, 1.0f);
+	perFrame.time = frame.time;
 
-	float4x4 lightMatrix = make_translation(make_vector(0.5f, 0.5f, 0.5f)) *
-		make_scale<float4x4>(0.5f) * lightProjectionMatrix *
-		lightViewMatrix	* inverse(viewMatrix);
-	setUniformSlow(shaderProgram, "lightMatrix", lightMatrix);
+	JobSystem::Counter views(0);
+	for (int pass = 0; pass < NUM_QUEUE_PASSES; ++pass)
+	{
+		jobSystem->run(views, [&frame, pass]() { queueView(frame, pass); });
+	}
+	jobSystem->wait(views);
+	frame.prepareTime = getTimeMs() - start;
+}
 
-	drawShadowCasters(shaderProgram, viewMatrix, projectionMatrix);
+/**
+* Forgets what the shadow map holds, e.g. after frames were prepared without
+* being drawn. Frames captured from here on draw it again, those already being
+* prepared are not waited for.
+*/
+void invalidateShadowMap()
+{
+	++shadowMapGeneration;
+}
 
-	glDepthMask(GL_FALSE);
-	glEnable(GL_BLEND);
-	glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+/**
+* Starts preparing a frame on the job system, frame.preparing is zero once it
+* is done.
+*/
+void startPreparingFrame(FrameState &frame)
+{
+	captureFrameInputs(frame);
+	frame.preparing = 0;
+	jobSystem->run(frame.preparing, [&frame]() { prepareFrame(frame); });
+}
 
-	drawModel(shaderProgram, skyboxnight, make_identity<float4x4>());
-	setUniformSlow(shaderProgram, "object_alpha", max<float>(0.0f, cosf((currentTime / 20.0f) * 2.0f * M_PI))); 
-	drawModel(shaderProgram, skybox, make_identity<float4x4>());
-	setUniformSlow(shaderProgram, "object_alpha", 1.0f);
+/**
+* Adds a full screen pass applying one of the optional effects to input.
+*/
+void addPostFxEffectPass(const char *name, const ShaderProgram &shader,
+						 RenderTargetHandle input, RenderTargetHandle output)
+{
+	renderGraph->addPass(name, { input }, output, [=](const RenderGraph &graph)
+	{
+		glUseProgram(shader.id);
+		glActiveTexture(GL_TEXTURE0);
+		glBindTexture(GL_TEXTURE_RECTANGLE_ARB, graph.getTexture(input));
+		drawFullScreenQuad();
+	});
+}
+
+/**
+* Renders all passes of a prepared frame, the final pass goes to
+* outputFramebuffer.
+*/
+void renderFrame(FrameState &frame)
+{
+	int w = frame.width;
+	int h = frame.height;
+	profilerBeginFrame();
+	dynamicResolution->beginFrame();
+	// The scene and bloom targets are allocated at full size and rendered
+	// at this scale, so it can change every frame without reallocating.
+	float scale = dynamicResolutionEnabled ? dynamicResolution->getScale() : 1.0f;
+
+	updatePerFrameUniforms(frame.perFrame);
+	if (stressCars)
+	{
+		stressCars->update(frame.carMatrices);
+	}
 
-	glDisable(GL_BLEND);
-	glDepthMask(GL_TRUE); 
+	renderGraph->beginFrame();
+	RenderTargetHandle shadowMap = renderGraph->importTarget("Shadow map", shadowMapFBO,
+		shadowMapTexture, shadowMapResolution * numShadowCascades, shadowMapResolution);
+	// The default frame buffer (or the offscreen output when benchmarking)
+	RenderTargetHandle output = renderGraph->importTarget("Output", outputFramebuffer, 0, w, h);
+	renderGraph->markOutput(output);
 
-	glUseProgram(0);	
+	FrameState *prepared = &frame;
+	renderGraph->addPass("Shadow map", vector<RenderTargetHandle>(), shadowMap, [=](const RenderGraph &)
+	{
+		if (prepared->shadows && !prepared->shadowMapCached)
+		{
+			drawShadowMap(*prepared);
+		}
+	});
+
+	// The scene is the only target rendered with depth
+	RenderTargetDesc sceneDesc = { w, h, GL_RGBA, true };
+	RenderTargetHandle scene = renderGraph->createTarget("Scene", sceneDesc, scale);
+	renderGraph->addPass("Scene", { shadowMap }, scene, [=](const RenderGraph &)
+	{
+		drawScene(*prepared);
+	});
+
+	// The bloom passes are always declared, they are culled when the
+	// composite pass below does not read the result.
+	RenderTargetHandle bloom = addBloomPasses(scene, scale);
+
+	// Only the enabled effects are added, each one is a full screen pass.
+	// Whichever pass comes last writes the output.
+	const char *effectNames[3];
+	const ShaderProgram *effectShaders[3];
+	int numEffects = 0;
+	if (mosaicEnabled)
+	{
+		effectNames[numEffects] = "Mosaic";
+		effectShaders[numEffects++] = &mosaicShader;
+	}
+	if (mushroomsEnabled)
+	{
+		effectNames[numEffects] = "Mushrooms";
+		effectShaders[numEffects++] = &mushroomsShader;
+	}
+	if (sepiaEnabled)
+	{
+		effectNames[numEffects] = "Sepia";
+		effectShaders[numEffects++] = &sepiaShader;
+	}
+	RenderTargetDesc postFxDesc = { w, h, GL_RGBA, false };
+	RenderTargetHandle composited = numEffects == 0 ? output
+		: renderGraph->createTarget("PostFx", postFxDesc);
+
+	vector<RenderTargetHandle> postFxInputs(1, scene);
+	if (bloomEnabled)
+	{
+		postFxInputs.push_back(bloom);
+	}
+	bool withBloom = bloomEnabled;
+	renderGraph->addPass("PostFx", postFxInputs, composited, [=](const RenderGraph &graph)
+	{
+		glClearColor(0.6, 0.0, 0.0, 0.1);
+		glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+
+		// Render with postFxShader, the bloom is left unbound (and weighted
+		// by zero) when disabled.
+		glUseProgram(postFxShader.id);
+		setUniform(postFxShader, UNIFORM_BLOOM_INTENSITY, withBloom ? 1.0f : 0.0f);
+		setUniform(postFxShader, UNIFORM_RENDER_SCALE, scale);
+		glActiveTexture(GL_TEXTURE0);
+		glBindTexture(GL_TEXTURE_RECTANGLE_ARB, graph.getTexture(scene));
+		glActiveTexture(GL_TEXTURE1);	
+		glBindTexture(GL_TEXTURE_RECTANGLE_ARB, withBloom ? graph.getTexture(bloom) : 0);
+		drawFullScreenQuad();
+	});
+
+	RenderTargetHandle current = composited;
+	for (int i = 0; i < numEffects; ++i)
+	{
+		RenderTargetHandle next = i == numEffects - 1 ? output
+			: renderGraph->createTarget(effectNames[i], postFxDesc);
+		addPostFxEffectPass(effectNames[i], *effectShaders[i], current, next);
+		current = next;
+	}
+
+	renderGraph->compile();
+	renderGraph->execute();
+
+	glUseProgram( 0 );	
 	CHECK_GL_ERROR();
-}
 
+#	if defined(_DEBUG)
+	// All uniform locations are resolved at link time, so the number of
+	// lookups by name must not grow once the first frame has been drawn.
+	static int lookupsAfterFirstFrame = -1;
+	if (lookupsAfterFirstFrame < 0)
+	{
+		lookupsAfterFirstFrame = getUniformNameLookupCount();
+	}
+	else if (getUniformNameLookupCount() != lookupsAfterFirstFrame)
+	{
+		printf("Warning: %d uniform name lookups at steady state\n",
+			getUniformNameLookupCount() - lookupsAfterFirstFrame);
+		lookupsAfterFirstFrame = getUniformNameLookupCount();
+	}
+#	endif // _DEBUG
 
+	dynamicResolution->endFrame();
+	profilerEndFrame();
+	CHECK_GL_ERROR();
+}
 
-void display(void)
+/**
+* Renders the next frame. With pipelining, the frame after it is prepared on
+* the worker threads in the meantime, from the input state at this point, so
+* input shows up one frame later than without.
+*/
+void runFrame()
 {
-	int w = glutGet((GLenum)GLUT_WINDOW_WIDTH);
-	int h = glutGet((GLenum)GLUT_WINDOW_HEIGHT);
+	// Unloading waits for the frame being prepared, which is then prepared
+	// again from the chunks left
+	sceneStreamer->update(sphericalToCartesian(camera_theta, camera_phi, camera_r), finishPreparingFrames);
+	FrameState &frame = frameStates[nextFrameState];
+	if (!pipelineStarted || !framePipeliningEnabled)
+	{
+		startPreparingFrame(frame);
+		pipelineStarted = true;
+	}
+	jobSystem->wait(frame.preparing);
+	if (framePipeliningEnabled)
+	{
+		nextFrameState = 1 - nextFrameState;
+		startPreparingFrame(frameStates[nextFrameState]);
+	}
+	renderFrame(frame);
+	displayedFrame = &frame;
+}
 
-	// Set up view and projection matrices for light
-	float4x4 lightViewMatrix = lookAt(lightPosition, make_vector(0.0f, 0.0f, 0.0f), up);
-	float4x4 lightProjectionMatrix = perspectiveMatrix(25.0f, 1.0, 5.0f, 500.0f);
+/**
+* Waits for the frame being prepared, if any, e.g. before the state it is
+* prepared from is changed.
+*/
+void finishPreparingFrames()
+{
+	for (int i = 0; i < 2; ++i)
+	{
+		jobSystem->wait(frameStates[i].preparing);
+	}
+	pipelineStarted = false;
+}
 
-	drawShadowMap(lightViewMatrix, lightProjectionMatrix);
-	
-	glBindFramebuffer(GL_FRAMEBUFFER, postProcessFBO.id);
+/**
+* The GL calls made by both passes of a submitted frame.
+*/
+RenderQueueStats getFrameQueueStats(const FrameState &frame)
+{
+	RenderQueueStats total = RenderQueueStats();
+	for (int i = 0; i < NUM_QUEUE_PASSES; ++i)
+	{
+		const RenderQueueStats &stats = frame.queues[i].getStats();
+		total.numPackets += stats.numPackets;
+		total.numDraws += stats.numDraws;
+		total.numInstances += stats.numInstances;
+		total.numProgramChanges += stats.numProgramChanges;
+		total.numVertexArrayChanges += stats.numVertexArrayChanges;
+		total.numMaterialChanges += stats.numMaterialChanges;
+		total.numTextureChanges += stats.numTextureChanges;
+		total.numUniformUpdates += stats.numUniformUpdates;
+		total.numBlendStateChanges += stats.numBlendStateChanges;
+	}
+	return total;
+}
 
-	drawScene(lightViewMatrix, lightProjectionMatrix);
+void frameTimer(int /*value*/)
+{
+	glutPostRedisplay();
+}
 
-	// Render with cutoffShader
-	glBindFramebuffer(GL_FRAMEBUFFER, cutoffFBO.id);
-	glClearColor(0.0,0.0,0.0,1.0);
-	glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
-	glUseProgram(cutoffShader);
-	setUniformSlow(cutoffShader, "frameBufferTexture", 0);
-	glActiveTexture(GL_TEXTURE0);
-	glBindTexture(GL_TEXTURE_RECTANGLE_ARB, postProcessFBO.colorTextureTarget);
-	drawFullScreenQuad();
+/**
+* Arranges for display() to be called once the frame pacer allows it, unless
+* that is already arranged.
+*/
+void scheduleFrame()
+{
+	if (frameScheduled)
+	{
+		return;
+	}
+	double now = getTimeMs();
+	double delay = framePacer.getTimeUntilNextFrame(now);
+	if (renderOnDemand && framesToDraw == 0)
+	{
+		// Only animating, nothing changes before the next step
+		delay = max(delay, simulationClock.getTimeUntilNextStep(now));
+	}
+	frameScheduled = true;
+	if (delay <= 0.0)
+	{
+		glutPostRedisplay();
+	}
+	else
+	{
+		glutTimerFunc(unsigned(ceil(delay)), frameTimer, 0);
+	}
+}
 
-	// Render blur
-	renderBlur();
+/**
+* Called when the view has changed. With pipelining the frame being prepared
+* was captured before the change, so it takes two frames to show it.
+*/
+void requestRedraw()
+{
+	framesToDraw = framePipeliningEnabled ? 2 : 1;
+	scheduleFrame();
+}
 
-	// Bind the default frame buffer
-	glBindFramebuffer(GL_FRAMEBUFFER, 0);
-	glViewport(0, 0, w, h);
-	glClearColor(0.6, 0.0, 0.0, 0.1);
-	glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
-
-	// Render with postFxShader
-	// Update time in PostFX Shader (required by the 'shrooms effect)
-	glUseProgram(postFxShader);
-	setUniformSlow(postFxShader, "frameBufferTexture", 0);
-	setUniformSlow(postFxShader, "blurredFrameBufferTexture", 1);
-	glActiveTexture(GL_TEXTURE0);
-	glBindTexture(GL_TEXTURE_RECTANGLE_ARB, postProcessFBO.colorTextureTarget);
-	glActiveTexture(GL_TEXTURE1);	
-	glBindTexture(GL_TEXTURE_RECTANGLE_ARB, verticalBlurFBO.colorTextureTarget);
-	setUniformSlow(postFxShader, "time", currentTime);
-	drawFullScreenQuad();
-
-	// Copy a frame buffer to the default frame buffer
-//	glBindFramebuffer(GL_DRAW_FRAMEBUFFER, 0);
-//	glBindFramebuffer(GL_READ_FRAMEBUFFER, horizontalBlurFBO.id);
-//	glBlitFramebuffer(0, 0, w, h, 0, 0, w, h, GL_COLOR_BUFFER_BIT,
-//		GL_NEAREST);
+/**
+* The culling counts of the shadow map, all cascades together, and of the
+* scene.
+*/
+void getPassCullingStats(const FrameState &frame, CullingStats passStats[2])
+{
+	resetCullingStats(passStats[0]);
+	for (int i = 0; i < frame.numShadowCascades; ++i)
+	{
+		addCullingStats(passStats[0], frame.cullingStats[QUEUE_PASS_SHADOW_MAP + i]);
+	}
+	passStats[1] = frame.cullingStats[QUEUE_PASS_SCENE];
+}
 
-	glUseProgram( 0 );	
-	CHECK_GL_ERROR();
+void display(void)
+{
+	frameScheduled = false;
+	double now = getTimeMs();
+	if (frameCapture)
+	{
+		// One step per recorded frame, however long the frame took
+		simulationClock.step(now);
+	}
+	else
+	{
+		simulationClock.update(now);
+	}
+	currentTime = simulationClock.getTime();
+	framePacer.beginFrame(now);
 
-	CHECK_GL_ERROR();
+	runFrame();
+	if (frameCapture)
+	{
+		// Before the overlay, which is not recorded
+		frameCapture->capture(outputFramebuffer, windowWidth, windowHeight);
+	}
+	if (showProfilerOverlay)
+	{
+		profilerDrawOverlay(windowWidth, windowHeight);
+		if (dynamicResolutionEnabled)
+		{
+			char line[128];
+			snprintf(line, sizeof(line), "render scale %.2f, GPU %.2f ms of %.2f ms",
+				dynamicResolution->getScale(), dynamicResolution->getFrameTime(),
+				dynamicResolution->getFrameBudget());
+			glWindowPos2i(10, 10);
+			glutBitmapString(GLUT_BITMAP_8_BY_13, (const unsigned char *)line);
+		}
+		const char *passNames[] = { "Shadow map", "Scene" };
+		CullingStats passStats[2];
+		getPassCullingStats(*displayedFrame, passStats);
+		for (int i = 0; i < 2; ++i)
+		{
+			char line[128];
+			snprintf(line, sizeof(line), "%-10s %4d of %4d chunks (%3d occluded), %7d of %7d triangles%s%s",
+				passNames[i], passStats[i].numVisibleChunks, passStats[i].numChunks,
+				passStats[i].numOccludedChunks, passStats[i].numVisibleTriangles,
+				passStats[i].numTriangles, displayedFrame->frustumCulling ? "" : " (culling off)",
+				displayedFrame->meshLod ? "" : " (LOD off)");
+			glWindowPos2i(10, 40 - i * 15);
+			glutBitmapString(GLUT_BITMAP_8_BY_13, (const unsigned char *)line);
+		}
+		RenderQueueStats queueStats = getFrameQueueStats(*displayedFrame);
+		char line[160];
+		snprintf(line, sizeof(line), "%d draws (%d instances): %d program, %d vertex array, %d material, "
+			"%d texture changes, %d uniform updates", queueStats.numDraws, queueStats.numInstances,
+			queueStats.numProgramChanges,
+			queueStats.numVertexArrayChanges, queueStats.numMaterialChanges, queueStats.numTextureChanges,
+			queueStats.numUniformUpdates);
+		glWindowPos2i(10, 55);
+		glutBitmapString(GLUT_BITMAP_8_BY_13, (const unsigned char *)line);
+		snprintf(line, sizeof(line), "frame prepared in %.2f ms on %d threads%s", displayedFrame->prepareTime,
+			jobSystem->getNumThreads(), framePipeliningEnabled ? ", pipelined" : "");
+		glWindowPos2i(10, 70);
+		glutBitmapString(GLUT_BITMAP_8_BY_13, (const unsigned char *)line);
+		if (renderOnDemand || framePacer.getTargetRate() > 0.0f)
+		{
+			snprintf(line, sizeof(line), "frames %s, at most %.0f per second", renderOnDemand ? "on demand" : "continuous",
+				framePacer.getTargetRate());
+			glWindowPos2i(10, 85);
+			glutBitmapString(GLUT_BITMAP_8_BY_13, (const unsigned char *)line);
+		}
+		int length = snprintf(line, sizeof(line), "shadow map %s, %d x %d^2, texels per unit:",
+			!displayedFrame->shadows ? "off" : displayedFrame->shadowMapCached ? "reused" : "drawn",
+			displayedFrame->numShadowCascades, shadowMapResolution);
+		for (int i = 0; i < displayedFrame->numShadowCascades && length < int(sizeof(line)); ++i)
+		{
+			length += snprintf(line + length, sizeof(line) - length, " %.1f", displayedFrame->shadowCascades[i].texelsPerUnit);
+		}
+		glWindowPos2i(10, 100);
+		glutBitmapString(GLUT_BITMAP_8_BY_13, (const unsigned char *)line);
+		snprintf(line, sizeof(line), "scene %.2f shaded fragments per pixel%s", sceneSampleCounter->getSamplesPerPixel(),
+			displayedFrame->depthPrepass ? " after a depth pre-pass" : "");
+		glWindowPos2i(10, 115);
+		glutBitmapString(GLUT_BITMAP_8_BY_13, (const unsigned char *)line);
+		snprintf(line, sizeof(line), "streaming %d of %d chunks resident, %.1f of %.0f MB%s",
+			sceneStreamer->getNumResidentChunks(), sceneStreamer->getNumChunks(),
+			sceneStreamer->getResidentBytes() / (1024.0 * 1024.0), sceneStreamer->getMemoryBudget() / (1024.0 * 1024.0),
+			sceneStreamer->isStreaming() ? ", loading" : "");
+		glWindowPos2i(10, 130);
+		glutBitmapString(GLUT_BITMAP_8_BY_13, (const unsigned char *)line);
+	}
 	glutSwapBuffers();  // swap front and back buffer. This frame will now be displayed.
+
+	if (framesToDraw > 0)
+	{
+		--framesToDraw;
+	}
+	// Chunks still streaming in show up in the frames after they arrive
+	if (sceneStreamer->isStreaming())
+	{
+		framesToDraw = framePipeliningEnabled ? 2 : 1;
+	}
+	// With render on demand and the animation paused, nothing is scheduled
+	// until the next input event
+	if (!renderOnDemand || !paused || framesToDraw > 0)
+	{
+		scheduleFrame();
+	}
 }
 
 void handleKeys(unsigned char key, int /*x*/, int /*y*/)
@@ -376,16 +1508,96 @@ void handleKeys(unsigned char key, int /*x*/, int /*y*/)
 	switch(key)
 	{
 	case 27:    /* ESC */
-		exit(0); /* dirty exit */
+		shutdownGL();
+		exit(0);
 		break;   /* unnecessary, I know */
 	case 32:    /* space */
 		paused = !paused;
+		simulationClock.setPaused(paused, getTimeMs());
+		break;
+	case 'p':
+		showProfilerOverlay = !showProfilerOverlay;
+		break;
+	case 'b':
+		bloomEnabled = !bloomEnabled;
+		break;
+	case '1':
+		mosaicEnabled = !mosaicEnabled;
+		break;
+	case '2':
+		mushroomsEnabled = !mushroomsEnabled;
+		break;
+	case '3':
+		sepiaEnabled = !sepiaEnabled;
+		break;
+	case 'g':
+		renderGraph->printStatistics();
+		break;
+	case 'r':
+		dynamicResolutionEnabled = !dynamicResolutionEnabled;
+		break;
+	case 'c':
+		frustumCullingEnabled = !frustumCullingEnabled;
+		break;
+	case 'o':
+		occlusionCullingEnabled = !occlusionCullingEnabled;
+		break;
+	case 'd':
+		renderOnDemand = !renderOnDemand;
+		break;
+	case 's':
+		shadowsEnabled = !shadowsEnabled;
+		break;
+	case 'z':
+		depthPrepassEnabled = !depthPrepassEnabled;
+		break;
+	case 'l':
+		meshLodEnabled = !meshLodEnabled;
+		invalidateShadowMap();
+		break;
+	case 'v':
+		if (frameCapture)
+		{
+			stopCapture();
+		}
+		else
+		{
+			char take[16];
+			snprintf(take, sizeof(take), "%d_", ++numCaptureTakes);
+			startCapture(capturePrefix + take);
+			printf("Recording to %s*, press 'v' again to stop\n", (capturePrefix + take).c_str());
+		}
+		break;
+	case 't':
+		if (profilerIsTracing())
+		{
+			profilerStopTrace("trace.json");
+		}
+		else
+		{
+			printf("Recording trace, press 't' again to write trace.json\n");
+			profilerStartTrace();
+		}
 		break;
 	}
+	// Any key may change what is drawn
+	requestRedraw();
 }
 
 
 
+/**
+* The post processing targets follow the window size, the ones of the old
+* size are released right away rather than kept until they expire.
+*/
+void reshape(int width, int height)
+{
+	windowWidth = max(1, width);
+	windowHeight = max(1, height);
+	renderGraph->releaseTargets();
+	requestRedraw();
+}
+
 void handleSpecialKeys(int key, int /*x*/, int /*y*/)
 {
 	switch(key)
@@ -452,29 +1664,284 @@ void motion(int x, int y)
 	}
 	prev_x = x;
 	prev_y = y;
+	if (leftDown || middleDown || rightDown)
+	{
+		requestRedraw();
+	}
 }
 
 
 
-void idle( void )
+/**
+* Renders benchmarkSettings.numFrames frames offscreen, advancing the scene by
+* a fixed timestep and moving the camera along the scripted path, then writes
+* the per-frame CPU and GPU times.
+*/
+void runBenchmark()
 {
-	static float startTime = float(glutGet(GLUT_ELAPSED_TIME)) / 1000.0f;
-	// Here is a good place to put application logic.
-	if (!paused)
+	benchmarkOutputFBO = createPostProcessFBO(windowWidth, windowHeight);
+	outputFramebuffer = benchmarkOutputFBO.id;
+
+	vector<double> cpuTimes;
+	GpuFrameTimer gpuTimer;
+	// Summed draw counts of the shadow and scene passes: chunks, visible
+	// chunks, triangles, visible triangles and occluded chunks
+	double cullingTotals[2][5] = { { 0.0 } };
+	// Summed GL calls made by the render queue
+	RenderQueueStats queueTotals = RenderQueueStats();
+	double prepareTotal = 0.0;
+	// Summed view depth range and texel density of each cascade
+	double shadowTotals[MAX_SHADOW_CASCADES][3] = { { 0.0 } };
+	int numShadowMapDraws = 0;
+	profilerResetTotals();
+	sceneSampleCounter->resetTotals();
+	if (!benchmarkTraceFile.empty())
+	{
+		profilerStartTrace();
+	}
+	for (int frame = 0; frame < benchmarkSettings.numFrames; ++frame)
 	{
-		currentTime = float(glutGet(GLUT_ELAPSED_TIME)) / 1000.0f - startTime;
+		currentTime = float(frame) * benchmarkSettings.timeStep;
+		getBenchmarkCamera(currentTime, camera_theta, camera_phi, camera_r);
+
+		double start = getTimeMs();
+		gpuTimer.beginFrame();
+		runFrame();
+		gpuTimer.endFrame();
+		glFlush();
+		cpuTimes.push_back(getTimeMs() - start);
+
+		CullingStats frameStats[2];
+		getPassCullingStats(*displayedFrame, frameStats);
+		for (int i = 0; i < 2; ++i)
+		{
+			cullingTotals[i][0] += frameStats[i].numChunks;
+			cullingTotals[i][1] += frameStats[i].numVisibleChunks;
+			cullingTotals[i][2] += frameStats[i].numTriangles;
+			cullingTotals[i][3] += frameStats[i].numVisibleTriangles;
+			cullingTotals[i][4] += frameStats[i].numOccludedChunks;
+		}
+		prepareTotal += displayedFrame->prepareTime;
+		if (displayedFrame->shadows && !displayedFrame->shadowMapCached)
+		{
+			++numShadowMapDraws;
+		}
+		for (int i = 0; i < displayedFrame->numShadowCascades; ++i)
+		{
+			const ShadowCascade &cascade = displayedFrame->shadowCascades[i];
+			shadowTotals[i][0] += cascade.nearDepth;
+			shadowTotals[i][1] += cascade.farDepth;
+			shadowTotals[i][2] += cascade.texelsPerUnit;
+		}
+		RenderQueueStats queueStats = getFrameQueueStats(*displayedFrame);
+		queueTotals.numDraws += queueStats.numDraws;
+		queueTotals.numInstances += queueStats.numInstances;
+		queueTotals.numProgramChanges += queueStats.numProgramChanges;
+		queueTotals.numVertexArrayChanges += queueStats.numVertexArrayChanges;
+		queueTotals.numMaterialChanges += queueStats.numMaterialChanges;
+		queueTotals.numTextureChanges += queueStats.numTextureChanges;
+		queueTotals.numUniformUpdates += queueStats.numUniformUpdates;
+	}
+	finishPreparingFrames();
+	glFinish();
+	profilerFinish();
+	sceneSampleCounter->collect();
+	const vector<double> &gpuTimes = gpuTimer.finish();
+	writeBenchmarkResults(benchmarkSettings, cpuTimes, gpuTimes);
+	renderGraph->printStatistics();
+	printResourceUsage();
+	double numFrames = double(max(1, benchmarkSettings.numFrames));
+	const char *passNames[] = { "Shadow map", "Scene" };
+	printf("Draws per frame %s frustum culling, %s occlusion culling:\n",
+		frustumCullingEnabled ? "with" : "without", occlusionCullingEnabled ? "with" : "without");
+	for (int i = 0; i < 2; ++i)
+	{
+		printf("  %-10s %8.1f of %8.1f chunks (%6.1f occluded), %10.0f of %10.0f triangles\n", passNames[i],
+			cullingTotals[i][1] / numFrames, cullingTotals[i][0] / numFrames, cullingTotals[i][4] / numFrames,
+			cullingTotals[i][3] / numFrames, cullingTotals[i][2] / numFrames);
+	}
+	printf("State changes per frame: %.1f draws (%.1f instances), %.1f program, %.1f vertex array, %.1f material, "
+		"%.1f texture changes, %.1f uniform updates\n", queueTotals.numDraws / numFrames,
+		queueTotals.numInstances / numFrames,
+		queueTotals.numProgramChanges / numFrames, queueTotals.numVertexArrayChanges / numFrames,
+		queueTotals.numMaterialChanges / numFrames, queueTotals.numTextureChanges / numFrames,
+		queueTotals.numUniformUpdates / numFrames);
+	printf("Frame preparation: %.2f ms per frame on %d threads, %s\n", prepareTotal / numFrames,
+		jobSystem->getNumThreads(), framePipeliningEnabled ? "overlapped with the submission of the previous frame"
+		: "before the frame is submitted");
+	printf("Overdraw: %.2f shaded fragments per pixel in the scene pass, %s depth pre-pass\n",
+		sceneSampleCounter->getTotalSamples() / max(1.0, sceneSampleCounter->getTotalPixels()),
+		depthPrepassEnabled ? "with" : "without");
+	double shadowCpuTime;
+	double shadowGpuTime;
+	int numShadowPasses;
+	profilerGetPassTotals("Shadow map", shadowCpuTime, shadowGpuTime, numShadowPasses);
+	printf("Shadow map: %d cascade(s) of %dx%d, drawn in %d of %d frames (%s), GPU %.3f ms per frame\n",
+		numShadowCascades, shadowMapResolution, shadowMapResolution, numShadowMapDraws, benchmarkSettings.numFrames,
+		shadowCachingEnabled ? "reused when unchanged" : "caching off",
+		numShadowPasses > 0 ? shadowGpuTime / numShadowPasses : 0.0);
+	for (int i = 0; i < numShadowCascades; ++i)
+	{
+		printf("  cascade %d: view depth %7.2f to %7.2f, %6.2f texels per unit\n", i,
+			shadowTotals[i][0] / numFrames, shadowTotals[i][1] / numFrames, shadowTotals[i][2] / numFrames);
+	}
+	if (dynamicResolutionEnabled)
+	{
+		printf("Dynamic resolution: scale %.2f at the end, GPU %.2f ms for a budget of %.2f ms\n",
+			dynamicResolution->getScale(), dynamicResolution->getFrameTime(),
+			dynamicResolution->getFrameBudget());
+	}
+	if (!benchmarkTraceFile.empty())
+	{
+		profilerStopTrace(benchmarkTraceFile);
 	}
 
-	// rotate light around X axis, sunlike fashion.
-	// do one full revolution every 20 seconds.
-	float4x4 rotateLight = make_rotation_x<float4x4>(2.0f * M_PI * currentTime / 20.0f);
-	// rotate and update global light position.
-	lightPosition = make_vector3(rotateLight * make_vector(30.1f, 450.0f, 0.1f, 1.0f));
+	if (meshLodEnabled)
+	{
+		// The same camera path again at full detail
+		double cpuTime = 0.0;
+		double gpuTime = 0.0;
+		for (size_t i = 0; i < cpuTimes.size(); ++i)
+		{
+			cpuTime += cpuTimes[i] / numFrames;
+		}
+		for (size_t i = 0; i < gpuTimes.size(); ++i)
+		{
+			gpuTime += gpuTimes[i] / max<size_t>(1, gpuTimes.size());
+		}
+		double fullCpuTime;
+		double fullGpuTime;
+		double fullTriangles[2];
+		meshLodEnabled = false;
+		invalidateShadowMap();
+		measureBenchmarkFrames(fullCpuTime, fullGpuTime, fullTriangles);
+		meshLodEnabled = true;
+		invalidateShadowMap();
+		printf("Mesh LOD (%.1f pixels): %10.0f scene, %10.0f shadow map triangles per frame, "
+			"CPU %.2f ms, GPU %.2f ms\n", lodPixelError, cullingTotals[1][3] / numFrames,
+			cullingTotals[0][3] / numFrames, cpuTime, gpuTime);
+		printf("  full detail:        %10.0f scene, %10.0f shadow map triangles per frame, "
+			"CPU %.2f ms, GPU %.2f ms\n", fullTriangles[1], fullTriangles[0], fullCpuTime, fullGpuTime);
+	}
+}
 
-	glutPostRedisplay();  
-	// Uncommenting the line above tells glut that the window 
-	// needs to be redisplayed again. This forces the display to be redrawn
-	// over and over again. 
+/**
+* Renders the benchmark camera path again, recording only the average CPU and
+* GPU frame times and the triangles drawn per frame by the shadow map and the
+* scene passes.
+*/
+void measureBenchmarkFrames(double &cpuTime, double &gpuTime, double triangles[2])
+{
+	GpuFrameTimer gpuTimer;
+	double numFrames = double(max(1, benchmarkSettings.numFrames));
+	cpuTime = 0.0;
+	triangles[0] = triangles[1] = 0.0;
+	for (int frame = 0; frame < benchmarkSettings.numFrames; ++frame)
+	{
+		currentTime = float(frame) * benchmarkSettings.timeStep;
+		getBenchmarkCamera(currentTime, camera_theta, camera_phi, camera_r);
+
+		double start = getTimeMs();
+		gpuTimer.beginFrame();
+		runFrame();
+		gpuTimer.endFrame();
+		glFlush();
+		cpuTime += (getTimeMs() - start) / numFrames;
+
+		CullingStats frameStats[2];
+		getPassCullingStats(*displayedFrame, frameStats);
+		for (int i = 0; i < 2; ++i)
+		{
+			triangles[i] += frameStats[i].numVisibleTriangles / numFrames;
+		}
+	}
+	finishPreparingFrames();
+	glFinish();
+	const vector<double> &gpuTimes = gpuTimer.finish();
+	gpuTime = 0.0;
+	for (size_t i = 0; i < gpuTimes.size(); ++i)
+	{
+		gpuTime += gpuTimes[i] / double(gpuTimes.size());
+	}
+}
+
+/**
+* Starts recording every frame drawn, written by a few background threads.
+*/
+void startCapture(const string &prefix)
+{
+	if (!captureWriters)
+	{
+		// Writing is mostly waiting for the disk, a couple of threads keep
+		// up with the frames handed to them
+		captureWriters = new ThreadPool(2);
+	}
+	frameCapture = new FrameCapture(*captureWriters, prefix, captureFormat);
+}
+
+/**
+* Writes the frames still in flight and prints the capture throughput.
+*/
+void stopCapture()
+{
+	frameCapture->finish();
+	delete frameCapture;
+	frameCapture = 0;
+}
+
+/**
+* Renders the benchmark camera path offscreen with the benchmark's fixed
+* timestep, so recordings are repeatable, and captures every frame.
+*/
+void runCapture()
+{
+	benchmarkOutputFBO = createPostProcessFBO(windowWidth, windowHeight);
+	outputFramebuffer = benchmarkOutputFBO.id;
+
+	startCapture(capturePrefix);
+	for (int frame = 0; frame < benchmarkSettings.numFrames; ++frame)
+	{
+		currentTime = float(frame) * benchmarkSettings.timeStep;
+		getBenchmarkCamera(currentTime, camera_theta, camera_phi, camera_r);
+		runFrame();
+		frameCapture->capture(outputFramebuffer, windowWidth, windowHeight);
+	}
+	finishPreparingFrames();
+	stopCapture();
+}
+
+/**
+* Prepares the benchmark frames (without rendering them) with 1, 2, 4, ...
+* threads, up to twice the number of hardware threads, and prints the time
+* per frame and the speedup over a single thread.
+*/
+void runJobScalingBenchmark()
+{
+	int numFrames = benchmarkSettings.numFrames > 0 ? benchmarkSettings.numFrames : 200;
+	int maxThreads = max(2, 2 * int(thread::hardware_concurrency()));
+	FrameState &frame = frameStates[0];
+	double singleThreadTime = 0.0;
+	printf("Frame preparation, %d frames%s:\n", numFrames, numStressCars > 0 ? "" : " (try --cars N for more work)");
+	for (int numThreads = 1; numThreads <= maxThreads; numThreads *= 2)
+	{
+		createJobSystem(numThreads - 1);
+		double start = getTimeMs();
+		for (int i = 0; i < numFrames; ++i)
+		{
+			currentTime = float(i) * benchmarkSettings.timeStep;
+			getBenchmarkCamera(currentTime, camera_theta, camera_phi, camera_r);
+			startPreparingFrame(frame);
+			jobSystem->wait(frame.preparing);
+		}
+		double time = (getTimeMs() - start) / double(numFrames);
+		if (numThreads == 1)
+		{
+			singleThreadTime = time;
+		}
+		printf("  %2d threads %8.3f ms per frame, %5.2fx\n", numThreads, time, singleThreadTime / time);
+	}
+	createJobSystem(numJobWorkers);
+	invalidateShadowMap();
 }
 
 int main(int argc, char *argv[])
@@ -483,6 +1950,222 @@ int main(int argc, char *argv[])
 	linux_initialize_cwd();
 #	endif // ! __linux__
 
+	benchmarkSettings.numFrames = 0;
+	benchmarkSettings.timeStep = 1.0f / 60.0f;
+	benchmarkSettings.csvFileName = "benchmark.csv";
+	for (int i = 1; i < argc; ++i)
+	{
+		if (strcmp(argv[i], "--benchmark") == 0 && i + 1 < argc)
+		{
+			benchmarkMode = true;
+			benchmarkSettings.numFrames = atoi(argv[++i]);
+		}
+		else if (strcmp(argv[i], "--benchmark-csv") == 0 && i + 1 < argc)
+		{
+			benchmarkSettings.csvFileName = argv[++i];
+		}
+		else if (strcmp(argv[i], "--capture") == 0 && i + 1 < argc)
+		{
+			// The benchmark camera path, recorded instead of timed
+			benchmarkMode = true;
+			captureMode = true;
+			benchmarkSettings.numFrames = atoi(argv[++i]);
+		}
+		else if (strcmp(argv[i], "--capture-prefix") == 0 && i + 1 < argc)
+		{
+			capturePrefix = argv[++i];
+		}
+		else if (strcmp(argv[i], "--capture-raw") == 0)
+		{
+			captureFormat = FrameCapture::FORMAT_RAW;
+		}
+		else if (strcmp(argv[i], "--trace") == 0 && i + 1 < argc)
+		{
+			benchmarkTraceFile = argv[++i];
+		}
+		else if (strcmp(argv[i], "--size") == 0 && i + 1 < argc)
+		{
+			sscanf(argv[++i], "%dx%d", &windowWidth, &windowHeight);
+		}
+		else if (strcmp(argv[i], "--dynamic-resolution") == 0 && i + 1 < argc)
+		{
+			dynamicResolutionEnabled = true;
+			targetFrameRate = max(1.0f, float(atof(argv[++i])));
+		}
+		else if (strcmp(argv[i], "--no-culling") == 0)
+		{
+			frustumCullingEnabled = false;
+		}
+		else if (strcmp(argv[i], "--cars") == 0 && i + 1 < argc)
+		{
+			numStressCars = max(0, atoi(argv[++i]));
+		}
+		else if (strcmp(argv[i], "--no-occlusion") == 0)
+		{
+			occlusionCullingEnabled = false;
+		}
+		else if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc)
+		{
+			// Including the main thread
+			numJobWorkers = max(0, atoi(argv[++i]) - 1);
+		}
+		else if (strcmp(argv[i], "--on-demand") == 0)
+		{
+			renderOnDemand = true;
+		}
+		else if (strcmp(argv[i], "--max-fps") == 0 && i + 1 < argc)
+		{
+			framePacer.setTargetRate(max(0.0f, float(atof(argv[++i]))));
+		}
+		else if (strcmp(argv[i], "--sim-rate") == 0 && i + 1 < argc)
+		{
+			simulationClock.setRate(max(1.0f, float(atof(argv[++i]))));
+		}
+		else if (strcmp(argv[i], "--shadow-cascades") == 0 && i + 1 < argc)
+		{
+			numShadowCascades = min(max(1, atoi(argv[++i])), MAX_SHADOW_CASCADES);
+		}
+		else if (strcmp(argv[i], "--shadow-resolution") == 0 && i + 1 < argc)
+		{
+			shadowMapResolution = max(64, atoi(argv[++i]));
+		}
+		else if (strcmp(argv[i], "--no-shadows") == 0)
+		{
+			shadowsEnabled = false;
+		}
+		else if (strcmp(argv[i], "--scene") == 0 && i + 1 < argc)
+		{
+			sceneFile = argv[++i];
+		}
+		else if (strcmp(argv[i], "--streaming-budget") == 0 && i + 1 < argc)
+		{
+			streamingBudgetMB = max(1, atoi(argv[++i]));
+		}
+		else if (strcmp(argv[i], "--streaming-distance") == 0 && i + 1 < argc)
+		{
+			streamingDistance = max(0.0f, float(atof(argv[++i])));
+		}
+		else if (strcmp(argv[i], "--no-compressed-textures") == 0)
+		{
+			compressedTexturesEnabled = false;
+		}
+		else if (strcmp(argv[i], "--no-shadow-cache") == 0)
+		{
+			shadowCachingEnabled = false;
+		}
+		else if (strcmp(argv[i], "--depth-prepass") == 0)
+		{
+			depthPrepassEnabled = true;
+		}
+		else if (strcmp(argv[i], "--no-lod") == 0)
+		{
+			meshLodEnabled = false;
+		}
+		else if (strcmp(argv[i], "--lod-error") == 0 && i + 1 < argc)
+		{
+			lodPixelError = max(0.0f, float(atof(argv[++i])));
+		}
+		else if (strcmp(argv[i], "--no-pipelining") == 0)
+		{
+			framePipeliningEnabled = false;
+		}
+		else if (strcmp(argv[i], "--job-scaling") == 0)
+		{
+			// Measures frame preparation only, prints no render times
+			benchmarkMode = true;
+			jobScalingBenchmark = true;
+		}
+		else if (strcmp(argv[i], "--occlusion-test") == 0)
+		{
+			// Benchmark and correctness check of the occlusion rasterizer,
+			// no GL context is needed for this
+			int numViews = i + 1 < argc && argv[i + 1][0] != '-' ? atoi(argv[++i]) : 100;
+			if (!loadIslandOccluder())
+			{
+				printf("Could not load the island of %s, using a generated terrain\n", sceneFile.c_str());
+				makeTerrainOccluder(islandOccluder);
+			}
+			return runOcclusionSelfTest(islandOccluder, occlusionBufferWidth, occlusionBufferHeight,
+				max(1, numViews)) ? 0 : 1;
+		}
+		else if (strcmp(argv[i], "--batch-math-test") == 0)
+		{
+			// Microbenchmark and exactness check of the batched kernels
+			int count = i + 1 < argc && argv[i + 1][0] != '-' ? atoi(argv[++i]) : 100000;
+			return runBatchMathSelfTest(count) ? 0 : 1;
+		}
+		else if (strcmp(argv[i], "--rebuild-mesh-cache") == 0)
+		{
+			forceMeshConversion = true;
+		}
+		else if (strcmp(argv[i], "--build-mesh-cache") == 0)
+		{
+			// Offline conversion, no GL context is needed for this
+			vector<string> modelFiles = getSceneModelFiles();
+			for (size_t j = 0; j < modelFiles.size(); ++j)
+			{
+				MeshData data;
+				string cacheFile = modelFiles[j] + ".mesh";
+				printf("Converting %s -> %s\n", modelFiles[j].c_str(), cacheFile.c_str());
+				if (!convertOBJToMeshCache(modelFiles[j], cacheFile, data))
+				{
+					return 1;
+				}
+				printf("  vertex cache misses per triangle: %.2f -> %.2f\n",
+					data.unoptimizedMissRatio, data.optimizedMissRatio);
+			}
+			return 0;
+		}
+		else if (strcmp(argv[i], "--build-texture-cache") == 0)
+		{
+			// Offline conversion of the material textures, the cube map faces
+			// and the skyboxes, no GL context is needed for this
+			ilInit();
+			return buildTextureCache() ? 0 : 1;
+		}
+	}
+	benchmarkSettings.width = windowWidth;
+	benchmarkSettings.height = windowHeight;
+
+#	if defined(USE_OSMESA)
+	// Headless build: render through Mesa's software rasterizer without any
+	// window system, for GPU-less CI machines. GLEW must be built with
+	// GLEW_OSMESA for this to resolve the extension entry points.
+	if (benchmarkMode)
+	{
+		const int attributes[] = {
+			OSMESA_FORMAT, OSMESA_RGBA,
+			OSMESA_DEPTH_BITS, 24,
+			OSMESA_PROFILE, OSMESA_COMPAT_PROFILE,
+			OSMESA_CONTEXT_MAJOR_VERSION, 3,
+			OSMESA_CONTEXT_MINOR_VERSION, 0,
+			0
+		};
+		OSMesaContext context = OSMesaCreateContextAttribs(attributes, NULL);
+		vector<unsigned char> colorBuffer(size_t(windowWidth) * windowHeight * 4);
+		if (!context || !OSMesaMakeCurrent(context, &colorBuffer[0], GL_UNSIGNED_BYTE, windowWidth, windowHeight))
+		{
+			fatal_error("Could not create OSMesa context");
+		}
+		initGL();
+		if (jobScalingBenchmark)
+		{
+			runJobScalingBenchmark();
+		}
+		else if (captureMode)
+		{
+			runCapture();
+		}
+		else
+		{
+			runBenchmark();
+		}
+		shutdownGL();
+		OSMesaDestroyContext(context);
+		return 0;
+	}
+#	endif // USE_OSMESA
+
 	glutInit(&argc, argv);
 	/* open window of size 800x600 with double buffering, RGB colors, and Z-buffering */
 #	if defined(GLUT_SRGB)
@@ -491,8 +2174,30 @@ int main(int argc, char *argv[])
 	glutInitDisplayMode(GLUT_DOUBLE | GLUT_RGB | GLUT_DEPTH);
 	printf( "Warning: GLUT_SRGB not supported by your GLUT!\n" );
 #	endif // ! GLUT_SRGB
-	glutInitWindowSize(800,512);
+	glutInitWindowSize(windowWidth, windowHeight);
 	glutCreateWindow("3D World Tutorial");
+
+	if (benchmarkMode)
+	{
+		// GLUT is only used for the context here, everything is drawn offscreen
+		glutHideWindow();
+		initGL();
+		if (jobScalingBenchmark)
+		{
+			runJobScalingBenchmark();
+		}
+		else if (captureMode)
+		{
+			runCapture();
+		}
+		else
+		{
+			runBenchmark();
+		}
+		shutdownGL();
+		return 0;
+	}
+
 	glutKeyboardFunc(handleKeys);
 	glutSpecialFunc(handleSpecialKeys);
 	/* the display function is called once when the gluMainLoop is called,
@@ -501,9 +2206,11 @@ int main(int argc, char *argv[])
 	* by making a glutPostRedisplay() call 
 	*/
 	glutDisplayFunc(display);	// This is the main redraw function
+	glutReshapeFunc(reshape);	// callback function on window resize
 	glutMouseFunc(mouse);		// callback function on mouse buttons
 	glutMotionFunc(motion);		// callback function on mouse movements
-	glutIdleFunc( idle );
+	// No idle function, display() schedules the next frame itself (see
+	// scheduleFrame()) so GLUT can sleep until it is due
 
 	glutDisplayFunc(display);	// Set the main redraw function
 
@@ -516,11 +2223,13 @@ int main(int argc, char *argv[])
 
 void createShadowMap(int width, int height)
 {
-	glGenTextures(1, &shadowMapTexture);
+	shadowMapTexture = GpuResource(RESOURCE_TEXTURE, RESOURCE_RENDER_TARGETS, "shadow map");
 	glBindTexture(GL_TEXTURE_2D, shadowMapTexture);
 	glTexImage2D(GL_TEXTURE_2D, 0, GL_DEPTH_COMPONENT32,
 				width, height, 0,
 				GL_DEPTH_COMPONENT, GL_FLOAT, 0);
+	setResourceStorage(RESOURCE_TEXTURE, shadowMapTexture,
+		getTextureBytes(GL_DEPTH_COMPONENT32, width, height), GL_DEPTH_COMPONENT32);
 	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
 	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
 	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_BORDER);
@@ -530,7 +2239,7 @@ void createShadowMap(int width, int height)
 	float4 ones = {1.0, 1.0, 1.0, 1.0};
 	glTexParameterfv(GL_TEXTURE_2D, GL_TEXTURE_BORDER_COLOR, &ones.x);
 
-	glGenFramebuffers(1, &shadowMapFBO);
+	shadowMapFBO = GpuResource(RESOURCE_FRAMEBUFFER, RESOURCE_RENDER_TARGETS, "shadow map");
 	glBindFramebuffer(GL_FRAMEBUFFER, shadowMapFBO);
 	glFramebufferTexture2D(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT,
 							GL_TEXTURE_2D, shadowMapTexture, 0);
@@ -539,12 +2248,34 @@ void createShadowMap(int width, int height)
 	// Activate the default framebuffer again
 	glBindFramebuffer(GL_FRAMEBUFFER, 0);
 
-	glUseProgram(shaderProgram);
-	setUniformSlow(shaderProgram, "shadowMap", 1);
 	glActiveTexture(GL_TEXTURE1);
 	glBindTexture(GL_TEXTURE_2D, shadowMapTexture);
 }
 
+void createSkyTriangle()
+{
+	// Covers the clip rectangle, the parts outside it are clipped
+	static const float2 positions[] = {
+		{ -1.0f, -1.0f },
+		{  3.0f, -1.0f },
+		{ -1.0f,  3.0f },
+	};
+	static const unsigned int indices[] = { 0, 1, 2 };
+	skyVertexArray = GpuResource(RESOURCE_VERTEX_ARRAY, RESOURCE_MESHES, "sky");
+	glBindVertexArray(skyVertexArray);
+	skyPositionBuffer = GpuResource(RESOURCE_BUFFER, RESOURCE_MESHES, "sky");
+	glBindBuffer(GL_ARRAY_BUFFER, skyPositionBuffer);
+	glBufferData(GL_ARRAY_BUFFER, sizeof(positions), positions, GL_STATIC_DRAW);
+	setResourceStorage(RESOURCE_BUFFER, skyPositionBuffer, sizeof(positions));
+	glVertexAttribPointer(0, 2, GL_FLOAT, false, 0, 0);
+	glEnableVertexAttribArray(0);
+	skyIndexBuffer = GpuResource(RESOURCE_BUFFER, RESOURCE_MESHES, "sky");
+	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, skyIndexBuffer);
+	glBufferData(GL_ELEMENT_ARRAY_BUFFER, sizeof(indices), indices, GL_STATIC_DRAW);
+	setResourceStorage(RESOURCE_BUFFER, skyIndexBuffer, sizeof(indices));
+	glBindVertexArray(0);
+}
+
 void drawFullScreenQuad()
 {
 	static GLuint vertexArrayObject = 0; 
@@ -567,63 +2298,60 @@ void drawFullScreenQuad()
 	glDrawArrays(GL_QUADS, 0, nofVertices); 
 }
 
-FBOInfo createPostProcessFBO(int width, int height)
+/**
+* Declares the bloom passes: the bright parts of the scene are progressively
+* downsampled through the pyramid, then upsampled back and accumulated so
+* that the returned level 0 holds the combined wide blur.
+*/
+RenderTargetHandle addBloomPasses(RenderTargetHandle scene, float scale)
 {
-	FBOInfo fbo;
-	
-	fbo.width = width;
-	fbo.height = height;
-
-	glGenTextures(1, &fbo.colorTextureTarget);
-	glBindTexture(GL_TEXTURE_RECTANGLE_ARB, fbo.colorTextureTarget);
-	glTexParameteri(GL_TEXTURE_RECTANGLE_ARB, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-	glTexParameteri(GL_TEXTURE_RECTANGLE_ARB, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-	glTexImage2D(GL_TEXTURE_RECTANGLE_ARB, 0, GL_RGBA, width, height, 0, GL_RGBA, GL_UNSIGNED_BYTE, NULL);
-
-	glGenFramebuffers(1, &fbo.id);
-	// Bind the framebuffer such that following commands will affect it
-	glBindFramebuffer(GL_FRAMEBUFFER, fbo.id);
-	glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0,
-							GL_TEXTURE_RECTANGLE_ARB, fbo.colorTextureTarget, 0);
-	glDrawBuffer(GL_COLOR_ATTACHMENT0);
-
-	glGenRenderbuffers(1, &fbo.depthBuffer);
-	glBindRenderbuffer(GL_RENDERBUFFER, fbo.depthBuffer);
-	glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH_COMPONENT, width, height);
-	// Associate our created depth buffer with the FBO
-	glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT,
-								GL_RENDERBUFFER, fbo.depthBuffer);
-
-	GLuint status = glCheckFramebufferStatus(GL_FRAMEBUFFER);
-	if (status != GL_FRAMEBUFFER_COMPLETE)
-	{
-		fatal_error("Framebuffer not complete");
+	// The profiler keeps the pass names, so they must outlive the frame
+	static const char *levelNames[numBloomLevels] = {
+		"Bloom 1/2", "Bloom 1/4", "Bloom 1/8", "Bloom 1/16", "Bloom 1/32" };
+	static const char *downsampleNames[numBloomLevels] = {
+		"Bloom down 1/2", "Bloom down 1/4", "Bloom down 1/8", "Bloom down 1/16", "Bloom down 1/32" };
+	// Every level but the smallest is upsampled into
+	static const char *upsampleNames[numBloomLevels - 1] = {
+		"Bloom up 1/2", "Bloom up 1/4", "Bloom up 1/8", "Bloom up 1/16" };
+
+	RenderTargetHandle levels[numBloomLevels];
+	int w = windowWidth;
+	int h = windowHeight;
+	RenderTargetHandle source = scene;
+	for (int i = 0; i < numBloomLevels; ++i)
+	{
+		w = max(1, w / 2);
+		h = max(1, h / 2);
+		// A float format so the accumulated levels do not saturate
+		RenderTargetDesc desc = { w, h, GL_R11F_G11F_B10F, false };
+		levels[i] = renderGraph->createTarget(levelNames[i], desc, scale);
+		// Only the first downsample reads the scene and applies the bright pass
+		float threshold = i == 0 ? 0.8f : 0.0f;
+		renderGraph->addPass(downsampleNames[i], { source }, levels[i], [=](const RenderGraph &graph)
+		{
+			glUseProgram(bloomDownsampleShader.id);
+			setUniform(bloomDownsampleShader, UNIFORM_BLOOM_THRESHOLD, threshold);
+			glActiveTexture(GL_TEXTURE0);
+			glBindTexture(GL_TEXTURE_RECTANGLE_ARB, graph.getTexture(source));
+			drawFullScreenQuad();
+		});
+		source = levels[i];
 	}
-	
-	return fbo;
-}
 
-void renderBlur()
-{
-	// Bind the horizontal blur frame buffer
-	glBindFramebuffer(GL_FRAMEBUFFER, horizontalBlurFBO.id);
-	glClearColor(0.0,0.0,0.0,1.0);
-	glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
-	
-	// Render with horizontalBlurShader
-	glUseProgram(horizontalBlurShader);
-	setUniformSlow(horizontalBlurShader, "frameBufferTexture", 0);
-	glBindTexture(GL_TEXTURE_RECTANGLE_ARB, cutoffFBO.colorTextureTarget);
-	drawFullScreenQuad();
-
-	// Bind the vertical blur frame buffer
-	glBindFramebuffer(GL_FRAMEBUFFER, verticalBlurFBO.id);
-	glClearColor(0.0,0.0,0.0,1.0);
-	glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
-
-	// Render with verticalBlurShader
-	glUseProgram(verticalBlurShader);
-	setUniformSlow(verticalBlurShader, "frameBufferTexture", 0);
-	glBindTexture(GL_TEXTURE_RECTANGLE_ARB, horizontalBlurFBO.colorTextureTarget);
-	drawFullScreenQuad();
-}
\ No newline at end of file
+	for (int i = numBloomLevels - 2; i >= 0; --i)
+	{
+		RenderTargetHandle smaller = levels[i + 1];
+		// Blends onto the downsampled level, so that is an input as well
+		renderGraph->addPass(upsampleNames[i], { smaller, levels[i] }, levels[i], [=](const RenderGraph &graph)
+		{
+			glUseProgram(bloomUpsampleShader.id);
+			glEnable(GL_BLEND);
+			glBlendFunc(GL_ONE, GL_ONE);
+			glActiveTexture(GL_TEXTURE0);
+			glBindTexture(GL_TEXTURE_RECTANGLE_ARB, graph.getTexture(smaller));
+			drawFullScreenQuad();
+			glDisable(GL_BLEND);
+		});
+	}
+	return levels[0];
+}
@@ -0,0 +1,37 @@
+#version 130
+
+// Note: this is core in OpenGL 3.1 (glsl 1.40) and later, we use OpenGL 3.0 for the tutorials
+#extension GL_ARB_texture_rectangle : enable
+
+// required by GLSL spec Sect 4.5.3 (though nvidia does not, amd does)
+precision highp float;
+
+uniform sampler2DRect frameBufferTexture;
+// Only samples with a channel above the threshold contribute, this is the
+// bright pass when reading the scene and 0.0 for the following levels.
+uniform float bloom_threshold;
+out vec4 fragmentColor;
+
+vec3 brightPass(vec3 sample)
+{
+	if (sample.r > bloom_threshold || sample.g > bloom_threshold || sample.b > bloom_threshold)
+	{
+		return sample;
+	}
+	return vec3(0.0);
+}
+
+/**
+ * Halves the resolution of the source. The four bilinear taps are placed
+ * between texels so that together they average the 4x4 source texels
+ * around this pixel, which avoids the aliasing of a plain 2x2 box.
+ */
+void main() 
+{
+	vec2 center = gl_FragCoord.xy * 2.0;
+	vec3 result = brightPass(texture(frameBufferTexture, center + vec2(-1.0, -1.0)).rgb);
+	result += brightPass(texture(frameBufferTexture, center + vec2( 1.0, -1.0)).rgb);
+	result += brightPass(texture(frameBufferTexture, center + vec2(-1.0,  1.0)).rgb);
+	result += brightPass(texture(frameBufferTexture, center + vec2( 1.0,  1.0)).rgb);
+	fragmentColor = vec4(result * 0.25, 1.0);
+}
@@ -0,0 +1,30 @@
+#version 130
+
+// Note: this is core in OpenGL 3.1 (glsl 1.40) and later, we use OpenGL 3.0 for the tutorials
+#extension GL_ARB_texture_rectangle : enable
+
+// required by GLSL spec Sect 4.5.3 (though nvidia does not, amd does)
+precision highp float;
+
+uniform sampler2DRect frameBufferTexture;
+out vec4 fragmentColor;
+
+/**
+ * Doubles the resolution of the source (the next smaller bloom level) with a
+ * 3x3 tent filter. The result is added on top of the downsampled level of
+ * this size, each coarser level contributing half as much as the one above.
+ */
+void main() 
+{
+	vec2 center = gl_FragCoord.xy * 0.5;
+	vec3 result = texture(frameBufferTexture, center).rgb * 4.0;
+	result += texture(frameBufferTexture, center + vec2(-1.0,  0.0)).rgb * 2.0;
+	result += texture(frameBufferTexture, center + vec2( 1.0,  0.0)).rgb * 2.0;
+	result += texture(frameBufferTexture, center + vec2( 0.0, -1.0)).rgb * 2.0;
+	result += texture(frameBufferTexture, center + vec2( 0.0,  1.0)).rgb * 2.0;
+	result += texture(frameBufferTexture, center + vec2(-1.0, -1.0)).rgb;
+	result += texture(frameBufferTexture, center + vec2( 1.0, -1.0)).rgb;
+	result += texture(frameBufferTexture, center + vec2(-1.0,  1.0)).rgb;
+	result += texture(frameBufferTexture, center + vec2( 1.0,  1.0)).rgb;
+	fragmentColor = vec4(result * (0.5 / 16.0), 1.0);
+}
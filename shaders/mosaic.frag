@@ -0,0 +1,36 @@
+#version 130
+
+// Note: this is core in OpenGL 3.1 (glsl 1.40) and later, we use OpenGL 3.0 for the tutorials
+#extension GL_ARB_texture_rectangle : enable
+
+// required by GLSL spec Sect 4.5.3 (though nvidia does not, amd does)
+precision highp float;
+
+uniform sampler2DRect frameBufferTexture;
+out vec4 fragmentColor;
+
+/**
+ * Changes the sampling coordinates of the pixel so that all pixels within a certain area
+ * will have the same coordinate. This creates a mosaic tile effect.
+ */
+vec2 mosaic(vec2 inCoord)
+{
+	vec2 texSize = textureSize(frameBufferTexture);
+	float width = texSize.x;
+	float height = texSize.y;
+
+	// The number of rows and columns of mosaic rectangles
+	int rows = 20;
+	int columns = 20;
+	
+	// Converts this coordinate to the top-right coordinate of the rectangle it belongs to
+	inCoord.x = ceil(inCoord.x / (width / columns)) * (width / columns);
+	inCoord.y = ceil(inCoord.y / (height / rows)) * (height / rows);
+
+	return inCoord;
+}
+
+void main() 
+{
+	fragmentColor = texture(frameBufferTexture, mosaic(gl_FragCoord.xy));
+}
@@ -0,0 +1,40 @@
+#version 130
+
+// Note: this is core in OpenGL 3.1 (glsl 1.40) and later, we use OpenGL 3.0 for the tutorials
+#extension GL_ARB_texture_rectangle : enable
+#extension GL_ARB_uniform_buffer_object : enable
+
+// required by GLSL spec Sect 4.5.3 (though nvidia does not, amd does)
+precision highp float;
+
+uniform sampler2DRect frameBufferTexture;
+
+// Shared per-frame data, updated once per frame (see ShaderUniforms.h).
+layout(std140) uniform PerFrame
+{
+	mat4 viewMatrix;
+	mat4 projectionMatrix;
+	mat4 inverseViewNormalMatrix;
+	mat4 lightMatrices[4];
+	vec4 shadowCascadeSplits;
+	vec4 viewSpaceLightPosition;
+	float time;
+	int numShadowCascades;
+};
+
+out vec4 fragmentColor;
+
+/**
+ * Perturps the sampling coordinates of the pixel and returns the new coordinates
+ * these can then be used to sample the frame buffer. The effect uses a sine wave to make us
+ * feel woozy.
+ */ 
+vec2 mushrooms(vec2 inCoord)
+{
+	return inCoord + vec2(sin(time * 4.3127 + inCoord.y / 9.0) * 15.0, 0.0);
+}
+
+void main() 
+{
+	fragmentColor = texture(frameBufferTexture, mushrooms(gl_FragCoord.xy));
+}
@@ -0,0 +1,39 @@
+#version 130
+
+// Note: this is core in OpenGL 3.1 (glsl 1.40) and later, we use OpenGL 3.0 for the tutorials
+#extension GL_ARB_texture_rectangle : enable
+
+// required by GLSL spec Sect 4.5.3 (though nvidia does not, amd does)
+precision highp float;
+
+uniform sampler2DRect frameBufferTexture;
+out vec4 fragmentColor;
+
+/**
+ * Converts the color sample to sepia tone (by transformation to the yiq color space).
+ */
+vec3 toSepiaTone(vec3 rgbSample)
+{
+	//-----------------------------------------------------------------
+	// Variables used for YIQ/RGB color space conversion.
+	//-----------------------------------------------------------------
+	vec3 yiqTransform0 = vec3(0.299, 0.587, 0.144);
+	vec3 yiqTransform1 = vec3(0.596,-0.275,-0.321);
+	vec3 yiqTransform2 = vec3(0.212,-0.523, 0.311);
+
+	vec3 yiqInverseTransform0 = vec3(1, 0.956, 0.621);
+	vec3 yiqInverseTransform1 = vec3(1,-0.272,-0.647);
+	vec3 yiqInverseTransform2 = vec3(1,-1.105, 1.702);
+	
+	// transform to YIQ color space and set color information to sepia tone
+	vec3 yiq = vec3(dot(yiqTransform0, rgbSample), 0.2, 0.0);
+	
+	// inverse transform to RGB color space
+	vec3 result = vec3(dot(yiqInverseTransform0, yiq), dot(yiqInverseTransform1, yiq), dot(yiqInverseTransform2, yiq));
+	return result;
+}
+
+void main() 
+{
+	fragmentColor = vec4(toSepiaTone(texture(frameBufferTexture, gl_FragCoord.xy).xyz), 1.0);
+}
@@ -1,12 +1,17 @@
 #version 130
+#extension GL_ARB_uniform_buffer_object : enable
 // required by GLSL spec Sect 4.5.3 (though nvidia does not, amd does)
 precision highp float;
 
+// Compiled in variants (see ShaderCache.h), each defined or not:
+//   TEXTURED    the material colours are modulated by diffuse_texture
+//   REFLECTIVE  the cube map is reflected, weighted by object_reflectiveness
+//   SHADOWED    the light is looked up in the shadow map
+
 // inputs from vertex shader.
 in vec2 texCoord;
 in vec3 viewSpacePosition; 
 in vec3 viewSpaceNormal; 
-in vec4 shadowTexCoord;
 
 // output to frame buffer.
 out vec4 fragmentColor;
@@ -27,11 +32,46 @@ uniform vec3 material_diffuse_color;
 uniform vec3 material_specular_color; 
 //uniform vec3 material_ambient_color;
 uniform vec3 material_emissive_color; 
-uniform int has_diffuse_texture; 
 uniform sampler2D diffuse_texture;
 
-uniform vec3 viewSpaceLightPosition;
-uniform mat4 inverseViewNormalMatrix;
+// Shared per-frame data, updated once per frame (see ShaderUniforms.h).
+layout(std140) uniform PerFrame
+{
+	mat4 viewMatrix;
+	mat4 projectionMatrix;
+	mat4 inverseViewNormalMatrix;
+	mat4 lightMatrices[4];
+	vec4 shadowCascadeSplits;
+	vec4 viewSpaceLightPosition;
+	float time;
+	int numShadowCascades;
+};
+
+/**
+ * The fraction of the light reaching the fragment. The cascades are laid out
+ * side by side in the shadow map, the first one whose depth range contains
+ * the fragment is used. Beyond the last one nothing is in shadow.
+ */
+float calculateShadow(vec3 position)
+{
+	float depth = -position.z;
+	int cascade = 0;
+	while (cascade < numShadowCascades && depth > shadowCascadeSplits[cascade])
+	{
+		cascade++;
+	}
+	if (cascade == numShadowCascades)
+	{
+		return 1.0;
+	}
+	vec4 shadowTexCoord = lightMatrices[cascade] * vec4(position, 1.0);
+	if (any(lessThan(shadowTexCoord.xy, vec2(0.0))) || any(greaterThan(shadowTexCoord.xy, vec2(1.0))))
+	{
+		return 1.0;
+	}
+	shadowTexCoord.x = (shadowTexCoord.x + float(cascade)) / float(numShadowCascades);
+	return texture(shadowMap, shadowTexCoord.xyz);
+}
 
 vec3 calculateAmbient(vec3 ambientLight, vec3 materialAmbient)
 {
@@ -75,31 +115,37 @@ void main()
 	vec3 ambient = material_diffuse_color;//material_ambient_color;
 	
 	// if we have a texture we modulate all of the color properties
-	if (has_diffuse_texture == 1)
-	{
-		diffuse *= texture(diffuse_texture, texCoord.xy).xyz; 
-		ambient *= texture(diffuse_texture, texCoord.xy).xyz; 
-		emissive *= texture(diffuse_texture, texCoord.xy).xyz; 
-	}
+#if defined(TEXTURED)
+	vec3 textureColor = texture(diffuse_texture, texCoord.xy).xyz;
+	diffuse *= textureColor;
+	ambient *= textureColor;
+	emissive *= textureColor;
+#endif
 
 	vec3 normal = normalize(viewSpaceNormal);
 	vec3 directionToLight = 
-			normalize(viewSpaceLightPosition - viewSpacePosition);
+			normalize(viewSpaceLightPosition.xyz - viewSpacePosition);
 	vec3 directionFromEye = normalize(viewSpacePosition);
 	
+#if defined(SHADOWED)
+	float visibility = calculateShadow(viewSpacePosition);
+#else
+	float visibility = 1.0;
+#endif
+	vec3 shading = calculateAmbient(scene_ambient_light, ambient)
+		+ calculateDiffuse(scene_light, diffuse, normal, directionToLight) * visibility
+		+ calculateSpecular(scene_light, specular, material_shininess,
+							normal, directionToLight, directionFromEye) * visibility
+		+ emissive;
+
+#if defined(REFLECTIVE)
 	vec3 reflectionVector = (inverseViewNormalMatrix *
 							vec4(reflect(directionFromEye, normal), 0.0)).xyz;
 	vec3 envMapSample = texture(cubeMap, reflectionVector).rgb;
 
 	vec3 fresnelSpecular = calculateFresnel(specular, normal,
 											directionFromEye);
-
-	float visibility = textureProj(shadowMap, shadowTexCoord);
-	vec3 shading = calculateAmbient(scene_ambient_light, ambient)
-		+ calculateDiffuse(scene_light, diffuse, normal, directionToLight) * visibility
-		+ calculateSpecular(scene_light, specular, material_shininess,
-							normal, directionToLight, directionFromEye) * visibility
-		+ emissive
-		+ envMapSample * fresnelSpecular * object_reflectiveness * visibility;
+	shading += envMapSample * fresnelSpecular * object_reflectiveness * visibility;
+#endif
 	fragmentColor = vec4(shading, object_alpha);
 }
@@ -1,31 +1,54 @@
 #version 130
+#extension GL_ARB_uniform_buffer_object : enable
 
-in vec3		position;
+in vec3		position;	// 0 to 1 within the mesh bounds, see Mesh::getDecodeMatrix()
 in	vec2	texCoordIn;	// incoming texcoord from the texcoord array
-in  vec3	normalIn;
+in  vec2	normalIn;	// octahedron encoded
+in	mat4	instanceMatrix;	// per instance, identity for non-instanced draws
 out vec3	viewSpacePosition; 
 out vec3	viewSpaceNormal; 
 out	vec2	texCoord;	// outgoing interpolated texcoord to fragshader
-out vec4	shadowTexCoord;
 uniform mat4 modelMatrix;
-uniform mat4 viewMatrix;
-uniform mat4 projectionMatrix;
-uniform mat4 lightMatrix;
+// Computed exactly as in shadow.vert, which the depth pre-pass draws with
+invariant gl_Position;
+
+// Shared per-frame data, updated once per frame (see ShaderUniforms.h).
+layout(std140) uniform PerFrame
+{
+	mat4 viewMatrix;
+	mat4 projectionMatrix;
+	mat4 inverseViewNormalMatrix;
+	mat4 lightMatrices[4];
+	vec4 shadowCascadeSplits;
+	vec4 viewSpaceLightPosition;
+	float time;
+	int numShadowCascades;
+};
+
+// Unfolds the octahedron the normal was projected onto (see Mesh.cpp)
+vec3 decodeOctahedral(vec2 e)
+{
+	vec3 n = vec3(e, 1.0 - abs(e.x) - abs(e.y));
+	if (n.z < 0.0)
+	{
+		n.xy = (1.0 - abs(n.yx)) * vec2(n.x >= 0.0 ? 1.0 : -1.0, n.y >= 0.0 ? 1.0 : -1.0);
+	}
+	return normalize(n);
+}
 
 void main() 
 {
-	mat4 modelViewMatrix = viewMatrix * modelMatrix; 
+	mat4 modelViewMatrix = viewMatrix * modelMatrix * instanceMatrix; 
 	mat4 modelViewProjectionMatrix = projectionMatrix * modelViewMatrix; 
 	///////////////////////////////////////////////////////////////////////////
 	// The normal matrix should really be the inverse transpose of the 
 	// modelViewMatrix, but that doesn't compile on current drivers.
 	// Just using the modelView matrix works fine, as long as it does not
-	// contain any nonuniform scaling. 
+	// contain any nonuniform scaling (the position decoding is uniform). 
 	mat4 normalMatrix = modelViewMatrix; //inverse(transpose(modelViewMatrix));
 	///////////////////////////////////////////////////////////////////////////
 	gl_Position = modelViewProjectionMatrix * vec4(position,1);
 	texCoord = texCoordIn; 
 	viewSpacePosition = vec3(modelViewMatrix * vec4(position, 1)); 
-	viewSpaceNormal = vec3(normalize((normalMatrix * vec4(normalIn,0.0)).xyz));
-	shadowTexCoord = lightMatrix * vec4(viewSpacePosition, 1.0);	
+	viewSpaceNormal = vec3(normalize((normalMatrix * vec4(decodeOctahedral(normalIn),0.0)).xyz));
 }
@@ -1,13 +1,17 @@
 #version 130
 
-in vec3		position;
+in vec3		position;	// compressed, the model matrix includes the decoding
+in mat4		instanceMatrix;	// per instance, identity for non-instanced draws
 uniform mat4 modelMatrix;
 uniform mat4 viewMatrix;
 uniform mat4 projectionMatrix;
+// Computed exactly as in shader.vert, the depth pre-pass of the scene is
+// drawn with this program and the colour pass tests for equal depth
+invariant gl_Position;
 
 void main() 
 {
-	mat4 modelViewMatrix = viewMatrix * modelMatrix; 
+	mat4 modelViewMatrix = viewMatrix * modelMatrix * instanceMatrix; 
 	mat4 modelViewProjectionMatrix = projectionMatrix * modelViewMatrix; 
 
 	gl_Position = modelViewProjectionMatrix * vec4(position,1);
@@ -0,0 +1,35 @@
+#version 130
+#extension GL_ARB_uniform_buffer_object : enable
+// required by GLSL spec Sect 4.5.3 (though nvidia does not, amd does)
+precision highp float;
+
+in vec3 worldDirection;
+
+out vec4 fragmentColor;
+
+uniform samplerCube skyDayCubeMap;
+uniform samplerCube skyNightCubeMap;
+
+// Shared per-frame data, updated once per frame (see ShaderUniforms.h).
+layout(std140) uniform PerFrame
+{
+	mat4 viewMatrix;
+	mat4 projectionMatrix;
+	mat4 inverseViewNormalMatrix;
+	mat4 lightMatrices[4];
+	vec4 shadowCascadeSplits;
+	vec4 viewSpaceLightPosition;
+	float time;
+	int numShadowCascades;
+};
+
+void main() 
+{
+	// The day sky fades in over the night sky and out again with the sun,
+	// which goes around once every 20 seconds (see computeLightPosition() in
+	// main.cpp)
+	float day = max(0.0, cos(time / 20.0 * 2.0 * 3.14159265));
+	vec3 daySky = texture(skyDayCubeMap, worldDirection).rgb;
+	vec3 nightSky = texture(skyNightCubeMap, worldDirection).rgb;
+	fragmentColor = vec4(mix(nightSky, daySky, day), 1.0);
+}
@@ -0,0 +1,30 @@
+#version 130
+#extension GL_ARB_uniform_buffer_object : enable
+
+// A triangle covering the screen at the far plane. It is drawn after the
+// opaque geometry with GL_LEQUAL, so the depth test rejects every pixel
+// that is already covered before the fragment shader runs.
+in vec2		position;
+out vec3	worldDirection;
+
+// Shared per-frame data, updated once per frame (see ShaderUniforms.h).
+layout(std140) uniform PerFrame
+{
+	mat4 viewMatrix;
+	mat4 projectionMatrix;
+	mat4 inverseViewNormalMatrix;
+	mat4 lightMatrices[4];
+	vec4 shadowCascadeSplits;
+	vec4 viewSpaceLightPosition;
+	float time;
+	int numShadowCascades;
+};
+
+void main() 
+{
+	gl_Position = vec4(position, 1.0, 1.0);
+	// The view space direction through this point of the far plane, rotated
+	// to world space. Interpolating it across the triangle is exact.
+	vec3 viewDirection = vec3(position.x / projectionMatrix[0][0], position.y / projectionMatrix[1][1], -1.0);
+	worldDirection = (inverseViewNormalMatrix * vec4(viewDirection, 0.0)).xyz;
+}